@@ -0,0 +1,589 @@
+#include <time.h>
+#include "globals.h"
+#include "layer0.h"
+#include "layer1.h"
+#include "layer2.h"
+#include "frag.h"
+
+/* Online defragmentation */
+int defrag_pause_ms = DEFRAG_PAUSE_MS;
+int defrag_blocks_moved = 0;
+pthread_mutex_t defrag_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t defrag_wake = PTHREAD_COND_INITIALIZER;
+pthread_t defrag_thread;
+int defrag_running = FALSE;
+int defrag_cancel = FALSE;
+
+/* Fills in report with how fragmented every file and the free space are. Files are
+ * found by going through the whole ilist, and each one's runs come from fiemap_i
+ *
+ * The score is the share of a file's blocks that start a new run, beyond the first,
+ * over every file: 0 when each file is in a single run, 100 when none of a file's
+ * blocks are next to each other
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - no filesystem
+ *   BUF_NULL           - report is null
+ *   SUCCESS            - report was filled in
+ */
+int frag_scan(frag_report* report){
+	if (report == NULL){
+		ERR(fprintf(stderr, "ERR: frag_scan: report is null\n"));
+		ERR(fprintf(stderr, "  report: %p\n", report));
+		return BUF_NULL;
+	}
+	memset(report, 0, sizeof(frag_report));
+
+	superblock sb;
+	int ret = read_superblock(&sb);
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: frag_scan: read_superblock failed\n"));
+		ERR(fprintf(stderr, "  ret: %d\n", ret));
+		return DISC_UNINITIALIZED;
+	}
+
+	int inum, blocks, extents;
+	for (inum = 1; inum <= sb.num_inodes; inum++){
+		if (frag_file(inum, &blocks, &extents) != SUCCESS || blocks == 0){
+			continue;
+		}
+
+		report->files++;
+		report->file_blocks += blocks;
+		report->file_extents += extents;
+		if (extents > 1){
+			report->fragmented_files++;
+		}
+		if (extents > report->worst_extents){
+			report->worst_extents = extents;
+			report->worst_inum = inum;
+		}
+	}
+
+	if (report->file_blocks > report->files){
+		report->score = 100.0 * (report->file_extents - report->files) / (report->file_blocks - report->files);
+	}
+
+	return frag_free_space(report);
+}
+
+/* Counts the data blocks of a file and the runs they are in. Unallocated inodes have
+ * neither
+ *
+ * Returns:
+ *   INT_NULL  - blocks or extents is null
+ *   BAD_INODE - inum isn't an inode
+ *   SUCCESS   - blocks and extents were set
+ */
+int frag_file(int inum, int* blocks, int* extents){
+	if (blocks == NULL || extents == NULL){
+		ERR(fprintf(stderr, "ERR: frag_file: something is null\n"));
+		ERR(fprintf(stderr, "  blocks:  %p\n", blocks));
+		ERR(fprintf(stderr, "  extents: %p\n", extents));
+		return INT_NULL;
+	}
+	*blocks = 0;
+	*extents = 0;
+
+	inode my_inode;
+	int ret = inode_read(inum, &my_inode);
+	if (ret != SUCCESS){
+		return ret;
+	}
+	if (my_inode.mode == 0){
+		return SUCCESS;
+	}
+
+	/* Ask for the runs a batch at a time, carrying on after the last one each time */
+	file_extent runs[FRAG_BATCH];
+	uint32_t start = 0;
+	int found, i;
+	do{
+		ret = fiemap_i(inum, start, runs, FRAG_BATCH, &found);
+		if (ret != SUCCESS){
+			return ret;
+		}
+
+		for (i = 0; i < found; i++){
+			*blocks += runs[i].length;
+		}
+		*extents += found;
+		if (found > 0){
+			start = runs[found - 1].logical + runs[found - 1].length;
+		}
+	} while (found == FRAG_BATCH && !(runs[found - 1].flags & FIEMAP_EXTENT_LAST));
+
+	return SUCCESS;
+}
+
+/* Goes through every group's block bitmap adding up the runs of free blocks, their
+ * sizes and the largest of them into report. Each bitmap is read with its group locked
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - no filesystem
+ *   SUCCESS            - the free space was added to report
+ */
+int frag_free_space(frag_report* report){
+	superblock sb;
+	int ret = read_superblock(&sb);
+	if (ret != SUCCESS){
+		return DISC_UNINITIALIZED;
+	}
+
+	uint8_t bitmap[BLOCK_SIZE];
+	group_desc gd;
+	int group, bit, run_end;
+	for (group = 0; group < sb.num_groups; group++){
+		pthread_mutex_lock(&group_locks[group]);
+		read_group_desc(group, &gd);
+		data_read(gd.block_bitmap, bitmap);
+		pthread_mutex_unlock(&group_locks[group]);
+
+		bit = 0;
+		while (bit < gd.num_blocks){
+			bit = bitmap_find_zero(bitmap, bit, gd.num_blocks);
+			if (bit < 0 || bit >= gd.num_blocks){
+				break;
+			}
+
+			run_end = bit + 1;
+			while (run_end < gd.num_blocks && !bitmap_test(bitmap, run_end)){
+				run_end++;
+			}
+
+			report->free_blocks += run_end - bit;
+			report->free_extents++;
+			report->free_histogram[frag_bucket(run_end - bit)]++;
+			report->largest_free = MAX(report->largest_free, run_end - bit);
+
+			bit = run_end;
+		}
+	}
+
+	return SUCCESS;
+}
+
+/* Returns the free space histogram bucket a run of length blocks goes in */
+int frag_bucket(int length){
+	int bucket = 0;
+	while (length > 1 && bucket < FRAG_BUCKETS - 1){
+		length >>= 1;
+		bucket++;
+	}
+
+	return bucket;
+}
+
+void frag_print(frag_report* report){
+	printf("frag: %d files in %d runs, %d of them fragmented\n", report->files, report->file_extents, report->fragmented_files);
+	printf("  file blocks:        %d\n", report->file_blocks);
+	printf("  most runs:          %d (inode %d)\n", report->worst_extents, report->worst_inum);
+	printf("  fragmentation:      %.1f%%\n", report->score);
+	printf("  free blocks:        %d in %d runs, largest %d\n", report->free_blocks, report->free_extents, report->largest_free);
+
+	int i;
+	for (i = 0; i < FRAG_BUCKETS; i++){
+		if (report->free_histogram[i] == 0){
+			continue;
+		}
+		if (i == FRAG_BUCKETS - 1){
+			printf("  free runs %6d+:     %d\n", 1 << i, report->free_histogram[i]);
+		}
+		else{
+			printf("  free runs %6d-%-6d %d\n", 1 << i, (2 << i) - 1, report->free_histogram[i]);
+		}
+	}
+}
+
+/* Prints the blocks and runs of every file in at least min_extents runs */
+void frag_print_files(int min_extents){
+	superblock sb;
+	if (read_superblock(&sb) != SUCCESS){
+		return;
+	}
+
+	int inum, blocks, extents;
+	for (inum = 1; inum <= sb.num_inodes; inum++){
+		if (frag_file(inum, &blocks, &extents) == SUCCESS && blocks > 0 && extents >= min_extents){
+			printf("  inode %8d: %8d blocks in %6d runs\n", inum, blocks, extents);
+		}
+	}
+}
+
+/* Defragments one file. Its runs are split into stretches with no holes or unwritten
+ * blocks between them, and every stretch in more than one run is moved into a single
+ * new one. A directory in one run outside its inode's group is moved as well. Files
+ * that are open, inline, or in a snapshot are left alone. moved is set to the number of
+ * blocks moved
+ *
+ * The runs are looked up with fs_lock held, and each stretch is moved under it again,
+ * so FUSE operations can go on in between stretches
+ *
+ * Returns:
+ *   INT_NULL         - moved is null
+ *   BAD_INODE        - inum isn't an inode
+ *   UNEXPECTED_ERROR - malloc failed
+ *   SUCCESS          - the file is as contiguous as the free space allows
+ */
+int defrag_file(int inum, int* moved){
+	if (moved == NULL){
+		ERR(fprintf(stderr, "ERR: defrag_file: moved is null\n"));
+		return INT_NULL;
+	}
+	*moved = 0;
+	
+	superblock sb;
+	int ret = read_superblock(&sb);
+	if (ret != SUCCESS){
+		return DISC_UNINITIALIZED;
+	}
+
+	pthread_mutex_lock(&fs_lock);
+	if (snapshot_view != NO_SNAPSHOT || defrag_is_open(inum)){
+		pthread_mutex_unlock(&fs_lock);
+		return SUCCESS;
+	}
+
+	inode my_inode;
+	ret = inode_read(inum, &my_inode);
+	if (ret != SUCCESS || my_inode.mode == 0 || (my_inode.flags & INODE_INLINE)){
+		pthread_mutex_unlock(&fs_lock);
+		return ret;
+	}
+
+	/* Every run at once, since the map is about to change under the batches */
+	int found;
+	file_extent* runs = NULL;
+	ret = fiemap_i(inum, 0, NULL, 0, &found);
+	if (ret == SUCCESS && found > 0){
+		runs = malloc(found * sizeof(file_extent));
+		if (runs == NULL){
+			ERR(perror(NULL));
+			ret = UNEXPECTED_ERROR;
+		}
+		else{
+			ret = fiemap_i(inum, 0, runs, found, &found);
+		}
+	}
+	pthread_mutex_unlock(&fs_lock);
+	if (ret != SUCCESS || found == 0){
+		free(runs);
+		return ret;
+	}
+
+	/* A new run can't cross groups, so neither can a stretch */
+	int i, j, length, segment_moved;
+	for (i = 0; i < found; i = j){
+		length = runs[i].length;
+		j = i + 1;
+		if (runs[i].flags & FIEMAP_EXTENT_UNWRITTEN){
+			continue;
+		}
+		while (j < found && runs[j].logical == runs[j - 1].logical + runs[j - 1].length
+		       && !(runs[j].flags & FIEMAP_EXTENT_UNWRITTEN) && length + runs[j].length <= sb.blocks_per_group){
+			length += runs[j].length;
+			j++;
+		}
+
+		if (j - i == 1 && !(S_ISDIR(my_inode.mode) && data_group(runs[i].physical) != (int)my_inode.group)){
+			continue;
+		}
+
+		ret = defrag_segment(inum, &runs[i], j - i, &segment_moved);
+		if (ret != SUCCESS){
+			ERR(fprintf(stderr, "ERR: defrag_file: defrag_segment failed\n"));
+			ERR(fprintf(stderr, "  inum:    %d\n", inum));
+			ERR(fprintf(stderr, "  logical: %u\n", runs[i].logical));
+			ERR(fprintf(stderr, "  ret:     %d\n", ret));
+			free(runs);
+			return ret;
+		}
+		*moved += segment_moved;
+	}
+
+	free(runs);
+	return SUCCESS;
+}
+
+/* Moves the count runs of inum at runs, which follow on from each other in the file,
+ * into one new run as near the inode as there is room for. The blocks are copied before
+ * anything refers to the new run, then the block map is switched over and the old
+ * blocks freed in one transaction, so a crash leaves the file in one place or the
+ * other. If the file has been opened or its map has changed since the runs were looked
+ * up, any of the blocks are shared with another file, or there's no free run long
+ * enough, nothing is moved. moved is set to the number of blocks moved
+ *
+ * fs_lock is held from the check through the switch, so nothing can write to the old
+ * blocks while they're copied
+ *
+ * Returns:
+ *   BUF_NULL      - runs or moved is null
+ *   INVALID_BLOCK - a block couldn't be copied
+ *   SUCCESS       - the runs were moved, or there was no better place for them
+ */
+int defrag_segment(int inum, file_extent* runs, int count, int* moved){
+	if (runs == NULL || moved == NULL){
+		ERR(fprintf(stderr, "ERR: defrag_segment: something is null\n"));
+		ERR(fprintf(stderr, "  runs:  %p\n", runs));
+		ERR(fprintf(stderr, "  moved: %p\n", moved));
+		return BUF_NULL;
+	}
+	*moved = 0;
+
+	pthread_mutex_lock(&fs_lock);
+	int ret = defrag_segment_locked(inum, runs, count, moved);
+	pthread_mutex_unlock(&fs_lock);
+
+	return ret;
+}
+
+/* Does the work of defrag_segment. The caller must hold fs_lock
+ *
+ * Returns:
+ *   INVALID_BLOCK - a block couldn't be copied
+ *   SUCCESS       - the runs were moved, or there was no better place for them
+ */
+int defrag_segment_locked(int inum, file_extent* runs, int count, int* moved){
+	if (snapshot_view != NO_SNAPSHOT || defrag_is_open(inum)){
+		return SUCCESS;
+	}
+
+	inode my_inode;
+	int ret = inode_read(inum, &my_inode);
+	if (ret != SUCCESS){
+		return ret;
+	}
+
+	/* The map may have changed since the runs were looked up */
+	int i;
+	uint32_t b, length = 0;
+	uint32_t physical, run;
+	int unwritten;
+	for (i = 0; i < count; i++){
+		ret = extent_lookup(&my_inode, runs[i].logical, &physical, &run, &unwritten);
+		if (ret != SUCCESS || physical != runs[i].physical || run < runs[i].length || unwritten){
+			return SUCCESS;
+		}
+		length += runs[i].length;
+	}
+
+	/* Blocks shared with a clone would only lose an owner when freed, so moving them
+	 * would take up twice the space */
+	int refs;
+	if (my_inode.flags & INODE_SHARED){
+		for (i = 0; i < count; i++){
+			for (b = 0; b < runs[i].length; b++){
+				if (data_refcount(runs[i].physical + b, &refs) != SUCCESS || refs > 0){
+					return SUCCESS;
+				}
+			}
+		}
+	}
+
+	int first;
+	if (data_allocate_contig(length, group_first_block(my_inode.group), &first) != SUCCESS){
+		return SUCCESS;
+	}
+
+	/* A directory already in one run is only worth moving if it ends up home */
+	if (count == 1 && data_group(first) != (int)my_inode.group){
+		data_free_run(first, length);
+		return SUCCESS;
+	}
+
+	/* Copy. Directory blocks are metadata, so they go through the journal */
+	uint8_t block_buf[BLOCK_SIZE];
+	uint32_t to = first;
+	for (i = 0; i < count; i++){
+		for (b = 0; b < runs[i].length; b++){
+			ret = data_read(runs[i].physical + b, block_buf);
+			if (ret == SUCCESS){
+				ret = S_ISREG(my_inode.mode) ? data_write_direct(to, block_buf) : data_write(to, block_buf);
+			}
+			if (ret != SUCCESS){
+				ERR(fprintf(stderr, "ERR: defrag_segment: couldn't copy a block\n"));
+				ERR(fprintf(stderr, "  from: %u\n", runs[i].physical + b));
+				ERR(fprintf(stderr, "  to:   %u\n", to));
+				ERR(fprintf(stderr, "  ret:  %d\n", ret));
+				data_free_run(first, length);
+				return INVALID_BLOCK;
+			}
+			to++;
+		}
+	}
+
+	/* Switch the map over. Taking out whole runs never needs a new tree node, and
+	 * neither does putting one run back in their place */
+	extent ext;
+	ext.logical = runs[0].logical;
+	ext.physical = first;
+	ext.length = length;
+	journal_begin();
+	ret = extent_remove(&my_inode, runs[0].logical, length, FALSE);
+	if (ret == SUCCESS){
+		ret = extent_insert(&my_inode, &ext);
+	}
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: defrag_segment: couldn't switch the block map over\n"));
+		ERR(fprintf(stderr, "  inum: %d\n", inum));
+		ERR(fprintf(stderr, "  ret:  %d\n", ret));
+		journal_end();
+		data_free_run(first, length);
+		return ret;
+	}
+	inode_write(inum, &my_inode);
+
+	for (i = 0; i < count; i++){
+		data_free_run(runs[i].physical, runs[i].length);
+	}
+	ret = journal_end();
+
+	*moved = length;
+	defrag_blocks_moved += length;
+	DEBUG(DB_DEFRAG, printf("DEBUG: defrag_segment: moved %u blocks of inode %d from %d runs to %d\n", length, inum, count, first));
+	return ret;
+}
+
+/* Defragments every file in the filesystem, pausing after every DEFRAG_BATCH_BLOCKS
+ * blocks moved. Stops early if defrag_stop is called. files is set to the number of
+ * files moved and moved to the number of blocks
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - no filesystem
+ *   INT_NULL           - files or moved is null
+ *   SUCCESS            - every file was gone through
+ */
+int defrag_all(int* files, int* moved){
+	if (files == NULL || moved == NULL){
+		ERR(fprintf(stderr, "ERR: defrag_all: something is null\n"));
+		ERR(fprintf(stderr, "  files: %p\n", files));
+		ERR(fprintf(stderr, "  moved: %p\n", moved));
+		return INT_NULL;
+	}
+	*files = 0;
+	*moved = 0;
+
+	superblock sb;
+	int ret = read_superblock(&sb);
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: defrag_all: read_superblock failed\n"));
+		ERR(fprintf(stderr, "  ret: %d\n", ret));
+		return DISC_UNINITIALIZED;
+	}
+
+	int inum, file_moved;
+	int since_pause = 0;
+	for (inum = 1; inum <= sb.num_inodes && !defrag_cancel; inum++){
+		if (defrag_file(inum, &file_moved) != SUCCESS || file_moved == 0){
+			continue;
+		}
+
+		(*files)++;
+		*moved += file_moved;
+		since_pause += file_moved;
+		if (since_pause >= DEFRAG_BATCH_BLOCKS){
+			defrag_pause();
+			since_pause = 0;
+		}
+	}
+
+	return SUCCESS;
+}
+
+/* Returns whether inum is open. The caller must hold fs_lock, since FUSE threads
+ * change the OFT under it */
+int defrag_is_open(int inum){
+	int i;
+	for (i = 0; i < oft_inodes_size; i++){
+		if (oft_inodes[i].inum == inum){
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/* Waits defrag_pause_ms, or until defrag_stop is called */
+void defrag_pause(){
+	if (defrag_pause_ms <= 0){
+		return;
+	}
+
+	struct timespec wake;
+	clock_gettime(CLOCK_REALTIME, &wake);
+	wake.tv_sec += defrag_pause_ms / 1000;
+	wake.tv_nsec += (long)(defrag_pause_ms % 1000) * 1000000;
+	if (wake.tv_nsec >= 1000000000){
+		wake.tv_sec++;
+		wake.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&defrag_lock);
+	if (!defrag_cancel){
+		pthread_cond_timedwait(&defrag_wake, &defrag_lock, &wake);
+	}
+	pthread_mutex_unlock(&defrag_lock);
+}
+
+/* Starts the background defragmenter, which makes a pass over the filesystem every
+ * DEFRAG_INTERVAL seconds
+ *
+ * Returns:
+ *   UNEXPECTED_ERROR - the thread couldn't be created
+ *   SUCCESS          - the defragmenter is running
+ */
+int defrag_start(){
+	if (defrag_running){
+		return SUCCESS;
+	}
+
+	defrag_running = TRUE;
+	defrag_cancel = FALSE;
+	if (pthread_create(&defrag_thread, NULL, defrag_main, NULL) != 0){
+		ERR(fprintf(stderr, "ERR: defrag_start: pthread_create failed\n"));
+		defrag_running = FALSE;
+		return UNEXPECTED_ERROR;
+	}
+
+	return SUCCESS;
+}
+
+/* Stops the background defragmenter. A file being moved is finished first */
+void defrag_stop(){
+	if (!defrag_running){
+		return;
+	}
+
+	pthread_mutex_lock(&defrag_lock);
+	defrag_cancel = TRUE;
+	pthread_cond_signal(&defrag_wake);
+	pthread_mutex_unlock(&defrag_lock);
+
+	pthread_join(defrag_thread, NULL);
+	defrag_running = FALSE;
+	defrag_cancel = FALSE;
+}
+
+/* Body of the background defragmenter */
+void* defrag_main(void* arg){
+	struct timespec wake;
+	int files, moved;
+
+	pthread_mutex_lock(&defrag_lock);
+	while (!defrag_cancel){
+		clock_gettime(CLOCK_REALTIME, &wake);
+		wake.tv_sec += DEFRAG_INTERVAL;
+		pthread_cond_timedwait(&defrag_wake, &defrag_lock, &wake);
+		if (defrag_cancel){
+			break;
+		}
+
+		pthread_mutex_unlock(&defrag_lock);
+		defrag_all(&files, &moved);
+		DEBUG(DB_DEFRAG, printf("DEBUG: defrag_main: moved %d blocks of %d files\n", moved, files));
+		pthread_mutex_lock(&defrag_lock);
+	}
+	pthread_mutex_unlock(&defrag_lock);
+
+	return NULL;
+}
@@ -0,0 +1,85 @@
+#ifndef FRAG_H
+#define FRAG_H
+
+#include <sys/ioctl.h>
+
+/* The fragmentation report walks every file's block map with fiemap_i and every group's
+ * block bitmap, to show how contiguous files and free space are. It's for deciding when
+ * a defragmentation is worth it, and for checking that allocator changes help */
+
+/* Free runs are counted by size in powers of two: 1 block, 2-3, 4-7, ... and the last
+ * bucket holds everything of 2^(FRAG_BUCKETS - 1) blocks or more */
+#define FRAG_BUCKETS 16
+
+/* Runs asked of fiemap_i at a time */
+#define FRAG_BATCH 64
+
+typedef struct frag_report {
+	int files;            //files with at least one data block
+	int fragmented_files; //files in more than one run
+	int file_blocks;      //data blocks of all files, not counting extent tree nodes
+	int file_extents;     //runs of all files
+	int worst_inum;       //the file in the most runs
+	int worst_extents;
+
+	int free_blocks;
+	int free_extents;     //runs of free blocks, which never cross groups
+	int largest_free;
+	int free_histogram[FRAG_BUCKETS];
+
+	double score; //0 if every file is in one run, 100 if no two blocks of a file are together
+} frag_report;
+
+/* The FUSE front end answers two ioctls of its own, on any file or directory in the
+ * mount. The kernel handles FS_IOC_FIEMAP itself and never passes it on, so the runs
+ * are asked for with FRAG_IOC_FIEMAP instead. FUSE copies a fixed size each way, so
+ * they come back FRAG_IOC_RUNS at a time: set start to the block after the last run
+ * and ask again, until a run has FIEMAP_EXTENT_LAST or none are found */
+#define FRAG_IOC_RUNS 64
+
+typedef struct frag_fiemap {
+	uint32_t start; //first file block to report from
+	int found;      //runs filled in
+	file_extent runs[FRAG_IOC_RUNS];
+} frag_fiemap;
+
+#define FRAG_IOC_FIEMAP _IOWR('F', 0x80, frag_fiemap)
+#define FRAG_IOC_REPORT _IOR('F', 0x81, frag_report)
+
+/* Online defragmentation moves each stretch of a file that is split over several runs
+ * into one new run near the file's inode, and swaps the block map over in a single
+ * transaction. Directories are also moved home to their inode's group. Each stretch is
+ * moved with fs_lock held, so no write can land in the old blocks while they are being
+ * copied. Open files are skipped, since their OFT entries remember where their blocks are.
+ * The whole-filesystem pass pauses for defrag_pause_ms after every DEFRAG_BATCH_BLOCKS
+ * blocks moved, so foreground I/O isn't held up behind it */
+#define DEFRAG_BATCH_BLOCKS 256
+#define DEFRAG_PAUSE_MS 10
+#define DEFRAG_INTERVAL 60 //seconds between passes of the background thread
+
+extern int defrag_pause_ms;
+extern int defrag_blocks_moved;
+extern pthread_mutex_t defrag_lock;
+extern pthread_cond_t defrag_wake;
+extern pthread_t defrag_thread;
+extern int defrag_running;
+extern int defrag_cancel;
+
+int frag_scan(frag_report* report);
+int frag_file(int inum, int* blocks, int* extents);
+int frag_free_space(frag_report* report);
+int frag_bucket(int length);
+void frag_print(frag_report* report);
+void frag_print_files(int min_extents);
+
+int defrag_file(int inum, int* moved);
+int defrag_segment(int inum, file_extent* runs, int count, int* moved);
+int defrag_segment_locked(int inum, file_extent* runs, int count, int* moved);
+int defrag_all(int* files, int* moved);
+int defrag_is_open(int inum);
+void defrag_pause();
+int defrag_start();
+void defrag_stop();
+void* defrag_main(void* arg);
+
+#endif
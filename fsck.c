@@ -0,0 +1,650 @@
+#include <time.h>
+#include "globals.h"
+#include "layer0.h"
+#include "layer1.h"
+#include "layer2.h"
+#include "fsck.h"
+
+/* Checks the filesystem for consistency, using threads worker threads. If snapshot
+ * isn't NO_SNAPSHOT, that snapshot is checked instead of the disk. The disk should
+ * only be checked directly when nothing else is using it; see fsck_online otherwise
+ *
+ * Every problem found is counted in report, along with how long each phase took
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - no filesystem to check
+ *   BUF_NULL           - report is null
+ *   UNEXPECTED_ERROR   - malloc or pthread error
+ *   FSCK_PROBLEMS      - the filesystem is inconsistent
+ *   SUCCESS            - no problems found
+ */
+int fsck(int snapshot, int threads, fsck_report* report){
+	if (report == NULL){
+		ERR(fprintf(stderr, "ERR: fsck: report is null\n"));
+		ERR(fprintf(stderr, "  report: %p\n", report));
+		return BUF_NULL;
+	}
+	memset(report, 0, sizeof(fsck_report));
+
+	if (total_blocks == UNINITIALIZED_BLOCKS || disk == NULL){
+		ERR(fprintf(stderr, "ERR: fsck: disk uninitialized\n"));
+		return DISC_UNINITIALIZED;
+	}
+
+	threads = MAX(1, MIN(threads, FSCK_MAX_THREADS));
+
+	fsck_state state;
+	memset(&state, 0, sizeof(fsck_state));
+	state.snapshot = snapshot;
+
+	/* Read the superblock and the group descriptor table from disk, not from the caches */
+	uint8_t buf[BLOCK_SIZE];
+	int ret = fsck_read(&state, 0, buf);
+	if (ret != SUCCESS){
+		return DISC_UNINITIALIZED;
+	}
+	memcpy(&state.sb, buf, sizeof(superblock));
+
+	superblock* sb = &state.sb;
+	if (sb->num_groups == 0 || sb->data_size == 0 || sb->blocks_per_group == 0 ||
+	    sb->data_block_offset + sb->data_size > total_blocks){
+		ERR(fprintf(stderr, "ERR: fsck: superblock is corrupt\n"));
+		ERR(fprintf(stderr, "  num_groups: %u\n", sb->num_groups));
+		ERR(fprintf(stderr, "  data_size:  %u\n", sb->data_size));
+		return DISC_UNINITIALIZED;
+	}
+
+	state.groups = malloc(sb->num_groups * sizeof(group_desc));
+	state.used = calloc(sb->data_size / 8 + 1, 1);
+	state.shares = calloc(sb->data_size + 1, 1);
+	state.allocated = calloc(sb->num_inodes / 8 + 1, 1);
+	state.refs = calloc(sb->num_inodes + 1, sizeof(int));
+	fsck_worker* workers = malloc(threads * sizeof(fsck_worker));
+	if (state.groups == NULL || state.used == NULL || state.shares == NULL || state.allocated == NULL || state.refs == NULL || workers == NULL){
+		ERR(perror(NULL));
+		ret = UNEXPECTED_ERROR;
+	}
+	else{
+		ret = fsck_check(&state, workers, threads, report);
+	}
+
+	free(state.groups);
+	free(state.used);
+	free(state.shares);
+	free(state.allocated);
+	free(state.refs);
+	free(workers);
+
+	return ret;
+}
+
+/* Does the work of fsck once everything it needs is allocated
+ *
+ * Returns:
+ *   UNEXPECTED_ERROR   - pthread error
+ *   FSCK_PROBLEMS      - the filesystem is inconsistent
+ *   SUCCESS            - no problems found
+ */
+int fsck_check(fsck_state* state, fsck_worker* workers, int threads, fsck_report* report){
+	superblock* sb = &state->sb;
+
+	gdt_block gdt;
+	int group;
+	for (group = 0; group < sb->num_groups; group++){
+		if (group % GROUPS_PER_BLOCK == 0){
+			fsck_read(state, sb->gdt_block_offset + group / GROUPS_PER_BLOCK, &gdt);
+		}
+		memcpy(&state->groups[group], &gdt.groups[group % GROUPS_PER_BLOCK], sizeof(group_desc));
+	}
+	report->groups = sb->num_groups;
+
+	int phase, ret;
+	for (phase = 0; phase < FSCK_PHASES; phase++){
+		ret = fsck_run_phase(state, workers, threads, phase);
+		if (ret != SUCCESS){
+			return ret;
+		}
+	}
+
+	/* Add up what the workers found */
+	int i;
+	for (i = 0; i < threads; i++){
+		report->inodes_checked += workers[i].report.inodes_checked;
+		report->blocks_used += workers[i].report.blocks_used;
+		report->leaked_blocks += workers[i].report.leaked_blocks;
+		report->unmarked_blocks += workers[i].report.unmarked_blocks;
+		report->double_blocks += workers[i].report.double_blocks;
+		report->bad_blocks += workers[i].report.bad_blocks;
+		report->bad_free_counts += workers[i].report.bad_free_counts;
+		report->bad_inodes += workers[i].report.bad_inodes;
+		report->bad_dirents += workers[i].report.bad_dirents;
+		report->bad_refcounts += workers[i].report.bad_refcounts;
+	}
+
+	/* Every inode but the root needs an entry in some directory, unless it's an orphan */
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	fsck_count_orphans(state, report);
+	int inum;
+	for (inum = 1; inum <= sb->num_inodes; inum++){
+		if (inum != sb->root_inode && fsck_bit_allocated(state, inum) && state->refs[inum] == 0){
+			DEBUG(DB_FSCK, printf("DEBUG: fsck: inode %d is unreachable\n", inum));
+			report->unreachable_inodes++;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	for (i = 0; i < FSCK_PHASES; i++){
+		report->phase_seconds[i] = workers[0].report.phase_seconds[i];
+	}
+	report->phase_seconds[FSCK_PHASE_DIRS] += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	return (fsck_problems(report) > 0) ? FSCK_PROBLEMS : SUCCESS;
+}
+
+/* Checks the filesystem while it's in use, by taking a snapshot and checking that.
+ * Files that were deleted while open still hold their inode and blocks, and show up
+ * as unreachable
+ *
+ * Returns:
+ *   the return value of fsck, or of snapshot_create if no snapshot could be taken
+ */
+int fsck_online(int threads, fsck_report* report){
+	int id;
+	int ret = snapshot_create("fsck", &id);
+	if (ret != SUCCESS){
+		return ret;
+	}
+
+	ret = fsck(id, threads, report);
+	snapshot_delete(id);
+
+	return ret;
+}
+
+/* Returns the number of problems in report */
+int fsck_problems(fsck_report* report){
+	return report->leaked_blocks + report->unmarked_blocks + report->double_blocks + report->bad_blocks +
+	       report->bad_free_counts + report->bad_inodes + report->bad_dirents + report->unreachable_inodes +
+	       report->bad_refcounts;
+}
+
+/* Prints report to stdout */
+void fsck_print(fsck_report* report){
+	printf("fsck: %d groups, %d inodes, %d blocks in use\n", report->groups, report->inodes_checked, report->blocks_used);
+	printf("  leaked blocks:      %d\n", report->leaked_blocks);
+	printf("  unmarked blocks:    %d\n", report->unmarked_blocks);
+	printf("  doubly used blocks: %d\n", report->double_blocks);
+	printf("  bad block pointers: %d\n", report->bad_blocks);
+	printf("  bad free counts:    %d\n", report->bad_free_counts);
+	printf("  bad inodes:         %d\n", report->bad_inodes);
+	printf("  bad dirents:        %d\n", report->bad_dirents);
+	printf("  unreachable inodes: %d\n", report->unreachable_inodes);
+	printf("  bad share counts:   %d\n", report->bad_refcounts);
+	printf("  orphans:            %d\n", report->orphans);
+	printf("  inodes phase:       %.3fs\n", report->phase_seconds[FSCK_PHASE_INODES]);
+	printf("  bitmaps phase:      %.3fs\n", report->phase_seconds[FSCK_PHASE_BITMAPS]);
+	printf("  directories phase:  %.3fs\n", report->phase_seconds[FSCK_PHASE_DIRS]);
+}
+
+/* Runs one phase of the check on every group, split between the workers, and waits
+ * for it to finish. The time it took is stored in the first worker's report
+ *
+ * Returns:
+ *   UNEXPECTED_ERROR   - a thread couldn't be created
+ *   SUCCESS            - the phase is done
+ */
+int fsck_run_phase(fsck_state* state, fsck_worker* workers, int threads, int phase){
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	state->phase = phase;
+	state->next_group = 0;
+
+	int i, created;
+	int ret = SUCCESS;
+	for (created = 0; created < threads; created++){
+		workers[created].state = state;
+		if (phase == 0){
+			memset(&workers[created].report, 0, sizeof(fsck_report));
+		}
+		if (pthread_create(&workers[created].thread, NULL, fsck_worker_main, &workers[created]) != 0){
+			ERR(fprintf(stderr, "ERR: fsck_run_phase: pthread_create failed\n"));
+			ret = UNEXPECTED_ERROR;
+			break;
+		}
+	}
+	for (i = 0; i < created; i++){
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	workers[0].report.phase_seconds[phase] = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	DEBUG(DB_FSCK, printf("DEBUG: fsck_run_phase: finished a phase\n"));
+	DEBUG(DB_FSCK, printf("  phase:   %d\n", phase));
+	DEBUG(DB_FSCK, printf("  threads: %d\n", created));
+	DEBUG(DB_FSCK, printf("  seconds: %f\n", workers[0].report.phase_seconds[phase]));
+
+	return ret;
+}
+
+/* Body of a worker. Takes groups one at a time until there are none left, and runs
+ * the current phase on each */
+void* fsck_worker_main(void* arg){
+	fsck_worker* worker = arg;
+	fsck_state* state = worker->state;
+
+	int group;
+	while ((group = __atomic_fetch_add(&state->next_group, 1, __ATOMIC_RELAXED)) < state->sb.num_groups){
+		if (state->phase == FSCK_PHASE_INODES){
+			fsck_check_inodes(state, &worker->report, group);
+		}
+		else if (state->phase == FSCK_PHASE_BITMAPS){
+			fsck_check_bitmap(state, &worker->report, group);
+		}
+		else{
+			fsck_check_dirs(state, &worker->report, group);
+		}
+	}
+
+	return NULL;
+}
+
+/* Reads the blocknum-th block of the disk, or of the snapshot being checked
+ *
+ * Returns:
+ *   the return value of read_block or snapshot_read
+ */
+int fsck_read(fsck_state* state, int blocknum, void* read_buf){
+	if (state->snapshot == NO_SNAPSHOT){
+		return read_block(blocknum, read_buf);
+	}
+
+	return snapshot_read(state->snapshot, blocknum, read_buf);
+}
+
+/* Reads the data_block_num-th data block, which must be valid
+ *
+ * Returns:
+ *   the return value of fsck_read
+ */
+int fsck_read_data(fsck_state* state, int data_block_num, void* read_buf){
+	return fsck_read(state, state->sb.data_block_offset + data_block_num - 1, read_buf);
+}
+
+/* Reads inode inode_num, which must be valid, going through the ichunk index
+ *
+ * Returns:
+ *   BAD_INODE          - the inode's chunk doesn't exist
+ *   SUCCESS            - read_node holds the inode
+ */
+int fsck_read_inode(fsck_state* state, int inode_num, inode* read_node){
+	int chunk_num = (inode_num - 1) / INODES_PER_BLOCK;
+	int chunks_per_group = state->sb.inodes_per_group / INODES_PER_BLOCK;
+	int group = chunk_num / chunks_per_group;
+	int chunk_in_group = chunk_num % chunks_per_group;
+
+	ichunk_block index;
+	fsck_read_data(state, state->groups[group].ichunk_index + chunk_in_group / ICHUNKS_PER_BLOCK, &index);
+	int chunk_block = index.chunk[chunk_in_group % ICHUNKS_PER_BLOCK];
+	if (chunk_block == INVALID_DATA || chunk_block > state->sb.data_size){
+		return BAD_INODE;
+	}
+
+	iblock block;
+	fsck_read_data(state, chunk_block, &block);
+	memcpy(read_node, &block.inodes[(inode_num - 1) % INODES_PER_BLOCK], sizeof(inode));
+
+	return SUCCESS;
+}
+
+/* Phase 1 for one group: copies the group's slice of the ibitmap, then marks the
+ * blocks used by the group's metadata, its inode chunks, and the extent trees of its
+ * allocated inodes
+ *
+ * Returns:
+ *   SUCCESS
+ */
+int fsck_check_inodes(fsck_state* state, fsck_report* report, int group){
+	superblock* sb = &state->sb;
+	group_desc* gd = &state->groups[group];
+
+	int i;
+	for (i = 0; i < 1 + sb->ibitmap_size + sb->ichunk_size; i++){
+		fsck_mark(state, report, INVALID_INODE, gd->first_block + i);
+	}
+	for (i = 0; gd->refcount_table != 0 && i < REFCOUNT_BLOCKS; i++){
+		fsck_mark(state, report, INVALID_INODE, gd->refcount_table + i);
+	}
+
+	/* Each group's slice starts on a byte, since inodes_per_group is a multiple of 8 */
+	uint8_t buf[BLOCK_SIZE];
+	int bytes = sb->inodes_per_group / 8;
+	int offset = group * bytes;
+	int block, len;
+	for (block = 0; block < sb->ibitmap_size; block++){
+		fsck_read_data(state, gd->ibitmap + block, buf);
+		len = MIN(BLOCK_SIZE, bytes - block * BLOCK_SIZE);
+		memcpy(state->allocated + offset + block * BLOCK_SIZE, buf, len);
+	}
+
+	ichunk_block index;
+	iblock chunk;
+	inode* inod;
+	int chunks_per_group = sb->inodes_per_group / INODES_PER_BLOCK;
+	int c, chunk_block, inum;
+	for (c = 0; c < chunks_per_group; c++){
+		if (c % ICHUNKS_PER_BLOCK == 0){
+			fsck_read_data(state, gd->ichunk_index + c / ICHUNKS_PER_BLOCK, &index);
+		}
+
+		chunk_block = index.chunk[c % ICHUNKS_PER_BLOCK];
+		if (chunk_block != INVALID_DATA){
+			if (fsck_mark(state, report, INVALID_INODE, chunk_block) != SUCCESS){
+				chunk_block = INVALID_DATA;
+			}
+			else{
+				fsck_read_data(state, chunk_block, &chunk);
+			}
+		}
+
+		for (i = 0; i < INODES_PER_BLOCK; i++){
+			inum = group * sb->inodes_per_group + c * INODES_PER_BLOCK + i + 1;
+			if (!fsck_bit_allocated(state, inum)){
+				continue;
+			}
+
+			inod = &chunk.inodes[i];
+			if (chunk_block == INVALID_DATA || inod->mode == 0){
+				DEBUG(DB_FSCK, printf("DEBUG: fsck: inode %d is allocated but empty\n", inum));
+				report->bad_inodes++;
+				continue;
+			}
+			report->inodes_checked++;
+
+			if (!(inod->flags & INODE_INLINE)){
+				fsck_walk_extents(state, report, inum, &inod->ext_header, inod->extents, INODE_EXTENTS);
+			}
+		}
+	}
+
+	return SUCCESS;
+}
+
+/* Phase 2 for one group: compares the group's block bitmap with the blocks found in
+ * use, its share counts with the owners found for each block, and its descriptor's
+ * free counts with its bitmaps
+ *
+ * Returns:
+ *   SUCCESS
+ */
+int fsck_check_bitmap(fsck_state* state, fsck_report* report, int group){
+	group_desc* gd = &state->groups[group];
+
+	uint8_t bitmap[BLOCK_SIZE];
+	fsck_read_data(state, gd->block_bitmap, bitmap);
+
+	uint8_t counts[REFCOUNT_BLOCKS * BLOCK_SIZE];
+	memset(counts, 0, sizeof(counts));
+	int i, marked, used, shares;
+	int table = (gd->refcount_table != 0 && gd->refcount_table + REFCOUNT_BLOCKS - 1 <= state->sb.data_size);
+	for (i = 0; table && i < REFCOUNT_BLOCKS; i++){
+		fsck_read_data(state, gd->refcount_table + i, &counts[i * BLOCK_SIZE]);
+	}
+
+	int free_blocks = 0;
+	for (i = 0; i < gd->num_blocks; i++){
+		/* Blocks that aren't shared and have more than one owner were counted by fsck_mark */
+		shares = state->shares[gd->first_block + i];
+		if (counts[i] > 0 && shares != counts[i]){
+			DEBUG(DB_FSCK, printf("DEBUG: fsck: block %d has the wrong share count\n", gd->first_block + i));
+			DEBUG(DB_FSCK, printf("  count: %d, owners past the first: %d\n", counts[i], shares));
+			report->bad_refcounts++;
+		}
+		else if (counts[i] == 0 && shares > 0){
+			report->double_blocks += shares;
+		}
+
+		marked = bitmap_test(bitmap, i);
+		used = bitmap_test(state->used, gd->first_block - 1 + i);
+		if (marked && !used){
+			DEBUG(DB_FSCK, printf("DEBUG: fsck: block %d is leaked\n", gd->first_block + i));
+			report->leaked_blocks++;
+		}
+		else if (used && !marked){
+			DEBUG(DB_FSCK, printf("DEBUG: fsck: block %d is used but free\n", gd->first_block + i));
+			report->unmarked_blocks++;
+		}
+
+		free_blocks += !marked;
+	}
+
+	int free_inodes = 0;
+	int first = group * state->sb.inodes_per_group + 1;
+	for (i = 0; i < state->sb.inodes_per_group; i++){
+		free_inodes += !fsck_bit_allocated(state, first + i);
+	}
+
+	if (free_blocks != gd->free_blocks || free_inodes != gd->free_inodes){
+		DEBUG(DB_FSCK, printf("DEBUG: fsck: group %d has the wrong free counts\n", group));
+		DEBUG(DB_FSCK, printf("  free_blocks: %u, counted %d\n", gd->free_blocks, free_blocks));
+		DEBUG(DB_FSCK, printf("  free_inodes: %u, counted %d\n", gd->free_inodes, free_inodes));
+		report->bad_free_counts++;
+	}
+
+	return SUCCESS;
+}
+
+/* Phase 3 for one group: checks the entries of the group's directories. Each must point
+ * at an allocated inode, and "." at the directory itself. Entries are counted for each
+ * inode they point at
+ *
+ * Returns:
+ *   SUCCESS
+ */
+int fsck_check_dirs(fsck_state* state, fsck_report* report, int group){
+	superblock* sb = &state->sb;
+
+	inode inod;
+	dirblock block;
+	int first = group * sb->inodes_per_group + 1;
+	int inum, page, num_pages, entries, physical, i, target;
+	for (inum = first; inum < first + sb->inodes_per_group; inum++){
+		if (!fsck_bit_allocated(state, inum) || fsck_read_inode(state, inum, &inod) != SUCCESS || !S_ISDIR(inod.mode)){
+			continue;
+		}
+
+		if ((inod.size % BLOCK_SIZE) % sizeof(dir_ent) != 0){
+			DEBUG(DB_FSCK, printf("DEBUG: fsck: directory %d has a bad size\n", inum));
+			report->bad_inodes++;
+			continue;
+		}
+
+		num_pages = inod.size / BLOCK_SIZE;
+		for (page = 0; page <= num_pages; page++){
+			entries = (page == num_pages) ? (inod.size % BLOCK_SIZE) / sizeof(dir_ent) : DIRENTS_PER_BLOCK;
+			if (entries == 0){
+				continue;
+			}
+
+			if (inod.flags & INODE_INLINE){
+				memcpy(&block, inod.inline_data, MIN(sizeof(inod.inline_data), entries * sizeof(dir_ent)));
+			}
+			else{
+				physical = fsck_map(state, &inod, page);
+				if (physical == INVALID_DATA){
+					DEBUG(DB_FSCK, printf("DEBUG: fsck: directory %d has a hole\n", inum));
+					report->bad_inodes++;
+					break;
+				}
+				fsck_read_data(state, physical, &block);
+			}
+
+			for (i = 0; i < entries; i++){
+				target = block.dir_ents[i].inode_num;
+				if (target <= 0 || target > sb->num_inodes || !fsck_bit_allocated(state, target) ||
+				    (strcmp(block.dir_ents[i].name, ".") == 0 && target != inum)){
+					DEBUG(DB_FSCK, printf("DEBUG: fsck: bad entry in directory %d\n", inum));
+					DEBUG(DB_FSCK, printf("  name:  %s\n", block.dir_ents[i].name));
+					DEBUG(DB_FSCK, printf("  inode: %d\n", target));
+					report->bad_dirents++;
+				}
+				else if (strcmp(block.dir_ents[i].name, ".") != 0 && strcmp(block.dir_ents[i].name, "..") != 0){
+					__atomic_fetch_add(&state->refs[target], 1, __ATOMIC_RELAXED);
+				}
+			}
+		}
+	}
+
+	return SUCCESS;
+}
+
+/* Marks data block data_block_num as used by inode inum (INVALID_INODE for metadata)
+ *
+ * Returns:
+ *   INVALID_BLOCK      - the block is outside of the data region
+ *   DATA_FULL          - something already uses the block, which is fine if it's shared
+ *   SUCCESS            - the block was marked
+ */
+int fsck_mark(fsck_state* state, fsck_report* report, int inum, int data_block_num){
+	if (data_block_num < 1 || data_block_num > state->sb.data_size){
+		DEBUG(DB_FSCK, printf("DEBUG: fsck: inode %d points outside the data region\n", inum));
+		DEBUG(DB_FSCK, printf("  block: %d\n", data_block_num));
+		report->bad_blocks++;
+		return INVALID_BLOCK;
+	}
+
+	/* Another use of a block is only a problem if it isn't shared, which is found out
+	 * once every group's share counts can be compared in phase 2 */
+	int bit = data_block_num - 1;
+	uint8_t mask = 0x80 >> (bit % 8);
+	if (__atomic_fetch_or(&state->used[bit / 8], mask, __ATOMIC_RELAXED) & mask){
+		DEBUG(DB_FSCK, printf("DEBUG: fsck: block %d is used twice\n", data_block_num));
+		DEBUG(DB_FSCK, printf("  inode: %d\n", inum));
+		if (inum == INVALID_INODE || __atomic_fetch_add(&state->shares[data_block_num], 1, __ATOMIC_RELAXED) == 255){
+			report->double_blocks++;
+		}
+		return DATA_FULL;
+	}
+
+	report->blocks_used++;
+	return SUCCESS;
+}
+
+/* Marks the blocks of an extent tree node, holding entries right after header, and of
+ * every node below it. max_entries is how many entries fit in the node
+ *
+ * Returns:
+ *   BAD_INODE          - the tree is malformed
+ *   SUCCESS            - every block in the tree was marked
+ */
+int fsck_walk_extents(fsck_state* state, fsck_report* report, int inum, extent_header* header, void* entries, int max_entries){
+	if (header->entries > max_entries || header->depth > EXTENT_MAX_DEPTH){
+		DEBUG(DB_FSCK, printf("DEBUG: fsck: inode %d has a malformed extent tree\n", inum));
+		report->bad_inodes++;
+		return BAD_INODE;
+	}
+
+	int i, b;
+	if (header->depth == 0){
+		extent* extents = entries;
+		for (i = 0; i < header->entries; i++){
+			for (b = 0; b < EXTENT_LENGTH(extents[i]); b++){
+				if (fsck_mark(state, report, inum, extents[i].physical + b) == INVALID_BLOCK){
+					break;
+				}
+			}
+		}
+
+		return SUCCESS;
+	}
+
+	extent_index* index = entries;
+	extent_block child;
+	for (i = 0; i < header->entries; i++){
+		if (fsck_mark(state, report, inum, index[i].child) != SUCCESS){
+			continue;
+		}
+
+		fsck_read_data(state, index[i].child, &child);
+		if (child.header.depth != header->depth - 1){
+			DEBUG(DB_FSCK, printf("DEBUG: fsck: inode %d has a node at the wrong depth\n", inum));
+			report->bad_inodes++;
+			continue;
+		}
+		fsck_walk_extents(state, report, inum, &child.header,
+		                  child.header.depth == 0 ? (void*)child.extents : (void*)child.index,
+		                  child.header.depth == 0 ? BLOCK_EXTENTS : BLOCK_EXTENT_INDEXES);
+	}
+
+	return SUCCESS;
+}
+
+/* Returns the data block holding the n-th block of the file, or INVALID_DATA if it's a
+ * hole. The tree must already have been checked by fsck_walk_extents */
+int fsck_map(fsck_state* state, inode* inod, uint32_t n){
+	extent_header header = inod->ext_header;
+	extent_block node;
+	memcpy(&node.extents, inod->extents, sizeof(inod->extents));
+
+	int i, found, depth;
+	for (depth = 0; depth <= EXTENT_MAX_DEPTH; depth++){
+		if (header.depth == 0){
+			for (i = 0; i < header.entries; i++){
+				if (n >= node.extents[i].logical && n < node.extents[i].logical + EXTENT_LENGTH(node.extents[i])){
+					return node.extents[i].physical + (n - node.extents[i].logical);
+				}
+			}
+			return INVALID_DATA;
+		}
+
+		/* Follow the last index entry starting at or before n */
+		found = -1;
+		for (i = 0; i < header.entries && node.index[i].logical <= n; i++){
+			found = i;
+		}
+		if (found == -1 || node.index[found].child < 1 || node.index[found].child > state->sb.data_size){
+			return INVALID_DATA;
+		}
+
+		fsck_read_data(state, node.index[found].child, &node);
+		header = node.header;
+	}
+
+	return INVALID_DATA;
+}
+
+/* Returns whether inode inum is marked allocated in the ibitmap */
+int fsck_bit_allocated(fsck_state* state, int inum){
+	return bitmap_test(state->allocated, inum - 1);
+}
+
+/* Walks the orphan list, counting each orphan as referenced so it isn't reported as
+ * unreachable. Orphans that aren't allocated count as bad inodes, and a list that loops
+ * or leaves the ilist is cut short there
+ *
+ * Returns:
+ *   SUCCESS
+ */
+int fsck_count_orphans(fsck_state* state, fsck_report* report){
+	inode orphan;
+	uint32_t inum = state->sb.orphan_head;
+	while (inum != INVALID_INODE && report->orphans < state->sb.num_inodes){
+		if (inum > state->sb.num_inodes || fsck_read_inode(state, inum, &orphan) != SUCCESS){
+			DEBUG(DB_FSCK, printf("DEBUG: fsck: orphan list points outside the ilist\n"));
+			report->bad_inodes++;
+			break;
+		}
+		if (!fsck_bit_allocated(state, inum)){
+			DEBUG(DB_FSCK, printf("DEBUG: fsck: orphan %u isn't allocated\n", inum));
+			report->bad_inodes++;
+		}
+		
+		state->refs[inum]++;
+		report->orphans++;
+		inum = orphan.next_orphan;
+	}
+	
+	return SUCCESS;
+}
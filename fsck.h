@@ -0,0 +1,75 @@
+#ifndef FSCK_H
+#define FSCK_H
+
+/* The checker reads the filesystem straight from its blocks rather than through the
+ * in-memory caches, so it sees what is really on disk. Work is split up by block group,
+ * each group being a range of the ilist, and handed out to worker threads one group at
+ * a time. The blocks in use are collected in a bitmap shared by every thread */
+#define FSCK_MAX_THREADS 64
+
+/* The check runs in three phases, each timed separately */
+#define FSCK_PHASE_INODES 0  //walk every allocated inode's extent tree, marking the blocks it uses
+#define FSCK_PHASE_BITMAPS 1 //compare the blocks found in use with each group's bitmap and counts
+#define FSCK_PHASE_DIRS 2    //check every directory entry, and that every inode can be reached
+#define FSCK_PHASES 3
+
+typedef struct fsck_report {
+	int groups;
+	int inodes_checked;
+	int blocks_used;
+
+	int leaked_blocks;      //marked in use in a bitmap, but nothing uses them
+	int unmarked_blocks;    //in use, but free in their bitmap
+	int double_blocks;      //used more than once
+	int bad_blocks;         //pointers outside of the data region
+	int bad_free_counts;    //group descriptors with the wrong free block or inode count
+	int bad_inodes;         //allocated inodes that are empty or malformed, or unallocated ones in use
+	int bad_dirents;        //entries pointing at inodes that aren't allocated
+	int unreachable_inodes; //allocated, but not in any directory or on the orphan list
+	int bad_refcounts;      //shared blocks whose share count doesn't match their owners
+
+	int orphans; //deleted, waiting for their blocks to be reclaimed. Not a problem
+
+	double phase_seconds[FSCK_PHASES];
+} fsck_report;
+
+/* Everything the workers share. Workers take the next group to check from next_group */
+typedef struct fsck_state {
+	int snapshot; //snapshot being checked, or NO_SNAPSHOT for the disk itself
+	superblock sb;
+	group_desc* groups;
+	uint8_t* used; //one bit per data block, from data block 1
+	uint8_t* shares; //owners found past the first, for each data block from data block 1
+	uint8_t* allocated; //one bit per inode, from inode 1, copied from the ibitmap
+	int* refs; //directory entries pointing at each inode
+	int next_group;
+	int phase;
+} fsck_state;
+
+typedef struct fsck_worker {
+	fsck_state* state;
+	fsck_report report;
+	pthread_t thread;
+} fsck_worker;
+
+int fsck(int snapshot, int threads, fsck_report* report);
+int fsck_online(int threads, fsck_report* report);
+int fsck_check(fsck_state* state, fsck_worker* workers, int threads, fsck_report* report);
+int fsck_problems(fsck_report* report);
+void fsck_print(fsck_report* report);
+
+int fsck_run_phase(fsck_state* state, fsck_worker* workers, int threads, int phase);
+void* fsck_worker_main(void* arg);
+int fsck_read(fsck_state* state, int blocknum, void* read_buf);
+int fsck_read_data(fsck_state* state, int data_block_num, void* read_buf);
+int fsck_read_inode(fsck_state* state, int inode_num, inode* read_node);
+int fsck_check_inodes(fsck_state* state, fsck_report* report, int group);
+int fsck_check_bitmap(fsck_state* state, fsck_report* report, int group);
+int fsck_check_dirs(fsck_state* state, fsck_report* report, int group);
+int fsck_mark(fsck_state* state, fsck_report* report, int inum, int data_block_num);
+int fsck_walk_extents(fsck_state* state, fsck_report* report, int inum, extent_header* header, void* entries, int max_entries);
+int fsck_map(fsck_state* state, inode* inod, uint32_t n);
+int fsck_bit_allocated(fsck_state* state, int inum);
+int fsck_count_orphans(fsck_state* state, fsck_report* report);
+
+#endif
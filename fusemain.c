@@ -2,17 +2,107 @@
 
 #include <fuse.h>
 #include <stdio.h>
+#include <sys/ioctl.h>
 #include "globals.h"
 #include "layer0.h"
 #include "layer1.h"
 #include "layer2.h"
+#include "frag.h"
+
+/* Largest read or write asked of the kernel, in bytes */
+#define FUSE_MAX_IO (1024 * 1024)
+#define FUSE_MAX_IO_STRING "1048576"
+
+/* The request fstrim sends, as in linux/fs.h, which can't be included here since it
+ * has a BLOCK_SIZE of its own */
+#ifndef FITRIM
+struct fstrim_range {
+	uint64_t start;
+	uint64_t len;
+	uint64_t minlen;
+};
+#define FITRIM _IOWR('X', 121, struct fstrim_range)
+#endif
+
+/* Sets ret to the result of call, run as a transaction of its own. Blocks freed by
+ * transactions that haven't committed yet can't be reused, so if call runs out of
+ * room the journal is committed to give them back and call is run once more */
+#define FS_TRANSACTION(ret, call) {\
+	journal_begin();\
+	ret = call;\
+	journal_end();\
+	if (ret == DATA_FULL || ret == -ENOSPC){\
+		journal_sync();\
+		journal_begin();\
+		ret = call;\
+		journal_end();\
+	}\
+}
 
 static void *fs_init(struct fuse_conn_info *conn){
 	struct fuse_context* context = fuse_get_context();
+	
+	/* Sequential I/O in big requests: each one is a single pass over the block map */
+	conn->max_write = FUSE_MAX_IO;
+	conn->max_readahead = FUSE_MAX_IO;
+	
+	/* Log-structured mode is for backing devices that are bad at random writes */
+	lfs_enabled = (getenv("FS_LOG_STRUCTURED") != NULL);
 	mkfs(40000, context->uid, context->gid);
+	lfs_cleaner_start();
+	delalloc_enabled = TRUE;
+	
+	/* Write-heavy workloads can skip looking for blocks of 0s to free */
+	char* sparse = getenv("FS_SPARSE_POLICY");
+	if (sparse != NULL && strcmp(sparse, "aligned") == 0){
+		sparse_policy = SPARSE_ALIGNED;
+	}
+	else if (sparse != NULL && strcmp(sparse, "never") == 0){
+		sparse_policy = SPARSE_NEVER;
+	}
+	
+	/* Give freed blocks back to the host in the background */
+	discard_enabled = TRUE;
+	discard_start();
+	
+	/* Unlinking a big file shouldn't wait for all of its blocks to be freed */
+	orphan_async = TRUE;
+	orphan_reaper_start();
+	
+	/* Long-lived mounts can have their files put back together in the background */
+	if (getenv("FS_DEFRAG") != NULL){
+		defrag_start();
+	}
 	return NULL;
 }
 
+static void fs_destroy(void* private_data){
+	defrag_stop();
+	
+	/* Orphans the reaper didn't get to are reclaimed at the next mount */
+	orphan_reaper_stop();
+	
+	journal_begin();
+	delalloc_flush_all();
+	journal_end();
+	
+	/* Leave everything in its home location with an empty journal */
+	journal_checkpoint();
+	lfs_cleaner_stop();
+	
+	int discarded = 0;
+	discard_stop();
+	data_discard_flush(&discarded);
+	
+	/* How fragmented the files and free space ended up, for tuning the allocator */
+	if (getenv("FS_FRAG_REPORT") != NULL){
+		frag_report report;
+		frag_scan(&report);
+		frag_print(&report);
+		frag_print_files(2);
+	}
+}
+
 static int fs_getattr(const char *path, struct stat *stbuf){
 	struct fuse_context* context = fuse_get_context();
 	
@@ -85,13 +175,19 @@ static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t
 static int fs_mknod(const char *path, mode_t mode, dev_t rdev){
 	struct fuse_context* context = fuse_get_context();
 	
-	return mknod_fs(path, mode, context->uid, context->gid);
+	int ret;
+	FS_TRANSACTION(ret, mknod_fs(path, mode, context->uid, context->gid));
+	
+	return ret;
 }
 
 static int fs_mkdir(const char *path, mode_t mode){
 	struct fuse_context* context = fuse_get_context();
 	
-	return mkdir_fs(path, mode, context->uid, context->gid);
+	int ret;
+	FS_TRANSACTION(ret, mkdir_fs(path, mode, context->uid, context->gid));
+	
+	return ret;
 }
 
 
@@ -124,8 +220,10 @@ static int fs_unlink(const char *path){
 		return -EACCES;
 	}
 
+	journal_begin();
 	remove_dirent(parent_inum, index);
 	oft_attempt_delete(target_inum);
+	journal_end();
 	
 	return 0;
 }
@@ -156,8 +254,10 @@ static int fs_rmdir(const char *path){
 		return -EACCES;
 	}
 
+	journal_begin();
 	remove_dirent(parent_inum, index);
 	del(target_inum);
+	journal_end();
 	
 	return 0;
 }
@@ -188,7 +288,16 @@ static int fs_truncate(const char *path, off_t size){
 		return -EACCES;
 	}
 
-	truncate(target_inum, size);
+	FS_TRANSACTION(ret, truncate(target_inum, size));
+	if (ret == FILE_TOO_BIG){
+		return -EFBIG;
+	}
+	if (ret == DATA_FULL){
+		return -ENOSPC;
+	}
+	if (ret != SUCCESS){
+		return -EIO;
+	}
 	
 	return 0;
 }
@@ -291,46 +400,346 @@ static int fs_write(const char *path, const char *buf, size_t size, off_t offset
 		if (ret != SUCCESS){
 			return -EBADF;
 		}
-		actual_offset = my_inode.size;
+		actual_offset = MAX(my_inode.size, oft_buffered_end(inum));
 	}
 
-	ret = write_i(inum, (void*)buf, actual_offset, size);
+	/* The kernel passes writes on as they come, so a program writing a line at a time
+	 * has its writes gathered up here rather than each one going through write_i */
+	FS_TRANSACTION(ret, oft_write(inum, (void*)buf, actual_offset, size));
 	if (ret == DATA_FULL){
 		return -ENOSPC;
 	}
+	if (ret == FILE_TOO_BIG){
+		return -EFBIG;
+	}
 	
 	return ret;
 }
 
+static int fs_fallocate(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi){
+	if (fi == NULL){
+		return -EBADF;
+	}
+	
+	int flags, inum, ret;
+	if (! oft_lookup(fi->fh, &inum, &flags)){
+		return -EBADF;
+	}
+	
+	int access_mode = flags & O_ACCMODE;
+	if (access_mode != O_RDWR && access_mode != O_WRONLY){
+		return -EBADF;
+	}
+	
+	FS_TRANSACTION(ret, fallocate_i(inum, mode, offset, len));
+	if (ret == DATA_FULL){
+		return -ENOSPC;
+	}
+	
+	return ret;
+}
+
+static int fs_flush_inode(int inum){
+	int ret = oft_flush_buffer(inum);
+	if (ret != SUCCESS){
+		return ret;
+	}
+	
+	return delalloc_flush(inum);
+}
+
+static int fs_flush(const char *path, struct fuse_file_info *fi){
+	if (fi == NULL){
+		return -EBADF;
+	}
+	
+	int flags, inum;
+	if (! oft_lookup(fi->fh, &inum, &flags)){
+		return -EBADF;
+	}
+	
+	/* Write out what's buffered, then give the file's delayed writes their blocks */
+	int ret;
+	FS_TRANSACTION(ret, fs_flush_inode(inum));
+	if (ret == DATA_FULL){
+		return -ENOSPC;
+	}
+	if (ret != SUCCESS){
+		return -EIO;
+	}
+	
+	return 0;
+}
+
+static int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi){
+	int ret = fs_flush(path, fi);
+	if (ret != 0){
+		return ret;
+	}
+	
+	/* Commits every operation finished so far, not just this file's, in one go */
+	if (journal_sync() != SUCCESS){
+		return -EIO;
+	}
+	
+	return 0;
+}
+
 static int fs_release(const char *path, struct fuse_file_info *fi){
 	if (fi == NULL){
 		return -EBADF;
 	}
+	
+	int flags, inum;
+	if (! oft_lookup(fi->fh, &inum, &flags)){
+		return -EBADF;
+	}
+
+	/* fs_flush has already tried to write out the write buffer, so if the remove
+	 * can't either, what was in it is lost */
+	int removed = oft_remove(fi->fh);
+	
+	/* Done after the remove, so a file deleted while open drops its pages instead */
+	int ret;
+	FS_TRANSACTION(ret, delalloc_flush(inum));
+	if (removed < 0){
+		ret = removed;
+	}
+	if (ret == DATA_FULL){
+		return -ENOSPC;
+	}
+	if (ret != SUCCESS){
+		return -EIO;
+	}
+	
+	return 0;
+}
 
-	oft_remove(fi->fh);
+
+/************************************************************************************ IOCTL FUNCTIONS ************************************************************************************/
+
+
+/* Answers FRAG_IOC_FIEMAP with the runs of the file at path, FRAG_IOC_REPORT with a
+ * fragmentation report of the whole filesystem, and FITRIM, as sent by fstrim, by
+ * discarding the filesystem's free runs. FUSE has already copied data in and will copy
+ * it back out */
+static int fs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data){
+	struct fuse_context* context = fuse_get_context();
+	
+	/* The commands carry their direction in the top bits, so compare them unsigned */
+	unsigned int request = cmd;
+	if (flags & FUSE_IOCTL_COMPAT){
+		return -ENOSYS;
+	}
+	
+	int parent_inum, target_inum, index, ret, read, write, exec;
+	if (request == FRAG_IOC_FIEMAP){
+		ret = namei(path, context->uid, context->gid, &parent_inum, &target_inum, &index);
+		if (ret != SUCCESS){
+			return ret;
+		}
+		if (target_inum == INVALID_INODE){
+			return -ENOENT;
+		}
+		
+		check_permissions(target_inum, context->uid, context->gid, &read, &write, &exec);
+		if (!read){
+			return -EACCES;
+		}
+		
+		/* Dirty pages are given their blocks first, so there's something to report */
+		frag_fiemap* map = data;
+		FS_TRANSACTION(ret, fiemap_i(target_inum, map->start, map->runs, FRAG_IOC_RUNS, &map->found));
+	}
+	else if (request == FRAG_IOC_REPORT){
+		FS_TRANSACTION(ret, frag_scan(data));
+	}
+	else if (request == FITRIM){
+		if (context->uid != 0){
+			return -EPERM;
+		}
+		
+		/* Every free run long enough is trimmed, wherever it is, and len is set to
+		 * how much was */
+		struct fstrim_range* range = data;
+		int trimmed;
+		ret = data_trim((range->minlen + BLOCK_SIZE - 1) / BLOCK_SIZE, &trimmed);
+		range->len = (uint64_t)trimmed * BLOCK_SIZE;
+	}
+	else{
+		return -ENOTTY;
+	}
+	
+	if (ret == DATA_FULL){
+		return -ENOSPC;
+	}
+	if (ret != SUCCESS){
+		return -EIO;
+	}
 	
 	return 0;
 }
 
 
+/************************************************************************************ LOCKING FUNCTIONS ************************************************************************************/
+
+
+/* FUSE runs operations on several threads at once. Each one holds fs_lock from start to
+ * finish, the same as the background threads do for each batch of their work */
+static int fs_getattr_locked(const char *path, struct stat *stbuf){
+	pthread_mutex_lock(&fs_lock);
+	int ret = fs_getattr(path, stbuf);
+	pthread_mutex_unlock(&fs_lock);
+	
+	return ret;
+}
+
+static int fs_readdir_locked(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi){
+	pthread_mutex_lock(&fs_lock);
+	int ret = fs_readdir(path, buf, filler, offset, fi);
+	pthread_mutex_unlock(&fs_lock);
+	
+	return ret;
+}
+
+static int fs_mknod_locked(const char *path, mode_t mode, dev_t rdev){
+	pthread_mutex_lock(&fs_lock);
+	int ret = fs_mknod(path, mode, rdev);
+	pthread_mutex_unlock(&fs_lock);
+	
+	return ret;
+}
+
+static int fs_mkdir_locked(const char *path, mode_t mode){
+	pthread_mutex_lock(&fs_lock);
+	int ret = fs_mkdir(path, mode);
+	pthread_mutex_unlock(&fs_lock);
+	
+	return ret;
+}
+
+static int fs_unlink_locked(const char *path){
+	pthread_mutex_lock(&fs_lock);
+	int ret = fs_unlink(path);
+	pthread_mutex_unlock(&fs_lock);
+	
+	return ret;
+}
+
+static int fs_rmdir_locked(const char *path){
+	pthread_mutex_lock(&fs_lock);
+	int ret = fs_rmdir(path);
+	pthread_mutex_unlock(&fs_lock);
+	
+	return ret;
+}
+
+static int fs_truncate_locked(const char *path, off_t size){
+	pthread_mutex_lock(&fs_lock);
+	int ret = fs_truncate(path, size);
+	pthread_mutex_unlock(&fs_lock);
+	
+	return ret;
+}
+
+static int fs_open_locked(const char *path, struct fuse_file_info *fi){
+	pthread_mutex_lock(&fs_lock);
+	int ret = fs_open(path, fi);
+	pthread_mutex_unlock(&fs_lock);
+	
+	return ret;
+}
+
+static int fs_read_locked(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi){
+	pthread_mutex_lock(&fs_lock);
+	int ret = fs_read(path, buf, size, offset, fi);
+	pthread_mutex_unlock(&fs_lock);
+	
+	return ret;
+}
+
+static int fs_write_locked(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi){
+	pthread_mutex_lock(&fs_lock);
+	int ret = fs_write(path, buf, size, offset, fi);
+	pthread_mutex_unlock(&fs_lock);
+	
+	return ret;
+}
+
+static int fs_fallocate_locked(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi){
+	pthread_mutex_lock(&fs_lock);
+	int ret = fs_fallocate(path, mode, offset, len, fi);
+	pthread_mutex_unlock(&fs_lock);
+	
+	return ret;
+}
+
+static int fs_flush_locked(const char *path, struct fuse_file_info *fi){
+	pthread_mutex_lock(&fs_lock);
+	int ret = fs_flush(path, fi);
+	pthread_mutex_unlock(&fs_lock);
+	
+	return ret;
+}
+
+static int fs_fsync_locked(const char *path, int datasync, struct fuse_file_info *fi){
+	pthread_mutex_lock(&fs_lock);
+	int ret = fs_fsync(path, datasync, fi);
+	pthread_mutex_unlock(&fs_lock);
+	
+	return ret;
+}
+
+static int fs_release_locked(const char *path, struct fuse_file_info *fi){
+	pthread_mutex_lock(&fs_lock);
+	int ret = fs_release(path, fi);
+	pthread_mutex_unlock(&fs_lock);
+	
+	return ret;
+}
+
+static int fs_ioctl_locked(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data){
+	pthread_mutex_lock(&fs_lock);
+	int ret = fs_ioctl(path, cmd, arg, fi, flags, data);
+	pthread_mutex_unlock(&fs_lock);
+	
+	return ret;
+}
+
+
 /************************************************************************************ FUSE FUNCTIONS ************************************************************************************/
 
 
 static struct fuse_operations fs_oper = {
 	.init       = fs_init,
-	.getattr	= fs_getattr,
-	.readdir	= fs_readdir,
-	.mknod		= fs_mknod,
-	.mkdir		= fs_mkdir,
-	.unlink		= fs_unlink,
-	.rmdir		= fs_rmdir,
-	.truncate	= fs_truncate,
-	.open		= fs_open,
-	.read		= fs_read,
-	.write		= fs_write,
-	.release	= fs_release,
+	.destroy    = fs_destroy,
+	.getattr	= fs_getattr_locked,
+	.readdir	= fs_readdir_locked,
+	.mknod		= fs_mknod_locked,
+	.mkdir		= fs_mkdir_locked,
+	.unlink		= fs_unlink_locked,
+	.rmdir		= fs_rmdir_locked,
+	.truncate	= fs_truncate_locked,
+	.open		= fs_open_locked,
+	.read		= fs_read_locked,
+	.write		= fs_write_locked,
+	.fallocate	= fs_fallocate_locked,
+	.flush		= fs_flush_locked,
+	.fsync		= fs_fsync_locked,
+	.release	= fs_release_locked,
+	.ioctl		= fs_ioctl_locked,
 };
 
 int main(int argc, char** argv){
-	return fuse_main(argc, argv, &fs_oper, NULL);
+	/* Without big_writes the kernel splits every write into pages. The limits are what we
+	 * ask for, the kernel may still cap them lower */
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	fuse_opt_add_arg(&args, "-obig_writes");
+	fuse_opt_add_arg(&args, "-omax_write=" FUSE_MAX_IO_STRING);
+	fuse_opt_add_arg(&args, "-omax_read=" FUSE_MAX_IO_STRING);
+	fuse_opt_add_arg(&args, "-omax_readahead=" FUSE_MAX_IO_STRING);
+	
+	int ret = fuse_main(args.argc, args.argv, &fs_oper, NULL);
+	fuse_opt_free_args(&args);
+	return ret;
 }
\ No newline at end of file
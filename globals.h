@@ -12,6 +12,7 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 
 #define BLOCK_SIZE 4096
 
@@ -23,16 +24,25 @@
 #define BAD_INODE -1005
 #define ILIST_FULL -1007
 #define BAD_UID -1008
+#define BAD_GROUP -1009
+#define TOO_MANY_REFS -1010
 #define MALFORMED_DIRECTORY -2009
 #define NOT_DIR -2010
 #define BAD_INDEX -2011
 #define NOT_IN_DIR -2012
 #define INVALID_PAGE -2013
+#define NO_ORPHANS -2014
+#define NO_DATA -2015
+#define FILE_TOO_BIG -2016
+#define FSCK_PROBLEMS -3001
 
 #define DISC_UNINITIALIZED -1
 #define INVALID_BLOCK -2
 #define BUF_NULL -3
 #define INT_NULL -4
+#define READ_ONLY -5
+#define BAD_SNAPSHOT -6
+#define SNAPSHOT_EXISTS -7
 
 #define SUCCESS 0
 #define UNEXPECTED_ERROR -99999
@@ -47,11 +57,15 @@
 #define NO_DEBUG 0
 #define DB_WRITEBLOCK 100
 #define DB_READBLOCK 101
+#define DB_JOURNAL 102
+#define DB_LFS 103
+#define DB_SNAPSHOT 104
+#define DB_DISCARD 105
 #define DB_MKFS 1100
 #define DB_READSB 1101
 #define DB_WRITEDATA 1102
 #define DB_READDATA 1103
-#define DB_FREELIST 1104
+#define DB_GROUPS 1104
 #define DB_WRITESB 1105
 #define DB_DATAFREE 1106
 #define DB_DATAALL 1107
@@ -60,11 +74,19 @@
 #define DB_INODEFREE 1110
 #define DB_INODECREATE 1112
 #define DB_MKDIRBASE 1113
+#define DB_ICHUNK 1114
 
 #define DB_GETNTH 2001
 #define DB_READI 2002
 #define DB_RMNTH 2003
 #define DB_WRITEI 2004
+#define DB_EXTENT 2005
+#define DB_DELALLOC 2006
+#define DB_FALLOCATE 2007
+#define DB_ORPHAN 2008
+
+#define DB_FSCK 3001
+#define DB_DEFRAG 3002
 
 #define TRUE 1
 #define FALSE 0
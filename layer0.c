@@ -1,12 +1,71 @@
+#include <sys/mman.h>
+#include <unistd.h>
 #include "globals.h"
 #include "layer0.h"
 
 uint8_t* disk = NULL;
 int total_blocks = UNINITIALIZED_BLOCKS;
+int disk_syncs = 0;
+int disk_blocks_discarded = 0;
+long long disk_bytes_written = 0;
+
+int journal_start = 0;
+int journal_size = 0;
+int journal_head = 0;
+uint32_t journal_seq = 0;
+int journal_handles = 0;
+__thread int journal_depth = 0;
+int journal_ops = 0;
+
+journal_entry* journal_running = NULL;
+int journal_running_size = 0;
+int* journal_running_map = NULL;
+journal_entry* journal_committed = NULL;
+int journal_committed_size = 0;
+int* journal_committed_map = NULL;
+
+pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t journal_idle = PTHREAD_COND_INITIALIZER;
+
+int journal_commits = 0;
+int journal_checkpoints = 0;
+
+int lfs_enabled = FALSE;
+int lfs_policy = LFS_POLICY_COST_BENEFIT;
+int lfs_segments = 0;
+
+int* lfs_map = NULL;          //block -> where its latest copy is, or -1 if never written
+int* lfs_owner = NULL;        //location on disk -> the block it holds, or -1 if dead
+int* lfs_seg_live = NULL;
+int* lfs_seg_state = NULL;
+uint32_t* lfs_seg_stamp = NULL; //lfs_clock when the segment's youngest block was written
+int* lfs_free_segs = NULL;
+int lfs_free_count = 0;
+int lfs_head[LFS_HEADS];
+int lfs_head_off[LFS_HEADS];
+uint32_t lfs_clock = 0;
+
+pthread_mutex_t lfs_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t lfs_wake = PTHREAD_COND_INITIALIZER;
+pthread_t lfs_cleaner_thread;
+int lfs_cleaner_running = FALSE;
+
+int lfs_blocks_written = 0;
+int lfs_blocks_moved = 0;
+int lfs_segments_cleaned = 0;
+int lfs_foreground_cleans = 0;
+
+snapshot* snapshots = NULL;
+int snapshots_size = 0;
+int snapshots_live = 0;
+int snapshot_view = NO_SNAPSHOT; //the snapshot the filesystem is mounted from, if any
+pthread_rwlock_t snapshot_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+int snapshot_blocks_saved = 0;
 
 /* Writes the data contained in write_buf,
  * a buffer of size BLOCK_SIZE, into the global
- * disk variable at the blocknum-th block
+ * disk variable at the blocknum-th block, bypassing the journal
  *
  * Blocks are 0-indexed, blocknum = 0 will write to the
  * first block
@@ -17,30 +76,38 @@ int total_blocks = UNINITIALIZED_BLOCKS;
  *   INVALID_BLOCK      - invalid block specified
  *   SUCCESS            - wrote data to disk
  */
-int write_block(int blocknum, void* write_buf){
+int disk_write(int blocknum, void* write_buf){
 	if (total_blocks == UNINITIALIZED_BLOCKS || disk == NULL){
-		ERR(fprintf(stderr, "ERR: write_block: disk uninitialized\n"));
+		ERR(fprintf(stderr, "ERR: disk_write: disk uninitialized\n"));
 		ERR(fprintf(stderr, "  disk:         %p\n", disk));
 		ERR(fprintf(stderr, "  total_blocks: %d\n", total_blocks));
 		return DISC_UNINITIALIZED;
 	}
 	
 	if (blocknum >= total_blocks || blocknum < 0){
-		ERR(fprintf(stderr, "ERR: write_block: invalid block\n"));
+		ERR(fprintf(stderr, "ERR: disk_write: invalid block\n"));
 		ERR(fprintf(stderr, "  blocknum:     %d\n", blocknum));
 		ERR(fprintf(stderr, "  total_blocks: %d\n", total_blocks));
 		return INVALID_BLOCK;
 	}
 	
 	if (write_buf == NULL){
-		ERR(fprintf(stderr, "ERR: write_block: write_buf is null\n"));
+		ERR(fprintf(stderr, "ERR: disk_write: write_buf is null\n"));
 		ERR(fprintf(stderr, "  write_buf: %p\n", write_buf));
 		return BUF_NULL;
 	}
 	
+	if (snapshots_live > 0){
+		snapshot_preserve(blocknum);
+	}
+	
+	if (lfs_segments > 0){
+		return lfs_write(blocknum, write_buf);
+	}
+	
 	uintptr_t write_start = (uintptr_t)disk + blocknum * BLOCK_SIZE;
 	
-	DEBUG(DB_WRITEBLOCK, printf("DEBUG: write_block: about to write\n"));
+	DEBUG(DB_WRITEBLOCK, printf("DEBUG: disk_write: about to write\n"));
 	DEBUG(DB_WRITEBLOCK, printf("  disk:        %p\n", disk));
 	DEBUG(DB_WRITEBLOCK, printf("  blocknum:    %d\n", blocknum));
 	DEBUG(DB_WRITEBLOCK, printf("  blocksize:   %d\n", BLOCK_SIZE));
@@ -48,13 +115,14 @@ int write_block(int blocknum, void* write_buf){
 	DEBUG(DB_WRITEBLOCK, printf("  write_buf:   %p\n", write_buf));
 	
 	memcpy((void*)write_start, write_buf, BLOCK_SIZE);
+	disk_bytes_written += BLOCK_SIZE;
 	
 	return SUCCESS;
 }
 
 /* Reads the data located at the blocknum-th block in the
  * global disk variable into a buffer located at read_buf
- * of size BLOCK_SIZE
+ * of size BLOCK_SIZE, bypassing the journal
  *
  * Blocks are 0-indexed, blocknum = 0 will read the
  * first block
@@ -65,30 +133,34 @@ int write_block(int blocknum, void* write_buf){
  *   INVALID_BLOCK      - invalid block specified
  *   SUCCESS            - read data to buffer
  */
-int read_block(int blocknum, void* read_buf){
+int disk_read(int blocknum, void* read_buf){
 	if (total_blocks == UNINITIALIZED_BLOCKS || disk == NULL){
-		ERR(fprintf(stderr, "ERR: read_block: disk uninitialized\n"));
+		ERR(fprintf(stderr, "ERR: disk_read: disk uninitialized\n"));
 		ERR(fprintf(stderr, "  disk:         %p\n", disk));
 		ERR(fprintf(stderr, "  total_blocks: %d\n", total_blocks));
 		return DISC_UNINITIALIZED;
 	}
 	
 	if (blocknum >= total_blocks || blocknum < 0){
-		ERR(fprintf(stderr, "ERR: read_block: invalid block\n"));
+		ERR(fprintf(stderr, "ERR: disk_read: invalid block\n"));
 		ERR(fprintf(stderr, "  blocknum:     %d\n", blocknum));
 		ERR(fprintf(stderr, "  total_blocks: %d\n", total_blocks));
 		return INVALID_BLOCK;
 	}
 	
 	if (read_buf == NULL){
-		ERR(fprintf(stderr, "ERR: read_block: read_buf is null\n"));
+		ERR(fprintf(stderr, "ERR: disk_read: read_buf is null\n"));
 		ERR(fprintf(stderr, "  read_buf: %p\n", read_buf));
 		return BUF_NULL;
 	}
 	
+	if (lfs_segments > 0){
+		return lfs_read(blocknum, read_buf);
+	}
+	
 	uintptr_t read_start = (uintptr_t)disk + blocknum * BLOCK_SIZE;
 	
-	DEBUG(DB_READBLOCK, printf("DEBUG: read_block: about to read\n"));
+	DEBUG(DB_READBLOCK, printf("DEBUG: disk_read: about to read\n"));
 	DEBUG(DB_READBLOCK, printf("  disk:        %p\n", disk));
 	DEBUG(DB_READBLOCK, printf("  blocknum:    %d\n", blocknum));
 	DEBUG(DB_READBLOCK, printf("  blocksize:   %d\n", BLOCK_SIZE));
@@ -98,4 +170,1374 @@ int read_block(int blocknum, void* read_buf){
 	memcpy(read_buf, (void*)read_start, BLOCK_SIZE);
 
 	return SUCCESS;
-}
\ No newline at end of file
+}
+
+/* Writes the data contained in write_buf, a buffer of size BLOCK_SIZE, to the
+ * blocknum-th block. While an operation holds a journal handle, the block goes
+ * into the running transaction and reaches the disk once it is checkpointed
+ *
+ * Blocks are 0-indexed, blocknum = 0 will write to the
+ * first block
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - no disk
+ *   BUF_NULL           - write buffer is null
+ *   INVALID_BLOCK      - invalid block specified
+ *   READ_ONLY          - mounted from a snapshot
+ *   SUCCESS            - wrote data to disk
+ */
+int write_block(int blocknum, void* write_buf){
+	if (snapshot_view != NO_SNAPSHOT){
+		ERR(fprintf(stderr, "ERR: write_block: mounted from a snapshot\n"));
+		ERR(fprintf(stderr, "  blocknum: %d\n", blocknum));
+		return READ_ONLY;
+	}
+	
+	if (journal_log(blocknum, write_buf)){
+		return SUCCESS;
+	}
+	
+	return disk_write(blocknum, write_buf);
+}
+
+/* Reads the blocknum-th block into read_buf, a buffer of size BLOCK_SIZE. Blocks
+ * that the journal holds newer versions of are read from the journal. When mounted
+ * from a snapshot, the snapshot's version is read instead
+ *
+ * Blocks are 0-indexed, blocknum = 0 will read the
+ * first block
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - no disk
+ *   BUF_NULL           - read buffer is null
+ *   INVALID_BLOCK      - invalid block specified
+ *   SUCCESS            - read data to buffer
+ */
+int read_block(int blocknum, void* read_buf){
+	if (snapshot_view != NO_SNAPSHOT){
+		return snapshot_read(snapshot_view, blocknum, read_buf);
+	}
+	
+	if (journal_lookup(blocknum, read_buf)){
+		return SUCCESS;
+	}
+	
+	return disk_read(blocknum, read_buf);
+}
+
+/* Writes write_buf to the blocknum-th block in place, even while a transaction is
+ * running. Used for file contents, which aren't journaled: they reach the disk before
+ * the transaction mapping them commits. Any version of the block the journal holds
+ * is dropped first, so that it can never be written over the new contents
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - no disk
+ *   BUF_NULL           - write buffer is null
+ *   INVALID_BLOCK      - invalid block specified
+ *   READ_ONLY          - mounted from a snapshot
+ *   SUCCESS            - wrote data to disk
+ */
+int write_block_direct(int blocknum, void* write_buf){
+	if (snapshot_view != NO_SNAPSHOT){
+		ERR(fprintf(stderr, "ERR: write_block_direct: mounted from a snapshot\n"));
+		ERR(fprintf(stderr, "  blocknum: %d\n", blocknum));
+		return READ_ONLY;
+	}
+	
+	journal_forget(blocknum);
+	
+	return disk_write(blocknum, write_buf);
+}
+
+/* Writes size bytes of write_buf to the blocknum-th block in place, starting offset
+ * bytes into it, and leaves the rest of the block alone. If write_buf is null, 0s are
+ * written instead. Like write_block_direct this is for file contents, and saves reading
+ * the whole block in and writing it back out to change part of it
+ *
+ * Blocks the journal holds a newer version of, and blocks in the log when the disk is
+ * log-structured, can only be written whole, so they're read in and merged first
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - no disk
+ *   INVALID_BLOCK      - invalid block specified, or the range runs off the block
+ *   READ_ONLY          - mounted from a snapshot
+ *   SUCCESS            - wrote data to disk
+ */
+int write_block_range(int blocknum, int offset, void* write_buf, int size){
+	if (total_blocks == UNINITIALIZED_BLOCKS || disk == NULL){
+		ERR(fprintf(stderr, "ERR: write_block_range: disk uninitialized\n"));
+		ERR(fprintf(stderr, "  disk:         %p\n", disk));
+		ERR(fprintf(stderr, "  total_blocks: %d\n", total_blocks));
+		return DISC_UNINITIALIZED;
+	}
+	
+	if (blocknum >= total_blocks || blocknum < 0 || offset < 0 || size < 0 || offset + size > BLOCK_SIZE){
+		ERR(fprintf(stderr, "ERR: write_block_range: invalid range\n"));
+		ERR(fprintf(stderr, "  blocknum:     %d\n", blocknum));
+		ERR(fprintf(stderr, "  offset:       %d\n", offset));
+		ERR(fprintf(stderr, "  size:         %d\n", size));
+		ERR(fprintf(stderr, "  total_blocks: %d\n", total_blocks));
+		return INVALID_BLOCK;
+	}
+	
+	if (snapshot_view != NO_SNAPSHOT){
+		ERR(fprintf(stderr, "ERR: write_block_range: mounted from a snapshot\n"));
+		ERR(fprintf(stderr, "  blocknum: %d\n", blocknum));
+		return READ_ONLY;
+	}
+	
+	uint8_t block_buf[BLOCK_SIZE];
+	int journaled = journal_lookup(blocknum, block_buf);
+	if (journaled || lfs_segments > 0){
+		if (!journaled){
+			int ret = disk_read(blocknum, block_buf);
+			if (ret != SUCCESS){
+				return ret;
+			}
+		}
+		if (write_buf == NULL){
+			memset(block_buf + offset, 0, size);
+		}
+		else{
+			memcpy(block_buf + offset, write_buf, size);
+		}
+		return write_block_direct(blocknum, block_buf);
+	}
+	
+	if (snapshots_live > 0){
+		snapshot_preserve(blocknum);
+	}
+	
+	uint8_t* write_start = disk + (uintptr_t)blocknum * BLOCK_SIZE + offset;
+	if (write_buf == NULL){
+		memset(write_start, 0, size);
+	}
+	else{
+		memcpy(write_start, write_buf, size);
+	}
+	disk_bytes_written += size;
+	
+	return SUCCESS;
+}
+
+/* Gives the count blocks starting at blocknum back to the host, so they stop taking up
+ * space. The disk lives in memory, so the pages behind the blocks are released with
+ * madvise, which is what punching a hole in an image file would be for a file-backed
+ * disk. The blocks read as 0s afterwards, and any version of them the journal holds is
+ * dropped so that it can't be written back later. Pages the blocks only partly cover
+ * are zeroed instead
+ *
+ * Nothing is discarded while snapshots are live, since they may still share the old
+ * contents, or in log-structured mode, where a block has no fixed place on the disk
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - no disk
+ *   INVALID_BLOCK      - the range runs off the disk
+ *   READ_ONLY          - mounted from a snapshot
+ *   SUCCESS            - the blocks were discarded, or had to be kept
+ */
+int disk_discard(int blocknum, int count){
+	if (total_blocks == UNINITIALIZED_BLOCKS || disk == NULL){
+		ERR(fprintf(stderr, "ERR: disk_discard: disk uninitialized\n"));
+		return DISC_UNINITIALIZED;
+	}
+	
+	if (blocknum < 0 || count < 0 || blocknum + count > total_blocks){
+		ERR(fprintf(stderr, "ERR: disk_discard: invalid range\n"));
+		ERR(fprintf(stderr, "  blocknum:     %d\n", blocknum));
+		ERR(fprintf(stderr, "  count:        %d\n", count));
+		ERR(fprintf(stderr, "  total_blocks: %d\n", total_blocks));
+		return INVALID_BLOCK;
+	}
+	
+	if (snapshot_view != NO_SNAPSHOT){
+		return READ_ONLY;
+	}
+	
+	if (snapshots_live > 0 || lfs_segments > 0 || count == 0){
+		return SUCCESS;
+	}
+	
+	int i;
+	for (i = 0; i < count; i++){
+		journal_forget(blocknum + i);
+	}
+	
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t)disk + (uintptr_t)blocknum * BLOCK_SIZE;
+	uintptr_t end = start + (uintptr_t)count * BLOCK_SIZE;
+	uintptr_t first_page = (start + page - 1) & ~(page - 1);
+	uintptr_t last_page = end & ~(page - 1);
+	
+	if (first_page >= last_page || madvise((void*)first_page, last_page - first_page, MADV_DONTNEED) != 0){
+		memset((void*)start, 0, end - start);
+	}
+	else{
+		memset((void*)start, 0, first_page - start);
+		memset((void*)last_page, 0, end - last_page);
+	}
+	
+	disk_blocks_discarded += count;
+	
+	DEBUG(DB_DISCARD, printf("DEBUG: disk_discard: discarded blocks\n"));
+	DEBUG(DB_DISCARD, printf("  blocknum: %d\n", blocknum));
+	DEBUG(DB_DISCARD, printf("  count:    %d\n", count));
+	
+	return SUCCESS;
+}
+
+/* Makes every write so far durable. The disk lives in memory, so this only counts
+ * how often it is asked to, which is what a backing device would charge for
+ *
+ * Returns:
+ *   SUCCESS
+ */
+int sync_disk(){
+	disk_syncs++;
+	return SUCCESS;
+}
+
+/* Sets up the journal in the size blocks starting at block start. If format is true
+ * the log is emptied, otherwise it is left for journal_recover to replay. A size of 0
+ * turns journaling off. Anything left over from a previous journal is thrown away
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - no disk
+ *   UNEXPECTED_ERROR   - malloc error
+ *   SUCCESS            - journal is ready
+ */
+int journal_init(int start, int size, int format){
+	if (total_blocks == UNINITIALIZED_BLOCKS || disk == NULL){
+		ERR(fprintf(stderr, "ERR: journal_init: disk uninitialized\n"));
+		return DISC_UNINITIALIZED;
+	}
+	
+	pthread_mutex_lock(&journal_lock);
+	
+	journal_start = start;
+	journal_size = size;
+	journal_head = 1;
+	journal_handles = 0;
+	journal_ops = 0;
+	journal_running_size = 0;
+	journal_committed_size = 0;
+	
+	if (size == 0){
+		free(journal_running);
+		free(journal_running_map);
+		free(journal_committed);
+		free(journal_committed_map);
+		journal_running = NULL;
+		journal_running_map = NULL;
+		journal_committed = NULL;
+		journal_committed_map = NULL;
+		
+		pthread_mutex_unlock(&journal_lock);
+		return SUCCESS;
+	}
+	
+	/* Every committed block takes up at least a block of the log, so the committed
+	 * cache never holds more than size blocks */
+	journal_running = realloc(journal_running, JOURNAL_TXN_MAX(size) * sizeof(journal_entry));
+	journal_committed = realloc(journal_committed, size * sizeof(journal_entry));
+	journal_running_map = realloc(journal_running_map, total_blocks * sizeof(int));
+	journal_committed_map = realloc(journal_committed_map, total_blocks * sizeof(int));
+	if (journal_running == NULL || journal_committed == NULL || journal_running_map == NULL || journal_committed_map == NULL){
+		ERR(perror(NULL));
+		journal_size = 0;
+		pthread_mutex_unlock(&journal_lock);
+		return UNEXPECTED_ERROR;
+	}
+	memset(journal_running_map, 0xff, total_blocks * sizeof(int));
+	memset(journal_committed_map, 0xff, total_blocks * sizeof(int));
+	
+	journal_header header;
+	if (format){
+		memset(&header, 0, sizeof(journal_header));
+		header.magic = JOURNAL_HEADER_MAGIC;
+		header.first_seq = 1;
+		disk_write(journal_start, &header);
+	}
+	else{
+		disk_read(journal_start, &header);
+	}
+	journal_seq = header.first_seq;
+	
+	DEBUG(DB_JOURNAL, printf("DEBUG: journal_init: journal set up\n"));
+	DEBUG(DB_JOURNAL, printf("  journal_start: %d\n", journal_start));
+	DEBUG(DB_JOURNAL, printf("  journal_size:  %d\n", journal_size));
+	DEBUG(DB_JOURNAL, printf("  journal_seq:   %u\n", journal_seq));
+	
+	pthread_mutex_unlock(&journal_lock);
+	return SUCCESS;
+}
+
+/* Joins the running transaction. Every block written until the matching journal_end
+ * is committed atomically, along with the other operations in the transaction
+ *
+ * An operation's outermost handle reserves JOURNAL_HANDLE_BLOCKS of the transaction,
+ * so it never has to be committed while the operation is half done. If the running
+ * transaction hasn't got that much room left for every handle in it, this waits for
+ * the operations in it to finish and commits it first
+ *
+ * Returns:
+ *   SUCCESS
+ */
+int journal_begin(){
+	pthread_mutex_lock(&journal_lock);
+	
+	if (journal_depth == 0 && journal_size > 0){
+		int reserve = MIN(JOURNAL_HANDLE_BLOCKS, JOURNAL_TXN_MAX(journal_size));
+		while (journal_running_size + (journal_handles + 1) * reserve > JOURNAL_TXN_MAX(journal_size)){
+			if (journal_handles == 0){
+				journal_commit_locked();
+				break;
+			}
+			pthread_cond_wait(&journal_idle, &journal_lock);
+		}
+	}
+	
+	journal_depth++;
+	journal_handles++;
+	pthread_mutex_unlock(&journal_lock);
+	
+	return SUCCESS;
+}
+
+/* Leaves the running transaction. The transaction isn't committed right away: it is
+ * left open for more operations to join it, until enough have or it's getting full
+ *
+ * Returns:
+ *   SUCCESS            - the handle was released
+ *   other              - committing the transaction failed
+ */
+int journal_end(){
+	int ret = SUCCESS;
+	
+	pthread_mutex_lock(&journal_lock);
+	journal_depth--;
+	journal_handles--;
+	journal_ops++;
+	if (journal_handles == 0){
+		if (journal_size > 0 && (journal_ops >= JOURNAL_BATCH_OPS || journal_running_size >= JOURNAL_TXN_MAX(journal_size) / 2)){
+			ret = journal_commit_locked();
+		}
+		pthread_cond_broadcast(&journal_idle);
+	}
+	pthread_mutex_unlock(&journal_lock);
+	
+	return ret;
+}
+
+/* Commits the running transaction once no operation is in the middle of it, so that
+ * every operation finished so far is durable. All of them share a single sync
+ *
+ * Returns:
+ *   SUCCESS            - everything finished so far is durable
+ *   other              - committing the transaction failed
+ */
+int journal_sync(){
+	pthread_mutex_lock(&journal_lock);
+	while (journal_handles > 0){
+		pthread_cond_wait(&journal_idle, &journal_lock);
+	}
+	
+	int ret = (journal_size > 0) ? journal_commit_locked() : sync_disk();
+	pthread_mutex_unlock(&journal_lock);
+	
+	return ret;
+}
+
+/* Commits the running transaction, then writes every committed block to its home
+ * location and empties the log. Used when unmounting
+ *
+ * Returns:
+ *   SUCCESS            - the disk is up to date and the log is empty
+ *   other              - committing the transaction failed
+ */
+int journal_checkpoint(){
+	pthread_mutex_lock(&journal_lock);
+	while (journal_handles > 0){
+		pthread_cond_wait(&journal_idle, &journal_lock);
+	}
+	
+	int ret = SUCCESS;
+	if (journal_size > 0){
+		ret = journal_commit_locked();
+		if (ret == SUCCESS){
+			ret = journal_checkpoint_locked();
+		}
+	}
+	pthread_mutex_unlock(&journal_lock);
+	
+	return ret;
+}
+
+/* Writes the running transaction to the log: a descriptor listing the home location
+ * of each block, the blocks themselves, and a commit block holding their checksum, all
+ * made durable by one sync. If the log doesn't have room, it's checkpointed first.
+ * The caller must hold journal_lock
+ *
+ * Returns:
+ *   SUCCESS            - transaction was committed
+ */
+int journal_commit_locked(){
+	journal_descriptor desc;
+	memset(&desc, 0, sizeof(journal_descriptor));
+	desc.magic = JOURNAL_DESC_MAGIC;
+	desc.seq = journal_seq;
+	
+	int i;
+	for (i = 0; i < journal_running_size; i++){
+		if (journal_running[i].blocknum != -1){
+			desc.blocks[desc.count++] = journal_running[i].blocknum;
+		}
+	}
+	
+	if (desc.count == 0){
+		journal_running_size = 0;
+		journal_ops = 0;
+		return SUCCESS;
+	}
+	
+	if (journal_head + desc.count + 2 > journal_size){
+		journal_checkpoint_locked();
+	}
+	
+	journal_commit commit;
+	memset(&commit, 0, sizeof(journal_commit));
+	commit.magic = JOURNAL_COMMIT_MAGIC;
+	commit.seq = journal_seq;
+	
+	int pos = journal_start + journal_head;
+	disk_write(pos++, &desc);
+	for (i = 0; i < journal_running_size; i++){
+		if (journal_running[i].blocknum != -1){
+			commit.checksum = journal_checksum(commit.checksum, journal_running[i].data);
+			disk_write(pos++, journal_running[i].data);
+		}
+	}
+	disk_write(pos++, &commit);
+	sync_disk();
+	
+	DEBUG(DB_JOURNAL, printf("DEBUG: journal_commit: committed a transaction\n"));
+	DEBUG(DB_JOURNAL, printf("  seq:    %u\n", journal_seq));
+	DEBUG(DB_JOURNAL, printf("  blocks: %u\n", desc.count));
+	DEBUG(DB_JOURNAL, printf("  ops:    %d\n", journal_ops));
+	DEBUG(DB_JOURNAL, printf("  head:   %d\n", journal_head));
+	
+	/* The blocks stay cached until they're checkpointed to their home locations */
+	int blocknum, slot;
+	for (i = 0; i < journal_running_size; i++){
+		blocknum = journal_running[i].blocknum;
+		if (blocknum == -1){
+			continue;
+		}
+		
+		slot = journal_committed_map[blocknum];
+		if (slot == -1){
+			slot = journal_committed_size++;
+			journal_committed_map[blocknum] = slot;
+			journal_committed[slot].blocknum = blocknum;
+		}
+		memcpy(journal_committed[slot].data, journal_running[i].data, BLOCK_SIZE);
+		journal_running_map[blocknum] = -1;
+	}
+	
+	journal_head += desc.count + 2;
+	journal_running_size = 0;
+	journal_ops = 0;
+	journal_seq++;
+	journal_commits++;
+	
+	return SUCCESS;
+}
+
+/* Writes every committed block to its home location, then marks the log as empty.
+ * The caller must hold journal_lock
+ *
+ * Returns:
+ *   SUCCESS            - the log is empty
+ */
+int journal_checkpoint_locked(){
+	if (journal_committed_size == 0 && journal_head == 1){
+		return SUCCESS;
+	}
+	
+	int i;
+	for (i = 0; i < journal_committed_size; i++){
+		if (journal_committed[i].blocknum != -1){
+			disk_write(journal_committed[i].blocknum, journal_committed[i].data);
+			journal_committed_map[journal_committed[i].blocknum] = -1;
+		}
+	}
+	sync_disk();
+	
+	DEBUG(DB_JOURNAL, printf("DEBUG: journal_checkpoint: wrote blocks home\n"));
+	DEBUG(DB_JOURNAL, printf("  blocks: %d\n", journal_committed_size));
+	DEBUG(DB_JOURNAL, printf("  seq:    %u\n", journal_seq));
+	
+	/* Only once the blocks are home can the log be reused */
+	journal_header header;
+	memset(&header, 0, sizeof(journal_header));
+	header.magic = JOURNAL_HEADER_MAGIC;
+	header.first_seq = journal_seq;
+	disk_write(journal_start, &header);
+	sync_disk();
+	
+	journal_committed_size = 0;
+	journal_head = 1;
+	journal_checkpoints++;
+	
+	return SUCCESS;
+}
+
+/* Replays the log after a crash. Transactions are written to their home locations
+ * in order, stopping at the first one that wasn't completely committed. The log is
+ * then emptied. journal_init must have been called without format
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - no journal on the disk
+ *   SUCCESS            - the disk holds every committed transaction
+ */
+int journal_recover(){
+	pthread_mutex_lock(&journal_lock);
+	
+	journal_header header;
+	if (journal_size == 0 || disk_read(journal_start, &header) != SUCCESS || header.magic != JOURNAL_HEADER_MAGIC){
+		pthread_mutex_unlock(&journal_lock);
+		ERR(fprintf(stderr, "ERR: journal_recover: no journal found\n"));
+		return DISC_UNINITIALIZED;
+	}
+	
+	journal_descriptor desc;
+	journal_commit commit;
+	uint8_t buf[BLOCK_SIZE];
+	uint32_t seq = header.first_seq, checksum;
+	int pos = 1, i;
+	while (pos + 2 <= journal_size){
+		disk_read(journal_start + pos, &desc);
+		if (desc.magic != JOURNAL_DESC_MAGIC || desc.seq != seq || desc.count > JOURNAL_DESC_BLOCKS || pos + desc.count + 2 > journal_size){
+			break;
+		}
+		
+		/* A transaction only counts if its commit block made it, with a checksum matching its blocks */
+		checksum = 0;
+		for (i = 0; i < desc.count; i++){
+			disk_read(journal_start + pos + 1 + i, buf);
+			checksum = journal_checksum(checksum, buf);
+		}
+		disk_read(journal_start + pos + 1 + desc.count, &commit);
+		if (commit.magic != JOURNAL_COMMIT_MAGIC || commit.seq != seq || commit.checksum != checksum){
+			break;
+		}
+		
+		for (i = 0; i < desc.count; i++){
+			disk_read(journal_start + pos + 1 + i, buf);
+			disk_write(desc.blocks[i], buf);
+		}
+		
+		DEBUG(DB_JOURNAL, printf("DEBUG: journal_recover: replayed a transaction\n"));
+		DEBUG(DB_JOURNAL, printf("  seq:    %u\n", seq));
+		DEBUG(DB_JOURNAL, printf("  blocks: %u\n", desc.count));
+		
+		pos += desc.count + 2;
+		seq++;
+	}
+	sync_disk();
+	
+	/* Start over with an empty log */
+	journal_seq = seq;
+	journal_running_size = 0;
+	journal_committed_size = 0;
+	memset(journal_running_map, 0xff, total_blocks * sizeof(int));
+	memset(journal_committed_map, 0xff, total_blocks * sizeof(int));
+	journal_head = pos;
+	journal_checkpoint_locked();
+	
+	pthread_mutex_unlock(&journal_lock);
+	return SUCCESS;
+}
+
+/* Throws away every block the journal holds in memory, committed or not, the same way
+ * a crash would. Whatever was committed can still be brought back with journal_recover */
+void journal_discard(){
+	pthread_mutex_lock(&journal_lock);
+	
+	if (journal_size > 0){
+		memset(journal_running_map, 0xff, total_blocks * sizeof(int));
+		memset(journal_committed_map, 0xff, total_blocks * sizeof(int));
+	}
+	journal_running_size = 0;
+	journal_committed_size = 0;
+	journal_handles = 0;
+	journal_depth = 0;
+	journal_ops = 0;
+	
+	pthread_mutex_unlock(&journal_lock);
+}
+
+/* Puts a block being written into the running transaction, if an operation holds a
+ * handle. Otherwise the write is going straight to disk, so any version of the block
+ * the journal holds is dropped
+ *
+ * Returns TRUE if the journal took the block, FALSE if it should be written to disk
+ */
+int journal_log(int blocknum, void* write_buf){
+	if (journal_size == 0 || blocknum < 0 || blocknum >= total_blocks || write_buf == NULL){
+		return FALSE;
+	}
+	
+	pthread_mutex_lock(&journal_lock);
+	
+	if (journal_handles == 0){
+		pthread_mutex_unlock(&journal_lock);
+		journal_forget(blocknum);
+		return FALSE;
+	}
+	
+	int slot = journal_running_map[blocknum];
+	if (slot == -1){
+		/* Only an operation that outgrew its reservation can get here. The log can't
+		 * hold all of it, so the only way on is to commit it in pieces */
+		if (journal_running_size == JOURNAL_TXN_MAX(journal_size)){
+			ERR(fprintf(stderr, "ERR: journal_log: transaction full, committing it part way through\n"));
+			ERR(fprintf(stderr, "  handles: %d\n", journal_handles));
+			journal_commit_locked();
+		}
+		
+		slot = journal_running_size++;
+		journal_running_map[blocknum] = slot;
+		journal_running[slot].blocknum = blocknum;
+	}
+	memcpy(journal_running[slot].data, write_buf, BLOCK_SIZE);
+	
+	pthread_mutex_unlock(&journal_lock);
+	return TRUE;
+}
+
+/* Reads the newest version of a block the journal holds into read_buf
+ *
+ * Returns TRUE if the journal had the block, FALSE if it should be read from disk
+ */
+int journal_lookup(int blocknum, void* read_buf){
+	if (journal_size == 0 || blocknum < 0 || blocknum >= total_blocks || read_buf == NULL){
+		return FALSE;
+	}
+	
+	pthread_mutex_lock(&journal_lock);
+	
+	int found = TRUE;
+	if (journal_running_map[blocknum] != -1){
+		memcpy(read_buf, journal_running[journal_running_map[blocknum]].data, BLOCK_SIZE);
+	}
+	else if (journal_committed_map[blocknum] != -1){
+		memcpy(read_buf, journal_committed[journal_committed_map[blocknum]].data, BLOCK_SIZE);
+	}
+	else{
+		found = FALSE;
+	}
+	
+	pthread_mutex_unlock(&journal_lock);
+	return found;
+}
+
+/* Drops every version of a block the journal holds, before it is written in place.
+ * A committed version would be replayed over the new contents after a crash, so the
+ * log is checkpointed first to get rid of it */
+void journal_forget(int blocknum){
+	if (journal_size == 0 || blocknum < 0 || blocknum >= total_blocks){
+		return;
+	}
+	
+	pthread_mutex_lock(&journal_lock);
+	
+	if (journal_committed_map[blocknum] != -1){
+		journal_checkpoint_locked();
+	}
+	
+	int slot = journal_running_map[blocknum];
+	if (slot != -1){
+		journal_running[slot].blocknum = -1;
+		journal_running_map[blocknum] = -1;
+	}
+	
+	pthread_mutex_unlock(&journal_lock);
+}
+
+/* Adds a block of data to a running FNV-1a checksum
+ *
+ * Returns the updated checksum
+ */
+uint32_t journal_checksum(uint32_t sum, void* data){
+	if (sum == 0){
+		sum = 2166136261u;
+	}
+	
+	uint8_t* bytes = data;
+	int i;
+	for (i = 0; i < BLOCK_SIZE; i++){
+		sum ^= bytes[i];
+		sum *= 16777619u;
+	}
+	
+	return sum;
+}
+
+/* Sets up log-structured mode on a disk of blocks blocks if enable is true, or turns it
+ * off otherwise. Only whole segments are used, and a share of them is held back so the
+ * cleaner can always find dead space. The number of blocks left for the filesystem is
+ * stored in usable, and total_blocks is set to match. The background cleaner is stopped
+ *
+ * Returns:
+ *   FS_TOO_SMALL       - not enough segments to hold anything back
+ *   UNEXPECTED_ERROR   - malloc error
+ *   SUCCESS            - usable is set
+ */
+int lfs_init(int blocks, int enable, int* usable){
+	lfs_cleaner_stop();
+	
+	pthread_mutex_lock(&lfs_lock);
+	
+	free(lfs_map);
+	free(lfs_owner);
+	free(lfs_seg_live);
+	free(lfs_seg_state);
+	free(lfs_seg_stamp);
+	free(lfs_free_segs);
+	lfs_map = NULL;
+	lfs_owner = NULL;
+	lfs_seg_live = NULL;
+	lfs_seg_state = NULL;
+	lfs_seg_stamp = NULL;
+	lfs_free_segs = NULL;
+	lfs_segments = 0;
+	lfs_free_count = 0;
+	
+	if (!enable){
+		*usable = blocks;
+		pthread_mutex_unlock(&lfs_lock);
+		return SUCCESS;
+	}
+	
+	int segments = blocks / LFS_SEGMENT_BLOCKS;
+	int reserve = MAX(segments / LFS_RESERVE_RATIO, LFS_MIN_RESERVE);
+	if (segments <= reserve){
+		ERR(fprintf(stderr, "ERR: lfs_init: not enough segments\n"));
+		ERR(fprintf(stderr, "  blocks:   %d\n", blocks));
+		ERR(fprintf(stderr, "  segments: %d\n", segments));
+		ERR(fprintf(stderr, "  reserve:  %d\n", reserve));
+		pthread_mutex_unlock(&lfs_lock);
+		return FS_TOO_SMALL;
+	}
+	
+	int logical = (segments - reserve) * LFS_SEGMENT_BLOCKS;
+	int physical = segments * LFS_SEGMENT_BLOCKS;
+	lfs_map = malloc(logical * sizeof(int));
+	lfs_owner = malloc(physical * sizeof(int));
+	lfs_seg_live = calloc(segments, sizeof(int));
+	lfs_seg_state = calloc(segments, sizeof(int));
+	lfs_seg_stamp = calloc(segments, sizeof(uint32_t));
+	lfs_free_segs = malloc(segments * sizeof(int));
+	if (lfs_map == NULL || lfs_owner == NULL || lfs_seg_live == NULL || lfs_seg_state == NULL ||
+	    lfs_seg_stamp == NULL || lfs_free_segs == NULL){
+		ERR(perror(NULL));
+		pthread_mutex_unlock(&lfs_lock);
+		return UNEXPECTED_ERROR;
+	}
+	memset(lfs_map, 0xff, logical * sizeof(int));
+	memset(lfs_owner, 0xff, physical * sizeof(int));
+	
+	/* Stacked backwards so the log starts at the front of the disk */
+	int i;
+	for (i = 0; i < segments; i++){
+		lfs_free_segs[i] = segments - 1 - i;
+	}
+	lfs_free_count = segments;
+	for (i = 0; i < LFS_HEADS; i++){
+		lfs_head[i] = -1;
+		lfs_head_off[i] = 0;
+	}
+	lfs_segments = segments;
+	total_blocks = logical;
+	*usable = logical;
+	
+	DEBUG(DB_LFS, printf("DEBUG: lfs_init: log-structured mode on\n"));
+	DEBUG(DB_LFS, printf("  segments: %d\n", segments));
+	DEBUG(DB_LFS, printf("  reserve:  %d\n", reserve));
+	DEBUG(DB_LFS, printf("  usable:   %d\n", logical));
+	
+	pthread_mutex_unlock(&lfs_lock);
+	return SUCCESS;
+}
+
+/* Appends write_buf to the log as the newest copy of the blocknum-th block.
+ * blocknum must already be checked
+ *
+ * Returns:
+ *   UNEXPECTED_ERROR   - the log is full, which the reserve should rule out
+ *   SUCCESS            - wrote data to disk
+ */
+int lfs_write(int blocknum, void* write_buf){
+	pthread_mutex_lock(&lfs_lock);
+	
+	int ret = lfs_append_locked(blocknum, write_buf, LFS_HEAD_USER, ++lfs_clock);
+	if (ret == SUCCESS){
+		lfs_blocks_written++;
+	}
+	
+	pthread_mutex_unlock(&lfs_lock);
+	return ret;
+}
+
+/* Reads the newest copy of the blocknum-th block into read_buf. A block that was
+ * never written reads as zeros. blocknum must already be checked
+ *
+ * Returns:
+ *   SUCCESS            - read data to buffer
+ */
+int lfs_read(int blocknum, void* read_buf){
+	pthread_mutex_lock(&lfs_lock);
+	
+	int phys = lfs_map[blocknum];
+	if (phys == -1){
+		memset(read_buf, 0, BLOCK_SIZE);
+	}
+	else{
+		memcpy(read_buf, disk + (uintptr_t)phys * BLOCK_SIZE, BLOCK_SIZE);
+	}
+	
+	pthread_mutex_unlock(&lfs_lock);
+	return SUCCESS;
+}
+
+/* Writes write_buf at the next spot of the given head's segment, taking a new segment
+ * if that one is full, and kills the copy of blocknum written before. The segment's
+ * stamp is raised to stamp. The caller must hold lfs_lock
+ *
+ * Returns:
+ *   UNEXPECTED_ERROR   - no free segment for the head
+ *   SUCCESS            - the block was appended
+ */
+int lfs_append_locked(int blocknum, void* write_buf, int head, uint32_t stamp){
+	int seg = lfs_head[head];
+	if (seg == -1 || lfs_head_off[head] == LFS_SEGMENT_BLOCKS){
+		if (seg != -1){
+			lfs_seg_state[seg] = LFS_SEG_FULL;
+			lfs_head[head] = -1;
+		}
+		
+		seg = lfs_take_segment_locked(head);
+		if (seg == -1){
+			ERR(fprintf(stderr, "ERR: lfs_append_locked: no free segment\n"));
+			ERR(fprintf(stderr, "  head:       %d\n", head));
+			ERR(fprintf(stderr, "  free_count: %d\n", lfs_free_count));
+			return UNEXPECTED_ERROR;
+		}
+		lfs_head[head] = seg;
+		lfs_head_off[head] = 0;
+		lfs_seg_state[seg] = LFS_SEG_ACTIVE;
+		lfs_seg_stamp[seg] = 0;
+	}
+	
+	int phys = seg * LFS_SEGMENT_BLOCKS + lfs_head_off[head]++;
+	memcpy(disk + (uintptr_t)phys * BLOCK_SIZE, write_buf, BLOCK_SIZE);
+	
+	int old = lfs_map[blocknum];
+	if (old != -1){
+		lfs_owner[old] = -1;
+		lfs_seg_live[old / LFS_SEGMENT_BLOCKS]--;
+	}
+	lfs_map[blocknum] = phys;
+	lfs_owner[phys] = blocknum;
+	lfs_seg_live[seg]++;
+	if (stamp > lfs_seg_stamp[seg]){
+		lfs_seg_stamp[seg] = stamp;
+	}
+	
+	return SUCCESS;
+}
+
+/* Takes a free segment for the given head. The user head can't take the last
+ * LFS_CLEANER_RESERVE segments, and cleans segments itself if that's all that is
+ * left. The background cleaner is woken whenever free segments run low. The caller
+ * must hold lfs_lock
+ *
+ * Returns:
+ *   -1                 - no segment could be freed
+ *   segment            - the segment taken
+ */
+int lfs_take_segment_locked(int head){
+	int victim;
+	if (head == LFS_HEAD_USER){
+		/* The background cleaner fell behind, so the writer has to wait for cleaning */
+		while (lfs_free_count <= LFS_CLEANER_RESERVE){
+			victim = lfs_pick_victim_locked(LFS_SEGMENT_BLOCKS - 1);
+			if (victim == -1 || lfs_clean_segment_locked(victim) != SUCCESS){
+				return -1;
+			}
+			lfs_foreground_cleans++;
+		}
+	}
+	else if (lfs_free_count == 0){
+		return -1;
+	}
+	
+	int seg = lfs_free_segs[--lfs_free_count];
+	if (lfs_free_count < LFS_CLEAN_TARGET && lfs_cleaner_running){
+		pthread_cond_signal(&lfs_wake);
+	}
+	
+	return seg;
+}
+
+/* Picks the next segment to clean out of the full ones with at most max_live live
+ * blocks, following lfs_policy. A segment with nothing live is always picked first.
+ * The caller must hold lfs_lock
+ *
+ * Returns:
+ *   -1                 - no segment is worth cleaning
+ *   segment            - the segment to clean
+ */
+int lfs_pick_victim_locked(int max_live){
+	int best = -1;
+	double best_score = -1;
+	double u, age, score;
+	
+	int seg;
+	for (seg = 0; seg < lfs_segments; seg++){
+		if (lfs_seg_state[seg] != LFS_SEG_FULL || lfs_seg_live[seg] > max_live){
+			continue;
+		}
+		if (lfs_seg_live[seg] == 0){
+			return seg;
+		}
+		
+		u = (double)lfs_seg_live[seg] / LFS_SEGMENT_BLOCKS;
+		if (lfs_policy == LFS_POLICY_GREEDY){
+			score = 1 - u;
+		}
+		else{
+			/* Space freed per block read and copied, favouring cold segments, whose
+			 * remaining blocks are less likely to die on their own soon */
+			age = lfs_clock - lfs_seg_stamp[seg];
+			score = (1 - u) * (age + 1) / (1 + u);
+		}
+		
+		if (score > best_score){
+			best_score = score;
+			best = seg;
+		}
+	}
+	
+	return best;
+}
+
+/* Copies the live blocks of seg to the cleaner's head and frees it. Copied blocks keep
+ * the segment's age. The caller must hold lfs_lock
+ *
+ * Returns:
+ *   UNEXPECTED_ERROR   - the cleaner ran out of segments
+ *   SUCCESS            - seg is free
+ */
+int lfs_clean_segment_locked(int seg){
+	int i, phys, ret;
+	int moved = 0;
+	for (i = 0; i < LFS_SEGMENT_BLOCKS; i++){
+		phys = seg * LFS_SEGMENT_BLOCKS + i;
+		if (lfs_owner[phys] == -1){
+			continue;
+		}
+		
+		ret = lfs_append_locked(lfs_owner[phys], disk + (uintptr_t)phys * BLOCK_SIZE, LFS_HEAD_CLEANER, lfs_seg_stamp[seg]);
+		if (ret != SUCCESS){
+			return ret;
+		}
+		moved++;
+	}
+	
+	lfs_seg_state[seg] = LFS_SEG_FREE;
+	lfs_seg_stamp[seg] = 0;
+	lfs_free_segs[lfs_free_count++] = seg;
+	lfs_blocks_moved += moved;
+	lfs_segments_cleaned++;
+	
+	DEBUG(DB_LFS, printf("DEBUG: lfs_clean_segment: cleaned a segment\n"));
+	DEBUG(DB_LFS, printf("  seg:        %d\n", seg));
+	DEBUG(DB_LFS, printf("  moved:      %d\n", moved));
+	DEBUG(DB_LFS, printf("  free_count: %d\n", lfs_free_count));
+	
+	return SUCCESS;
+}
+
+/* Cleans segments until target of them are free, or none of the rest have any dead
+ * blocks. Does nothing outside of log-structured mode
+ *
+ * Returns:
+ *   UNEXPECTED_ERROR   - the cleaner ran out of segments
+ *   SUCCESS            - done cleaning
+ */
+int lfs_clean(int target){
+	pthread_mutex_lock(&lfs_lock);
+	
+	int victim;
+	int ret = SUCCESS;
+	while (lfs_segments > 0 && lfs_free_count < target){
+		victim = lfs_pick_victim_locked(LFS_SEGMENT_BLOCKS - 1);
+		if (victim == -1){
+			break;
+		}
+		
+		ret = lfs_clean_segment_locked(victim);
+		if (ret != SUCCESS){
+			break;
+		}
+	}
+	
+	pthread_mutex_unlock(&lfs_lock);
+	return ret;
+}
+
+/* Starts the background cleaner, if in log-structured mode
+ *
+ * Returns:
+ *   UNEXPECTED_ERROR   - the thread couldn't be created
+ *   SUCCESS            - the cleaner is running, or isn't needed
+ */
+int lfs_cleaner_start(){
+	if (lfs_segments == 0 || lfs_cleaner_running){
+		return SUCCESS;
+	}
+	
+	lfs_cleaner_running = TRUE;
+	if (pthread_create(&lfs_cleaner_thread, NULL, lfs_cleaner_main, NULL) != 0){
+		ERR(fprintf(stderr, "ERR: lfs_cleaner_start: pthread_create failed\n"));
+		lfs_cleaner_running = FALSE;
+		return UNEXPECTED_ERROR;
+	}
+	
+	return SUCCESS;
+}
+
+/* Stops the background cleaner and waits for it to finish the segment it's on */
+void lfs_cleaner_stop(){
+	if (!lfs_cleaner_running){
+		return;
+	}
+	
+	pthread_mutex_lock(&lfs_lock);
+	lfs_cleaner_running = FALSE;
+	pthread_cond_signal(&lfs_wake);
+	pthread_mutex_unlock(&lfs_lock);
+	
+	pthread_join(lfs_cleaner_thread, NULL);
+}
+
+/* Body of the background cleaner. Sleeps until free segments run low, then cleans
+ * one segment at a time, letting writers in between segments */
+void* lfs_cleaner_main(void* arg){
+	pthread_mutex_lock(&lfs_lock);
+	
+	int victim;
+	while (lfs_cleaner_running){
+		victim = -1;
+		if (lfs_free_count < LFS_CLEAN_TARGET){
+			victim = lfs_pick_victim_locked(LFS_BACKGROUND_MAX_LIVE);
+		}
+		
+		if (victim == -1 || lfs_clean_segment_locked(victim) != SUCCESS){
+			pthread_cond_wait(&lfs_wake, &lfs_lock);
+			continue;
+		}
+		
+		pthread_mutex_unlock(&lfs_lock);
+		pthread_mutex_lock(&lfs_lock);
+	}
+	
+	pthread_mutex_unlock(&lfs_lock);
+	return NULL;
+}
+
+/* Takes a snapshot of the disk called name, and stores its number in id. Waits for
+ * the operations in progress to finish and checkpoints the journal first, so that the
+ * snapshot holds a consistent filesystem with an empty log. No blocks are copied
+ *
+ * Returns:
+ *   BUF_NULL           - name or id is null
+ *   SNAPSHOT_EXISTS    - there is already a snapshot called name
+ *   BAD_SNAPSHOT       - name is too long
+ *   UNEXPECTED_ERROR   - malloc error
+ *   SUCCESS            - the snapshot was taken
+ */
+int snapshot_create(const char* name, int* id){
+	if (name == NULL || id == NULL){
+		ERR(fprintf(stderr, "ERR: snapshot_create: buffer is null\n"));
+		ERR(fprintf(stderr, "  name: %p\n", name));
+		ERR(fprintf(stderr, "  id:   %p\n", id));
+		return BUF_NULL;
+	}
+	
+	if (strlen(name) >= SNAPSHOT_NAME_LENGTH){
+		ERR(fprintf(stderr, "ERR: snapshot_create: name too long\n"));
+		ERR(fprintf(stderr, "  name: %s\n", name));
+		return BAD_SNAPSHOT;
+	}
+	
+	int existing;
+	if (snapshot_find(name, &existing) == SUCCESS){
+		ERR(fprintf(stderr, "ERR: snapshot_create: name taken\n"));
+		ERR(fprintf(stderr, "  name: %s\n", name));
+		return SNAPSHOT_EXISTS;
+	}
+	
+	/* Holding journal_lock keeps new operations out until the snapshot exists */
+	pthread_mutex_lock(&journal_lock);
+	while (journal_handles > 0){
+		pthread_cond_wait(&journal_idle, &journal_lock);
+	}
+	
+	int ret = SUCCESS;
+	if (journal_size > 0){
+		ret = journal_commit_locked();
+		if (ret == SUCCESS){
+			ret = journal_checkpoint_locked();
+		}
+	}
+	if (ret != SUCCESS){
+		pthread_mutex_unlock(&journal_lock);
+		return ret;
+	}
+	
+	pthread_rwlock_wrlock(&snapshot_lock);
+	
+	/* Reuse a deleted snapshot's slot, or grow the table */
+	int i;
+	for (i = 0; i < snapshots_size; i++){
+		if (!snapshots[i].in_use){
+			break;
+		}
+	}
+	if (i == snapshots_size){
+		snapshot* bigger = realloc(snapshots, (snapshots_size + 1) * sizeof(snapshot));
+		if (bigger == NULL){
+			ERR(perror(NULL));
+			pthread_rwlock_unlock(&snapshot_lock);
+			pthread_mutex_unlock(&journal_lock);
+			return UNEXPECTED_ERROR;
+		}
+		snapshots = bigger;
+		snapshots_size++;
+	}
+	
+	snapshots[i].in_use = TRUE;
+	strcpy(snapshots[i].name, name);
+	snapshots[i].saved = NULL;
+	snapshots[i].broken = FALSE;
+	snapshots_live++;
+	*id = i;
+	
+	DEBUG(DB_SNAPSHOT, printf("DEBUG: snapshot_create: took a snapshot\n"));
+	DEBUG(DB_SNAPSHOT, printf("  name: %s\n", name));
+	DEBUG(DB_SNAPSHOT, printf("  id:   %d\n", i));
+	
+	pthread_rwlock_unlock(&snapshot_lock);
+	pthread_mutex_unlock(&journal_lock);
+	
+	return SUCCESS;
+}
+
+/* Looks up the snapshot called name and stores its number in id
+ *
+ * Returns:
+ *   BUF_NULL           - name or id is null
+ *   BAD_SNAPSHOT       - no snapshot has that name
+ *   SUCCESS            - id is set
+ */
+int snapshot_find(const char* name, int* id){
+	if (name == NULL || id == NULL){
+		ERR(fprintf(stderr, "ERR: snapshot_find: buffer is null\n"));
+		ERR(fprintf(stderr, "  name: %p\n", name));
+		ERR(fprintf(stderr, "  id:   %p\n", id));
+		return BUF_NULL;
+	}
+	
+	pthread_rwlock_rdlock(&snapshot_lock);
+	
+	int i;
+	for (i = 0; i < snapshots_size; i++){
+		if (snapshots[i].in_use && strcmp(snapshots[i].name, name) == 0){
+			*id = i;
+			pthread_rwlock_unlock(&snapshot_lock);
+			return SUCCESS;
+		}
+	}
+	
+	pthread_rwlock_unlock(&snapshot_lock);
+	return BAD_SNAPSHOT;
+}
+
+/* Deletes snapshot id, freeing every saved block no other snapshot shares
+ *
+ * Returns:
+ *   BAD_SNAPSHOT       - id isn't a snapshot, or the filesystem is mounted from it
+ *   SUCCESS            - the snapshot is gone
+ */
+int snapshot_delete(int id){
+	pthread_rwlock_wrlock(&snapshot_lock);
+	
+	if (id < 0 || id >= snapshots_size || !snapshots[id].in_use || id == snapshot_view){
+		ERR(fprintf(stderr, "ERR: snapshot_delete: can't delete snapshot\n"));
+		ERR(fprintf(stderr, "  id:   %d\n", id));
+		ERR(fprintf(stderr, "  view: %d\n", snapshot_view));
+		pthread_rwlock_unlock(&snapshot_lock);
+		return BAD_SNAPSHOT;
+	}
+	
+	int i;
+	if (snapshots[id].saved != NULL){
+		for (i = 0; i < total_blocks; i++){
+			if (snapshots[id].saved[i] != NULL && --snapshots[id].saved[i]->refs == 0){
+				free(snapshots[id].saved[i]);
+			}
+		}
+		free(snapshots[id].saved);
+	}
+	snapshots[id].saved = NULL;
+	snapshots[id].in_use = FALSE;
+	snapshots_live--;
+	
+	pthread_rwlock_unlock(&snapshot_lock);
+	return SUCCESS;
+}
+
+/* Deletes every snapshot. Used when a new disk is made */
+void snapshot_reset(){
+	snapshot_view = NO_SNAPSHOT;
+	
+	int i;
+	for (i = 0; i < snapshots_size; i++){
+		if (snapshots[i].in_use){
+			snapshot_delete(i);
+		}
+	}
+}
+
+/* Reads the blocknum-th block of snapshot id into read_buf, a buffer of size BLOCK_SIZE.
+ * Blocks that haven't been written since the snapshot was taken come from the disk
+ *
+ * Returns:
+ *   BAD_SNAPSHOT       - id isn't a snapshot, or it's broken
+ *   BUF_NULL           - read buffer is null
+ *   INVALID_BLOCK      - invalid block specified
+ *   SUCCESS            - read data to buffer
+ */
+int snapshot_read(int id, int blocknum, void* read_buf){
+	if (blocknum >= total_blocks || blocknum < 0){
+		ERR(fprintf(stderr, "ERR: snapshot_read: invalid block\n"));
+		ERR(fprintf(stderr, "  blocknum:     %d\n", blocknum));
+		ERR(fprintf(stderr, "  total_blocks: %d\n", total_blocks));
+		return INVALID_BLOCK;
+	}
+	
+	if (read_buf == NULL){
+		ERR(fprintf(stderr, "ERR: snapshot_read: read_buf is null\n"));
+		ERR(fprintf(stderr, "  read_buf: %p\n", read_buf));
+		return BUF_NULL;
+	}
+	
+	pthread_rwlock_rdlock(&snapshot_lock);
+	
+	if (id < 0 || id >= snapshots_size || !snapshots[id].in_use || snapshots[id].broken){
+		ERR(fprintf(stderr, "ERR: snapshot_read: bad snapshot\n"));
+		ERR(fprintf(stderr, "  id: %d\n", id));
+		pthread_rwlock_unlock(&snapshot_lock);
+		return BAD_SNAPSHOT;
+	}
+	
+	/* Held until the disk is read, so the block can't be saved and overwritten in between */
+	int ret = SUCCESS;
+	if (snapshots[id].saved != NULL && snapshots[id].saved[blocknum] != NULL){
+		memcpy(read_buf, snapshots[id].saved[blocknum]->data, BLOCK_SIZE);
+	}
+	else{
+		ret = disk_read(blocknum, read_buf);
+	}
+	
+	pthread_rwlock_unlock(&snapshot_lock);
+	return ret;
+}
+
+/* Copies the whole of snapshot id into image, a buffer of total_blocks * BLOCK_SIZE
+ * bytes, for backing it up
+ *
+ * Returns:
+ *   BAD_SNAPSHOT       - id isn't a snapshot
+ *   BUF_NULL           - image is null
+ *   SUCCESS            - image holds the snapshot
+ */
+int snapshot_export(int id, void* image){
+	if (image == NULL){
+		ERR(fprintf(stderr, "ERR: snapshot_export: image is null\n"));
+		ERR(fprintf(stderr, "  image: %p\n", image));
+		return BUF_NULL;
+	}
+	
+	int i, ret;
+	for (i = 0; i < total_blocks; i++){
+		ret = snapshot_read(id, i, (uint8_t*)image + (uintptr_t)i * BLOCK_SIZE);
+		if (ret != SUCCESS){
+			return ret;
+		}
+	}
+	
+	return SUCCESS;
+}
+
+/* Saves the current contents of the blocknum-th block for every snapshot that doesn't
+ * have its own copy yet, right before the block is overwritten. They all share one copy.
+ * A snapshot that can't be given its copy is marked broken rather than silently taking
+ * on the new contents */
+void snapshot_preserve(int blocknum){
+	pthread_rwlock_wrlock(&snapshot_lock);
+	
+	snapshot_block* copy = NULL;
+	int i;
+	for (i = 0; i < snapshots_size; i++){
+		if (!snapshots[i].in_use || snapshots[i].broken){
+			continue;
+		}
+		
+		if (snapshots[i].saved == NULL){
+			snapshots[i].saved = calloc(total_blocks, sizeof(snapshot_block*));
+			if (snapshots[i].saved == NULL){
+				ERR(perror(NULL));
+				ERR(fprintf(stderr, "ERR: snapshot_preserve: snapshot %s is broken\n", snapshots[i].name));
+				snapshots[i].broken = TRUE;
+				continue;
+			}
+		}
+		if (snapshots[i].saved[blocknum] != NULL){
+			continue;
+		}
+		
+		if (copy == NULL){
+			copy = malloc(sizeof(snapshot_block));
+			if (copy == NULL){
+				ERR(perror(NULL));
+				ERR(fprintf(stderr, "ERR: snapshot_preserve: snapshot %s is broken\n", snapshots[i].name));
+				snapshots[i].broken = TRUE;
+				continue;
+			}
+			copy->refs = 0;
+			disk_read(blocknum, copy->data);
+			snapshot_blocks_saved++;
+			
+			DEBUG(DB_SNAPSHOT, printf("DEBUG: snapshot_preserve: saved a block\n"));
+			DEBUG(DB_SNAPSHOT, printf("  blocknum: %d\n", blocknum));
+		}
+		snapshots[i].saved[blocknum] = copy;
+		copy->refs++;
+	}
+	
+	pthread_rwlock_unlock(&snapshot_lock);
+}
@@ -7,6 +7,175 @@
 extern uint8_t* disk;
 extern int total_blocks;
 
+/* Number of times the disk has been asked to make writes durable */
+extern int disk_syncs;
+
+/* Number of blocks given back to the host with disk_discard */
+extern int disk_blocks_discarded;
+
+/* Number of bytes written to blocks in place. Writes to the log-structured log aren't counted */
+extern long long disk_bytes_written;
+
+/* The journal is a redo log of whole blocks in a region of the disk. Block writes made
+ * while an operation holds a handle are collected into the running transaction instead
+ * of going to disk. Committing writes a descriptor block, the block images and a commit
+ * block to the log with a single sync, and several operations are batched into each
+ * commit. Committed blocks stay cached in memory until a checkpoint writes them to their
+ * home locations and empties the log */
+#define JOURNAL_HEADER_MAGIC 0x4a484452
+#define JOURNAL_DESC_MAGIC 0x4a445343
+#define JOURNAL_COMMIT_MAGIC 0x4a434d54
+
+#define JOURNAL_DESC_BLOCKS ((BLOCK_SIZE - 3 * sizeof(uint32_t)) / sizeof(uint32_t))
+#define JOURNAL_DESC_REMAINDER ((BLOCK_SIZE - 3 * sizeof(uint32_t)) % sizeof(uint32_t))
+
+/* Most blocks a transaction can hold: the log also needs its header, a descriptor
+ * and a commit block */
+#define JOURNAL_TXN_MAX(size) MIN(JOURNAL_DESC_BLOCKS, (size) - 3)
+
+/* The running transaction is committed once this many operations have joined it,
+ * or it holds half as many blocks as it can */
+#define JOURNAL_BATCH_OPS 32
+
+/* Blocks of the running transaction set aside for each operation in it, well over what
+ * one operation logs. Work that could log more, like reclaiming a deleted file, is done
+ * in batches that each get their own handle */
+#define JOURNAL_HANDLE_BLOCKS 64
+
+typedef struct __attribute__((__packed__)) journal_header {
+	uint32_t magic;
+	uint32_t first_seq; //sequence number of the first transaction in the log
+	
+	uint8_t padding[BLOCK_SIZE - 2 * sizeof(uint32_t)];
+} journal_header;
+
+typedef struct __attribute__((__packed__)) journal_descriptor {
+	uint32_t magic;
+	uint32_t seq;
+	uint32_t count;
+	uint32_t blocks[JOURNAL_DESC_BLOCKS]; //home location of each image that follows
+	
+	uint8_t padding[JOURNAL_DESC_REMAINDER];
+} journal_descriptor;
+
+typedef struct __attribute__((__packed__)) journal_commit {
+	uint32_t magic;
+	uint32_t seq;
+	uint32_t checksum; //of the images, so a torn transaction is never replayed
+	
+	uint8_t padding[BLOCK_SIZE - 3 * sizeof(uint32_t)];
+} journal_commit;
+
+typedef struct journal_entry {
+	int blocknum; //-1 if the entry was dropped
+	uint8_t data[BLOCK_SIZE];
+} journal_entry;
+
+extern int journal_start;
+extern int journal_size;
+extern int journal_head;
+extern uint32_t journal_seq;
+extern int journal_handles;
+extern __thread int journal_depth; //handles held by this thread, so nested ones don't reserve again
+extern int journal_ops;
+
+extern journal_entry* journal_running;
+extern int journal_running_size;
+extern int* journal_running_map;
+extern journal_entry* journal_committed;
+extern int journal_committed_size;
+extern int* journal_committed_map;
+
+extern pthread_mutex_t journal_lock;
+extern pthread_cond_t journal_idle;
+
+extern int journal_commits;
+extern int journal_checkpoints;
+
+/* In log-structured mode the disk is split into segments and every block write is
+ * appended at the head of the current segment, so writes to the disk are always
+ * sequential. A remap table keeps track of where the latest copy of each block is,
+ * and older copies are left behind as dead space. The cleaner gets that space back
+ * by copying the live blocks out of mostly dead segments. Only part of the disk is
+ * handed to the filesystem, so there is always dead space for the cleaner to find */
+#define LFS_SEGMENT_BLOCKS 64
+#define LFS_RESERVE_RATIO 8 //1/8 of the segments are held back from the filesystem
+#define LFS_MIN_RESERVE 4
+
+/* Free segments that only the cleaner can take, so it always has room to copy into */
+#define LFS_CLEANER_RESERVE 1
+
+/* The background cleaner tries to keep this many segments free, but only bothers
+ * with segments that are at most LFS_BACKGROUND_MAX_LIVE live */
+#define LFS_CLEAN_TARGET 3
+#define LFS_BACKGROUND_MAX_LIVE (LFS_SEGMENT_BLOCKS * 3 / 4)
+
+/* How the cleaner picks which segment to clean next */
+#define LFS_POLICY_GREEDY 0       //fewest live blocks
+#define LFS_POLICY_COST_BENEFIT 1 //most free space gained for the copying, weighted by age
+
+#define LFS_SEG_FREE 0
+#define LFS_SEG_ACTIVE 1
+#define LFS_SEG_FULL 2
+
+#define LFS_HEAD_USER 0
+#define LFS_HEAD_CLEANER 1
+#define LFS_HEADS 2
+
+extern int lfs_enabled;
+extern int lfs_policy;
+extern int lfs_segments;
+
+extern int* lfs_map;
+extern int* lfs_owner;
+extern int* lfs_seg_live;
+extern int* lfs_seg_state;
+extern uint32_t* lfs_seg_stamp;
+extern int* lfs_free_segs;
+extern int lfs_free_count;
+extern int lfs_head[LFS_HEADS];
+extern int lfs_head_off[LFS_HEADS];
+extern uint32_t lfs_clock;
+
+extern pthread_mutex_t lfs_lock;
+extern pthread_cond_t lfs_wake;
+extern pthread_t lfs_cleaner_thread;
+extern int lfs_cleaner_running;
+
+extern int lfs_blocks_written;
+extern int lfs_blocks_moved;
+extern int lfs_segments_cleaned;
+extern int lfs_foreground_cleans;
+
+/* A snapshot is a named, read-only copy of the disk as it was when it was taken.
+ * Taking one copies nothing: the first time a block is written afterwards, its old
+ * contents are saved for every snapshot that doesn't have it yet, and snapshots taken
+ * before the same write share the one copy. A snapshot costs only the blocks written
+ * since it was taken. Snapshots are taken with the journal checkpointed, so each one
+ * is a consistent filesystem that can be read block by block or mounted read-only */
+#define SNAPSHOT_NAME_LENGTH 32
+#define NO_SNAPSHOT -1
+
+typedef struct snapshot_block {
+	int refs; //number of snapshots sharing this copy
+	uint8_t data[BLOCK_SIZE];
+} snapshot_block;
+
+typedef struct snapshot {
+	int in_use;
+	char name[SNAPSHOT_NAME_LENGTH];
+	snapshot_block** saved; //block -> contents when taken, NULL if not written since. Allocated on first use
+	int broken; //a block was overwritten without its old contents being saved, so the snapshot can't be read
+} snapshot;
+
+extern snapshot* snapshots;
+extern int snapshots_size;
+extern int snapshots_live;
+extern int snapshot_view;
+extern pthread_rwlock_t snapshot_lock;
+
+extern int snapshot_blocks_saved;
+
 /* Writes the data contained in write_buf,
  * a buffer of size BLOCK_SIZE, into the global
  * disk variable at the blocknum-th block
@@ -36,5 +205,45 @@ int write_block(int blocknum, void* write_buf);
  *   SUCCESS            - read data to buffer
  */
 int read_block(int blocknum, void* read_buf);
+int write_block_direct(int blocknum, void* write_buf);
+int write_block_range(int blocknum, int offset, void* write_buf, int size);
+int disk_write(int blocknum, void* write_buf);
+int disk_read(int blocknum, void* read_buf);
+int disk_discard(int blocknum, int count);
+int sync_disk();
+
+int journal_init(int start, int size, int format);
+int journal_begin();
+int journal_end();
+int journal_sync();
+int journal_checkpoint();
+int journal_recover();
+void journal_discard();
+int journal_log(int blocknum, void* write_buf);
+int journal_lookup(int blocknum, void* read_buf);
+void journal_forget(int blocknum);
+int journal_commit_locked();
+int journal_checkpoint_locked();
+uint32_t journal_checksum(uint32_t sum, void* data);
+
+int lfs_init(int blocks, int enable, int* usable);
+int lfs_write(int blocknum, void* write_buf);
+int lfs_read(int blocknum, void* read_buf);
+int lfs_append_locked(int blocknum, void* write_buf, int head, uint32_t stamp);
+int lfs_take_segment_locked(int head);
+int lfs_pick_victim_locked(int max_live);
+int lfs_clean_segment_locked(int seg);
+int lfs_clean(int target);
+int lfs_cleaner_start();
+void lfs_cleaner_stop();
+void* lfs_cleaner_main(void* arg);
+
+int snapshot_create(const char* name, int* id);
+int snapshot_find(const char* name, int* id);
+int snapshot_delete(int id);
+void snapshot_reset();
+int snapshot_read(int id, int blocknum, void* read_buf);
+int snapshot_export(int id, void* image);
+void snapshot_preserve(int blocknum);
 
 #endif
@@ -1,3 +1,4 @@
+#include <time.h>
 #include "globals.h"
 #include "layer0.h"
 #include "layer1.h"
@@ -5,18 +6,39 @@
 
 superblock* cached_superblock = NULL;
 
+/* Number of times an inode has been written back, each of which rewrites its whole chunk */
+int inode_writes = 0;
+
+int mkfs_threads = MKFS_DEFAULT_THREADS;
+
+group_desc* cached_gdt = NULL;
+pthread_mutex_t* group_locks = NULL;
+int group_locks_size = 0;
+pthread_mutex_t gdt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int discard_enabled = FALSE;
+discard_range* discard_pending = NULL;
+int discard_pending_size = 0;
+int discard_pending_blocks = 0;
+pthread_mutex_t discard_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t discard_wake = PTHREAD_COND_INITIALIZER;
+pthread_t discard_thread;
+int discard_running = FALSE;
+
 /* Initializes a filesystem for use by other functions by doing the following:
  * - Allocates min(MAX_FS_SIZE, blocks) * BLOCK_SIZE bytes to the filesystem
  * - Updates global variables to point to the filesystem
- * - Initializes superblock and sizes of each part of the filesystem (fractional blocks are
- *   assigned to the inodes)
- * - Creates the ilist and ibitmap
- * - Initializes the free list
+ * - Sets up log-structured mode if lfs_enabled, leaving fewer blocks for the filesystem
+ * - Initializes superblock and sizes of each part of the filesystem
+ * - Sets up an empty journal, if the filesystem is big enough for one
+ * - Splits the data region into block groups, each with a block bitmap,
+ *   an (empty) ibitmap slice and an (empty) ichunk index slice
  * - Creates the root inode and updates the superblock
  *
  * Returns:
  *   TOTALBLOCKS_INVALID - blocks is a negative number
- *   FS_TOO_SMALL        - blocks is smaller than MIN_BLOCKS
+ *   FS_TOO_SMALL        - blocks is smaller than MIN_BLOCKS, or than what
+ *                         log-structured mode needs
  *   BLOCKSIZE_TOO_SMALL - can't fit an inode into a single block
  *   BAD_UID             - provided uid is negative
  *   UNEXPECTED_ERROR    - malloc error
@@ -58,7 +80,14 @@ int mkfs(int blocks, int root_uid, int root_gid){
 	if (blocks > MAX_FS_SIZE){
 		blocks = MAX_FS_SIZE;
 	}
-	disk = malloc(blocks * BLOCK_SIZE);
+	
+	/* Snapshots of the old disk mean nothing on the new one */
+	snapshot_reset();
+	discard_reset();
+	
+	/* A fresh disk reads as 0s, so nothing below has to write out zeroed blocks. Big
+	 * allocations are mapped in lazily, so this costs nothing up front */
+	disk = calloc(blocks, BLOCK_SIZE);
 	total_blocks = blocks;
 	
 	if (disk == NULL){
@@ -71,21 +100,36 @@ int mkfs(int blocks, int root_uid, int root_gid){
 	DEBUG(DB_MKFS, printf("  total_blocks: %d\n", total_blocks));
 	/************************ CREATE IN-MEMORY DISK ************************/
 	
+	/* In log-structured mode part of the disk is held back for the cleaner */
+	int ret = lfs_init(blocks, lfs_enabled, &blocks);
+	if (ret != SUCCESS){
+		return ret;
+	}
+	if (blocks < MIN_BLOCKS){
+		ERR(fprintf(stderr, "ERR: mkfs: not enough room for a filesystem\n"));
+		ERR(fprintf(stderr, "  blocks: %d\n", blocks));
+		return FS_TOO_SMALL;
+	}
+	
 	/* Initialize the superblock */
 	init_superblock(blocks);
 	
-	/* Initialize the free list */
-	init_freelist();
+	superblock sb;
+	read_superblock(&sb);
+	if (journal_init(sb.journal_block_offset, sb.journal_size, TRUE) != SUCCESS){
+		return UNEXPECTED_ERROR;
+	}
 	
-	/* Initialize the ibitmap to 0s */
-	init_ibitmap();
+	/* Set up the block groups. No inode chunks exist yet, they are allocated as inodes are created */
+	if (init_groups() != SUCCESS){
+		return UNEXPECTED_ERROR;
+	}
 	
 	/* Create the root inode */
 	int root_inode = 0;
 	mode_t mode = S_IRWXU | S_IRWXG | S_IRWXO;
 	create_dir_base(&root_inode, mode, root_uid, root_gid, INVALID_INODE);
 	
-	superblock sb;
 	read_superblock(&sb);
 	sb.root_inode = root_inode;
 	DEBUG(DB_MKFS, printf("  root inode: %d\n", root_inode));
@@ -110,24 +154,33 @@ int mkfs(int blocks, int root_uid, int root_gid){
 int create_dir_base(int* inode_num, mode_t mode, int uid, int gid, int parent_inum){
 	int ret;
 	
-	/* Get an inode */
+	/* Get an inode. The root goes in the first group, other directories are spread out */
+	int group = ROOT_GROUP;
+	if (parent_inum != INVALID_INODE){
+		group = find_group_dir(inode_group(parent_inum));
+	}
+	
 	int my_inode = 0;
 	inode new_dir;
-	ret = inode_create(&new_dir, &my_inode);
+	ret = inode_create_in_group(&new_dir, group, &my_inode);
 	if (ret != SUCCESS){
 		DEBUG(DB_MKDIRBASE, printf("DEBUG: create_dir_base: couldn't allocate inode\n"));
 		return ret;
 	}
+	group = inode_group(my_inode);
 	
 	/* Get and populate a data block */
 	int data_num = 0;
 	dirblock d;
+	memset(&d, 0, sizeof(dirblock));
 
 	dir_ent dot;
+	memset(&dot, 0, sizeof(dir_ent));
 	strcpy(dot.name, ".");
 	dot.inode_num = my_inode;
 	
 	dir_ent dot_dot;
+	memset(&dot_dot, 0, sizeof(dir_ent));
 	strcpy(dot_dot.name, "..");
 	if (parent_inum == INVALID_INODE){
 		dot_dot.inode_num = my_inode;
@@ -138,7 +191,7 @@ int create_dir_base(int* inode_num, mode_t mode, int uid, int gid, int parent_in
 	
 	d.dir_ents[0] = dot;
 	d.dir_ents[1] = dot_dot;
-	ret = data_allocate(&d, &data_num);
+	ret = data_allocate_near(&d, group_first_block(group), &data_num);
 	if (ret != SUCCESS){
 		inode_free(my_inode);
 		DEBUG(DB_MKDIRBASE, printf("DEBUG: create_dir_base: couldn't allocate datablock\n"));
@@ -151,8 +204,12 @@ int create_dir_base(int* inode_num, mode_t mode, int uid, int gid, int parent_in
 	new_dir.mode &= (0xffff ^ (S_IFREG));
 	new_dir.uid = uid;
 	new_dir.gid = gid;
+	new_dir.group = group;
 	new_dir.size = 2 * sizeof(dir_ent); /* Should never be more than one block, or we have a problem */
-	new_dir.direct_blocks[0] = data_num;
+	new_dir.ext_header.entries = 1;
+	new_dir.extents[0].logical = 0;
+	new_dir.extents[0].physical = data_num;
+	new_dir.extents[0].length = 1;
 	inode_write(my_inode, &new_dir);
 	
 	DEBUG(DB_MKDIRBASE, printf("DEBUG: create_dir_base: created the dir\n"));
@@ -176,148 +233,580 @@ int create_dir_base(int* inode_num, mode_t mode, int uid, int gid, int parent_in
  */
 int init_superblock(int blocks){
 
-	/* Summon math demons to calculate sizes of each part of the filesystem for us */
-	int total_iblocks = MAX(MIN_IBITMAP + MIN_INODES, (int)ceil(blocks * INODES_PERCENT));
-	int data_blocks = blocks - SUPERBLOCK_SIZE - total_iblocks;
-
-	double inode_blocks_per_bitmap_block = (double)BITS_PER_BLOCK / INODES_PER_BLOCK;
+	int journal_blocks = MIN(JOURNAL_MAX_BLOCKS, blocks / JOURNAL_RATIO);
+	if (journal_blocks < JOURNAL_MIN_BLOCKS){
+		journal_blocks = 0;
+	}
+	
+	/* The size of the group descriptor table depends on the number of groups, so
+	 * count the groups as if the table took a single block, then recount */
+	int avail_blocks = blocks - SUPERBLOCK_SIZE - journal_blocks;
+	int blocks_per_group = MIN(BLOCKS_PER_GROUP, avail_blocks - MIN_GDT);
+	int num_groups = (int)ceil((double)(avail_blocks - MIN_GDT) / blocks_per_group);
+	int gdt_blocks = (int)ceil((double)num_groups / GROUPS_PER_BLOCK);
+	int data_blocks = avail_blocks - gdt_blocks;
+	num_groups = (int)ceil((double)data_blocks / blocks_per_group);
+	
+	/* Every block in a group could become an inode chunk, so size each group's slices
+	 * of the ibitmap and the ichunk index to cover that */
+	int inodes_per_group = blocks_per_group * INODES_PER_BLOCK;
+	int ibitmap_blocks = (int)ceil((double)inodes_per_group / BITS_PER_BLOCK);
+	int ichunk_blocks = (int)ceil((double)blocks_per_group / ICHUNKS_PER_BLOCK);
+	int metadata_blocks = 1 + ibitmap_blocks + ichunk_blocks;
+	
+	/* A last group too short to hold its own metadata and some data is left unused */
+	int last_group_blocks = data_blocks - (num_groups - 1) * blocks_per_group;
+	if (num_groups > 1 && last_group_blocks <= metadata_blocks){
+		num_groups--;
+		data_blocks -= last_group_blocks;
+	}
 	
-	int ibitmap_blocks = (int)ceil(total_iblocks / (inode_blocks_per_bitmap_block + 1));
-	int inode_blocks = total_iblocks - ibitmap_blocks;
+	int max_inodes = num_groups * inodes_per_group;
 	
 	DEBUG(DB_MKFS, printf("DEBUG: mkfs: doing superblock calculations\n"));
-	DEBUG(DB_MKFS, printf("  BLOCK_SIZE:                    %d\n", BLOCK_SIZE));
-	DEBUG(DB_MKFS, printf("  SUPERBLOCK_SIZE:               %d\n", SUPERBLOCK_SIZE));
-	DEBUG(DB_MKFS, printf("  INODES_PER_BLOCK:              %d\n", INODES_PER_BLOCK));
-	DEBUG(DB_MKFS, printf("  sizeof(inode):                 %d\n", sizeof(inode)));
-	DEBUG(DB_MKFS, printf("  sizeof(superblock):            %d\n", sizeof(superblock)));
-	DEBUG(DB_MKFS, printf("  total_iblocks:                 %d\n", total_iblocks));
-	DEBUG(DB_MKFS, printf("  data_blocks:                   %d\n", data_blocks));
-	DEBUG(DB_MKFS, printf("  inode_blocks_per_bitmap_block: %f\n", inode_blocks_per_bitmap_block));
-	DEBUG(DB_MKFS, printf("  ibitmap_blocks:                %d\n", ibitmap_blocks));
-	DEBUG(DB_MKFS, printf("  inode_blocks:                  %d\n", inode_blocks));
+	DEBUG(DB_MKFS, printf("  BLOCK_SIZE:         %d\n", BLOCK_SIZE));
+	DEBUG(DB_MKFS, printf("  SUPERBLOCK_SIZE:    %d\n", SUPERBLOCK_SIZE));
+	DEBUG(DB_MKFS, printf("  INODES_PER_BLOCK:   %zu\n", INODES_PER_BLOCK));
+	DEBUG(DB_MKFS, printf("  sizeof(inode):      %zu\n", sizeof(inode)));
+	DEBUG(DB_MKFS, printf("  sizeof(superblock): %zu\n", sizeof(superblock)));
+	DEBUG(DB_MKFS, printf("  journal_blocks:     %d\n", journal_blocks));
+	DEBUG(DB_MKFS, printf("  gdt_blocks:         %d\n", gdt_blocks));
+	DEBUG(DB_MKFS, printf("  num_groups:         %d\n", num_groups));
+	DEBUG(DB_MKFS, printf("  blocks_per_group:   %d\n", blocks_per_group));
+	DEBUG(DB_MKFS, printf("  ibitmap_blocks:     %d\n", ibitmap_blocks));
+	DEBUG(DB_MKFS, printf("  ichunk_blocks:      %d\n", ichunk_blocks));
+	DEBUG(DB_MKFS, printf("  data_blocks:        %d\n", data_blocks));
+	DEBUG(DB_MKFS, printf("  max_inodes:         %d\n", max_inodes));
 	
 	/* Initialize fields of superblock */
 	superblock sb;
-	sb.ibitmap_block_offset = SUPERBLOCK_SIZE;
-	sb.ibitmap_size = ibitmap_blocks;
+	sb.gdt_block_offset = SUPERBLOCK_SIZE;
+	sb.gdt_size = gdt_blocks;
 	
-	sb.ilist_block_offset = SUPERBLOCK_SIZE + ibitmap_blocks;
-	sb.ilist_size = inode_blocks;
+	sb.journal_block_offset = SUPERBLOCK_SIZE + gdt_blocks;
+	sb.journal_size = journal_blocks;
 	
-	sb.data_block_offset = SUPERBLOCK_SIZE + ibitmap_blocks + inode_blocks;
+	sb.data_block_offset = SUPERBLOCK_SIZE + gdt_blocks + journal_blocks;
 	sb.data_size = data_blocks;
 	
+	sb.num_groups = num_groups;
+	sb.blocks_per_group = blocks_per_group;
+	sb.inodes_per_group = inodes_per_group;
+	sb.ibitmap_size = ibitmap_blocks;
+	sb.ichunk_size = ichunk_blocks;
+	
 	sb.total_blocks = blocks;
-	sb.total_inodes = inode_blocks * INODES_PER_BLOCK;
+	sb.total_inodes = max_inodes;
 	
-	sb.free_list_head = ROOT_FREELIST;
 	sb.root_inode = ROOT_INODE;
 	
 	sb.block_size = BLOCK_SIZE;
 	sb.inodes_per_block = INODES_PER_BLOCK;
-	sb.num_inodes = inode_blocks * INODES_PER_BLOCK;
+	sb.num_inodes = max_inodes;
+	
+	sb.orphan_head = INVALID_INODE;
 
 	return write_superblock(&sb);
 }
 
-/* Initializes the freelist into the data blocks, given their length
+/* Lays out every block group and writes the group descriptor table. Each group
+ * starts with its block bitmap, then its slices of the ibitmap and the ichunk index.
+ * Groups are independent of each other, so they're split between up to mkfs_threads
+ * threads. The descriptor table is written once at the end, a block at a time. Also
+ * sets up the in-memory descriptor table and the group locks
+ *
+ * In log-structured mode every write is appended to the log, so where each group's
+ * blocks land depends on the order they're written in. The groups are laid out by one
+ * thread there, so the disk comes out the same every time
  *
  * This function is called during mkfs and is not really
  * intended for normal use. It requires that the filesystem has
- * at least a valid superblock
+ * at least a valid superblock, on a zeroed disk
  *
  * Returns:
  *   DISC_UNINITIALIZED - FS hasn't been set up yet
- *   SUCCESS            - freelist was created
+ *   UNEXPECTED_ERROR   - malloc or pthread error
+ *   SUCCESS            - every group is ready
  */
-int init_freelist(){
+int init_groups(){
 	superblock sb;
 
 	int ret = read_superblock(&sb);
 	if (ret != SUCCESS){
-		ERR(fprintf(stderr, "ERR: create_freelist: read_superblock failed\n"));
+		ERR(fprintf(stderr, "ERR: init_groups: read_superblock failed\n"));
 		ERR(fprintf(stderr, "  ret: %d\n", ret));
 		return DISC_UNINITIALIZED;
 	}
 	
-	int num_data_blocks = sb.data_size;
-	freelist_node cur;
-	int node_loc, next_loc, i, j;
+	ret = alloc_group_cache(sb.num_groups);
+	if (ret != SUCCESS){
+		return ret;
+	}
+	
+	mkfs_job job;
+	job.next_group = 0;
+	job.ret = SUCCESS;
 	
-	int blocks_per_node = ADDR_PER_NODE + 1;
-	int num_nodes = (int)ceil((double)num_data_blocks / blocks_per_node);
+	int threads = MAX(1, MIN(MIN(mkfs_threads, MKFS_MAX_THREADS), sb.num_groups));
+	if (lfs_segments > 0){
+		threads = 1;
+	}
+	if (threads == 1){
+		init_groups_worker(&job);
+	}
+	else{
+		pthread_t pool[MKFS_MAX_THREADS];
+		int i, created;
+		for (created = 0; created < threads; created++){
+			if (pthread_create(&pool[created], NULL, init_groups_worker, &job) != 0){
+				ERR(fprintf(stderr, "ERR: init_groups: pthread_create failed\n"));
+				job.ret = UNEXPECTED_ERROR;
+				break;
+			}
+		}
+		for (i = 0; i < created; i++){
+			pthread_join(pool[i], NULL);
+		}
+	}
 	
-	DEBUG(DB_FREELIST, printf("DEBUG: create_freelist: about to begin\n"));
-	DEBUG(DB_FREELIST, printf("  num_data_blocks: %d\n", num_data_blocks));
-	DEBUG(DB_FREELIST, printf("  blocks_per_node: %d\n", blocks_per_node));
-	DEBUG(DB_FREELIST, printf("  num_nodes:       %d\n\n", num_nodes));
+	DEBUG(DB_GROUPS, printf("DEBUG: init_groups: initialized every group\n"));
+	DEBUG(DB_GROUPS, printf("  num_groups: %d\n", sb.num_groups));
+	DEBUG(DB_GROUPS, printf("  threads:    %d\n", threads));
 	
-	/* Create a node and populate it */
-	for (i = 0; i < num_nodes; i++){
-		node_loc = (i * blocks_per_node) + 1;
-		memset(&cur, INVALID_DATA, sizeof(freelist_node));
-		
-		DEBUG(DB_FREELIST, printf("Building node at location: %d\n", node_loc));
-		
-		/* Populate it with its free blocks */
-		for (j = 0; j < ADDR_PER_NODE && node_loc + j + 1 <= num_data_blocks; j++){
-			cur.addr[j] = node_loc + j + 1;
-			
-			DEBUG(DB_FREELIST, printf("  addr[%d]: %d\n", j, node_loc + j + 1));
+	if (job.ret != SUCCESS){
+		return job.ret;
+	}
+	
+	return write_gdt();
+}
+
+/* Body of a thread of init_groups. Takes groups one at a time from job until there are
+ * none left, and records an error in job if one fails */
+void* init_groups_worker(void* arg){
+	mkfs_job* job = arg;
+	
+	superblock sb;
+	read_superblock(&sb);
+	
+	int group, ret;
+	while ((group = __atomic_fetch_add(&job->next_group, 1, __ATOMIC_RELAXED)) < sb.num_groups){
+		ret = init_group(group);
+		if (ret != SUCCESS){
+			__atomic_store_n(&job->ret, ret, __ATOMIC_RELAXED);
 		}
+	}
+	
+	return NULL;
+}
+
+/* Lays out a single group: fills in its descriptor in the in-memory table and writes
+ * its block bitmap, with the bits covering the group's own metadata set. Its slices of
+ * the ibitmap and the ichunk index are left as the disk's 0s. Doesn't write the
+ * descriptor table
+ *
+ * Returns:
+ *   other              - data_write failed
+ *   SUCCESS            - the group is ready
+ */
+int init_group(int group){
+	superblock sb;
+	read_superblock(&sb);
+	
+	int metadata_blocks = 1 + sb.ibitmap_size + sb.ichunk_size;
+	
+	group_desc gd;
+	memset(&gd, 0, sizeof(group_desc));
+	gd.first_block = group * sb.blocks_per_group + 1;
+	gd.num_blocks = MIN(sb.blocks_per_group, sb.data_size - group * sb.blocks_per_group);
+	gd.block_bitmap = gd.first_block;
+	gd.ibitmap = gd.block_bitmap + 1;
+	gd.ichunk_index = gd.ibitmap + sb.ibitmap_size;
+	gd.free_blocks = gd.num_blocks - metadata_blocks;
+	gd.free_inodes = sb.inodes_per_group;
+	
+	/* The group's own metadata is always in use */
+	uint8_t block_bitmap[BLOCK_SIZE];
+	memset(block_bitmap, 0, sizeof(block_bitmap));
+	int i;
+	for (i = 0; i < metadata_blocks; i++){
+		bitmap_set(block_bitmap, i);
+	}
+	int ret = data_write(gd.block_bitmap, block_bitmap);
+	if (ret != SUCCESS){
+		return ret;
+	}
+	
+	/* Each thread has its own groups, so their entries can be filled in without a lock */
+	memcpy(&cached_gdt[group], &gd, sizeof(group_desc));
+	
+	DEBUG(DB_GROUPS, printf("DEBUG: init_group: initialized a group\n"));
+	DEBUG(DB_GROUPS, printf("  group:        %d\n", group));
+	DEBUG(DB_GROUPS, printf("  first_block:  %d\n", gd.first_block));
+	DEBUG(DB_GROUPS, printf("  num_blocks:   %d\n", gd.num_blocks));
+	DEBUG(DB_GROUPS, printf("  free_blocks:  %d\n", gd.free_blocks));
+	
+	return SUCCESS;
+}
+
+/* Writes the whole in-memory descriptor table to disk
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - FS hasn't been set up yet
+ *   other              - write_block failed
+ *   SUCCESS            - the table is on disk
+ */
+int write_gdt(){
+	superblock sb;
+	
+	int ret = read_superblock(&sb);
+	if (ret != SUCCESS || cached_gdt == NULL){
+		ERR(fprintf(stderr, "ERR: write_gdt: filesystem isn't set up\n"));
+		ERR(fprintf(stderr, "  ret: %d\n", ret));
+		return DISC_UNINITIALIZED;
+	}
+	
+	gdt_block block;
+	int i, in_block;
+	pthread_mutex_lock(&gdt_lock);
+	for (i = 0; i < sb.gdt_size; i++){
+		memset(&block, 0, sizeof(gdt_block));
+		in_block = MAX(0, MIN(GROUPS_PER_BLOCK, (int)sb.num_groups - i * (int)GROUPS_PER_BLOCK));
+		memcpy(block.groups, &cached_gdt[i * GROUPS_PER_BLOCK], in_block * sizeof(group_desc));
 		
-		/* If there's room for another node after it, link it to the next one */
-		next_loc = ((i + 1) * blocks_per_node) + 1; //TODO: make sure this works for weird blocksizes
-		if (next_loc <= num_data_blocks){
-			cur.next = next_loc;
+		ret = write_block(sb.gdt_block_offset + i, &block);
+		if (ret != SUCCESS){
+			break;
 		}
-		
-		DEBUG(DB_FREELIST, printf("  next_loc: %d\n", cur.next));
-		
-		/* Write the node */
-		if (data_write(node_loc, &cur) != SUCCESS){
-			return DISC_UNINITIALIZED;
+	}
+	pthread_mutex_unlock(&gdt_lock);
+	
+	return ret;
+}
+
+/* Sets up a zeroed in-memory descriptor table and a lock for each of num_groups
+ * groups, replacing anything left over from a previous filesystem
+ *
+ * Returns:
+ *   UNEXPECTED_ERROR   - malloc error
+ *   SUCCESS            - table and locks were set up
+ */
+int alloc_group_cache(int num_groups){
+	int i;
+	for (i = 0; i < group_locks_size; i++){
+		pthread_mutex_destroy(&group_locks[i]);
+	}
+	group_locks_size = 0;
+	
+	group_locks = realloc(group_locks, num_groups * sizeof(pthread_mutex_t));
+	cached_gdt = realloc(cached_gdt, num_groups * sizeof(group_desc));
+	if (group_locks == NULL || cached_gdt == NULL){
+		ERR(perror(NULL));
+		return UNEXPECTED_ERROR;
+	}
+	memset(cached_gdt, 0, num_groups * sizeof(group_desc));
+	
+	for (i = 0; i < num_groups; i++){
+		pthread_mutex_init(&group_locks[i], NULL);
+	}
+	group_locks_size = num_groups;
+	
+	return SUCCESS;
+}
+
+/* Brings the in-memory state of the filesystem back in line with the disk, as after
+ * a crash: the journal is replayed, then the superblock and the group descriptor table
+ * are read back from disk
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - no disk, or its journal couldn't be read
+ *   UNEXPECTED_ERROR   - malloc error
+ *   SUCCESS            - filesystem is ready to use
+ */
+int mount_fs(){
+	/* Forget the cached superblock so it's read from disk */
+	free(cached_superblock);
+	cached_superblock = NULL;
+	
+	superblock sb;
+	int ret = read_superblock(&sb);
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: mount_fs: read_superblock failed\n"));
+		ERR(fprintf(stderr, "  ret: %d\n", ret));
+		return DISC_UNINITIALIZED;
+	}
+	
+	/* Frees that hadn't committed are gone with the journal, and the rest can wait for data_trim */
+	discard_reset();
+	
+	ret = journal_init(sb.journal_block_offset, sb.journal_size, FALSE);
+	if (ret != SUCCESS){
+		return ret;
+	}
+	/* A snapshot's log is always empty, and it can't be written to anyway */
+	if (sb.journal_size > 0 && snapshot_view == NO_SNAPSHOT){
+		ret = journal_recover();
+		if (ret != SUCCESS){
+			return ret;
+		}
+	}
+	
+	/* The superblock could have been replayed too */
+	free(cached_superblock);
+	cached_superblock = NULL;
+	read_superblock(&sb);
+	
+	ret = alloc_group_cache(sb.num_groups);
+	if (ret != SUCCESS){
+		return ret;
+	}
+	
+	gdt_block block;
+	int group;
+	for (group = 0; group < sb.num_groups; group++){
+		if (group % GROUPS_PER_BLOCK == 0){
+			read_block(sb.gdt_block_offset + group / GROUPS_PER_BLOCK, &block);
 		}
+		memcpy(&cached_gdt[group], &block.groups[group % GROUPS_PER_BLOCK], sizeof(group_desc));
 	}
 	
+	DEBUG(DB_MKFS, printf("DEBUG: mount_fs: mounted\n"));
+	DEBUG(DB_MKFS, printf("  num_groups:   %d\n", sb.num_groups));
+	DEBUG(DB_MKFS, printf("  journal_size: %d\n", sb.journal_size));
+	
 	return SUCCESS;
 }
 
-/* Initializes the ibitmap to all 0s
- * 
- * This function is called during mkfs and is not really
- * intended for normal use. It requires that the filesystem has
- * at least a valid superblock
- * 
+/* Mounts the filesystem from snapshot id, read-only. The live filesystem is checkpointed
+ * first and is left alone until snapshot_unmount. Meant for tools like backups, so no
+ * files should be open
+ *
+ * Returns:
+ *   BAD_SNAPSHOT       - id isn't a snapshot, it's broken, or one is already mounted
+ *   other              - mount_fs failed
+ *   SUCCESS            - reads now see the snapshot, and writes fail
+ */
+int snapshot_mount(int id){
+	if (snapshot_view != NO_SNAPSHOT || id < 0 || id >= snapshots_size || !snapshots[id].in_use || snapshots[id].broken){
+		ERR(fprintf(stderr, "ERR: snapshot_mount: can't mount snapshot\n"));
+		ERR(fprintf(stderr, "  id:   %d\n", id));
+		ERR(fprintf(stderr, "  view: %d\n", snapshot_view));
+		return BAD_SNAPSHOT;
+	}
+	
+	/* Nothing the live journal holds may show through, and it has to survive the remount */
+	journal_checkpoint();
+	
+	snapshot_view = id;
+	int ret = mount_fs();
+	if (ret != SUCCESS){
+		snapshot_unmount();
+	}
+	
+	return ret;
+}
+
+/* Goes back to the live filesystem after snapshot_mount
+ *
+ * Returns:
+ *   other              - mount_fs failed
+ *   SUCCESS            - the live filesystem is mounted again
+ */
+int snapshot_unmount(){
+	snapshot_view = NO_SNAPSHOT;
+	
+	return mount_fs();
+}
+
+/* Reads the descriptor of the specified group into gd
+ *
  * Returns:
- * 	 DISC_UNINITIALIZED - FS hasn't been set up yet
- *   SUCCESS            - bitmap was initialized
+ *   DISC_UNINITIALIZED - FS hasn't been set up yet
+ *   BAD_GROUP          - not a valid group in this fs
+ *   BUF_NULL           - gd is null
+ *   SUCCESS            - descriptor was read
  */
-int init_ibitmap(){
-	DEBUG(DB_MKFS, printf("DEBUG: init_ibitmap: about to begin\n"));
+int read_group_desc(int group, group_desc* gd){
 	superblock sb;
 
 	int ret = read_superblock(&sb);
 	if (ret != SUCCESS){
-		ERR(fprintf(stderr, "ERR: init_ibitmap: read_superblock failed\n"));
+		ERR(fprintf(stderr, "ERR: read_group_desc: read_superblock failed\n"));
 		ERR(fprintf(stderr, "  ret: %d\n", ret));
 		return DISC_UNINITIALIZED;
 	}
 	
-	uint8_t zero_buffer[BLOCK_SIZE];
-	memset(zero_buffer, 0, sizeof(zero_buffer));
+	if (gd == NULL){
+		ERR(fprintf(stderr, "ERR: read_group_desc: gd is null\n"));
+		ERR(fprintf(stderr, "  gd: %p\n", gd));
+		return BUF_NULL;
+	}
+	
+	if (group < 0 || group >= sb.num_groups){
+		ERR(fprintf(stderr, "ERR: read_group_desc: group invalid\n"));
+		ERR(fprintf(stderr, "  group:           %d\n", group));
+		ERR(fprintf(stderr, "  max (exclusive): %d\n", sb.num_groups));
+		return BAD_GROUP;
+	}
 	
-	int cur_ibitmap_block = 0;
-	for (cur_ibitmap_block = 0; cur_ibitmap_block < sb.ibitmap_size; cur_ibitmap_block++){
-		write_block(sb.ibitmap_block_offset + cur_ibitmap_block, zero_buffer);
+	/* Read the cached table, if it exists */
+	if (cached_gdt != NULL){
+		memcpy(gd, &cached_gdt[group], sizeof(group_desc));
+		return SUCCESS;
 	}
 	
-	DEBUG(DB_MKFS, printf("DEBUG: init_ibitmap: ibitmap initialized\n"));
+	gdt_block block;
+	ret = read_block(sb.gdt_block_offset + group / GROUPS_PER_BLOCK, &block);
+	if (ret != SUCCESS){
+		return ret;
+	}
 	
+	memcpy(gd, &block.groups[group % GROUPS_PER_BLOCK], sizeof(group_desc));
 	return SUCCESS;
 }
 
+/* Writes gd as the descriptor of the specified group, to the cached table and to disk
+ *
+ * The caller should hold the group's lock, so that the descriptor can't change
+ * between reading and writing it
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - FS hasn't been set up yet
+ *   BAD_GROUP          - not a valid group in this fs
+ *   BUF_NULL           - gd is null
+ *   SUCCESS            - descriptor was written
+ */
+int write_group_desc(int group, group_desc* gd){
+	superblock sb;
+
+	int ret = read_superblock(&sb);
+	if (ret != SUCCESS || cached_gdt == NULL){
+		ERR(fprintf(stderr, "ERR: write_group_desc: filesystem isn't set up\n"));
+		ERR(fprintf(stderr, "  ret: %d\n", ret));
+		return DISC_UNINITIALIZED;
+	}
+	
+	if (gd == NULL){
+		ERR(fprintf(stderr, "ERR: write_group_desc: gd is null\n"));
+		ERR(fprintf(stderr, "  gd: %p\n", gd));
+		return BUF_NULL;
+	}
+	
+	if (group < 0 || group >= sb.num_groups){
+		ERR(fprintf(stderr, "ERR: write_group_desc: group invalid\n"));
+		ERR(fprintf(stderr, "  group:           %d\n", group));
+		ERR(fprintf(stderr, "  max (exclusive): %d\n", sb.num_groups));
+		return BAD_GROUP;
+	}
+	
+	/* Groups share blocks of the table, so write a whole block from the cache while
+	 * making sure nobody else is doing the same */
+	pthread_mutex_lock(&gdt_lock);
+	memcpy(&cached_gdt[group], gd, sizeof(group_desc));
+	
+	gdt_block block;
+	memset(&block, 0, sizeof(gdt_block));
+	int first_in_block = (group / GROUPS_PER_BLOCK) * GROUPS_PER_BLOCK;
+	int in_block = MIN(GROUPS_PER_BLOCK, sb.num_groups - first_in_block);
+	memcpy(block.groups, &cached_gdt[first_in_block], in_block * sizeof(group_desc));
+	
+	ret = write_block(sb.gdt_block_offset + group / GROUPS_PER_BLOCK, &block);
+	pthread_mutex_unlock(&gdt_lock);
+	
+	return ret;
+}
+
+/* Returns the group that inode inode_num lives in. inode_num must be valid */
+int inode_group(int inode_num){
+	superblock sb;
+	read_superblock(&sb);
+	
+	return (inode_num - 1) / sb.inodes_per_group;
+}
+
+/* Returns the group that data block data_block_num is in. data_block_num must be valid */
+int data_group(int data_block_num){
+	superblock sb;
+	read_superblock(&sb);
+	
+	return (data_block_num - 1) / sb.blocks_per_group;
+}
+
+/* Returns the first data block of a group, which makes a good allocation goal for
+ * anything that should go in that group. group must be valid */
+int group_first_block(int group){
+	superblock sb;
+	read_superblock(&sb);
+	
+	return group * sb.blocks_per_group + 1;
+}
+
+/* Picks the group for a new directory. Files are placed in their directory's group,
+ * so directories are spread out to the group with the most free blocks that still has
+ * free inodes, giving each directory room to grow. The parent's group wins ties
+ *
+ * Returns the chosen group
+ */
+int find_group_dir(int parent_group){
+	superblock sb;
+	read_superblock(&sb);
+	
+	group_desc gd;
+	int best_group = parent_group;
+	int best_free = -1;
+	if (read_group_desc(parent_group, &gd) == SUCCESS && gd.free_inodes > 0){
+		best_free = gd.free_blocks;
+	}
+	
+	int group;
+	for (group = 0; group < sb.num_groups; group++){
+		read_group_desc(group, &gd);
+		if (gd.free_inodes > 0 && (int)gd.free_blocks > best_free){
+			best_group = group;
+			best_free = gd.free_blocks;
+		}
+	}
+	
+	return best_group;
+}
+
+/* Finds the first 0 bit in bitmap between start (inclusive) and end (exclusive).
+ * Bits are numbered from the most significant bit of the first byte
+ *
+ * Returns the bit found, or -1 if every bit in the range is set
+ */
+int bitmap_find_zero(uint8_t* bitmap, int start, int end){
+	int bit = start;
+	while (bit < end){
+		/* Skip over full bytes */
+		if (bit % 8 == 0 && bitmap[bit / 8] == 0xff){
+			bit += 8;
+			continue;
+		}
+		
+		if ((bitmap[bit / 8] & (0x80 >> (bit % 8))) == 0){
+			return bit;
+		}
+		bit++;
+	}
+	
+	return -1;
+}
+
+/* Returns whether the specified bit of bitmap is set */
+int bitmap_test(uint8_t* bitmap, int bit){
+	return (bitmap[bit / 8] & (0x80 >> (bit % 8))) != 0;
+}
+
+/* Sets the specified bit of bitmap */
+void bitmap_set(uint8_t* bitmap, int bit){
+	bitmap[bit / 8] |= (0x80 >> (bit % 8));
+}
+
+/* Clears the specified bit of bitmap */
+void bitmap_clear(uint8_t* bitmap, int bit){
+	bitmap[bit / 8] &= ~(0x80 >> (bit % 8));
+}
+
 /* Reads the specified inode into read_node, a buffer of size sizeof(inode)
  *
  * Note that inodes are 1-indexed. 1 is the first inode,
@@ -353,20 +842,30 @@ int inode_read(int inode_num, inode* read_node){
 		return BAD_INODE;
 	}
 	
-	int inode_block_num = (inode_num - 1) / INODES_PER_BLOCK;
+	int chunk_num = (inode_num - 1) / INODES_PER_BLOCK;
 	int inode_in_block = (inode_num - 1) % INODES_PER_BLOCK;
 
-	int total_block_offset = sb.ilist_block_offset + inode_block_num;
+	int chunk_block = INVALID_DATA;
+	ret = ichunk_lookup(chunk_num, FALSE, &chunk_block);
+	if (ret != SUCCESS){
+		return ret;
+	}
+	
+	/* Inodes in chunks that were never allocated are all 0s */
+	if (chunk_block == INVALID_DATA){
+		memset(read_node, 0, sizeof(inode));
+		return SUCCESS;
+	}
 	
 	iblock block;
-	read_block(total_block_offset, &block);
+	data_read(chunk_block, &block);
 
 	DEBUG(DB_INODEREAD, printf("DEBUG: inode_read: reading an inode\n"));
 	DEBUG(DB_INODEREAD, printf("  inode_num:                     %d\n", inode_num));
 	DEBUG(DB_INODEREAD, printf("  INODES_PER_BLOCK:              %d\n", INODES_PER_BLOCK));
-	DEBUG(DB_INODEREAD, printf("  inode_block_num:               %d\n", inode_block_num));
+	DEBUG(DB_INODEREAD, printf("  chunk_num:                     %d\n", chunk_num));
 	DEBUG(DB_INODEREAD, printf("  inode_in_block:                %d\n", inode_in_block));
-	DEBUG(DB_INODEREAD, printf("  total_block_offset:            %d\n", total_block_offset));
+	DEBUG(DB_INODEREAD, printf("  chunk_block:                   %d\n", chunk_block));
 	DEBUG(DB_INODEREAD, printf("  &block:                        %p\n", &block));
 	DEBUG(DB_INODEREAD, printf("  &block.inodes[inode_in_block]: %p\n", &block.inodes[inode_in_block]));
 	
@@ -411,29 +910,39 @@ int inode_write(int inode_num, inode* modified){
 		return BAD_INODE;
 	}
 	
-	int inode_block_num = (inode_num - 1) / INODES_PER_BLOCK;
+	int chunk_num = (inode_num - 1) / INODES_PER_BLOCK;
 	int inode_in_block = (inode_num - 1) % INODES_PER_BLOCK;
 
-	int total_block_offset = sb.ilist_block_offset + inode_block_num;
+	/* Writing an inode brings its chunk into existence, if it wasn't already */
+	int chunk_block = INVALID_DATA;
+	ret = ichunk_lookup(chunk_num, TRUE, &chunk_block);
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: inode_write: couldn't get inode chunk\n"));
+		ERR(fprintf(stderr, "  chunk_num: %d\n", chunk_num));
+		ERR(fprintf(stderr, "  ret:       %d\n", ret));
+		return ret;
+	}
 	
 	iblock block;
-	read_block(total_block_offset, &block);
+	data_read(chunk_block, &block);
 
 	DEBUG(DB_INODEWRITE, printf("DEBUG: inode_write: writing an inode\n"));
 	DEBUG(DB_INODEWRITE, printf("  inode_num:                     %d\n", inode_num));
 	DEBUG(DB_INODEWRITE, printf("  INODES_PER_BLOCK:              %d\n", INODES_PER_BLOCK));
-	DEBUG(DB_INODEWRITE, printf("  inode_block_num:               %d\n", inode_block_num));
+	DEBUG(DB_INODEWRITE, printf("  chunk_num:                     %d\n", chunk_num));
 	DEBUG(DB_INODEWRITE, printf("  inode_in_block:                %d\n", inode_in_block));
-	DEBUG(DB_INODEWRITE, printf("  total_block_offset:            %d\n", total_block_offset));
+	DEBUG(DB_INODEWRITE, printf("  chunk_block:                   %d\n", chunk_block));
 	DEBUG(DB_INODEWRITE, printf("  &block:                        %p\n", &block));
 	DEBUG(DB_INODEWRITE, printf("  &block.inodes[inode_in_block]: %p\n", &block.inodes[inode_in_block]));
 	
 	memcpy(&block.inodes[inode_in_block], modified, sizeof(inode));
+	inode_writes++;
 	
-	return write_block(total_block_offset, &block);
+	return data_write(chunk_block, &block);
 }
 
-/* Marks an inode as free in the ibitmap
+/* Marks an inode as free in its group's ibitmap. If it was the last inode in use
+ * in its chunk, the chunk is given back to the data region
  *
  * Returns:
  *   DISC_UNINITIALIZED - FS hasn't been set up yet
@@ -458,45 +967,51 @@ int inode_free(int inode_num){
 		return BAD_INODE;
 	}
 	
-	int bitmap_block_num = (inode_num - 1) / BITS_PER_BLOCK;
-	int bit_in_block = (inode_num - 1) % BITS_PER_BLOCK;
-	
-	int byte_in_block = bit_in_block / 8;
-	int bit_in_byte = bit_in_block % 8;
-	
-	int total_block_offset = sb.ibitmap_block_offset + bitmap_block_num;
-	
-	uint8_t buf[BLOCK_SIZE];
-	read_block(total_block_offset, buf);
+	int group = (inode_num - 1) / sb.inodes_per_group;
+	int local = (inode_num - 1) % sb.inodes_per_group;
 	
 	DEBUG(DB_INODEFREE, printf("DEBUG: inode_free: setting bit to 0\n"));
-	DEBUG(DB_INODEFREE, printf("  inode_num:                 %d\n", inode_num));
-	DEBUG(DB_INODEFREE, printf("  INODES_PER_BLOCK:          %d\n", INODES_PER_BLOCK));
-	DEBUG(DB_INODEFREE, printf("  bitmap_block_num:          %d\n", bitmap_block_num));
-	DEBUG(DB_INODEFREE, printf("  bit_in_block:              %d\n", bit_in_block));
-	DEBUG(DB_INODEFREE, printf("  byte_in_block:             %d\n", byte_in_block));
-	DEBUG(DB_INODEFREE, printf("  bit_in_byte:               %d\n", bit_in_byte));
-	DEBUG(DB_INODEFREE, printf("  total_block_offset:        %d\n", total_block_offset));
-	DEBUG(DB_INODEFREE, printf("  buf[byte_in_block] before: %x\n", buf[byte_in_block]));
-
-	/* Clear the bit */
-	buf[byte_in_block] &= buf[byte_in_block] ^ (0x80 >> bit_in_byte);
+	DEBUG(DB_INODEFREE, printf("  inode_num: %d\n", inode_num));
+	DEBUG(DB_INODEFREE, printf("  group:     %d\n", group));
+	DEBUG(DB_INODEFREE, printf("  local:     %d\n", local));
 	
-	DEBUG(DB_INODEFREE, printf("  buf[byte_in_block] after:  %x\n", buf[byte_in_block]));
+	ret = ibitmap_put(group, local);
+	if (ret != SUCCESS){
+		return ret;
+	}
 	
-	return write_block(total_block_offset, buf);
+	/* Gives the chunk back if no other inode in it is still in use */
+	return ichunk_release((inode_num - 1) / INODES_PER_BLOCK);
 }
 
-/* Creates a new inode at the first available location in the ilist
+/* Creates a new inode at the first available location in the ibitmap, allocating
+ * a chunk for it from the data region if needed
  *
  * Returns:
  *   DISC_UNINITIALIZED - FS hasn't been set up yet
  *   BUF_NULL           - new_node is null
  *   INT_NULL           - inode_num is null
- *   ILIST_FULL         - the ilist is full
+ *   ILIST_FULL         - no free inode, and no room for a new chunk
  *   SUCCESS            - block was read
  */
 int inode_create(inode* new_node, int* inode_num){
+	return inode_create_in_group(new_node, ROOT_GROUP, inode_num);
+}
+
+/* Creates a new inode at the first available location in group's slice of the ibitmap,
+ * moving on to the following groups if it's full. A chunk is allocated for the inode
+ * from the data region if needed. new_node's group is set to the group the inode
+ * ended up in before it is written
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - FS hasn't been set up yet
+ *   BUF_NULL           - new_node is null
+ *   INT_NULL           - inode_num is null
+ *   BAD_GROUP          - not a valid group in this fs
+ *   ILIST_FULL         - no free inode, and no room for a new chunk
+ *   SUCCESS            - block was read
+ */
+int inode_create_in_group(inode* new_node, int group, int* inode_num){
 	superblock sb;
 
 	int ret = read_superblock(&sb);
@@ -519,62 +1034,296 @@ int inode_create(inode* new_node, int* inode_num){
 		return INT_NULL;
 	}
 	
-	uint8_t ibitmap_buffer[BLOCK_SIZE];
-	int cur_ibitmap_block;
-	int byte_offset, bit_offset = 0;
-	int inode_number = 0;
-	for (cur_ibitmap_block = 0; cur_ibitmap_block < sb.ibitmap_size; cur_ibitmap_block++){
-		/* Read a block of the ibitmap */
-		ret = read_block(sb.ibitmap_block_offset + cur_ibitmap_block, ibitmap_buffer);
-		
-		DEBUG(DB_INODECREATE, printf("DEBUG: inode_create: read a block of the ibitmap\n"));
-		DEBUG(DB_INODECREATE, printf("  cur_ibitmap_block:           %d\n", cur_ibitmap_block));
+	if (group < 0 || group >= sb.num_groups){
+		ERR(fprintf(stderr, "ERR: inode_create: group invalid\n"));
+		ERR(fprintf(stderr, "  group:           %d\n", group));
+		ERR(fprintf(stderr, "  max (exclusive): %d\n", sb.num_groups));
+		return BAD_GROUP;
+	}
+	
+	int i, cur_group, local, skip_to, inode_number, chunk_block;
+	for (i = 0; i < sb.num_groups; i++){
+		cur_group = (group + i) % sb.num_groups;
+		skip_to = 0;
 		
-		int free_bit = 0;
-		for (byte_offset = 0; byte_offset < sizeof(ibitmap_buffer); byte_offset++){
-			uint8_t byte = ibitmap_buffer[byte_offset];
-			if (byte != 0xff){ // If a byte is full, continue
-				for (bit_offset = 0; bit_offset < 8; bit_offset++){
-					/* Calculate the inode_number of this bit */ //TODO this could be sped up but I don't think it matters much
-					inode_number = cur_ibitmap_block * (BLOCK_SIZE * 8);
-					inode_number += byte_offset * 8;
-					inode_number += bit_offset;
-					inode_number += 1; // One-indexed
-					
-					if (inode_number > sb.num_inodes){
-						ERR(fprintf(stderr, "ERR: inode_create: ilist is full\n"));
-						return ILIST_FULL;
-					}
-					
-					if (((byte << bit_offset) & 0x80) == 0){
-						DEBUG(DB_INODECREATE, printf("DEBUG: inode_create: found a free spot\n"));
-						DEBUG(DB_INODECREATE, printf("  byte_offset:             %d\n", byte_offset));
-						DEBUG(DB_INODECREATE, printf("  bit_offset:              %d\n", bit_offset));
-						DEBUG(DB_INODECREATE, printf("  cur_ibitmap_block:       %d\n", cur_ibitmap_block));
-						DEBUG(DB_INODECREATE, printf("  sb.ibitmap_block_offset: %d\n", sb.ibitmap_block_offset));
-						
-						DEBUG(DB_INODECREATE, printf("  byte (before):           %x\n", byte));
-						
-						/* Update the ibitmap */
-						byte |= (0x80 >> bit_offset);
-						ibitmap_buffer[byte_offset] = byte;
-						write_block(sb.ibitmap_block_offset + cur_ibitmap_block, ibitmap_buffer);
-						
-						DEBUG(DB_INODECREATE, printf("  byte (after):            %x\n", byte));
-						DEBUG(DB_INODECREATE, printf("  inode_number:            %d\n", inode_number));
-						
-						*inode_num = inode_number;
-						return inode_write(inode_number, new_node);
-					}
-				}
+		while (ibitmap_take(cur_group, skip_to, &local) == SUCCESS){
+			inode_number = cur_group * sb.inodes_per_group + local + 1; // One-indexed
+			
+			/* Make sure the chunk holding this inode exists. If there's no room for a new
+			 * chunk, give the inode back and skip ahead to a chunk that might already exist */
+			if (ichunk_lookup((inode_number - 1) / INODES_PER_BLOCK, TRUE, &chunk_block) != SUCCESS){
+				DEBUG(DB_INODECREATE, printf("DEBUG: inode_create: no room for chunk, skipping it\n"));
+				DEBUG(DB_INODECREATE, printf("  inode_number:            %d\n", inode_number));
+				ibitmap_put(cur_group, local);
+				skip_to = (local / INODES_PER_BLOCK + 1) * INODES_PER_BLOCK;
+				continue;
 			}
+			
+			DEBUG(DB_INODECREATE, printf("DEBUG: inode_create: found a free spot\n"));
+			DEBUG(DB_INODECREATE, printf("  cur_group:    %d\n", cur_group));
+			DEBUG(DB_INODECREATE, printf("  local:        %d\n", local));
+			DEBUG(DB_INODECREATE, printf("  inode_number: %d\n", inode_number));
+			
+			new_node->group = cur_group;
+			*inode_num = inode_number;
+			return inode_write(inode_number, new_node);
+		}
+	}
+	
+	ERR(fprintf(stderr, "ERR: inode_create: no room for more inodes\n"));
+	return ILIST_FULL;
+}
+
+/* Marks the first free inode at or after local bit from in group's slice of the
+ * ibitmap as in use, and puts its position within the group in local
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - FS hasn't been set up yet
+ *   BAD_GROUP          - not a valid group in this fs
+ *   ILIST_FULL         - no free inode in the group at or after from
+ *   SUCCESS            - an inode was taken
+ */
+int ibitmap_take(int group, int from, int* local){
+	superblock sb;
+
+	int ret = read_superblock(&sb);
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: ibitmap_take: read_superblock failed\n"));
+		ERR(fprintf(stderr, "  ret: %d\n", ret));
+		return DISC_UNINITIALIZED;
+	}
+	
+	group_desc gd;
+	ret = read_group_desc(group, &gd);
+	if (ret != SUCCESS){
+		return ret;
+	}
+	
+	pthread_mutex_lock(&group_locks[group]);
+	read_group_desc(group, &gd);
+	if (gd.free_inodes == 0){
+		pthread_mutex_unlock(&group_locks[group]);
+		return ILIST_FULL;
+	}
+	
+	uint8_t buf[BLOCK_SIZE];
+	int block, start, end, bit;
+	for (block = from / BITS_PER_BLOCK; block < sb.ibitmap_size; block++){
+		start = (block == from / BITS_PER_BLOCK) ? from % BITS_PER_BLOCK : 0;
+		end = MIN(BITS_PER_BLOCK, sb.inodes_per_group - block * BITS_PER_BLOCK);
+		
+		data_read(gd.ibitmap + block, buf);
+		bit = bitmap_find_zero(buf, start, end);
+		if (bit != -1){
+			bitmap_set(buf, bit);
+			data_write(gd.ibitmap + block, buf);
+			
+			gd.free_inodes--;
+			ret = write_group_desc(group, &gd);
+			pthread_mutex_unlock(&group_locks[group]);
+			
+			*local = block * BITS_PER_BLOCK + bit;
+			return ret;
 		}
 	}
 	
-	ERR(fprintf(stderr, "ERR: inode_create: ilist is full\n"));
+	pthread_mutex_unlock(&group_locks[group]);
 	return ILIST_FULL;
 }
 
+/* Marks inode local of group as free in the group's slice of the ibitmap. Does
+ * nothing if it was already free
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - FS hasn't been set up yet
+ *   BAD_GROUP          - not a valid group in this fs
+ *   SUCCESS            - the inode is free
+ */
+int ibitmap_put(int group, int local){
+	group_desc gd;
+	int ret = read_group_desc(group, &gd);
+	if (ret != SUCCESS){
+		return ret;
+	}
+	
+	pthread_mutex_lock(&group_locks[group]);
+	read_group_desc(group, &gd);
+	
+	uint8_t buf[BLOCK_SIZE];
+	int block = gd.ibitmap + local / BITS_PER_BLOCK;
+	data_read(block, buf);
+	if (bitmap_test(buf, local % BITS_PER_BLOCK)){
+		bitmap_clear(buf, local % BITS_PER_BLOCK);
+		data_write(block, buf);
+		
+		gd.free_inodes++;
+		ret = write_group_desc(group, &gd);
+	}
+	
+	pthread_mutex_unlock(&group_locks[group]);
+	return ret;
+}
+
+/* Finds the data block holding the chunk_num-th chunk of inodes. If create is true
+ * and the chunk doesn't exist, a zeroed chunk is allocated and added to the index
+ *
+ * Chunks are indexed by the group their inodes belong to, and new chunks are
+ * allocated from that group when there's room
+ *
+ * data_block_num is set to INVALID_DATA if the chunk doesn't exist and create is false
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - FS hasn't been set up yet
+ *   INT_NULL           - data_block_num is null
+ *   BAD_INODE          - chunk_num is beyond the end of the index
+ *   DATA_FULL          - create is true and there's no room for the chunk
+ *   SUCCESS            - data_block_num was set
+ */
+int ichunk_lookup(int chunk_num, int create, int* data_block_num){
+	superblock sb;
+
+	int ret = read_superblock(&sb);
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: ichunk_lookup: read_superblock failed\n"));
+		ERR(fprintf(stderr, "  ret: %d\n", ret));
+		return DISC_UNINITIALIZED;
+	}
+	
+	if (data_block_num == NULL){
+		ERR(fprintf(stderr, "ERR: ichunk_lookup: data_block_num is null\n"));
+		ERR(fprintf(stderr, "  data_block_num: %p\n", data_block_num));
+		return INT_NULL;
+	}
+	
+	int chunks_per_group = sb.inodes_per_group / INODES_PER_BLOCK;
+	if (chunk_num < 0 || chunk_num >= sb.num_groups * chunks_per_group){
+		ERR(fprintf(stderr, "ERR: ichunk_lookup: chunk_num invalid\n"));
+		ERR(fprintf(stderr, "  chunk_num:       %d\n", chunk_num));
+		ERR(fprintf(stderr, "  max (exclusive): %d\n", sb.num_groups * chunks_per_group));
+		return BAD_INODE;
+	}
+	
+	int group = chunk_num / chunks_per_group;
+	int chunk_in_group = chunk_num % chunks_per_group;
+	
+	group_desc gd;
+	read_group_desc(group, &gd);
+	int index_block_num = gd.ichunk_index + chunk_in_group / ICHUNKS_PER_BLOCK;
+	int chunk_in_block = chunk_in_group % ICHUNKS_PER_BLOCK;
+	
+	ichunk_block index;
+	pthread_mutex_lock(&group_locks[group]);
+	data_read(index_block_num, &index);
+	pthread_mutex_unlock(&group_locks[group]);
+	
+	*data_block_num = index.chunk[chunk_in_block];
+	if (*data_block_num != INVALID_DATA || !create){
+		return SUCCESS;
+	}
+	
+	/* Allocate a new chunk full of empty inodes. The group's lock isn't held while
+	 * allocating, since the chunk may have to come from another group */
+	iblock empty_chunk;
+	memset(&empty_chunk, 0, sizeof(iblock));
+	ret = data_allocate_near(&empty_chunk, gd.first_block, data_block_num);
+	if (ret != SUCCESS){
+		*data_block_num = INVALID_DATA;
+		return ret;
+	}
+	
+	DEBUG(DB_ICHUNK, printf("DEBUG: ichunk_lookup: allocated a chunk\n"));
+	DEBUG(DB_ICHUNK, printf("  chunk_num:      %d\n", chunk_num));
+	DEBUG(DB_ICHUNK, printf("  data_block_num: %d\n", *data_block_num));
+	
+	/* Someone else may have created the chunk in the meantime */
+	pthread_mutex_lock(&group_locks[group]);
+	data_read(index_block_num, &index);
+	if (index.chunk[chunk_in_block] != INVALID_DATA){
+		int new_chunk = *data_block_num;
+		*data_block_num = index.chunk[chunk_in_block];
+		pthread_mutex_unlock(&group_locks[group]);
+		return data_free(new_chunk);
+	}
+	
+	index.chunk[chunk_in_block] = *data_block_num;
+	ret = data_write(index_block_num, &index);
+	pthread_mutex_unlock(&group_locks[group]);
+	return ret;
+}
+
+/* Gives the data block holding the chunk_num-th chunk of inodes back to the
+ * data region. Does nothing if the chunk isn't allocated, or if any inode in
+ * it is still in use
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - FS hasn't been set up yet
+ *   BAD_INODE          - chunk_num is beyond the end of the index
+ *   SUCCESS            - chunk is no longer allocated
+ */
+int ichunk_release(int chunk_num){
+	superblock sb;
+
+	int ret = read_superblock(&sb);
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: ichunk_release: read_superblock failed\n"));
+		ERR(fprintf(stderr, "  ret: %d\n", ret));
+		return DISC_UNINITIALIZED;
+	}
+	
+	int chunks_per_group = sb.inodes_per_group / INODES_PER_BLOCK;
+	if (chunk_num < 0 || chunk_num >= sb.num_groups * chunks_per_group){
+		ERR(fprintf(stderr, "ERR: ichunk_release: chunk_num invalid\n"));
+		ERR(fprintf(stderr, "  chunk_num:       %d\n", chunk_num));
+		ERR(fprintf(stderr, "  max (exclusive): %d\n", sb.num_groups * chunks_per_group));
+		return BAD_INODE;
+	}
+	
+	int group = chunk_num / chunks_per_group;
+	int chunk_in_group = chunk_num % chunks_per_group;
+	
+	group_desc gd;
+	read_group_desc(group, &gd);
+	int index_block_num = gd.ichunk_index + chunk_in_group / ICHUNKS_PER_BLOCK;
+	int chunk_in_block = chunk_in_group % ICHUNKS_PER_BLOCK;
+	
+	pthread_mutex_lock(&group_locks[group]);
+	
+	/* Check whether any inode in the chunk is still in use. A chunk never straddles
+	 * two blocks of the ibitmap */
+	uint8_t buf[BLOCK_SIZE];
+	int first_bit = chunk_in_group * INODES_PER_BLOCK;
+	data_read(gd.ibitmap + first_bit / BITS_PER_BLOCK, buf);
+	int i;
+	for (i = 0; i < INODES_PER_BLOCK; i++){
+		if (bitmap_test(buf, first_bit % BITS_PER_BLOCK + i)){
+			pthread_mutex_unlock(&group_locks[group]);
+			return SUCCESS;
+		}
+	}
+	
+	ichunk_block index;
+	data_read(index_block_num, &index);
+	
+	int chunk_block = index.chunk[chunk_in_block];
+	if (chunk_block == INVALID_DATA){
+		pthread_mutex_unlock(&group_locks[group]);
+		return SUCCESS;
+	}
+	
+	DEBUG(DB_ICHUNK, printf("DEBUG: ichunk_release: releasing a chunk\n"));
+	DEBUG(DB_ICHUNK, printf("  chunk_num:   %d\n", chunk_num));
+	DEBUG(DB_ICHUNK, printf("  chunk_block: %d\n", chunk_block));
+	
+	index.chunk[chunk_in_block] = INVALID_DATA;
+	ret = data_write(index_block_num, &index);
+	pthread_mutex_unlock(&group_locks[group]);
+	if (ret != SUCCESS){
+		return ret;
+	}
+	
+	return data_free(chunk_block);
+}
+
 /* Reads the specified data block into read_buf, a buffer of size BLOCK_SIZE
  *
  * Note that data blocks are 1-indexed. 1 is the first data block,
@@ -665,90 +1414,190 @@ int data_write(int data_block_num, void* write_buf){
 	return write_block(total_offset, write_buf);
 }
 
-/* Puts a data block on the free list. Does not do any error checking
- *
- * Note that data blocks are 1-indexed. 1 is the first data block,
- * and 0 is not a valid data block
+/* Writes write_buf, a buffer of size BLOCK_SIZE, to the specified data block in
+ * place, bypassing the journal. Used for the contents of regular files, which
+ * aren't journaled
  *
  * Returns:
  *   DISC_UNINITIALIZED - FS hasn't been set up yet
  *   INVALID_BLOCK      - not a valid data block in our fs
- *   SUCCESS            - block was added to free list
+ *   BUF_NULL           - write_buf is null
+ *   SUCCESS            - block was written
  */
-int data_free(int data_block_num){
+int data_write_direct(int data_block_num, void* write_buf){
+	superblock sb;
+
+	int ret = read_superblock(&sb);
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: data_write_direct: read_superblock failed\n"));
+		ERR(fprintf(stderr, "  ret: %d\n", ret));
+		return DISC_UNINITIALIZED;
+	}
+	
+	if (data_block_num <= 0 || data_block_num > sb.data_size){
+		ERR(fprintf(stderr, "ERR: data_write_direct: data_block_num invalid\n"));
+		ERR(fprintf(stderr, "  data_block_num:  %d\n", data_block_num));
+		ERR(fprintf(stderr, "  min (exclusive): %d\n", 0));
+		ERR(fprintf(stderr, "  max (inclusive): %d\n", sb.data_size));
+		return INVALID_BLOCK;
+	}
+	
+	return write_block_direct(sb.data_block_offset + data_block_num - 1, write_buf);
+}
+
+/* Writes size bytes of write_buf to a data block in place, starting offset bytes into
+ * it, bypassing the journal. 0s are written if write_buf is null. The rest of the block
+ * is left as it is, so part of a block of a regular file can be changed without reading
+ * it first
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - FS hasn't been set up yet
+ *   INVALID_BLOCK      - not a valid data block in our fs, or the range runs off it
+ *   SUCCESS            - the range was written
+ */
+int data_write_range(int data_block_num, int offset, void* write_buf, int size){
 	superblock sb;
 
 	int ret = read_superblock(&sb);
 	if (ret != SUCCESS){
-		ERR(fprintf(stderr, "ERR: data_free: read_superblock failed\n"));
+		ERR(fprintf(stderr, "ERR: data_write_range: read_superblock failed\n"));
 		ERR(fprintf(stderr, "  ret: %d\n", ret));
 		return DISC_UNINITIALIZED;
 	}
 	
 	if (data_block_num <= 0 || data_block_num > sb.data_size){
-		ERR(fprintf(stderr, "ERR: data_free: data_block_num invalid\n"));
+		ERR(fprintf(stderr, "ERR: data_write_range: data_block_num invalid\n"));
 		ERR(fprintf(stderr, "  data_block_num:  %d\n", data_block_num));
 		ERR(fprintf(stderr, "  min (exclusive): %d\n", 0));
 		ERR(fprintf(stderr, "  max (inclusive): %d\n", sb.data_size));
 		return INVALID_BLOCK;
 	}
 	
-	int original_root = sb.free_list_head;
+	return write_block_range(sb.data_block_offset + data_block_num - 1, offset, write_buf, size);
+}
+
+/* Marks a data block as free in its group's block bitmap
+ *
+ * Note that data blocks are 1-indexed. 1 is the first data block,
+ * and 0 is not a valid data block
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - FS hasn't been set up yet
+ *   INVALID_BLOCK      - not a valid data block in our fs, or it was already free
+ *   SUCCESS            - block was freed
+ */
+int data_free(int data_block_num){
+	return data_free_run(data_block_num, 1);
+}
+
+/* Marks count contiguous data blocks starting at first as free. Each group the run
+ * covers has its bitmap and descriptor read and written once, however many of its
+ * blocks are freed. Nothing in a group is freed unless every block of the run in it
+ * is allocated. Blocks shared with another file only have their share count dropped
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - FS hasn't been set up yet
+ *   INVALID_BLOCK      - the run isn't inside our fs, or some block in it was already free
+ *   SUCCESS            - the blocks were freed
+ */
+int data_free_run(int first, int count){
+	superblock sb;
 
-	int cur_loc = original_root;
-	freelist_node cur_node;
+	int ret = read_superblock(&sb);
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: data_free_run: read_superblock failed\n"));
+		ERR(fprintf(stderr, "  ret: %d\n", ret));
+		return DISC_UNINITIALIZED;
+	}
+	
+	if (first <= 0 || count <= 0 || count > sb.data_size || first > sb.data_size - count + 1){
+		ERR(fprintf(stderr, "ERR: data_free_run: run invalid\n"));
+		ERR(fprintf(stderr, "  first:           %d\n", first));
+		ERR(fprintf(stderr, "  count:           %d\n", count));
+		ERR(fprintf(stderr, "  min (exclusive): %d\n", 0));
+		ERR(fprintf(stderr, "  max (inclusive): %d\n", sb.data_size));
+		return INVALID_BLOCK;
+	}
 	
-	DEBUG(DB_DATAFREE, printf("DEBUG: data_free: scanning freelist for spot\n"));
-	DEBUG(DB_DATAFREE, printf("  cur_loc: %d\n", cur_loc));
+	uint8_t bitmap[BLOCK_SIZE];
+	uint8_t counts[REFCOUNT_BLOCKS * BLOCK_SIZE];
+	group_desc gd;
+	int group, bit, here, i, shared, run;
 	
-	/* Scan the free list until the end */
-	int i;
-	while(cur_loc != INVALID_DATA){
-		/* Read the free list node */
-		data_read(cur_loc, &cur_node);
+	while (count > 0){
+		group = (first - 1) / sb.blocks_per_group;
+		
+		pthread_mutex_lock(&group_locks[group]);
+		
+		read_group_desc(group, &gd);
+		bit = first - gd.first_block;
+		here = MIN(count, (int)gd.num_blocks - bit);
+		
+		data_read(gd.block_bitmap, bitmap);
 		
-		/* Scan it for a spot to put our free'd block on */
-		for (i = 0; i < ADDR_PER_NODE; i++){
-			if (cur_node.addr[i] == INVALID_DATA){
-				DEBUG(DB_DATAFREE, printf("DEBUG: data_free: found a spot\n"));
-				DEBUG(DB_DATAFREE, printf("  cur_loc:          %d\n", cur_loc));
-				DEBUG(DB_DATAFREE, printf("  i:                %d\n", i));
-				
-				cur_node.addr[i] = data_block_num;
-				data_write(cur_loc, &cur_node);
-				return SUCCESS;
+		DEBUG(DB_DATAFREE, printf("DEBUG: data_free_run: clearing bits\n"));
+		DEBUG(DB_DATAFREE, printf("  first: %d\n", first));
+		DEBUG(DB_DATAFREE, printf("  count: %d\n", here));
+		DEBUG(DB_DATAFREE, printf("  group: %d\n", group));
+		DEBUG(DB_DATAFREE, printf("  bit:   %d\n", bit));
+		
+		for (i = 0; i < here; i++){
+			if (!bitmap_test(bitmap, bit + i)){
+				pthread_mutex_unlock(&group_locks[group]);
+				ERR(fprintf(stderr, "ERR: data_free_run: block is already free\n"));
+				ERR(fprintf(stderr, "  data_block_num: %d\n", first + i));
+				return INVALID_BLOCK;
+			}
+		}
+		
+		/* Shared blocks lose an owner instead of being freed */
+		if (gd.refcount_table != 0){
+			for (i = 0; i < REFCOUNT_BLOCKS; i++){
+				data_read(gd.refcount_table + i, &counts[i * BLOCK_SIZE]);
+			}
+		}
+		shared = 0;
+		run = 0;
+		for (i = 0; i < here; i++){
+			if (gd.refcount_table != 0 && counts[bit + i] > 0){
+				counts[bit + i]--;
+				shared++;
+				if (run > 0){
+					data_discard_note(first + i - run, run);
+				}
+				run = 0;
+				continue;
+			}
+			bitmap_clear(bitmap, bit + i);
+			run++;
+		}
+		if (run > 0){
+			data_discard_note(first + here - run, run);
+		}
+		data_write(gd.block_bitmap, bitmap);
+		if (shared > 0){
+			for (i = 0; i < REFCOUNT_BLOCKS; i++){
+				data_write(gd.refcount_table + i, &counts[i * BLOCK_SIZE]);
 			}
 		}
 		
-		/* If it's full, go to the next one */
-		cur_loc = cur_node.next;
+		gd.free_blocks += here - shared;
+		ret = write_group_desc(group, &gd);
+		pthread_mutex_unlock(&group_locks[group]);
+		
+		if (ret != SUCCESS){
+			return ret;
+		}
 		
-		DEBUG(DB_DATAFREE, printf("  cur_loc: %d\n", cur_loc));
+		first += here;
+		count -= here;
 	}
 	
-	/* Hit the end of the free list without finding a spot to put our
-	 * newly free'd node. Thus, we're going to transform the current block
-	 * into a new node for the freelist:
-	 */
-	memset(&cur_node, INVALID_DATA, sizeof(freelist_node));
-
-	/* It becomes the new root */
-	sb.free_list_head = data_block_num;
-	cur_node.next = original_root;
-	
-	DEBUG(DB_DATAFREE, printf("DEBUG: data_free: couldn't find a spot, creating new head\n"));
-	DEBUG(DB_DATAFREE, printf("  sb.free_list_head: %d\n", sb.free_list_head));
-	DEBUG(DB_DATAFREE, printf("  cur_node.next:     %d\n", cur_node.next));
-
-	/* Write the changes to disk */
-	data_write(data_block_num, &cur_node);
-	write_superblock(&sb);
-
 	return SUCCESS;
 }
 
-/* Finds a data block from the freelist and initializes it to
- * new_data. Puts the data block found in data_block_num
+/* Finds a free data block and initializes it to new_data. Puts the data block
+ * found in data_block_num. The search starts at the first group
  *
  * Note that data blocks are 1-indexed. 1 is the first data block,
  * and 0 is not a valid data block
@@ -759,87 +1608,851 @@ int data_free(int data_block_num){
  *   SUCCESS            - a block was found and returned
  */
 int data_allocate(void* new_data, int* data_block_num){
+	return data_allocate_near(new_data, INVALID_DATA, data_block_num);
+}
+
+/* Finds a free data block as close after goal as possible and initializes it to
+ * new_data. Puts the data block found in data_block_num. If goal is INVALID_DATA,
+ * the search starts at the first group
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - FS hasn't been set up yet
+ *   DATA_FULL          - filesystem is full
+ *   SUCCESS            - a block was found and returned
+ */
+int data_allocate_near(void* new_data, int goal, int* data_block_num){
+	int count;
+	int ret = data_allocate_run(1, goal, data_block_num, &count);
+	if (ret != SUCCESS){
+		return ret;
+	}
+	
+	return data_write(*data_block_num, new_data);
+}
+
+/* Allocates up to want data blocks that are contiguous on disk, without writing
+ * anything to them. The search starts at goal and stays in goal's group if it can,
+ * then moves on to the following groups. A run never crosses groups, so it may come
+ * up short: first is set to the first block and count to how many were taken
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - FS hasn't been set up yet
+ *   INT_NULL           - first or count is null
+ *   DATA_FULL          - there are no free data blocks
+ *   SUCCESS            - at least one block was allocated
+ */
+int data_allocate_run(int want, int goal, int* first, int* count){
 	superblock sb;
 
 	int ret = read_superblock(&sb);
 	if (ret != SUCCESS){
-		ERR(fprintf(stderr, "ERR: data_allocate: read_superblock failed\n"));
+		ERR(fprintf(stderr, "ERR: data_allocate_run: read_superblock failed\n"));
 		ERR(fprintf(stderr, "  ret: %d\n", ret));
 		return DISC_UNINITIALIZED;
 	}
 	
-	if (sb.free_list_head == INVALID_DATA){
-		ERR(fprintf(stderr, "ERR: data_allocate: data blocks are full\n"));
-		return DATA_FULL;
+	if (first == NULL || count == NULL){
+		ERR(fprintf(stderr, "ERR: data_allocate_run: first or count is null\n"));
+		ERR(fprintf(stderr, "  first: %p\n", first));
+		ERR(fprintf(stderr, "  count: %p\n", count));
+		return INT_NULL;
 	}
 	
-	/* Look at the first node of the freelist */
-	freelist_node cur;
-	data_read(sb.free_list_head, &cur);
-	
-	DEBUG(DB_DATAALL, printf("DEBUG: data_allocate: checking freelist head\n"));
-	DEBUG(DB_DATAALL, printf("  sb.free_list_head: %d\n", sb.free_list_head));
+	if (goal <= 0 || goal > sb.data_size){
+		goal = 1;
+	}
 	
-	/* Scan its addresses */
-	int i;
-	*data_block_num = sb.free_list_head;
-	for (i = 0; i < ADDR_PER_NODE; i++){
-		/* If a free node is found, give the block to the user and update the node */
-		if (cur.addr[i] != INVALID_DATA){
-			*data_block_num = cur.addr[i];
-			cur.addr[i] = INVALID_DATA;
-			data_write(sb.free_list_head, &cur);
-			
-			DEBUG(DB_DATAALL, printf("  i:                 %d\n", i));
-			DEBUG(DB_DATAALL, printf("  *data_block_num:   %d\n", *data_block_num));
+	int start_group = (goal - 1) / sb.blocks_per_group;
+	int i, group, start;
+	for (i = 0; i < sb.num_groups; i++){
+		group = (start_group + i) % sb.num_groups;
+		start = (i == 0) ? (goal - 1) % sb.blocks_per_group : 0;
+		
+		if (group_allocate(group, start, want, first, count) == SUCCESS){
+			DEBUG(DB_DATAALL, printf("DEBUG: data_allocate_run: took a run\n"));
+			DEBUG(DB_DATAALL, printf("  goal:   %d\n", goal));
+			DEBUG(DB_DATAALL, printf("  *first: %d\n", *first));
+			DEBUG(DB_DATAALL, printf("  *count: %d\n", *count));
 			
-			return data_write(*data_block_num, new_data);
+			return SUCCESS;
 		}
 	}
 	
-	/* Otherwise, give the user the head of the free list and update sb */
-	sb.free_list_head = cur.next;
-	write_superblock(&sb);
-	
-	DEBUG(DB_DATAALL, printf("DEBUG: data_allocate: giving user the old freelist head\n"));
-	DEBUG(DB_DATAALL, printf("  sb.free_list_head: %d\n", sb.free_list_head));
-	DEBUG(DB_DATAALL, printf("  *data_block_num:   %d\n", *data_block_num));
-	
-	return data_write(*data_block_num, new_data);
+	ERR(fprintf(stderr, "ERR: data_allocate_run: data blocks are full\n"));
+	return DATA_FULL;
 }
 
-/* Reads the superblock into the provided object, if it exists
- *
- * This function assumes the disk hasn't been messed with. If you manually set
- * disk instead of calling mkfs or leaving disk NULL, this isn't guaranteed to work right
+/* Allocates up to want contiguous blocks from group's block bitmap, starting with the
+ * first free block at or after bit start of the group and wrapping around to the
+ * front of the group. first is set to the first data block and count to how many
+ * were taken. Only the group's lock is held, so allocations in other groups can go
+ * on at the same time. Blocks whose free hasn't committed yet are passed over, since
+ * file data is written to them in place
  *
  * Returns:
- *   DISC_UNINITIALIZED - no disk
- *   BUF_NULL           - superblock buffer is null
- *   SUCCESS            - read the superblock
+ *   DISC_UNINITIALIZED - FS hasn't been set up yet
+ *   BAD_GROUP          - not a valid group in this fs
+ *   DATA_FULL          - the group has no free blocks
+ *   SUCCESS            - at least one block was allocated
  */
-int read_superblock(superblock* sb){
-	if (sb == NULL){
-		ERR(fprintf(stderr, "ERR: read_superblock: sb is null\n"));
-		ERR(fprintf(stderr, "  sb: %p\n", sb));
-		return BUF_NULL;
+int group_allocate(int group, int start, int want, int* first, int* count){
+	group_desc gd;
+	int ret = read_group_desc(group, &gd);
+	if (ret != SUCCESS){
+		return ret;
 	}
 	
-	/* Read the cached superblock, if it exists */
-	if (cached_superblock != NULL){
-		DEBUG(DB_READSB, printf("DEBUG: read_superblock: read a cached superblock\n"));
-		memcpy(sb, cached_superblock, sizeof(superblock));
-		return SUCCESS;
+	pthread_mutex_lock(&group_locks[group]);
+	read_group_desc(group, &gd);
+	if (gd.free_blocks == 0){
+		pthread_mutex_unlock(&group_locks[group]);
+		return DATA_FULL;
 	}
 	
-	uint8_t temp_buffer[BLOCK_SIZE * SUPERBLOCK_SIZE];
+	/* Searched with the uncommitted frees hidden, but only the real bitmap is written */
+	uint8_t bitmap[BLOCK_SIZE];
+	uint8_t avail[BLOCK_SIZE];
+	data_read(gd.block_bitmap, bitmap);
+	memcpy(avail, bitmap, BLOCK_SIZE);
+	group_hide_uncommitted(&gd, avail);
+	
+	start = MIN(MAX(start, 0), gd.num_blocks);
+	int bit = bitmap_find_zero(avail, start, gd.num_blocks);
+	if (bit == -1){
+		bit = bitmap_find_zero(avail, 0, start);
+	}
+	if (bit == -1){
+		pthread_mutex_unlock(&group_locks[group]);
+		return DATA_FULL;
+	}
 	
-	/* Read the superblock into temp_buffer, one block at a time */
-	int i, ret;
-	for (i = 0; i < SUPERBLOCK_SIZE; i++){
-		/* Read a block and check the return value */
-		ret = read_block(i, &temp_buffer[BLOCK_SIZE * i]);
-		if (ret != SUCCESS){
+	*count = 0;
+	while (*count < want && bit + *count < gd.num_blocks && !bitmap_test(avail, bit + *count)){
+		bitmap_set(bitmap, bit + *count);
+		(*count)++;
+	}
+	data_write(gd.block_bitmap, bitmap);
+	
+	gd.free_blocks -= *count;
+	ret = write_group_desc(group, &gd);
+	pthread_mutex_unlock(&group_locks[group]);
+	
+	*first = gd.first_block + bit;
+	return ret;
+}
+
+/* Allocates want data blocks that are all contiguous on disk, without writing anything
+ * to them. Unlike data_allocate_run the run is never short: the first free run of at
+ * least want blocks is taken, looking from goal onwards through the groups
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - FS hasn't been set up yet
+ *   INT_NULL           - first is null
+ *   DATA_FULL          - no group has want free blocks in a row
+ *   SUCCESS            - first was set to the first of the want blocks
+ */
+int data_allocate_contig(int want, int goal, int* first){
+	superblock sb;
+
+	int ret = read_superblock(&sb);
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: data_allocate_contig: read_superblock failed\n"));
+		ERR(fprintf(stderr, "  ret: %d\n", ret));
+		return DISC_UNINITIALIZED;
+	}
+	
+	if (first == NULL){
+		ERR(fprintf(stderr, "ERR: data_allocate_contig: first is null\n"));
+		return INT_NULL;
+	}
+	
+	if (want <= 0 || want > sb.blocks_per_group){
+		return DATA_FULL;
+	}
+	if (goal <= 0 || goal > sb.data_size){
+		goal = 1;
+	}
+	
+	int start_group = (goal - 1) / sb.blocks_per_group;
+	int i, group, start;
+	for (i = 0; i < sb.num_groups; i++){
+		group = (start_group + i) % sb.num_groups;
+		start = (i == 0) ? (goal - 1) % sb.blocks_per_group : 0;
+		
+		if (group_allocate_contig(group, start, want, first) == SUCCESS){
+			DEBUG(DB_DATAALL, printf("DEBUG: data_allocate_contig: took a run\n"));
+			DEBUG(DB_DATAALL, printf("  goal:   %d\n", goal));
+			DEBUG(DB_DATAALL, printf("  want:   %d\n", want));
+			DEBUG(DB_DATAALL, printf("  *first: %d\n", *first));
+			
+			return SUCCESS;
+		}
+	}
+	
+	return DATA_FULL;
+}
+
+/* Allocates want contiguous blocks from group's block bitmap, taking the first free run
+ * at least that long at or after bit start of the group, then wrapping around to the
+ * front of the group. Blocks whose free hasn't committed yet are passed over
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - FS hasn't been set up yet
+ *   BAD_GROUP          - not a valid group in this fs
+ *   DATA_FULL          - the group has no free run of want blocks
+ *   SUCCESS            - first was set to the first of the want blocks
+ */
+int group_allocate_contig(int group, int start, int want, int* first){
+	group_desc gd;
+	int ret = read_group_desc(group, &gd);
+	if (ret != SUCCESS){
+		return ret;
+	}
+	
+	pthread_mutex_lock(&group_locks[group]);
+	read_group_desc(group, &gd);
+	if (gd.free_blocks < want){
+		pthread_mutex_unlock(&group_locks[group]);
+		return DATA_FULL;
+	}
+	
+	uint8_t bitmap[BLOCK_SIZE];
+	uint8_t avail[BLOCK_SIZE];
+	data_read(gd.block_bitmap, bitmap);
+	memcpy(avail, bitmap, BLOCK_SIZE);
+	group_hide_uncommitted(&gd, avail);
+	
+	/* Two passes: from start to the end of the group, then from the front */
+	start = MIN(MAX(start, 0), gd.num_blocks);
+	int pass, bit, run_end, end;
+	int found = -1;
+	for (pass = 0; pass < 2 && found == -1; pass++){
+		bit = (pass == 0) ? start : 0;
+		end = (pass == 0) ? gd.num_blocks : start;
+		while (bit < end){
+			bit = bitmap_find_zero(avail, bit, end);
+			if (bit == -1){
+				break;
+			}
+			
+			run_end = bit + 1;
+			while (run_end < gd.num_blocks && run_end - bit < want && !bitmap_test(avail, run_end)){
+				run_end++;
+			}
+			if (run_end - bit == want){
+				found = bit;
+				break;
+			}
+			bit = run_end;
+		}
+	}
+	if (found == -1){
+		pthread_mutex_unlock(&group_locks[group]);
+		return DATA_FULL;
+	}
+	
+	for (bit = found; bit < found + want; bit++){
+		bitmap_set(bitmap, bit);
+	}
+	data_write(gd.block_bitmap, bitmap);
+	
+	gd.free_blocks -= want;
+	ret = write_group_desc(group, &gd);
+	pthread_mutex_unlock(&group_locks[group]);
+	
+	*first = gd.first_block + found;
+	return ret;
+}
+
+/* Counts the data blocks that are currently free, from the free counts kept
+ * in the group descriptors
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - FS hasn't been set up yet
+ *   INT_NULL           - free_blocks is null
+ *   SUCCESS            - free_blocks was set
+ */
+int data_count_free(int* free_blocks){
+	superblock sb;
+
+	int ret = read_superblock(&sb);
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: data_count_free: read_superblock failed\n"));
+		ERR(fprintf(stderr, "  ret: %d\n", ret));
+		return DISC_UNINITIALIZED;
+	}
+	
+	if (free_blocks == NULL){
+		ERR(fprintf(stderr, "ERR: data_count_free: free_blocks is null\n"));
+		ERR(fprintf(stderr, "  free_blocks: %p\n", free_blocks));
+		return INT_NULL;
+	}
+	
+	*free_blocks = 0;
+	
+	group_desc gd;
+	int group;
+	for (group = 0; group < sb.num_groups; group++){
+		read_group_desc(group, &gd);
+		*free_blocks += gd.free_blocks;
+	}
+	
+	return SUCCESS;
+}
+
+/* Gives group a table of share counts, all 0, if it doesn't have one yet. The table
+ * goes in the group itself if there's room
+ *
+ * Returns:
+ *   BAD_GROUP          - not a valid group in this fs
+ *   DATA_FULL          - there's nowhere to put the table
+ *   SUCCESS            - the group has a table
+ */
+int refcount_table_create(int group){
+	group_desc gd;
+	int ret = read_group_desc(group, &gd);
+	if (ret != SUCCESS){
+		return ret;
+	}
+	if (gd.refcount_table != 0){
+		return SUCCESS;
+	}
+	
+	int first;
+	ret = data_allocate_contig(REFCOUNT_BLOCKS, gd.first_block, &first);
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: refcount_table_create: no room for the table\n"));
+		ERR(fprintf(stderr, "  group: %d\n", group));
+		return ret;
+	}
+	
+	uint8_t zeros[BLOCK_SIZE];
+	memset(zeros, 0, BLOCK_SIZE);
+	int i;
+	for (i = 0; i < REFCOUNT_BLOCKS; i++){
+		data_write(first + i, zeros);
+	}
+	
+	/* Someone else may have got there first */
+	pthread_mutex_lock(&group_locks[group]);
+	read_group_desc(group, &gd);
+	if (gd.refcount_table == 0){
+		gd.refcount_table = first;
+		ret = write_group_desc(group, &gd);
+		first = 0;
+	}
+	pthread_mutex_unlock(&group_locks[group]);
+	
+	if (first != 0){
+		data_free_run(first, REFCOUNT_BLOCKS);
+	}
+	
+	return ret;
+}
+
+/* Adds an owner to each of count allocated data blocks starting at first, so that
+ * they're shared with one more file. If it can't be done for every block, it isn't
+ * done for any
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - FS hasn't been set up yet
+ *   INVALID_BLOCK      - the run isn't inside our fs, or some block in it is free
+ *   TOO_MANY_REFS      - some block in the run already has REFCOUNT_MAX extra owners
+ *   DATA_FULL          - there's nowhere to put a group's table of share counts
+ *   SUCCESS            - every block in the run has one more owner
+ */
+int data_share_run(int first, int count){
+	superblock sb;
+
+	int ret = read_superblock(&sb);
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: data_share_run: read_superblock failed\n"));
+		ERR(fprintf(stderr, "  ret: %d\n", ret));
+		return DISC_UNINITIALIZED;
+	}
+	
+	if (first <= 0 || count <= 0 || count > sb.data_size || first > sb.data_size - count + 1){
+		ERR(fprintf(stderr, "ERR: data_share_run: run invalid\n"));
+		ERR(fprintf(stderr, "  first: %d\n", first));
+		ERR(fprintf(stderr, "  count: %d\n", count));
+		return INVALID_BLOCK;
+	}
+	
+	uint8_t bitmap[BLOCK_SIZE];
+	uint8_t counts[REFCOUNT_BLOCKS * BLOCK_SIZE];
+	group_desc gd;
+	int group, bit, here, i;
+	int done = 0;
+	
+	while (done < count){
+		group = (first + done - 1) / sb.blocks_per_group;
+		ret = refcount_table_create(group);
+		if (ret != SUCCESS){
+			break;
+		}
+		
+		pthread_mutex_lock(&group_locks[group]);
+		
+		read_group_desc(group, &gd);
+		bit = first + done - gd.first_block;
+		here = MIN(count - done, (int)gd.num_blocks - bit);
+		
+		data_read(gd.block_bitmap, bitmap);
+		for (i = 0; i < REFCOUNT_BLOCKS; i++){
+			data_read(gd.refcount_table + i, &counts[i * BLOCK_SIZE]);
+		}
+		
+		for (i = 0; i < here && ret == SUCCESS; i++){
+			if (!bitmap_test(bitmap, bit + i)){
+				ERR(fprintf(stderr, "ERR: data_share_run: block is free\n"));
+				ERR(fprintf(stderr, "  data_block_num: %d\n", first + done + i));
+				ret = INVALID_BLOCK;
+			}
+			else if (counts[bit + i] == REFCOUNT_MAX){
+				ret = TOO_MANY_REFS;
+			}
+		}
+		if (ret == SUCCESS){
+			for (i = 0; i < here; i++){
+				counts[bit + i]++;
+			}
+			for (i = 0; i < REFCOUNT_BLOCKS; i++){
+				data_write(gd.refcount_table + i, &counts[i * BLOCK_SIZE]);
+			}
+		}
+		
+		pthread_mutex_unlock(&group_locks[group]);
+		
+		if (ret != SUCCESS){
+			break;
+		}
+		done += here;
+	}
+	
+	/* Give back the owners already added in earlier groups */
+	if (ret != SUCCESS && done > 0){
+		data_free_run(first, done);
+	}
+	
+	return ret;
+}
+
+/* Sets refs to the number of owners data block data_block_num has past the first,
+ * which is 0 unless it's shared
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - FS hasn't been set up yet
+ *   INT_NULL           - refs is null
+ *   INVALID_BLOCK      - not a valid data block in our fs
+ *   SUCCESS            - refs was set
+ */
+int data_refcount(int data_block_num, int* refs){
+	superblock sb;
+
+	int ret = read_superblock(&sb);
+	if (ret != SUCCESS){
+		return DISC_UNINITIALIZED;
+	}
+	
+	if (refs == NULL){
+		ERR(fprintf(stderr, "ERR: data_refcount: refs is null\n"));
+		return INT_NULL;
+	}
+	*refs = 0;
+	
+	if (data_block_num <= 0 || data_block_num > sb.data_size){
+		ERR(fprintf(stderr, "ERR: data_refcount: data_block_num invalid\n"));
+		ERR(fprintf(stderr, "  data_block_num: %d\n", data_block_num));
+		return INVALID_BLOCK;
+	}
+	
+	group_desc gd;
+	int group = (data_block_num - 1) / sb.blocks_per_group;
+	read_group_desc(group, &gd);
+	if (gd.refcount_table == 0){
+		return SUCCESS;
+	}
+	
+	uint8_t counts[BLOCK_SIZE];
+	int bit = data_block_num - gd.first_block;
+	pthread_mutex_lock(&group_locks[group]);
+	ret = data_read(gd.refcount_table + bit / BLOCK_SIZE, counts);
+	pthread_mutex_unlock(&group_locks[group]);
+	
+	*refs = counts[bit % BLOCK_SIZE];
+	return ret;
+}
+
+/* Queues count data blocks from data_block_num that were just freed to be discarded, once
+ * the transaction freeing them has committed. Blocks freed one after another by the same
+ * transaction are merged into one range. Called by data_free_run with the blocks' group
+ * locked. Without the background thread only uncommitted frees are kept, so that the
+ * allocators and data_trim stay off them
+ *
+ * Returns:
+ *   SUCCESS
+ */
+int data_discard_note(int data_block_num, int count){
+	/* Without a handle the bitmap went straight to disk, so the free is already durable */
+	int commit;
+	pthread_mutex_lock(&journal_lock);
+	commit = (journal_handles > 0) ? journal_commits : journal_commits - 1;
+	pthread_mutex_unlock(&journal_lock);
+	int committed = discard_committed_before();
+	
+	pthread_mutex_lock(&discard_lock);
+	
+	int i, kept;
+	if (!discard_enabled){
+		kept = 0;
+		for (i = 0; i < discard_pending_size; i++){
+			if (discard_pending[i].commit >= committed){
+				discard_pending[kept++] = discard_pending[i];
+			}
+			else{
+				discard_pending_blocks -= discard_pending[i].count;
+			}
+		}
+		discard_pending_size = kept;
+	}
+	
+	discard_range* last = (discard_pending_size > 0) ? &discard_pending[discard_pending_size - 1] : NULL;
+	if (last != NULL && last->commit == commit && last->first + last->count == data_block_num){
+		last->count += count;
+	}
+	else if (last != NULL && last->commit == commit && data_block_num + count == last->first){
+		last->first -= count;
+		last->count += count;
+	}
+	else{
+		discard_pending_size++;
+		discard_pending = realloc(discard_pending, discard_pending_size * sizeof(discard_range));
+		discard_pending[discard_pending_size - 1].first = data_block_num;
+		discard_pending[discard_pending_size - 1].count = count;
+		discard_pending[discard_pending_size - 1].commit = commit;
+	}
+	discard_pending_blocks += count;
+	
+	if (discard_enabled && discard_pending_blocks >= DISCARD_BATCH){
+		pthread_cond_signal(&discard_wake);
+	}
+	
+	pthread_mutex_unlock(&discard_lock);
+	return SUCCESS;
+}
+
+/* Discards every queued range whose free has committed. The ranges are sorted and
+ * merged first, so neighbouring frees from different transactions become one discard.
+ * Blocks that have been allocated again since are skipped. The number of blocks
+ * discarded is added to discarded
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - FS hasn't been set up yet
+ *   INT_NULL           - discarded is null
+ *   SUCCESS            - the committed ranges were discarded
+ */
+int data_discard_flush(int* discarded){
+	if (discarded == NULL){
+		ERR(fprintf(stderr, "ERR: data_discard_flush: discarded is null\n"));
+		return INT_NULL;
+	}
+	
+	superblock sb;
+	if (read_superblock(&sb) != SUCCESS){
+		return DISC_UNINITIALIZED;
+	}
+	
+	/* Take the committed ranges off the queue */
+	int committed = discard_committed_before();
+	pthread_mutex_lock(&discard_lock);
+	discard_range* ready = malloc(MAX(discard_pending_size, 1) * sizeof(discard_range));
+	int num_ready = 0;
+	int i, kept = 0;
+	for (i = 0; i < discard_pending_size; i++){
+		if (discard_pending[i].commit < committed){
+			ready[num_ready++] = discard_pending[i];
+			discard_pending_blocks -= discard_pending[i].count;
+		}
+		else{
+			discard_pending[kept++] = discard_pending[i];
+		}
+	}
+	discard_pending_size = kept;
+	pthread_mutex_unlock(&discard_lock);
+	
+	qsort(ready, num_ready, sizeof(discard_range), discard_range_compare);
+	
+	int first, end, block, group, group_end;
+	i = 0;
+	while (i < num_ready){
+		first = ready[i].first;
+		end = ready[i].first + ready[i].count;
+		for (i++; i < num_ready && ready[i].first <= end; i++){
+			end = MAX(end, ready[i].first + ready[i].count);
+		}
+		
+		/* Ranges can cross groups, but each group is discarded under its own lock */
+		for (block = first; block < end; block = group_end){
+			group = (block - 1) / sb.blocks_per_group;
+			group_end = MIN(end, group_first_block(group) + sb.blocks_per_group);
+			group_discard(group, block - group_first_block(group), group_end - group_first_block(group), 1, discarded);
+		}
+	}
+	
+	free(ready);
+	return SUCCESS;
+}
+
+/* Discards every free run of at least min_blocks data blocks, like fstrim. Anything
+ * freed so far is committed first, so nothing that a crash could bring back is lost.
+ * The number of blocks discarded is put in trimmed
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - FS hasn't been set up yet
+ *   INT_NULL           - trimmed is null
+ *   SUCCESS            - every free run was discarded
+ */
+int data_trim(int min_blocks, int* trimmed){
+	if (trimmed == NULL){
+		ERR(fprintf(stderr, "ERR: data_trim: trimmed is null\n"));
+		return INT_NULL;
+	}
+	*trimmed = 0;
+	
+	superblock sb;
+	if (read_superblock(&sb) != SUCCESS){
+		ERR(fprintf(stderr, "ERR: data_trim: read_superblock failed\n"));
+		return DISC_UNINITIALIZED;
+	}
+	
+	journal_sync();
+	
+	group_desc gd;
+	int group;
+	for (group = 0; group < sb.num_groups; group++){
+		read_group_desc(group, &gd);
+		group_discard(group, 0, gd.num_blocks, MAX(min_blocks, 1), trimmed);
+	}
+	
+	/* What was waiting and committed has just been discarded along with everything else */
+	int committed = discard_committed_before();
+	pthread_mutex_lock(&discard_lock);
+	int i, kept = 0;
+	for (i = 0; i < discard_pending_size; i++){
+		if (discard_pending[i].commit >= committed){
+			discard_pending[kept++] = discard_pending[i];
+		}
+		else{
+			discard_pending_blocks -= discard_pending[i].count;
+		}
+	}
+	discard_pending_size = kept;
+	pthread_mutex_unlock(&discard_lock);
+	
+	DEBUG(DB_DISCARD, printf("DEBUG: data_trim: trimmed\n"));
+	DEBUG(DB_DISCARD, printf("  min_blocks: %d\n", min_blocks));
+	DEBUG(DB_DISCARD, printf("  trimmed:    %d\n", *trimmed));
+	
+	return SUCCESS;
+}
+
+/* Discards the runs of at least min_blocks free blocks between bits start and end of
+ * group's block bitmap, with the group locked so nothing can be allocated from them
+ * meanwhile. Blocks whose free hasn't committed yet count as in use. The number of
+ * blocks discarded is added to discarded
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - FS hasn't been set up yet
+ *   BAD_GROUP          - not a valid group
+ *   SUCCESS            - the free runs were discarded
+ */
+int group_discard(int group, int start, int end, int min_blocks, int* discarded){
+	superblock sb;
+	if (read_superblock(&sb) != SUCCESS){
+		return DISC_UNINITIALIZED;
+	}
+	if (group < 0 || group >= sb.num_groups){
+		ERR(fprintf(stderr, "ERR: group_discard: group invalid\n"));
+		ERR(fprintf(stderr, "  group: %d\n", group));
+		return BAD_GROUP;
+	}
+	
+	pthread_mutex_lock(&group_locks[group]);
+	
+	group_desc gd;
+	read_group_desc(group, &gd);
+	start = MAX(start, 0);
+	end = MIN(end, gd.num_blocks);
+	
+	uint8_t bitmap[BLOCK_SIZE];
+	data_read(gd.block_bitmap, bitmap);
+	group_hide_uncommitted(&gd, bitmap);
+	
+	int run_start, run_end;
+	int bit = start;
+	while (bit < end){
+		run_start = bitmap_find_zero(bitmap, bit, end);
+		if (run_start == -1){
+			break;
+		}
+		
+		run_end = run_start;
+		while (run_end < end && !bitmap_test(bitmap, run_end)){
+			run_end++;
+		}
+		
+		if (run_end - run_start >= min_blocks){
+			disk_discard(sb.data_block_offset + gd.first_block + run_start - 1, run_end - run_start);
+			*discarded += run_end - run_start;
+		}
+		bit = run_end;
+	}
+	
+	pthread_mutex_unlock(&group_locks[group]);
+	return SUCCESS;
+}
+
+/* Sets the bits of bitmap, a copy of gd's block bitmap, for the blocks of the group
+ * whose free hasn't committed yet. Until it has, a crash would bring them back to
+ * their old owner, so they can't be discarded or handed to anyone else. The caller
+ * must hold the group's lock */
+void group_hide_uncommitted(group_desc* gd, uint8_t* bitmap){
+	int committed = discard_committed_before();
+	int i, block, first, end;
+	pthread_mutex_lock(&discard_lock);
+	for (i = 0; i < discard_pending_size; i++){
+		if (discard_pending[i].commit < committed){
+			continue;
+		}
+		first = MAX(discard_pending[i].first, (int)gd->first_block);
+		end = MIN(discard_pending[i].first + discard_pending[i].count, (int)(gd->first_block + gd->num_blocks));
+		for (block = first; block < end; block++){
+			bitmap_set(bitmap, block - gd->first_block);
+		}
+	}
+	pthread_mutex_unlock(&discard_lock);
+}
+
+/* Returns the value of journal_commits that frees are committed below. Without a
+ * journal, every free is on disk as soon as it's made */
+int discard_committed_before(){
+	if (journal_size == 0){
+		return INT32_MAX;
+	}
+	
+	pthread_mutex_lock(&journal_lock);
+	int committed = journal_commits;
+	pthread_mutex_unlock(&journal_lock);
+	
+	return committed;
+}
+
+/* Orders discard ranges by their first block, for qsort */
+int discard_range_compare(const void* a, const void* b){
+	return ((discard_range*)a)->first - ((discard_range*)b)->first;
+}
+
+/* Forgets every queued free, when the disk they were on goes away */
+void discard_reset(){
+	pthread_mutex_lock(&discard_lock);
+	free(discard_pending);
+	discard_pending = NULL;
+	discard_pending_size = 0;
+	discard_pending_blocks = 0;
+	pthread_mutex_unlock(&discard_lock);
+}
+
+/* Starts the background discard thread, if discard_enabled is set
+ *
+ * Returns:
+ *   UNEXPECTED_ERROR - the thread couldn't be created
+ *   SUCCESS          - the thread is running, or discarding is off
+ */
+int discard_start(){
+	if (!discard_enabled || discard_running){
+		return SUCCESS;
+	}
+	
+	discard_running = TRUE;
+	if (pthread_create(&discard_thread, NULL, discard_main, NULL) != 0){
+		ERR(fprintf(stderr, "ERR: discard_start: pthread_create failed\n"));
+		discard_running = FALSE;
+		return UNEXPECTED_ERROR;
+	}
+	
+	return SUCCESS;
+}
+
+/* Stops the background discard thread and waits for it to finish the ranges it's on */
+void discard_stop(){
+	if (!discard_running){
+		return;
+	}
+	
+	pthread_mutex_lock(&discard_lock);
+	discard_running = FALSE;
+	pthread_cond_signal(&discard_wake);
+	pthread_mutex_unlock(&discard_lock);
+	
+	pthread_join(discard_thread, NULL);
+}
+
+/* Body of the background discard thread. Wakes up every DISCARD_INTERVAL seconds, or
+ * when enough frees are waiting, and discards whatever has committed */
+void* discard_main(void* arg){
+	struct timespec wake;
+	int discarded = 0;
+	
+	pthread_mutex_lock(&discard_lock);
+	while (discard_running){
+		clock_gettime(CLOCK_REALTIME, &wake);
+		wake.tv_sec += DISCARD_INTERVAL;
+		pthread_cond_timedwait(&discard_wake, &discard_lock, &wake);
+		if (!discard_running){
+			break;
+		}
+		
+		pthread_mutex_unlock(&discard_lock);
+		data_discard_flush(&discarded);
+		pthread_mutex_lock(&discard_lock);
+	}
+	pthread_mutex_unlock(&discard_lock);
+	
+	return NULL;
+}
+
+/* Reads the superblock into the provided object, if it exists
+ *
+ * This function assumes the disk hasn't been messed with. If you manually set
+ * disk instead of calling mkfs or leaving disk NULL, this isn't guaranteed to work right
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - no disk
+ *   BUF_NULL           - superblock buffer is null
+ *   SUCCESS            - read the superblock
+ */
+int read_superblock(superblock* sb){
+	if (sb == NULL){
+		ERR(fprintf(stderr, "ERR: read_superblock: sb is null\n"));
+		ERR(fprintf(stderr, "  sb: %p\n", sb));
+		return BUF_NULL;
+	}
+	
+	/* Read the cached superblock, if it exists */
+	if (cached_superblock != NULL){
+		DEBUG(DB_READSB, printf("DEBUG: read_superblock: read a cached superblock\n"));
+		memcpy(sb, cached_superblock, sizeof(superblock));
+		return SUCCESS;
+	}
+	
+	uint8_t temp_buffer[BLOCK_SIZE * SUPERBLOCK_SIZE];
+	
+	/* Read the superblock into temp_buffer, one block at a time */
+	int i, ret;
+	for (i = 0; i < SUPERBLOCK_SIZE; i++){
+		/* Read a block and check the return value */
+		ret = read_block(i, &temp_buffer[BLOCK_SIZE * i]);
+		if (ret != SUCCESS){
 			ERR(fprintf(stderr, "ERR: read_superblock: read_block failed\n"));
 			ERR(fprintf(stderr, "  ret: %d\n", ret));
 			return DISC_UNINITIALIZED;
@@ -852,6 +2465,12 @@ int read_superblock(superblock* sb){
 	}
 	
 	memcpy(sb, temp_buffer, sizeof(superblock));
+	
+	/* Keep it cached for next time, like write_superblock does */
+	cached_superblock = malloc(sizeof(superblock));
+	if (cached_superblock != NULL){
+		memcpy(cached_superblock, sb, sizeof(superblock));
+	}
 
 	return SUCCESS;
 }
@@ -882,6 +2501,7 @@ int write_superblock(superblock* sb){
 	
 	/* Put the suberblock into a block-size buffer */
 	uint8_t temp_buffer[BLOCK_SIZE * SUPERBLOCK_SIZE];
+	memset(temp_buffer, 0, sizeof(temp_buffer));
 	memcpy(temp_buffer, sb, sizeof(superblock));
 	
 	/* Write the superblock to disk, one block at a time */
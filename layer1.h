@@ -3,31 +3,63 @@
 
 #define READNODE_NULL -2
 #define INODE_NUM_OUT_OF_RANGE -3
-/* The minimum number of blocks we can possibly make a valid FS on */
-#define MIN_IBITMAP 1
-#define MIN_INODES 1
-#define MIN_DATA 1
-#define MIN_BLOCKS (SUPERBLOCK_SIZE + MIN_IBITMAP + MIN_INODES + MIN_DATA)
-
-/* The rough percentage of non-superblock blocks to use for i-nodes */
-#define INODES_PERCENT 0.1
+/* The minimum number of blocks we can possibly make a valid FS on: a group descriptor
+ * table, one group's bitmaps and ichunk index, and the root directory's two data
+ * blocks (one inode chunk and one block of entries) */
+#define MIN_GDT 1
+#define MIN_GROUP_METADATA 3
+#define MIN_DATA 2
+#define MIN_BLOCKS (SUPERBLOCK_SIZE + MIN_GDT + MIN_GROUP_METADATA + MIN_DATA)
 
 /* Size of the superblock, in blocks */
 #define SUPERBLOCK_SIZE ((int)ceil(sizeof(superblock) / (double)BLOCK_SIZE))
 
-/* Dimensions of the freelist nodes */
-#define ADDR_PER_NODE ((BLOCK_SIZE - sizeof(uint32_t)) / sizeof(uint32_t))
-#define REMAINDER ((BLOCK_SIZE - sizeof(uint32_t)) % sizeof(uint32_t))
+/* The data region is split into block groups, each with its own block bitmap, slice
+ * of the ibitmap and slice of the ichunk index. A group's block bitmap is a single
+ * block, so a group can't be bigger than BITS_PER_BLOCK */
+#define BLOCKS_PER_GROUP MIN(8192, BITS_PER_BLOCK)
+#define GROUPS_PER_BLOCK (BLOCK_SIZE / sizeof(group_desc))
+#define GROUPS_REMAINDER (BLOCK_SIZE % sizeof(group_desc))
+
+/* The journal takes up 1/JOURNAL_RATIO of the filesystem, within these limits. Filesystems
+ * too small for the minimum don't get a journal */
+#define JOURNAL_RATIO 32
+#define JOURNAL_MIN_BLOCKS 16
+#define JOURNAL_MAX_BLOCKS 1024
+
+/* mkfs lays out the groups with up to mkfs_threads threads */
+#define MKFS_DEFAULT_THREADS 4
+#define MKFS_MAX_THREADS 64
 
 /* How inodes are packed into blocks */
 #define INODES_PER_BLOCK (BLOCK_SIZE / sizeof(inode))
 #define INODES_REMAINDER (BLOCK_SIZE % sizeof(inode))
-#define NUM_DIRECT 10
+
+/* Inodes are larger than their fields need, so that small files can be stored
+ * inline in the space the extent tree root would otherwise use */
+#define INODE_SIZE 256
+#define INLINE_DATA_SIZE (INODE_SIZE - sizeof(mode_t) - sizeof(uint64_t) - 8 * sizeof(uint32_t))
+
+/* The block map is an extent tree rooted in the inode. The root holds either
+ * extents (depth 0) or index entries pointing at tree nodes in data blocks */
+#define INODE_EXTENTS ((INLINE_DATA_SIZE - sizeof(extent_header)) / sizeof(extent))
+#define INODE_EXTENT_INDEXES ((INLINE_DATA_SIZE - sizeof(extent_header)) / sizeof(extent_index))
+
+/* Inode flags */
+#define INODE_INLINE 0x1 /* contents are in inline_data rather than data blocks */
+#define INODE_SPARSE_MASK 0x6 /* the file's own sparse policy plus one, 0 to follow the mount's */
+#define INODE_SPARSE_SHIFT 1
+#define INODE_SHARED 0x8 /* some of the file's blocks may be shared with other files */
+
+/* Inodes live in chunks (one block of inodes each) allocated from the data region on
+ * demand. The ichunk index maps a chunk number to the data block holding it */
+#define ICHUNKS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+#define ICHUNKS_REMAINDER (BLOCK_SIZE % sizeof(uint32_t))
 
 #define BITS_PER_BLOCK (BLOCK_SIZE * 8)
 
 #define ROOT_INODE 1
-#define ROOT_FREELIST 1
+#define ROOT_GROUP 0
 #define INVALID_INODE 0
 #define INVALID_DATA 0
 
@@ -36,42 +68,151 @@
 
 /* TODO: cache? superblock in program memory? */
 typedef struct __attribute__((__packed__)) superblock {
-	uint32_t ibitmap_block_offset;
-	uint32_t ibitmap_size; //in blocks
+	uint32_t gdt_block_offset;
+	uint32_t gdt_size; //in blocks
 	
-	uint32_t ilist_block_offset;
-	uint32_t ilist_size; //in blocks
+	uint32_t journal_block_offset;
+	uint32_t journal_size; //in blocks, 0 if there's no journal
 
 	uint32_t data_block_offset;
 	uint32_t data_size;
+	
+	uint32_t num_groups;
+	uint32_t blocks_per_group; //the last group may be shorter
+	uint32_t inodes_per_group;
+	uint32_t ibitmap_size; //in blocks, per group
+	uint32_t ichunk_size; //in blocks, per group
 
 	uint32_t total_blocks;
 	uint32_t total_inodes;
 	
-	uint32_t free_list_head; /* TODO: Include free list tail? */
 	uint32_t root_inode;
 	
 	uint32_t block_size;
 	uint32_t inodes_per_block;
 	uint32_t num_inodes;
 	
+	uint32_t orphan_head; //first deleted inode waiting for its blocks to be reclaimed, INVALID_INODE if none
+	
 	uint8_t padding[0];
 } superblock;
 
+/* Describes one block group. The bitmaps and index live at the front of the group,
+ * as data blocks marked in use in the group's own block bitmap */
+typedef struct __attribute__((__packed__)) group_desc {
+	uint32_t block_bitmap; //data block holding the group's block bitmap
+	uint32_t ibitmap; //first data block of the group's slice of the ibitmap
+	uint32_t ichunk_index; //first data block of the group's slice of the ichunk index
+	uint32_t first_block; //first data block in the group
+	uint32_t num_blocks;
+	uint32_t free_blocks;
+	uint32_t free_inodes;
+	uint32_t refcount_table; //first of REFCOUNT_BLOCKS data blocks of share counts, 0 until a block in the group is shared
+} group_desc;
+
+/* Data blocks can be shared between files (by reflinks). Each group that has shared
+ * blocks gets a table of one byte per block, counting its owners past the first, so
+ * blocks that aren't shared count 0. A shared block is only freed when the last owner
+ * lets go of it */
+#define REFCOUNT_BLOCKS ((BLOCKS_PER_GROUP + BLOCK_SIZE - 1) / BLOCK_SIZE)
+#define REFCOUNT_MAX 255
+
+typedef struct __attribute__((__packed__)) gdt_block {
+	group_desc groups[GROUPS_PER_BLOCK];
+	
+	uint8_t padding[GROUPS_REMAINDER];
+} gdt_block;
+
 extern superblock* cached_superblock;
 
+extern int inode_writes;
+
+extern int mkfs_threads;
+
+/* Groups still to be laid out by the threads of init_groups */
+typedef struct mkfs_job {
+	int next_group;
+	int ret; //SUCCESS, or an error one of the threads ran into
+} mkfs_job;
+
+/* In-memory copy of the group descriptor table, and one lock per group. Holding a
+ * group's lock makes its bitmaps, index slice and descriptor consistent, so
+ * allocations in different groups never wait on each other */
+extern group_desc* cached_gdt;
+extern pthread_mutex_t* group_locks;
+extern int group_locks_size;
+extern pthread_mutex_t gdt_lock;
+
+/* Freed data blocks are discarded, which gives their space back to the host, but only
+ * once the transaction that freed them has committed. Until then a crash could bring
+ * them back into use, contents and all. Frees are queued up as ranges, and while
+ * discard_enabled is set a background thread discards the committed ones every
+ * DISCARD_INTERVAL seconds, or sooner once DISCARD_BATCH blocks are waiting */
+#define DISCARD_INTERVAL 5
+#define DISCARD_BATCH 1024
+
+typedef struct discard_range {
+	int first; //first data block
+	int count;
+	int commit; //journal_commits when the blocks were freed
+} discard_range;
+
+extern int discard_enabled;
+extern discard_range* discard_pending;
+extern int discard_pending_size;
+extern int discard_pending_blocks;
+extern pthread_mutex_t discard_lock;
+extern pthread_cond_t discard_wake;
+extern pthread_t discard_thread;
+extern int discard_running;
+
+/* The top bit of an extent's length marks it unwritten: its blocks are allocated
+ * (by fallocate) but have never been written, so they read as 0s */
+#define EXTENT_UNWRITTEN 0x80000000
+#define EXTENT_MAX_LENGTH 0x7fffffff
+#define EXTENT_LENGTH(e) ((e).length & EXTENT_MAX_LENGTH)
+#define EXTENT_IS_UNWRITTEN(e) ((e).length & EXTENT_UNWRITTEN)
+
+/* A run of length file blocks starting at file block logical, stored in the
+ * data blocks starting at physical */
+typedef struct __attribute__((__packed__)) extent {
+	uint32_t logical;
+	uint32_t physical;
+	uint32_t length;
+} extent;
+
+/* Points at the extent tree node holding the file blocks from logical onwards */
+typedef struct __attribute__((__packed__)) extent_index {
+	uint32_t logical;
+	uint32_t child;
+} extent_index;
+
+typedef struct __attribute__((__packed__)) extent_header {
+	uint16_t entries;
+	uint16_t depth; //0 if the node holds extents, otherwise levels of index below it
+} extent_header;
+
 typedef struct __attribute__((__packed__)) inode {
 	mode_t mode;
 	uint32_t links; //currently unused
 	uint32_t uid;
 	uint32_t gid;
-	uint32_t size;
+	uint64_t size; //in bytes, up to MAX_FILE_SIZE
 	uint32_t access_time; //currently unused
 	uint32_t mod_time; //currently unused
-	uint32_t direct_blocks[NUM_DIRECT];
-	uint32_t indirect;
-	uint32_t double_indirect;
-	uint32_t triple_indirect;
+	uint32_t flags;
+	uint32_t group; //block group the inode lives in, and where its data is allocated from
+	uint32_t next_orphan; //next inode on the orphan list, only meaningful while this one is on it
+	union {
+		struct __attribute__((__packed__)) {
+			extent_header ext_header;
+			union {
+				extent extents[INODE_EXTENTS];
+				extent_index ext_index[INODE_EXTENT_INDEXES];
+			};
+		};
+		uint8_t inline_data[INLINE_DATA_SIZE];
+	};
 	
 	uint8_t padding[0];
 } inode;
@@ -82,28 +223,75 @@ typedef struct __attribute__((__packed__)) iblock {
 	uint8_t padding[INODES_REMAINDER];
 } iblock;
 
-typedef struct __attribute__((__packed__)) freelist_node {
-	uint32_t next;
-	uint32_t addr[ADDR_PER_NODE];
+typedef struct __attribute__((__packed__)) ichunk_block {
+	uint32_t chunk[ICHUNKS_PER_BLOCK]; //data block of each chunk, INVALID_DATA if not allocated
 	
-	uint8_t padding[REMAINDER];
-} freelist_node;
+	uint8_t padding[ICHUNKS_REMAINDER];
+} ichunk_block;
 
 int mkfs(int blocks, int root_uid, int root_gid);
 int init_superblock(int blocks);
-int init_freelist();
-int init_ibitmap();
+int init_groups();
+void* init_groups_worker(void* arg);
+int init_group(int group);
+int write_gdt();
+int alloc_group_cache(int num_groups);
+int mount_fs();
+int snapshot_mount(int id);
+int snapshot_unmount();
 int create_dir_base(int* inode_num, mode_t mode, int uid, int gid, int parent_inum);
 
+int read_group_desc(int group, group_desc* gd);
+int write_group_desc(int group, group_desc* gd);
+int inode_group(int inode_num);
+int data_group(int data_block_num);
+int group_first_block(int group);
+int find_group_dir(int parent_group);
+
+int bitmap_find_zero(uint8_t* bitmap, int start, int end);
+int bitmap_test(uint8_t* bitmap, int bit);
+void bitmap_set(uint8_t* bitmap, int bit);
+void bitmap_clear(uint8_t* bitmap, int bit);
+
 int inode_read(int inode_num, inode* read_node);
 int inode_write(int inode_num, inode* modified);
 int inode_free(int inode_num);
 int inode_create(inode* new_node, int* inode_num);
+int inode_create_in_group(inode* new_node, int group, int* inode_num);
+int ibitmap_take(int group, int from, int* local);
+int ibitmap_put(int group, int local);
+int ichunk_lookup(int chunk_num, int create, int* data_block_num);
+int ichunk_release(int chunk_num);
 
 int data_read(int data_block_num, void* read_buf);
 int data_write(int data_block_num, void* write_buf);
+int data_write_direct(int data_block_num, void* write_buf);
+int data_write_range(int data_block_num, int offset, void* write_buf, int size);
 int data_free(int data_block_num);
+int data_free_run(int first, int count);
 int data_allocate(void* new_data, int* data_block_num);
+int data_allocate_near(void* new_data, int goal, int* data_block_num);
+int data_allocate_run(int want, int goal, int* first, int* count);
+int group_allocate(int group, int start, int want, int* first, int* count);
+int data_allocate_contig(int want, int goal, int* first);
+int group_allocate_contig(int group, int start, int want, int* first);
+int data_count_free(int* free_blocks);
+
+int refcount_table_create(int group);
+int data_share_run(int first, int count);
+int data_refcount(int data_block_num, int* refs);
+
+int data_discard_note(int data_block_num, int count);
+int data_discard_flush(int* discarded);
+int data_trim(int min_blocks, int* trimmed);
+int group_discard(int group, int start, int end, int min_blocks, int* discarded);
+void group_hide_uncommitted(group_desc* gd, uint8_t* bitmap);
+int discard_committed_before();
+int discard_range_compare(const void* a, const void* b);
+void discard_reset();
+int discard_start();
+void discard_stop();
+void* discard_main(void* arg);
 
 int read_superblock(superblock* sb);
 int write_superblock(superblock* sb);
@@ -2,6 +2,11 @@
 #include "layer0.h"
 #include "layer1.h"
 #include "layer2.h"
+#ifdef __AVX2__
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 //TODO: not currently bothering with link count, dev, times
 //TODO: assuming file paths do not contain ., .., or a / at the end
@@ -15,6 +20,31 @@ int oft_inodes_size = 0;
 oft_fd* oft_fds = NULL;
 int oft_fds_size = 0;
 
+/* Pages written with delayed allocation, waiting for data blocks */
+int delalloc_enabled = FALSE;
+dirty_inode* dirty_inodes = NULL;
+int dirty_inodes_size = 0;
+
+/* Held by every FUSE operation, and by the background threads for each batch of their
+ * work, so that no two of them change the filesystem at once. Inode chunks, the
+ * superblock and the OFT are all changed by reading them in and writing them back */
+pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Deleted files waiting for the reaper to give their blocks back */
+int orphan_async = FALSE;
+pthread_mutex_t orphan_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t orphan_wake = PTHREAD_COND_INITIALIZER;
+pthread_t orphan_reaper_thread;
+int orphan_reaper_running = FALSE;
+int orphan_blocks_reclaimed = 0;
+
+/* When write_i frees blocks of 0s, for files that don't have a policy of their own */
+int sparse_policy = SPARSE_ALWAYS;
+
+/* Bumped by every change to a block map, which makes every extent_cursor stale */
+uint32_t extent_generation = 0;
+int extent_node_reads = 0;
+
 /* Adds an item to the OFT
  *
  * Returns:
@@ -41,6 +71,8 @@ int oft_add(int inode, int flags){
 		n.inum = inode;
 		n.ref = 1;
 		n.pending_deletion = FALSE;
+		memset(&n.cursor, 0, sizeof(extent_cursor));
+		memset(&n.wbuf, 0, sizeof(write_buffer));
 		memcpy(&oft_inodes[oft_inodes_size - 1], &n, sizeof(oft_inode));
 	}
 	
@@ -73,11 +105,14 @@ int oft_add(int inode, int flags){
 }
 
 /* Removes an item from the OFT. If it is pending deletion and
- * the last reference, it will be deleted.
+ * the last reference, it will be deleted. Otherwise closing the last
+ * reference writes out anything left in its write buffer
  *
  * Returns:
  *   TRUE  - fd was removed from both OFT entries
  *   FALSE - fd couldn't be found in an OFT entry
+ *   INT   - fd was removed, but what was left in the write buffer couldn't be
+ *           written out and is lost: the error oft_flush_buffer returned
  */
 int oft_remove(int fd){
 	/* Remove from table 2 */
@@ -105,22 +140,40 @@ int oft_remove(int fd){
 	}
 	
 	/* Remove from table 1 */
+	int ret = TRUE;
 	oft_inode n;
 	for (i = 0; i < oft_inodes_size; i++){
 		n = oft_inodes[i];
 		if (n.inum == inode){
 			n.ref--;
 			if (n.ref == 0){
+				/* A file about to be deleted has no use for what's buffered */
 				if (n.pending_deletion == TRUE){
+					oft_inodes[i].wbuf.size = 0;
 					del(inode);
 				}
+				else if (n.wbuf.size > 0){
+					journal_begin();
+					ret = oft_flush_buffer(inode);
+					journal_end();
+					if (ret != SUCCESS){
+						ERR(fprintf(stderr, "ERR: oft_remove: write buffer lost\n"));
+						ERR(fprintf(stderr, "  inum: %d\n", inode));
+						ERR(fprintf(stderr, "  ret:  %d\n", ret));
+					}
+					else{
+						ret = TRUE;
+					}
+				}
+				free(n.wbuf.data);
+				
 				/* Remove from table by moving rest back + calling realloc */
 				if (i + 1 < oft_inodes_size){
 					memmove(&oft_inodes[i], &oft_inodes[i + 1], sizeof(oft_inode) * (oft_inodes_size - i - 1));
 				}
 				oft_inodes_size--;
 				oft_inodes = realloc(oft_inodes, oft_inodes_size * sizeof(oft_inode));
-				return TRUE;
+				return ret;
 			}
 			memcpy(&oft_inodes[i], &n, sizeof(oft_inode));
 			return TRUE;
@@ -177,6 +230,457 @@ int oft_lookup(int fd, int* inode, int* flags){
 	return FALSE;
 }
 
+/* Sets cursor to the one kept for inum in the OFT, if inum is open, so that a file read
+ * or written in order picks up where the last call left off. Otherwise the cursor
+ * starts out empty */
+void oft_get_cursor(int inum, extent_cursor* cursor){
+	int i;
+	for (i = 0; i < oft_inodes_size; i++){
+		if (oft_inodes[i].inum == inum){
+			memcpy(cursor, &oft_inodes[i].cursor, sizeof(extent_cursor));
+			return;
+		}
+	}
+	
+	memset(cursor, 0, sizeof(extent_cursor));
+}
+
+/* Keeps cursor in the OFT entry of inum, if inum is open */
+void oft_put_cursor(int inum, extent_cursor* cursor){
+	int i;
+	for (i = 0; i < oft_inodes_size; i++){
+		if (oft_inodes[i].inum == inum){
+			memcpy(&oft_inodes[i].cursor, cursor, sizeof(extent_cursor));
+			return;
+		}
+	}
+}
+
+/* Writes size bytes of buf to inum at offset like write_i, except that while inum is
+ * open, writes smaller than a block that carry on from the last one are gathered in
+ * its write buffer and only given to write_i once the buffer reaches the end of its
+ * block. A write that doesn't carry on from the buffer writes it out first
+ *
+ * Anything that goes wrong writing out the buffer is only found out then, so it may
+ * be returned by a later call, or by oft_flush_buffer. The buffer keeps its bytes
+ * until they have been written, so a later flush can try again
+ *
+ * Returns:
+ *   BUF_NULL     - buf is null
+ *   FILE_TOO_BIG - the write would go past the largest file size
+ *   DATA_FULL    - no data blocks left for the buffer
+ *   ssize_t      - bytes written or buffered
+ */
+ssize_t oft_write(int inum, void* buf, off_t offset, size_t size){
+	if (buf == NULL){
+		ERR(fprintf(stderr, "ERR: oft_write: buf is null\n"));
+		return BUF_NULL;
+	}
+	if (offset < 0 || size > MAX_FILE_SIZE || offset > MAX_FILE_SIZE - (off_t)size){
+		ERR(fprintf(stderr, "ERR: oft_write: write is past the largest file size\n"));
+		ERR(fprintf(stderr, "  offset: %lld\n", (long long)offset));
+		ERR(fprintf(stderr, "  size:   %llu\n", (unsigned long long)size));
+		return FILE_TOO_BIG;
+	}
+	
+	int i;
+	for (i = 0; i < oft_inodes_size; i++){
+		if (oft_inodes[i].inum == inum){
+			break;
+		}
+	}
+	if (i == oft_inodes_size){
+		return write_i(inum, buf, offset, size);
+	}
+	
+	ssize_t ret;
+	write_buffer* wb = &oft_inodes[i].wbuf;
+	if (wb->size > 0 && offset != wb->offset + wb->size){
+		ret = oft_flush_buffer(inum);
+		if (ret != SUCCESS){
+			return ret;
+		}
+	}
+	
+	size_t done = 0;
+	int room, n;
+	while (done < size){
+		if (wb->size == 0){
+			if (size - done < BLOCK_SIZE && wb->data == NULL){
+				wb->data = malloc(BLOCK_SIZE);
+			}
+			
+			/* Whole blocks gain nothing from the buffer, and without one the
+			 * rest is written straight through */
+			if (size - done >= BLOCK_SIZE || wb->data == NULL){
+				ret = write_i(inum, (uint8_t*)buf + done, offset + done, size - done);
+				if (ret < 0){
+					return (done > 0) ? (ssize_t)done : ret;
+				}
+				return done + ret;
+			}
+			wb->offset = offset + done;
+		}
+		
+		room = BLOCK_SIZE - (wb->offset % BLOCK_SIZE) - wb->size;
+		n = MIN((size_t)room, size - done);
+		memcpy(&wb->data[wb->size], (uint8_t*)buf + done, n);
+		wb->size += n;
+		done += n;
+		
+		/* Bytes of this call that are still buffered after a failed flush are taken
+		 * back out, so they aren't counted as written */
+		if (n == room){
+			ret = oft_flush_buffer(inum);
+			if (ret != SUCCESS){
+				n = MIN(n, wb->size);
+				wb->size -= n;
+				done -= n;
+				return (done > 0) ? (ssize_t)done : ret;
+			}
+		}
+	}
+	
+	return size;
+}
+
+/* Gives whatever is in the write buffer of inum to write_i. Does nothing if inum
+ * isn't open or its buffer is empty. Whatever write_i doesn't write stays buffered
+ *
+ * Returns:
+ *   SUCCESS      - the buffer is empty
+ *   DATA_FULL    - no data blocks left for the buffer
+ *   INT          - the error write_i returned
+ */
+int oft_flush_buffer(int inum){
+	int i;
+	for (i = 0; i < oft_inodes_size; i++){
+		if (oft_inodes[i].inum == inum){
+			break;
+		}
+	}
+	if (i == oft_inodes_size || oft_inodes[i].wbuf.size == 0){
+		return SUCCESS;
+	}
+	
+	/* Marked empty while write_i runs, since it comes back here before it writes */
+	write_buffer* wb = &oft_inodes[i].wbuf;
+	int size = wb->size;
+	wb->size = 0;
+	
+	ssize_t ret = write_i(inum, wb->data, wb->offset, size);
+	if (ret >= size){
+		return SUCCESS;
+	}
+	
+	/* Keep whatever didn't make it to disk */
+	int written = MAX(ret, 0);
+	memmove(wb->data, &wb->data[written], size - written);
+	wb->offset += written;
+	wb->size = size - written;
+	
+	ERR(fprintf(stderr, "ERR: oft_flush_buffer: write_i failed\n"));
+	ERR(fprintf(stderr, "  inum: %d\n", inum));
+	ERR(fprintf(stderr, "  ret:  %zd\n", ret));
+	return (ret < 0) ? ret : DATA_FULL;
+}
+
+/* Returns where the data in the write buffer of inum ends, which is past the end of
+ * the file when it's been appended to, or 0 if nothing is buffered */
+off_t oft_buffered_end(int inum){
+	int i;
+	for (i = 0; i < oft_inodes_size; i++){
+		if (oft_inodes[i].inum == inum){
+			return (oft_inodes[i].wbuf.size > 0) ? oft_inodes[i].wbuf.offset + oft_inodes[i].wbuf.size : 0;
+		}
+	}
+	
+	return 0;
+}
+
+/* Searches the dirty inode table for inum
+ *
+ * Returns:
+ *   -1  - inum has no dirty pages
+ *   INT - index of inum in dirty_inodes
+ */
+int delalloc_find(int inum){
+	int i;
+	for (i = 0; i < dirty_inodes_size; i++){
+		if (dirty_inodes[i].inum == inum){
+			return i;
+		}
+	}
+	
+	return -1;
+}
+
+/* Looks up the dirty page holding the nth block of inum. If there isn't one and
+ * create is set, a page of all 0s is added for it
+ *
+ * Sets data to the contents of the page, which stay valid until the next time a page
+ * is added or removed
+ *
+ * Returns:
+ *   TRUE  - the page was found or created
+ *   FALSE - the block has no dirty page
+ */
+int delalloc_page(int inum, uint32_t n, int create, uint8_t** data){
+	int index = delalloc_find(inum);
+	if (index == -1){
+		if (!create){
+			return FALSE;
+		}
+		
+		dirty_inodes_size++;
+		dirty_inodes = realloc(dirty_inodes, dirty_inodes_size * sizeof(dirty_inode));
+		index = dirty_inodes_size - 1;
+		dirty_inodes[index].inum = inum;
+		dirty_inodes[index].num_pages = 0;
+		dirty_inodes[index].capacity = 0;
+		dirty_inodes[index].pages = NULL;
+	}
+	dirty_inode* d = &dirty_inodes[index];
+	
+	/* Binary search for the first page at or after n */
+	int low = 0;
+	int high = d->num_pages;
+	int mid;
+	while (low < high){
+		mid = low + (high - low) / 2;
+		if (d->pages[mid].n < n){
+			low = mid + 1;
+		}
+		else{
+			high = mid;
+		}
+	}
+	
+	if (low < d->num_pages && d->pages[low].n == n){
+		*data = d->pages[low].data;
+		return TRUE;
+	}
+	if (!create){
+		return FALSE;
+	}
+	
+	d->num_pages++;
+	if (d->num_pages > d->capacity){
+		d->capacity = MAX(d->capacity * 2, 16);
+		d->pages = realloc(d->pages, d->capacity * sizeof(dirty_page));
+	}
+	memmove(&d->pages[low + 1], &d->pages[low], (d->num_pages - low - 1) * sizeof(dirty_page));
+	d->pages[low].n = n;
+	memset(d->pages[low].data, 0, BLOCK_SIZE);
+	
+	*data = d->pages[low].data;
+	return TRUE;
+}
+
+/* Throws away the dirty page holding the nth block of inum, if there is one
+ *
+ * Returns:
+ *   TRUE  - the page was removed
+ *   FALSE - the block has no dirty page
+ */
+int delalloc_remove_page(int inum, uint32_t n){
+	int index = delalloc_find(inum);
+	if (index == -1){
+		return FALSE;
+	}
+	dirty_inode* d = &dirty_inodes[index];
+	
+	int i;
+	for (i = 0; i < d->num_pages; i++){
+		if (d->pages[i].n == n){
+			break;
+		}
+	}
+	if (i == d->num_pages){
+		return FALSE;
+	}
+	
+	memmove(&d->pages[i], &d->pages[i + 1], (d->num_pages - i - 1) * sizeof(dirty_page));
+	d->num_pages--;
+	
+	/* Once an inode has no pages left it leaves the table */
+	if (d->num_pages == 0){
+		free(d->pages);
+		memmove(&dirty_inodes[index], &dirty_inodes[index + 1], (dirty_inodes_size - index - 1) * sizeof(dirty_inode));
+		dirty_inodes_size--;
+		dirty_inodes = realloc(dirty_inodes, dirty_inodes_size * sizeof(dirty_inode));
+	}
+	
+	return TRUE;
+}
+
+/* Throws away every dirty page of inum, for files whose contents are going away */
+void delalloc_drop(int inum){
+	int index = delalloc_find(inum);
+	if (index == -1){
+		return;
+	}
+	
+	free(dirty_inodes[index].pages);
+	memmove(&dirty_inodes[index], &dirty_inodes[index + 1], (dirty_inodes_size - index - 1) * sizeof(dirty_inode));
+	dirty_inodes_size--;
+	dirty_inodes = realloc(dirty_inodes, dirty_inodes_size * sizeof(dirty_inode));
+}
+
+/* Throws away the dirty pages of inum past the end of a file size bytes long, and clears
+ * the part of the last page past the end
+ */
+void delalloc_truncate(int inum, off_t size){
+	int index = delalloc_find(inum);
+	if (index == -1){
+		return;
+	}
+	dirty_inode* d = &dirty_inodes[index];
+	
+	uint32_t first_gone = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int kept = 0;
+	while (kept < d->num_pages && d->pages[kept].n < first_gone){
+		kept++;
+	}
+	if (kept == 0){
+		delalloc_drop(inum);
+		return;
+	}
+	
+	if (size % BLOCK_SIZE != 0 && d->pages[kept - 1].n == size / BLOCK_SIZE){
+		memset(&d->pages[kept - 1].data[size % BLOCK_SIZE], 0, BLOCK_SIZE - size % BLOCK_SIZE);
+	}
+	d->num_pages = kept;
+}
+
+/* Returns the number of dirty pages inum has */
+int delalloc_count(int inum){
+	int index = delalloc_find(inum);
+	if (index == -1){
+		return 0;
+	}
+	
+	return dirty_inodes[index].num_pages;
+}
+
+/* Gives every dirty page of inum a data block and writes it to disk. Pages are
+ * allocated in file order one after another, so runs of pages get contiguous blocks
+ * and end up as single extents. Pages that couldn't be allocated stay dirty
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - no disk
+ *   BAD_INODE          - inode supplied was bad
+ *   DATA_FULL          - ran out of data blocks before every page was written
+ *   INVALID_BLOCK      - a page couldn't be written to its block
+ *   SUCCESS            - inum has no dirty pages left
+ */
+int delalloc_flush(int inum){
+	int index = delalloc_find(inum);
+	if (index == -1){
+		return SUCCESS;
+	}
+	dirty_inode* d = &dirty_inodes[index];
+	
+	int ret;
+	inode my_inode;
+	ret = inode_read(inum, &my_inode);
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: delalloc_flush: inode_read failed\n"));
+		ERR(fprintf(stderr, "  inum: %d\n", inum));
+		ERR(fprintf(stderr, "  ret:  %d\n", ret));
+		return ret;
+	}
+	
+	/* Each run of consecutive pages asks for all of its blocks at once */
+	int i, j, want, block_addr, count;
+	extent ext;
+	ret = SUCCESS;
+	for (i = 0; i < d->num_pages; i += count){
+		want = 1;
+		while (i + want < d->num_pages && d->pages[i + want].n == d->pages[i].n + want){
+			want++;
+		}
+		
+		ret = data_allocate_run(want, extent_goal(&my_inode, d->pages[i].n), &block_addr, &count);
+		if (ret != SUCCESS){
+			break;
+		}
+		for (j = 0; j < count && ret == SUCCESS; j++){
+			ret = data_write_direct(block_addr + j, d->pages[i + j].data);
+		}
+		if (ret != SUCCESS){
+			data_free_run(block_addr, count);
+			break;
+		}
+		
+		ext.logical = d->pages[i].n;
+		ext.physical = block_addr;
+		ext.length = count;
+		ret = extent_insert(&my_inode, &ext);
+		if (ret != SUCCESS){
+			data_free_run(block_addr, count);
+			break;
+		}
+	}
+	
+	DEBUG(DB_DELALLOC, printf("DEBUG: delalloc_flush: allocated pages\n"));
+	DEBUG(DB_DELALLOC, printf("  inum:      %d\n", inum));
+	DEBUG(DB_DELALLOC, printf("  allocated: %d\n", i));
+	DEBUG(DB_DELALLOC, printf("  pages:     %d\n", d->num_pages));
+	
+	/* Forget the pages that made it to disk */
+	memmove(d->pages, &d->pages[i], (d->num_pages - i) * sizeof(dirty_page));
+	d->num_pages -= i;
+	if (d->num_pages == 0){
+		free(d->pages);
+		memmove(&dirty_inodes[index], &dirty_inodes[index + 1], (dirty_inodes_size - index - 1) * sizeof(dirty_inode));
+		dirty_inodes_size--;
+		dirty_inodes = realloc(dirty_inodes, dirty_inodes_size * sizeof(dirty_inode));
+	}
+	
+	if (i > 0){
+		inode_write(inum, &my_inode);
+	}
+	
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: delalloc_flush: pages left dirty\n"));
+		ERR(fprintf(stderr, "  inum: %d\n", inum));
+		ERR(fprintf(stderr, "  ret:  %d\n", ret));
+		return ret;
+	}
+	
+	return SUCCESS;
+}
+
+/* Flushes the dirty pages of every inode, after writing out every open file's
+ * write buffer
+ *
+ * Returns:
+ *   DATA_FULL - ran out of data blocks before every page was written
+ *   SUCCESS   - there are no dirty pages left
+ */
+int delalloc_flush_all(){
+	int result = SUCCESS;
+	int ret, i;
+	
+	for (i = 0; i < oft_inodes_size; i++){
+		ret = oft_flush_buffer(oft_inodes[i].inum);
+		if (ret != SUCCESS){
+			result = ret;
+		}
+	}
+	
+	/* Walk backwards, since flushed inodes leave the table */
+	for (i = dirty_inodes_size - 1; i >= 0; i--){
+		ret = delalloc_flush(dirty_inodes[i].inum);
+		if (ret != SUCCESS){
+			result = ret;
+		}
+	}
+	
+	return result;
+}
+
 /* Returns the stat structure associated with an inode
  *
  * On inode read failure, returns an empty stat structure
@@ -199,7 +703,7 @@ struct stat get_stat(int inum){
 	s.st_mode = my_inode.mode;
 	s.st_uid = my_inode.uid;
 	s.st_gid = my_inode.gid;
-	s.st_size = my_inode.size;
+	s.st_size = MAX(my_inode.size, oft_buffered_end(inum));
 	
 	return s;
 }
@@ -305,7 +809,8 @@ int mknod_fs(const char *pathname, mode_t mode, int uid, int gid){
 	new_inode.mode &= (0xffff ^ (S_IFDIR));
 	new_inode.uid = uid;
 	new_inode.gid = gid;
-	if ((ret = inode_create(&new_inode, &new_inum)) != SUCCESS){
+	new_inode.flags = INODE_INLINE; /* Files start out inline until they outgrow the inode */
+	if ((ret = inode_create_in_group(&new_inode, inode_group(parent_inum), &new_inum)) != SUCCESS){
 		ERR(fprintf(stderr, "ERR: mknod_fs: no space for new directory\n"));
 		return -ENOSPC;
 	}
@@ -700,7 +1205,8 @@ int add_dirent(int inum, dir_ent* d){
 	return write_i(inum, d, write_offset, sizeof(dir_ent));
 }
 
-/* Deletes an inode and the data associated with it
+/* Deletes an inode and the data associated with it. While orphan_async is set the
+ * inode is only put on the orphan list, and its blocks are reclaimed in the background
  *
  * Returns (normally only SUCCESS):
  *   DISC_UNINITIALIZED  - no disk
@@ -708,6 +1214,14 @@ int add_dirent(int inum, dir_ent* d){
  *   SUCCESS             - file size changed
  */
 int del(int inum){
+	/* Pages that never made it to disk can just be forgotten */
+	delalloc_drop(inum);
+	
+	/* Leave the data for the reaper */
+	if (orphan_async){
+		return orphan_add(inum);
+	}
+	
 	/* Delete the data */
 	int ret = truncate(inum, 0);
 	if (ret != SUCCESS){
@@ -721,58 +1235,442 @@ int del(int inum){
 	return inode_free(inum);
 }
 
-/* Changes a file's size to exactly offset bytes
+/* Puts a deleted inode at the head of the orphan list. The list is threaded through
+ * the inodes and starts in the superblock, so files deleted before a crash are still
+ * found at the next mount. Wakes the reaper to reclaim the inode's blocks
  *
- * Appends 0s to a file if offset > current file size
- *
- * Returns (normally only SUCCESS):
- *   DISC_UNINITIALIZED  - no disk
- *   BAD_INODE           - inode supplied was bad
- *   SUCCESS             - file size changed
+ * Returns:
+ *   DISC_UNINITIALIZED - no disk
+ *   BAD_INODE          - inode supplied was bad
+ *   SUCCESS            - the inode is on the orphan list
  */
-int truncate(int inum, off_t offset){
-	int ret;
+int orphan_add(int inum){
+	superblock sb;
 	inode my_inode;
+	int ret;
+	
+	pthread_mutex_lock(&orphan_lock);
+	
+	ret = read_superblock(&sb);
+	if (ret != SUCCESS){
+		pthread_mutex_unlock(&orphan_lock);
+		return DISC_UNINITIALIZED;
+	}
+	
 	ret = inode_read(inum, &my_inode);
 	if (ret != SUCCESS){
-		ERR(fprintf(stderr, "ERR: read_dir: inode_read failed\n"));
+		ERR(fprintf(stderr, "ERR: orphan_add: inode_read failed\n"));
 		ERR(fprintf(stderr, "  inum: %d\n", inum));
 		ERR(fprintf(stderr, "  ret:  %d\n", ret));
+		pthread_mutex_unlock(&orphan_lock);
 		return ret;
 	}
 	
-	/* Does the file need to be extended */
-	if (offset > my_inode.size){
-		my_inode.size = offset;
-		inode_write(inum, &my_inode);
-		return SUCCESS;
-	}
-
-	/* Shorten the file */
-	int buf_size = my_inode.size - offset;
-
-	uint8_t* buf = malloc(buf_size);
+	my_inode.next_orphan = sb.orphan_head;
+	inode_write(inum, &my_inode);
 	
-	memset(buf, 0, buf_size);
+	sb.orphan_head = inum;
+	write_superblock(&sb);
 	
-	write_i(inum, buf, offset, buf_size);
-
-	free(buf);
-	my_inode.size = offset;
-	inode_write(inum, &my_inode);
+	DEBUG(DB_ORPHAN, printf("DEBUG: orphan_add: inode %d orphaned\n", inum));
+	DEBUG(DB_ORPHAN, printf("  size: %llu\n", (unsigned long long)my_inode.size));
+	
+	pthread_cond_signal(&orphan_wake);
+	pthread_mutex_unlock(&orphan_lock);
 	
 	return SUCCESS;
 }
 
-/* Reads a block of directory entries from a directory into d
+/* Frees up to ORPHAN_BATCH_BLOCKS of the orphan at the head of the list, starting from
+ * the end of the file, as one transaction. Once the orphan has nothing left it comes
+ * off the list and its inode is freed. Orphans aren't in any directory and aren't open,
+ * but their inodes share chunks with live ones, so the caller must hold fs_lock as well
+ * as orphan_lock
  *
- * Returns (normally only SUCCESS):
- *   DISC_UNINITIALIZED  - no disk
- *   BUF_NULL            - one of the given parameters is null
- *   INVALID_PAGE        - page is negative or beyond the end of the file
- *   NOT_DIR             - S_IFDIR bit is not set
- *   MALFORMED_DIRECTORY - the directory is of odd size
- *   SUCCESS             - directory was read successfully
+ * Returns:
+ *   DISC_UNINITIALIZED - no disk
+ *   NO_ORPHANS         - the orphan list is empty
+ *   BAD_INODE          - the orphan list is corrupt
+ *   SUCCESS            - one batch was reclaimed
+ */
+int orphan_reap_locked(){
+	superblock sb;
+	inode my_inode;
+	int ret;
+	
+	ret = read_superblock(&sb);
+	if (ret != SUCCESS){
+		return DISC_UNINITIALIZED;
+	}
+	if (sb.orphan_head == INVALID_INODE){
+		return NO_ORPHANS;
+	}
+	
+	int inum = sb.orphan_head;
+	ret = inode_read(inum, &my_inode);
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: orphan_reap_locked: orphan list is corrupt\n"));
+		ERR(fprintf(stderr, "  inum: %d\n", inum));
+		ERR(fprintf(stderr, "  ret:  %d\n", ret));
+		return BAD_INODE;
+	}
+	
+	journal_begin();
+	
+	/* Free the last batch of blocks. Preallocated blocks past the end go in the first batch */
+	uint32_t blocks = 0;
+	uint32_t start = 0;
+	if (!(my_inode.flags & INODE_INLINE)){
+		blocks = ((uint64_t)my_inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		start = (blocks > ORPHAN_BATCH_BLOCKS) ? blocks - ORPHAN_BATCH_BLOCKS : 0;
+		
+		ret = extent_truncate(&my_inode, start);
+		if (ret != SUCCESS){
+			ERR(fprintf(stderr, "ERR: orphan_reap_locked: extent_truncate failed\n"));
+			ERR(fprintf(stderr, "  inum: %d\n", inum));
+			ERR(fprintf(stderr, "  ret:  %d\n", ret));
+			journal_end();
+			return ret;
+		}
+		orphan_blocks_reclaimed += blocks - start;
+	}
+	
+	if (start > 0){
+		my_inode.size = start * BLOCK_SIZE;
+		inode_write(inum, &my_inode);
+	}
+	else{
+		/* Nothing left, so the inode itself can go */
+		sb.orphan_head = my_inode.next_orphan;
+		write_superblock(&sb);
+		inode_free(inum);
+		
+		DEBUG(DB_ORPHAN, printf("DEBUG: orphan_reap_locked: inode %d reclaimed\n", inum));
+	}
+	
+	return journal_end();
+}
+
+/* Reclaims every orphan on the list before returning. Called after mounting, for
+ * files that were deleted but not yet reclaimed when the filesystem went down.
+ * Snapshots are read only, so their orphans are left alone
+ *
+ * Returns:
+ *   BAD_INODE          - the orphan list is corrupt
+ *   SUCCESS            - the orphan list is empty
+ */
+int orphan_recover(){
+	if (snapshot_view != NO_SNAPSHOT){
+		return SUCCESS;
+	}
+	
+	int ret;
+	pthread_mutex_lock(&fs_lock);
+	pthread_mutex_lock(&orphan_lock);
+	do{
+		ret = orphan_reap_locked();
+	} while (ret == SUCCESS);
+	pthread_mutex_unlock(&orphan_lock);
+	pthread_mutex_unlock(&fs_lock);
+	
+	if (ret != NO_ORPHANS && ret != DISC_UNINITIALIZED){
+		ERR(fprintf(stderr, "ERR: orphan_recover: couldn't empty the orphan list\n"));
+		ERR(fprintf(stderr, "  ret: %d\n", ret));
+		return ret;
+	}
+	
+	return SUCCESS;
+}
+
+/* Starts the background reaper, which reclaims orphans a batch at a time
+ *
+ * Returns:
+ *   UNEXPECTED_ERROR - the thread couldn't be created
+ *   SUCCESS          - the reaper is running
+ */
+int orphan_reaper_start(){
+	if (orphan_reaper_running){
+		return SUCCESS;
+	}
+	
+	orphan_reaper_running = TRUE;
+	if (pthread_create(&orphan_reaper_thread, NULL, orphan_reaper_main, NULL) != 0){
+		ERR(fprintf(stderr, "ERR: orphan_reaper_start: pthread_create failed\n"));
+		orphan_reaper_running = FALSE;
+		return UNEXPECTED_ERROR;
+	}
+	
+	return SUCCESS;
+}
+
+/* Stops the background reaper and waits for it to finish the batch it's on. Orphans
+ * left on the list are reclaimed at the next mount */
+void orphan_reaper_stop(){
+	if (!orphan_reaper_running){
+		return;
+	}
+	
+	pthread_mutex_lock(&orphan_lock);
+	orphan_reaper_running = FALSE;
+	pthread_cond_signal(&orphan_wake);
+	pthread_mutex_unlock(&orphan_lock);
+	
+	pthread_join(orphan_reaper_thread, NULL);
+}
+
+/* Body of the background reaper. Sleeps until there are orphans, then reclaims them
+ * one batch at a time, letting other operations in between batches. fs_lock is taken
+ * before orphan_lock, the same order as an unlink holding fs_lock adding an orphan */
+void* orphan_reaper_main(void* arg){
+	int ret;
+	while (TRUE){
+		pthread_mutex_lock(&fs_lock);
+		pthread_mutex_lock(&orphan_lock);
+		if (!orphan_reaper_running){
+			pthread_mutex_unlock(&orphan_lock);
+			pthread_mutex_unlock(&fs_lock);
+			break;
+		}
+		
+		ret = orphan_reap_locked();
+		pthread_mutex_unlock(&fs_lock);
+		if (ret != SUCCESS){
+			pthread_cond_wait(&orphan_wake, &orphan_lock);
+		}
+		pthread_mutex_unlock(&orphan_lock);
+	}
+	
+	return NULL;
+}
+
+/* Returns whether the size bytes at buf are all 0s. Stops at the first non-zero
+ * word, and checks 64 bytes per step with vector instructions where the compiler
+ * has them */
+int is_zero(const void* buf, size_t size){
+	const uint8_t* p = buf;
+	const uint8_t* end = p + size;
+	
+#ifdef __AVX2__
+	__m256i acc;
+	while (end - p >= 64){
+		acc = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)p), _mm256_loadu_si256((const __m256i*)(p + 32)));
+		if (!_mm256_testz_si256(acc, acc)){
+			return FALSE;
+		}
+		p += 64;
+	}
+#elif defined(__SSE2__)
+	__m128i acc;
+	const __m128i zero = _mm_setzero_si128();
+	while (end - p >= 64){
+		acc = _mm_or_si128(_mm_or_si128(_mm_loadu_si128((const __m128i*)p), _mm_loadu_si128((const __m128i*)(p + 16))),
+		                   _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + 32)), _mm_loadu_si128((const __m128i*)(p + 48))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff){
+			return FALSE;
+		}
+		p += 64;
+	}
+#endif
+	
+	uint64_t word;
+	while (end - p >= sizeof(uint64_t)){
+		memcpy(&word, p, sizeof(uint64_t));
+		if (word != 0){
+			return FALSE;
+		}
+		p += sizeof(uint64_t);
+	}
+	
+	while (p < end){
+		if (*p++ != 0){
+			return FALSE;
+		}
+	}
+	
+	return TRUE;
+}
+
+/* Returns the sparse policy write_i uses for a file: its own, if it has one, otherwise
+ * sparse_policy */
+int sparse_policy_of(inode* inod){
+	int policy = (inod->flags & INODE_SPARSE_MASK) >> INODE_SPARSE_SHIFT;
+	if (policy == 0){
+		return sparse_policy;
+	}
+	
+	return policy - 1;
+}
+
+/* Gives a file a sparse policy of its own, or SPARSE_DEFAULT to have it follow
+ * sparse_policy again
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - no disk
+ *   BAD_INODE          - inode supplied was bad
+ *   BAD_INDEX          - not a sparse policy
+ *   SUCCESS            - the policy was set
+ */
+int sparse_set_policy(int inum, int policy){
+	if (policy != SPARSE_DEFAULT && policy != SPARSE_ALWAYS && policy != SPARSE_ALIGNED && policy != SPARSE_NEVER){
+		ERR(fprintf(stderr, "ERR: sparse_set_policy: bad policy\n"));
+		ERR(fprintf(stderr, "  policy: %d\n", policy));
+		return BAD_INDEX;
+	}
+	
+	inode my_inode;
+	int ret = inode_read(inum, &my_inode);
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: sparse_set_policy: inode_read failed\n"));
+		ERR(fprintf(stderr, "  inum: %d\n", inum));
+		ERR(fprintf(stderr, "  ret:  %d\n", ret));
+		return ret;
+	}
+	
+	my_inode.flags &= ~INODE_SPARSE_MASK;
+	my_inode.flags |= ((policy + 1) << INODE_SPARSE_SHIFT) & INODE_SPARSE_MASK;
+	return inode_write(inum, &my_inode);
+}
+
+/* Changes a file's size to exactly offset bytes
+ *
+ * Appends 0s to a file if offset > current file size
+ *
+ * Returns (normally only SUCCESS):
+ *   DISC_UNINITIALIZED  - no disk
+ *   BAD_INODE           - inode supplied was bad
+ *   DATA_FULL           - no data blocks left to flush the write buffer, move inline
+ *                         data out or unshare the last block
+ *   FILE_TOO_BIG        - offset is negative or past MAX_FILE_SIZE
+ *   SUCCESS             - file size changed
+ */
+int truncate(int inum, off_t offset){
+	if (offset < 0 || offset > MAX_FILE_SIZE){
+		ERR(fprintf(stderr, "ERR: truncate: size is out of range\n"));
+		ERR(fprintf(stderr, "  offset: %lld\n", (long long)offset));
+		return FILE_TOO_BIG;
+	}
+	
+	int ret = oft_flush_buffer(inum);
+	if (ret != SUCCESS){
+		return ret;
+	}
+	
+	inode my_inode;
+	ret = inode_read(inum, &my_inode);
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: read_dir: inode_read failed\n"));
+		ERR(fprintf(stderr, "  inum: %d\n", inum));
+		ERR(fprintf(stderr, "  ret:  %d\n", ret));
+		return ret;
+	}
+	
+	/* Inline files just need their tail cleared, unless they're growing past the inode */
+	if (my_inode.flags & INODE_INLINE){
+		if (offset <= INLINE_DATA_SIZE){
+			if (offset < my_inode.size){
+				memset(&my_inode.inline_data[offset], 0, my_inode.size - offset);
+			}
+			my_inode.size = offset;
+			return inode_write(inum, &my_inode);
+		}
+		
+		ret = inline_to_blocks(inum, &my_inode);
+		if (ret != SUCCESS){
+			return ret;
+		}
+	}
+	
+	/* Does the file need to be extended */
+	if (offset > my_inode.size){
+		my_inode.size = offset;
+		inode_write(inum, &my_inode);
+		return SUCCESS;
+	}
+
+	/* Shorten the file. Dirty pages past the end are thrown away, and every block past
+	 * the end is freed in one pass over the block map */
+	delalloc_truncate(inum, offset);
+	
+	ret = extent_truncate(&my_inode, (offset + BLOCK_SIZE - 1) / BLOCK_SIZE);
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: truncate: extent_truncate failed\n"));
+		ERR(fprintf(stderr, "  inum: %d\n", inum));
+		ERR(fprintf(stderr, "  ret:  %d\n", ret));
+		
+		/* Keep what was unmapped before the failure, so freed blocks aren't left mapped */
+		inode_write(inum, &my_inode);
+		return ret;
+	}
+	
+	/* What's left of the last block past the new end has to read as 0s if the file
+	 * grows again. Preallocated blocks already do */
+	uint32_t physical, run;
+	int unwritten, block_addr;
+	int tail = offset % BLOCK_SIZE;
+	if (tail != 0){
+		ret = extent_lookup(&my_inode, offset / BLOCK_SIZE, &physical, &run, &unwritten);
+		if (ret == SUCCESS && physical != INVALID_DATA && !unwritten){
+			block_addr = physical;
+			if (my_inode.flags & INODE_SHARED){
+				ret = reflink_unshare(&my_inode, offset / BLOCK_SIZE, &block_addr, TRUE);
+			}
+			if (ret == SUCCESS){
+				ret = truncate_tail(&my_inode, block_addr, tail);
+			}
+		}
+		if (ret != SUCCESS){
+			ERR(fprintf(stderr, "ERR: truncate: couldn't clear the last block\n"));
+			ERR(fprintf(stderr, "  inum: %d\n", inum));
+			ERR(fprintf(stderr, "  ret:  %d\n", ret));
+			
+			/* The blocks past the end are already free, so they can't be left mapped */
+			inode_write(inum, &my_inode);
+			return ret;
+		}
+	}
+	
+	if (offset < my_inode.size){
+		my_inode.mode &= (0xffff ^ (S_ISUID | S_ISGID));
+	}
+	my_inode.size = offset;
+	inode_write(inum, &my_inode);
+	
+	return SUCCESS;
+}
+
+/* Writes 0s over the bytes of data block block_addr of the file inod from tail on,
+ * used when the file is cut short part way through the block. Regular files have the
+ * 0s written in place, anything else is read in and written back through the journal
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - no disk
+ *   INVALID_BLOCK      - block_addr isn't a valid data block
+ *   SUCCESS            - the end of the block was cleared
+ */
+int truncate_tail(inode* inod, int block_addr, int tail){
+	if (S_ISREG(inod->mode)){
+		return data_write_range(block_addr, tail, NULL, BLOCK_SIZE - tail);
+	}
+	
+	uint8_t block_buf[BLOCK_SIZE];
+	int ret = data_read(block_addr, &block_buf);
+	if (ret != SUCCESS){
+		return ret;
+	}
+	memset(&block_buf[tail], 0, BLOCK_SIZE - tail);
+	
+	return data_write(block_addr, &block_buf);
+}
+
+/* Reads a block of directory entries from a directory into d
+ *
+ * Returns (normally only SUCCESS):
+ *   DISC_UNINITIALIZED  - no disk
+ *   BUF_NULL            - one of the given parameters is null
+ *   INVALID_PAGE        - page is negative or beyond the end of the file
+ *   NOT_DIR             - S_IFDIR bit is not set
+ *   MALFORMED_DIRECTORY - the directory is of odd size
+ *   SUCCESS             - directory was read successfully
  */
 int read_dir_page(int inum, dirblock* d, int page, int* entries, int* last){
 	if (d == NULL || entries == NULL || last == NULL){
@@ -930,14 +1828,18 @@ int read_dir_whole(int inum, dir_ent* buf){
  *   INVALID_BLOCK      - a data block found was invalid
  *   INT                - upon success, returns number of bytes read
  */
-int read_i(int inum, void* buf, off_t offset, size_t size){
+ssize_t read_i(int inum, void* buf, off_t offset, size_t size){
 	if (buf == NULL){
 		ERR(fprintf(stderr, "ERR: read_i: buf is null\n"));
 		ERR(fprintf(stderr, "  buf: %p\n", buf));
 		return BUF_NULL;
 	}
 	
-	int ret;
+	int ret = oft_flush_buffer(inum);
+	if (ret != SUCCESS){
+		return ret;
+	}
+	
 	inode my_inode;
 	ret = inode_read(inum, &my_inode);
 	if (ret != SUCCESS){
@@ -947,123 +1849,400 @@ int read_i(int inum, void* buf, off_t offset, size_t size){
 	}
 
 	/* If the read position is beyond the end of the file */
-	if (offset >= my_inode.size){
+	if (offset < 0 || (uint64_t)offset >= my_inode.size){
 		return 0;
 	}
 	
 	/* Consider the length we will read */
-	int truncated_size = MIN(my_inode.size - offset, size);
+	size_t truncated_size = MIN(my_inode.size - offset, size);
 	if (truncated_size == 0){
 		return 0;
 	}
 	
-	/* Calculate reading start and end */
-	int start_block = offset / BLOCK_SIZE;
+	/* Inline files are read straight out of the inode */
+	if (my_inode.flags & INODE_INLINE){
+		memcpy(buf, &my_inode.inline_data[offset], truncated_size);
+		return truncated_size;
+	}
+	
+	/* Calculate reading start and end. The last byte is at most MAX_FILE_SIZE - 1, so
+	 * block numbers always fit in 32 bits */
+	uint32_t start_block = offset / BLOCK_SIZE;
 	int start_offset = offset % BLOCK_SIZE;
 
-	int end_block = (offset + truncated_size - 1) / BLOCK_SIZE; //not sure this is correct
+	uint32_t end_block = (offset + truncated_size - 1) / BLOCK_SIZE;
 	int end_size = ((offset + truncated_size - 1) % BLOCK_SIZE) + 1; //1-4096
 	
 	DEBUG(DB_READI, printf("DEBUG: read_i: calculated offsets\n"));
-	DEBUG(DB_READI, printf("  offset:              %d\n", offset));
-	DEBUG(DB_READI, printf("  size:                %d\n", size));
-	DEBUG(DB_READI, printf("  start_block:         %d\n", start_block));
+	DEBUG(DB_READI, printf("  offset:              %lld\n", (long long)offset));
+	DEBUG(DB_READI, printf("  size:                %llu\n", (unsigned long long)size));
+	DEBUG(DB_READI, printf("  start_block:         %u\n", start_block));
 	DEBUG(DB_READI, printf("  start_offset:        %d\n", start_offset));
-	DEBUG(DB_READI, printf("  end_block:           %d\n", end_block));
+	DEBUG(DB_READI, printf("  end_block:           %u\n", end_block));
 	DEBUG(DB_READI, printf("  end_size:            %d\n", end_size));
 
-	int block_addr;
+	int unwritten;
+	uint32_t physical, run, count;
 	uint8_t block_buf[BLOCK_SIZE];
+	uint8_t* page;
+	uint8_t* dest;
+	extent_cursor cursor;
+	oft_get_cursor(inum, &cursor);
+	
+	/* Holes can only be skipped over whole if no dirty page might be sitting in them */
+	int dirty = (delalloc_find(inum) != -1);
 	
 	int read_start = start_offset;
 	uintptr_t read_size = BLOCK_SIZE;
 	uintptr_t bytes_read = 0;
+	uintptr_t length;
 	
 	/* Read blocks */
-	int i;
+	uint32_t i;
 	for (i = start_block; i <= end_block; i++){
 		if (i == end_block){
 			read_size = end_size;
 		}
+		dest = (uint8_t*)buf + bytes_read;
+		length = read_size - read_start;
 		
-		block_addr = get_nth_datablock(&my_inode, i, FALSE, NULL);
-		DEBUG(DB_READI, printf("  block_addr (%06d): %d\n", i, block_addr));
-		
-		ret = data_read(block_addr, block_buf);
-		if (ret != SUCCESS){
-			ERR(fprintf(stderr, "ERR: read_i: data_read failed\n"));
-			ERR(fprintf(stderr, "  block_addr: %d\n", block_addr));
-			return ret;
+		/* Blocks waiting on delayed allocation only exist in memory */
+		if (dirty && delalloc_page(inum, i, FALSE, &page)){
+			memcpy(dest, page + read_start, length);
+		}
+		else{
+			ret = extent_cursor_lookup(&cursor, &my_inode, i, &physical, &run, &unwritten);
+			if (ret != SUCCESS){
+				ERR(fprintf(stderr, "ERR: read_i: extent_lookup failed\n"));
+				ERR(fprintf(stderr, "  i:   %u\n", i));
+				ERR(fprintf(stderr, "  ret: %d\n", ret));
+				return ret;
+			}
+			DEBUG(DB_READI, printf("  block_addr (%06u): %d\n", i, unwritten ? INVALID_DATA : physical));
+			
+			/* Holes, and preallocated blocks that were never written, read as 0s.
+			 * The whole run of them in the range is filled in at once */
+			if (physical == INVALID_DATA || unwritten){
+				count = dirty ? 1 : MIN(run, end_block - i + 1);
+				if (count > 1){
+					length += (uintptr_t)(count - 1) * BLOCK_SIZE;
+					i += count - 1;
+					if (i == end_block){
+						length -= BLOCK_SIZE - end_size;
+					}
+				}
+				memset(dest, 0, length);
+			}
+			/* Whole blocks go straight into buf */
+			else if (length == BLOCK_SIZE){
+				ret = data_read(physical, dest);
+			}
+			else{
+				ret = data_read(physical, block_buf);
+				memcpy(dest, block_buf + read_start, length);
+			}
+			if (ret != SUCCESS){
+				ERR(fprintf(stderr, "ERR: read_i: data_read failed\n"));
+				ERR(fprintf(stderr, "  physical: %u\n", physical));
+				return ret;
+			}
 		}
 		
-		memcpy((void*)((uintptr_t)buf + bytes_read), (void*)((uintptr_t)block_buf + read_start), read_size - read_start);
-		
-		bytes_read += read_size - read_start;
+		bytes_read += length;
 		
 		read_start = 0;
 		read_size = BLOCK_SIZE;
 	}
 	
+	oft_put_cursor(inum, &cursor);
 	return bytes_read;
 }
 
-/* Writes size bytes at offset offset from buf into the file specified by inum
+/* Finds the next data or hole in a file at or after offset, as lseek(2) does with
+ * SEEK_DATA and SEEK_HOLE, and sets result to where it starts. The end of the file
+ * counts as a hole. Preallocated blocks that were never written count as holes,
+ * since they read as 0s
  *
- * Updates inode's size field and clears its SUID and SGID bits
+ * The block map is scanned a whole extent or hole at a time, so the cost goes with
+ * the number of extents rather than the size of the file. Dirty pages are flushed
+ * first so that they show up in the block map
  *
- * Returns (normally only DATA_FULL or INT):
+ * Returns:
  *   DISC_UNINITIALIZED - no disk
- *   BUF_NULL           - buf is null
- *   INVALID_BLOCK      - a data block found was invalid
- *   DATA_FULL          - if a block cannot be written because the FS filled up
- *   INT                - upon success, returns the number of bytes written
+ *   BUF_NULL           - result is null
+ *   BAD_INDEX          - whence isn't SEEK_DATA or SEEK_HOLE
+ *   BAD_INODE          - inode supplied was bad
+ *   NO_DATA            - offset is past the end of the file, or there's no data after it
+ *   SUCCESS            - result was set
  */
-int write_i(int inum, void* buf, off_t offset, size_t size){
-	if (buf == NULL){
-		ERR(fprintf(stderr, "ERR: write_i: buf is null\n"));
-		ERR(fprintf(stderr, "  buf: %p\n", buf));
+int seek_i(int inum, off_t offset, int whence, off_t* result){
+	if (result == NULL){
+		ERR(fprintf(stderr, "ERR: seek_i: result is null\n"));
 		return BUF_NULL;
 	}
+	if (whence != SEEK_DATA && whence != SEEK_HOLE){
+		ERR(fprintf(stderr, "ERR: seek_i: bad whence\n"));
+		ERR(fprintf(stderr, "  whence: %d\n", whence));
+		return BAD_INDEX;
+	}
+	
+	int ret = oft_flush_buffer(inum);
+	if (ret != SUCCESS){
+		return ret;
+	}
+	if (delalloc_count(inum) > 0){
+		ret = delalloc_flush(inum);
+		if (ret != SUCCESS){
+			return ret;
+		}
+	}
 	
-	int ret;
 	inode my_inode;
 	ret = inode_read(inum, &my_inode);
 	if (ret != SUCCESS){
-		ERR(fprintf(stderr, "ERR: write_i: inode_read failed\n"));
+		ERR(fprintf(stderr, "ERR: seek_i: inode_read failed\n"));
 		ERR(fprintf(stderr, "  inum: %d\n", inum));
 		return ret;
 	}
-
-	int original_size = my_inode.size;
 	
-	/* Calculate writing start and end */
-	int start_block = offset / BLOCK_SIZE;
-	int start_offset = offset % BLOCK_SIZE;
-
-	int end_block = (offset + size - 1) / BLOCK_SIZE; //not sure this is correct
-	int end_size = ((offset + size - 1) % BLOCK_SIZE) + 1; //1-4096
+	if (offset < 0 || offset >= my_inode.size){
+		return NO_DATA;
+	}
 	
-	DEBUG(DB_WRITEI, printf("DEBUG: write_i: calculated offsets\n"));
-	DEBUG(DB_WRITEI, printf("  offset:              %d\n", offset));
-	DEBUG(DB_WRITEI, printf("  size:                %d\n", size));
-	DEBUG(DB_WRITEI, printf("  original_size:       %d\n", original_size));
-	DEBUG(DB_WRITEI, printf("  start_block:         %d\n", start_block));
-	DEBUG(DB_WRITEI, printf("  start_offset:        %d\n", start_offset));
-	DEBUG(DB_WRITEI, printf("  end_block:           %d\n", end_block));
-	DEBUG(DB_WRITEI, printf("  end_size:            %d\n", end_size));
-
-	uint8_t zero_block[BLOCK_SIZE];
-	memset(zero_block, 0, BLOCK_SIZE);
+	/* Inline files are all data */
+	if (my_inode.flags & INODE_INLINE){
+		*result = (whence == SEEK_DATA) ? offset : (off_t)my_inode.size;
+		return SUCCESS;
+	}
+	
+	uint32_t physical, run;
+	int unwritten, data;
+	uint64_t n = offset / BLOCK_SIZE;
+	uint64_t end = ((uint64_t)my_inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	while (n < end){
+		ret = extent_lookup(&my_inode, n, &physical, &run, &unwritten);
+		if (ret != SUCCESS){
+			ERR(fprintf(stderr, "ERR: seek_i: extent_lookup failed\n"));
+			ERR(fprintf(stderr, "  n:   %llu\n", (unsigned long long)n));
+			ERR(fprintf(stderr, "  ret: %d\n", ret));
+			return ret;
+		}
+		
+		data = (physical != INVALID_DATA && !unwritten);
+		if (data == (whence == SEEK_DATA)){
+			*result = MIN(MAX(offset, (off_t)(n * BLOCK_SIZE)), (off_t)my_inode.size);
+			return SUCCESS;
+		}
+		
+		n += MAX(run, 1);
+	}
+	
+	if (whence == SEEK_DATA){
+		return NO_DATA;
+	}
+	*result = my_inode.size;
+	return SUCCESS;
+}
+
+/* Reports how a file is laid out on disk, like the FIEMAP ioctl. Starting from file
+ * block start, every run of blocks that is contiguous both in the file and on disk is
+ * put into extents, up to max of them, and found is set to how many there were. Runs
+ * are merged across extent tree entries, so they are what the disk actually holds.
+ * Preallocated runs have FIEMAP_EXTENT_UNWRITTEN set, and the file's last run has
+ * FIEMAP_EXTENT_LAST. If extents is null, found is set to the number of runs instead
+ *
+ * Inline files have no blocks, and so no runs. Dirty pages are flushed first so that
+ * they have a place on disk to report
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - no disk
+ *   INT_NULL           - found is null
+ *   BAD_INODE          - inode supplied was bad
+ *   INVALID_BLOCK      - the extent tree is malformed
+ *   SUCCESS            - found was set
+ */
+int fiemap_i(int inum, uint32_t start, file_extent* extents, int max, int* found){
+	if (found == NULL){
+		ERR(fprintf(stderr, "ERR: fiemap_i: found is null\n"));
+		return INT_NULL;
+	}
+	*found = 0;
+	
+	int ret = oft_flush_buffer(inum);
+	if (ret != SUCCESS){
+		return ret;
+	}
+	if (delalloc_count(inum) > 0){
+		ret = delalloc_flush(inum);
+		if (ret != SUCCESS){
+			return ret;
+		}
+	}
+	
+	inode my_inode;
+	ret = inode_read(inum, &my_inode);
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: fiemap_i: inode_read failed\n"));
+		ERR(fprintf(stderr, "  inum: %d\n", inum));
+		return ret;
+	}
+	if (my_inode.flags & INODE_INLINE){
+		return SUCCESS;
+	}
+	
+	file_extent current;
+	uint32_t physical, run;
+	int unwritten, flags;
+	int have = FALSE;
+	uint64_t n = start;
+	while (n < EXTENT_END){
+		ret = extent_lookup(&my_inode, n, &physical, &run, &unwritten);
+		if (ret != SUCCESS){
+			ERR(fprintf(stderr, "ERR: fiemap_i: extent_lookup failed\n"));
+			ERR(fprintf(stderr, "  n:   %llu\n", (unsigned long long)n));
+			ERR(fprintf(stderr, "  ret: %d\n", ret));
+			return ret;
+		}
+		run = MAX(run, 1);
+		
+		if (physical != INVALID_DATA){
+			flags = unwritten ? FIEMAP_EXTENT_UNWRITTEN : 0;
+			
+			/* Carries straight on from the last run */
+			if (have && current.logical + current.length == n && current.physical + current.length == physical && current.flags == flags){
+				current.length += run;
+			}
+			else{
+				if (have){
+					if (extents != NULL){
+						extents[*found] = current;
+					}
+					(*found)++;
+				}
+				
+				/* No room for any more */
+				if (extents != NULL && *found == max){
+					return SUCCESS;
+				}
+				current.logical = n;
+				current.physical = physical;
+				current.length = run;
+				current.flags = flags;
+				have = TRUE;
+			}
+		}
+		
+		n += run;
+	}
+	
+	if (have){
+		current.flags |= FIEMAP_EXTENT_LAST;
+		if (extents != NULL){
+			extents[*found] = current;
+		}
+		(*found)++;
+	}
+	
+	return SUCCESS;
+}
+
+/* Writes size bytes at offset offset from buf into the file specified by inum
+ *
+ * Updates inode's size field and clears its SUID and SGID bits
+ *
+ * Returns (normally only DATA_FULL or INT):
+ *   DISC_UNINITIALIZED - no disk
+ *   BUF_NULL           - buf is null
+ *   INVALID_BLOCK      - a data block found was invalid
+ *   DATA_FULL          - if a block cannot be written because the FS filled up
+ *   FILE_TOO_BIG       - the write would go past MAX_FILE_SIZE, or offset is negative
+ *   INT                - upon success, returns the number of bytes written
+ */
+ssize_t write_i(int inum, void* buf, off_t offset, size_t size){
+	if (buf == NULL){
+		ERR(fprintf(stderr, "ERR: write_i: buf is null\n"));
+		ERR(fprintf(stderr, "  buf: %p\n", buf));
+		return BUF_NULL;
+	}
+	
+	if (offset < 0 || size > MAX_FILE_SIZE || offset > MAX_FILE_SIZE - (off_t)size){
+		ERR(fprintf(stderr, "ERR: write_i: write is past the largest file size\n"));
+		ERR(fprintf(stderr, "  offset: %lld\n", (long long)offset));
+		ERR(fprintf(stderr, "  size:   %llu\n", (unsigned long long)size));
+		return FILE_TOO_BIG;
+	}
+	if (size == 0){
+		return 0;
+	}
+	
+	/* Whatever was buffered was written first, so it goes in first */
+	int ret = oft_flush_buffer(inum);
+	if (ret != SUCCESS){
+		return ret;
+	}
+	
+	inode my_inode;
+	ret = inode_read(inum, &my_inode);
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: write_i: inode_read failed\n"));
+		ERR(fprintf(stderr, "  inum: %d\n", inum));
+		return ret;
+	}
+
+	/* Inline files are written straight into the inode, as long as they still fit */
+	if (my_inode.flags & INODE_INLINE){
+		if (offset + size <= INLINE_DATA_SIZE){
+			memcpy(&my_inode.inline_data[offset], buf, size);
+			my_inode.size = MAX(my_inode.size, offset + size);
+			my_inode.mode &= (0xffff ^ (S_ISUID | S_ISGID));
+			ret = inode_write(inum, &my_inode);
+			if (ret != SUCCESS){
+				return ret;
+			}
+			return size;
+		}
+		
+		ret = inline_to_blocks(inum, &my_inode);
+		if (ret != SUCCESS){
+			return ret;
+		}
+	}
+	
+	uint64_t original_size = my_inode.size;
+	int delalloc = delalloc_enabled && S_ISREG(my_inode.mode);
+	int policy = sparse_policy_of(&my_inode);
+	
+	/* Calculate writing start and end. The range was checked against MAX_FILE_SIZE,
+	 * so block numbers always fit in 32 bits */
+	uint32_t start_block = offset / BLOCK_SIZE;
+	int start_offset = offset % BLOCK_SIZE;
+
+	uint32_t end_block = (offset + size - 1) / BLOCK_SIZE;
+	int end_size = ((offset + size - 1) % BLOCK_SIZE) + 1; //1-4096
 	
+	DEBUG(DB_WRITEI, printf("DEBUG: write_i: calculated offsets\n"));
+	DEBUG(DB_WRITEI, printf("  offset:              %lld\n", (long long)offset));
+	DEBUG(DB_WRITEI, printf("  size:                %llu\n", (unsigned long long)size));
+	DEBUG(DB_WRITEI, printf("  original_size:       %llu\n", (unsigned long long)original_size));
+	DEBUG(DB_WRITEI, printf("  start_block:         %u\n", start_block));
+	DEBUG(DB_WRITEI, printf("  start_offset:        %d\n", start_offset));
+	DEBUG(DB_WRITEI, printf("  end_block:           %u\n", end_block));
+	DEBUG(DB_WRITEI, printf("  end_size:            %d\n", end_size));
+
 	uint8_t block_buf[BLOCK_SIZE];
+	uint8_t* page;
 	
 	int write_start = start_offset;
 	uintptr_t write_size = BLOCK_SIZE;
 	uintptr_t bytes_written = 0;
-	int created, all_zeros, block_addr;
+	int created, all_zeros, whole, direct, block_addr, unwritten;
+	int result = SUCCESS;
+	uint32_t physical, run, batch, last_whole, done;
+	extent_cursor cursor;
+	oft_get_cursor(inum, &cursor);
 
 	/* Write intermediate full blocks */
-	int i;
+	uint32_t i;
 	for (i = start_block; i <= end_block; i++){
 		//if we're writing a block of 0s, just delete the block and move on
 		//get the data block
@@ -1075,410 +2254,1825 @@ int write_i(int inum, void* buf, off_t offset, size_t size){
 			write_size = end_size;
 		}
 		
-		/* Check to see if we're writing all 0s */
-		if (memcmp((void*)((uintptr_t)buf + write_start), zero_block, write_size - write_start) == 0){
-			all_zeros = TRUE;
+		/* Check to see if we're writing all 0s, unless the policy wouldn't do anything about it */
+		whole = (write_start == 0 && write_size == BLOCK_SIZE);
+		all_zeros = FALSE;
+		if (policy == SPARSE_ALWAYS || (policy == SPARSE_ALIGNED && whole)){
+			all_zeros = is_zero((void*)((uintptr_t)buf + bytes_written), write_size - write_start);
 		}
-		else{
-			all_zeros = FALSE;
+		
+		ret = extent_cursor_lookup(&cursor, &my_inode, i, &physical, &run, &unwritten);
+		if (ret != SUCCESS){
+			ERR(fprintf(stderr, "ERR: write_i: extent_lookup failed\n"));
+			ERR(fprintf(stderr, "  i:   %u\n", i));
+			ERR(fprintf(stderr, "  ret: %d\n", ret));
+			result = ret;
+			break;
+		}
+		
+		/* A run of whole blocks of a regular file going into a hole is given its data
+		 * blocks in one allocation and mapped by one extent */
+		batch = 0;
+		if (!delalloc && S_ISREG(my_inode.mode) && physical == INVALID_DATA && whole && !all_zeros){
+			last_whole = (end_size == BLOCK_SIZE) ? end_block : end_block - 1;
+			batch = 1;
+			while (batch < run && i + batch <= last_whole &&
+			       (policy == SPARSE_NEVER || !is_zero((void*)((uintptr_t)buf + bytes_written + (uintptr_t)batch * BLOCK_SIZE), BLOCK_SIZE))){
+				batch++;
+			}
+		}
+		if (batch > 1){
+			ret = write_run(&my_inode, i, batch, (void*)((uintptr_t)buf + bytes_written), &done);
+			bytes_written += (uintptr_t)done * BLOCK_SIZE;
+			if (ret != SUCCESS){
+				ERR(fprintf(stderr, "ERR: write_i: write_run failed\n"));
+				ERR(fprintf(stderr, "  i:    %u\n", i));
+				ERR(fprintf(stderr, "  done: %u\n", done));
+				ERR(fprintf(stderr, "  ret:  %d\n", ret));
+				result = ret;
+				break;
+			}
+			
+			DEBUG(DB_WRITEI, printf("  blocks %06u-%06u: new run\n", i, i + done - 1));
+			i += done - 1;
+			continue;
 		}
 		
+		/* Blocks that would need a new data block are held as dirty pages until the file is flushed */
+		if (delalloc && (delalloc_page(inum, i, FALSE, &page) || physical == INVALID_DATA)){
+			if (all_zeros && whole){
+				delalloc_remove_page(inum, i);
+			}
+			else{
+				delalloc_page(inum, i, TRUE, &page);
+				memcpy((void*)(page + (uintptr_t)write_start), (void*)((uintptr_t)buf + bytes_written), write_size - write_start);
+				if (policy == SPARSE_ALWAYS && is_zero(page, BLOCK_SIZE)){
+					delalloc_remove_page(inum, i);
+				}
+			}
+			block_addr = 0;
+		}
+		/* Preallocated blocks already read as 0s, so writing 0s to them changes nothing */
+		else if (unwritten && all_zeros){
+			block_addr = physical;
+		}
 		/* If we're writing a block of 0s, just delete it instead */
-		if (all_zeros && write_size == BLOCK_SIZE && write_start == 0){
+		else if (all_zeros && whole){
 			rm_nth_datablock(&my_inode, i);
 			block_addr = 0;
 		}
 		else{
-			/* If the filesystem is full and we aren't writing all zeros */
+			/* Regular files are written in place, so a new block can be built up there
+			 * without being zeroed first, and only the bytes being written are copied */
+			direct = S_ISREG(my_inode.mode);
 			created = FALSE;
-			block_addr = get_nth_datablock(&my_inode, i, TRUE, &created);
+			if (physical != INVALID_DATA){
+				block_addr = physical;
+			}
+			else{
+				block_addr = get_nth_datablock(&my_inode, i, (whole || direct) ? CREATE_UNZEROED : TRUE, &created);
+			}
+			
+			/* A block shared with another file gets a copy of its own to be written */
+			if (block_addr > 0 && !created && (my_inode.flags & INODE_SHARED)){
+				ret = reflink_unshare(&my_inode, i, &block_addr, !whole);
+				if (ret != SUCCESS){
+					ERR(fprintf(stderr, "ERR: write_i: reflink_unshare failed\n"));
+					ERR(fprintf(stderr, "  i:   %u\n", i));
+					ERR(fprintf(stderr, "  ret: %d\n", ret));
+					result = ret;
+					break;
+				}
+			}
+			
+			/* If the filesystem is full and we aren't writing all zeros */
 			if (block_addr == DATA_FULL && !all_zeros){
 				rm_nth_datablock(&my_inode, i);
 				ERR(fprintf(stderr, "ERR: write_i: filesystem full\n"));
-				return DATA_FULL;
+				result = DATA_FULL;
+				break;
 			}
 			/* If the filesystem is full but we are writing all zeros */
 			else if (block_addr == DATA_FULL){
 				rm_nth_datablock(&my_inode, i);
 				block_addr = 0;
 			}
-			/* If the filesystem isn't full */
+			else if (block_addr < 0){
+				ERR(fprintf(stderr, "ERR: write_i: get_nth_datablock failed\n"));
+				ERR(fprintf(stderr, "  i:   %u\n", i));
+				ERR(fprintf(stderr, "  ret: %d\n", block_addr));
+				result = block_addr;
+				break;
+			}
+			/* If we're writing a whole block, just write it directly from buf */
+			else if (whole){
+				ret = file_data_write(&my_inode, block_addr, (void*)((uintptr_t)buf + bytes_written));
+				if (ret != SUCCESS){
+					ERR(fprintf(stderr, "ERR: write_i: data_write failed\n"));
+					ERR(fprintf(stderr, "  block_addr: %d\n", block_addr));
+					result = ret;
+					break;
+				}
+				if (unwritten){
+					extent_mark_written(&my_inode, i);
+				}
+			}
+			/* 0s written over a block that starts out as 0s leave it empty */
+			else if (direct && (created || unwritten) && all_zeros){
+				rm_nth_datablock(&my_inode, i);
+				block_addr = 0;
+			}
+			/* Part of a block of a regular file: write our data in place. A fresh or
+			 * preallocated block gets 0s around it, an existing one keeps the rest */
+			else if (direct){
+				ret = SUCCESS;
+				if (created || unwritten){
+					ret = data_write_range(block_addr, 0, NULL, write_start);
+					if (ret == SUCCESS){
+						ret = data_write_range(block_addr, write_size, NULL, BLOCK_SIZE - write_size);
+					}
+				}
+				if (ret == SUCCESS){
+					ret = data_write_range(block_addr, write_start, (void*)((uintptr_t)buf + bytes_written), write_size - write_start);
+				}
+				if (ret != SUCCESS){
+					ERR(fprintf(stderr, "ERR: write_i: data_write_range failed\n"));
+					ERR(fprintf(stderr, "  block_addr: %d\n", block_addr));
+					result = ret;
+					break;
+				}
+				if (unwritten){
+					extent_mark_written(&my_inode, i);
+				}
+				
+				/* Only a write of 0s can leave an existing block all 0s, so only then is it read back */
+				if (all_zeros && data_read(block_addr, &block_buf) == SUCCESS && is_zero(block_buf, BLOCK_SIZE)){
+					rm_nth_datablock(&my_inode, i);
+					block_addr = 0;
+				}
+			}
+			/* Anything else goes through the journal a block at a time, so read it
+			 * first, add our data, then write it back */
 			else{
-				/* If we're writing a whole block, just write it directly from buf */
-				if (write_size == BLOCK_SIZE && write_start == 0){
-					ret = data_write(block_addr, (void*)((uintptr_t)buf + bytes_written));
+				/* Fresh or preallocated block -> starts out all 0s */
+				if (created || unwritten){
+					memset(block_buf, 0, BLOCK_SIZE);
+				}
+				else{
+					ret = data_read(block_addr, &block_buf);
 					if (ret != SUCCESS){
-						ERR(fprintf(stderr, "ERR: write_i: data_write failed\n"));
+						ERR(fprintf(stderr, "ERR: write_i: data_read failed\n"));
 						ERR(fprintf(stderr, "  block_addr: %d\n", block_addr));
-						ERR(fprintf(stderr, "  block_buf:  %p\n", block_buf));
-						return ret;
+						result = ret;
+						break;
 					}
 				}
-				/* If we aren't writing a whole block, read it first, add our data, then write it back */
+				
+				/* If the resultant block is all 0s, just delete it instead */
+				memcpy((void*)(block_buf + (uintptr_t)write_start), (void*)((uintptr_t)buf + bytes_written), write_size - write_start);
+				if (policy == SPARSE_ALWAYS && is_zero(block_buf, BLOCK_SIZE)){
+					rm_nth_datablock(&my_inode, i);
+					block_addr = 0;
+				}
 				else{
-					/* Fresh block -> starts out all 0s */
-					if (created){
-						memset(block_buf, 0, BLOCK_SIZE);
-					}
-					else{
-						ret = data_read(block_addr, &block_buf);
-						if (ret != SUCCESS){
-							ERR(fprintf(stderr, "ERR: write_i: data_read failed\n"));
-							ERR(fprintf(stderr, "  block_addr: %d\n", block_addr));
-							return ret;
-						}
-					}
-					
-					/* If the resultant block is all 0s, just delete it instead */
-					memcpy((void*)(block_buf + (uintptr_t)write_start), (void*)((uintptr_t)buf + bytes_written), write_size - write_start);
-					if (memcmp(block_buf, zero_block, BLOCK_SIZE) == 0){
-						rm_nth_datablock(&my_inode, i);
-						block_addr = 0;
-					}
-					else{
-						ret = data_write(block_addr, &block_buf);
-						if (ret != SUCCESS){
-							ERR(fprintf(stderr, "ERR: write_i: data_write failed\n"));
-							ERR(fprintf(stderr, "  block_addr: %d\n", block_addr));
-							ERR(fprintf(stderr, "  block_buf:  %p\n", block_buf));
-							return ret;
-						}
+					ret = file_data_write(&my_inode, block_addr, &block_buf);
+					if (ret != SUCCESS){
+						ERR(fprintf(stderr, "ERR: write_i: data_write failed\n"));
+						ERR(fprintf(stderr, "  block_addr: %d\n", block_addr));
+						ERR(fprintf(stderr, "  block_buf:  %p\n", block_buf));
+						result = ret;
+						break;
 					}
 				}
 			}
 		}
 		
-		DEBUG(DB_WRITEI, printf("  block_addr (%06d): %d\n", i, block_addr));
+		DEBUG(DB_WRITEI, printf("  block_addr (%06u): %d\n", i, block_addr));
 		
 		bytes_written += write_size - write_start;
 		
 		write_start = 0;
 		write_size = BLOCK_SIZE;
-		
-		/* Update and write inode */
+	}
+	
+	/* The inode is written back once for the whole call, even if it failed part way,
+	 * so that the blocks mapped before the failure aren't lost */
+	if (bytes_written > 0){
 		my_inode.size = MAX(original_size, offset + bytes_written);
 		my_inode.mode &= (0xffff ^ (S_ISUID | S_ISGID));
-		inode_write(inum, &my_inode);
+	}
+	ret = inode_write(inum, &my_inode);
+	if (result == SUCCESS){
+		result = ret;
+	}
+	if (result != SUCCESS){
+		return result;
+	}
+	
+	oft_put_cursor(inum, &cursor);
+	
+	/* Don't let a single file hold on to too much memory */
+	if (delalloc && delalloc_count(inum) > DELALLOC_MAX_PAGES){
+		ret = delalloc_flush(inum);
+		if (ret != SUCCESS){
+			return ret;
+		}
 	}
 
 	return bytes_written;
 }
 
-/* Frees the blocks associated with the nth block of a file. Does not return
- * an error if the block is already deleted
- *
- * This operation is equivilant (from a file contents perspective) of writing all
- * 0s to a block, except that it doesn't take up room on disk
- *
- * Note that n is zero-indexed. n = 0 will return the first block of the file
+/* Writes the count whole blocks at buf to blocks n onwards of the regular file inod,
+ * which must all be holes. The data blocks are allocated a run at a time, as long as
+ * free space allows, and each run is written before being mapped by a single extent,
+ * so a failure part way never maps a block that wasn't written. done is set to the
+ * number of blocks written. Only inod in memory is updated
  *
  * Returns:
  *   DISC_UNINITIALIZED - no disk
- *   BUF_NULL           - inode is null
- *   INVALID_BLOCK      - an invalid block number was found during the search
- *   SUCCESS            - nth block of file is no longer allocated
+ *   DATA_FULL          - ran out of data blocks, or room for the extent tree
+ *   SUCCESS            - every block was written
  */
-int rm_nth_datablock(inode* inod, off_t n){
-	if (inod == NULL){
-		ERR(fprintf(stderr, "ERR: rm_nth_datablock: inode is null\n"));
-		ERR(fprintf(stderr, "  inod: %p\n", inod));
-		return BUF_NULL;
-	}
-	
-	int num_direct = NUM_DIRECT; //10
-	int single_indirect = num_direct + ADDRESSES_PER_BLOCK; //10 + 1024
-	int double_indirect = single_indirect + ADDRESSES_PER_BLOCK * ADDRESSES_PER_BLOCK; //10 + 1024 + 1048576
-	int triple_indirect = double_indirect + ADDRESSES_PER_BLOCK * ADDRESSES_PER_BLOCK * ADDRESSES_PER_BLOCK;
-	
-	address_block b[3];
-	int offset, next_addr, next_index[3], ret, block_addrs[3];
-	int* from_pointer;
-	int check_start = 0;
-	
-	uint8_t empty_block[BLOCK_SIZE];
-	memset(empty_block, 0, BLOCK_SIZE);
+int write_run(inode* inod, uint32_t n, uint32_t count, void* buf, uint32_t* done){
+	*done = 0;
 	
-	DEBUG(DB_RMNTH, printf("DEBUG: rm_nth_datablock: about to begin\n"));
-	DEBUG(DB_RMNTH, printf("  n:                %d\n", n));
-	DEBUG(DB_RMNTH, printf("  num_direct:       %d\n", num_direct));
-	DEBUG(DB_RMNTH, printf("  single_indirect:  %d\n", single_indirect));
-	DEBUG(DB_RMNTH, printf("  double_indirect:  %d\n", double_indirect));
-	DEBUG(DB_RMNTH, printf("  triple_indirect:  %d\n", triple_indirect));
-	DEBUG(DB_RMNTH, printf("  inod:             %p\n", inod));
-	
-	/* Figure out what type of block our target is, update i and next_addr */
-	offset = n;
-	int i;
-	if (offset < num_direct){
-		i = -1;
-		next_addr = inod->direct_blocks[offset];
-		from_pointer = &inod->direct_blocks[offset];
-	}
-	else if (offset < single_indirect){
-		offset -= num_direct;
-		i = 0;
-		next_addr = inod->indirect;
-		from_pointer = &inod->indirect;
-	}
-	else if (offset < double_indirect){
-		offset -= single_indirect;
-		i = 1;
-		next_addr = inod->double_indirect;
-		from_pointer = &inod->double_indirect;
-	}
-	else if (offset < triple_indirect){
-		offset -= double_indirect;
-		i = 2;
-		next_addr = inod->triple_indirect;
-		from_pointer = &inod->triple_indirect;
-	}
-	else{
-		ERR(fprintf(stderr, "ERR: rm_nth_datablock: block num was too big\n"));
-		ERR(fprintf(stderr, "  triple_indirect: %d\n", triple_indirect));
-		ERR(fprintf(stderr, "  n:               %d\n", n));
-		return INVALID_BLOCK;
-	}
-	
-	DEBUG(DB_RMNTH, printf("  next_addr:        %d\n", next_addr));
-	
-	/* Continue down indirect blocks */
-	int j;
-	for (j = i; j >= 0; j--){
-		/* Don't bother checking down 0 blocks */
-		if (next_addr == 0){
-			DEBUG(DB_RMNTH, printf("DEBUG: rm_nth_datablock: block is zero\n"));
-			DEBUG(DB_RMNTH, printf("  j: %d\n", j));
-			check_start = j + 1;
-			break;
-		}
-		
-		block_addrs[j] = next_addr;
-		ret = data_read(next_addr, &b[j]);
+	int ret, first, got, b;
+	extent ext;
+	while (*done < count){
+		ret = data_allocate_run(count - *done, extent_goal(inod, n + *done), &first, &got);
 		if (ret != SUCCESS){
-			ERR(fprintf(stderr, "ERR: get_nth_datablock: data_read failed\n"));
-			ERR(fprintf(stderr, "  next_addr: %d\n", next_addr));
-			ERR(fprintf(stderr, "  ret:       %d\n", ret));
 			return ret;
 		}
 		
-		next_index[j] = offset / intPow(ADDRESSES_PER_BLOCK, j);
-		offset = offset % intPow(ADDRESSES_PER_BLOCK, j);
-		
-		DEBUG(DB_RMNTH, printf("DEBUG: rm_nth_datablock: doing an iteration\n"));
-		DEBUG(DB_RMNTH, printf("  j:              %d\n", j));
-		DEBUG(DB_RMNTH, printf("  next_index[j]:  %d\n", next_index[j]));
-		DEBUG(DB_RMNTH, printf("  offset:         %d\n", offset));
-		
-		next_addr = b[j].address[next_index[j]];
-		
-		DEBUG(DB_RMNTH, printf("  next_addr:      %d\n", next_addr));
-	}
-	
-	/* Delete the blocks that need deleting */
-	for (j = check_start; j <= i; j++){
-		next_addr = b[j].address[next_index[j]];
-		if (next_addr != 0){
-			ret = data_free(next_addr);
+		for (b = 0; b < got; b++){
+			ret = data_write_direct(first + b, (void*)((uintptr_t)buf + (uintptr_t)(*done + b) * BLOCK_SIZE));
 			if (ret != SUCCESS){
-				ERR(fprintf(stderr, "ERR: rm_nth_datablock: data_free failed\n"));
-				ERR(fprintf(stderr, "  next_addr: %d\n", next_addr));
-				ERR(fprintf(stderr, "  ret:       %d\n", ret));
+				data_free_run(first, got);
 				return ret;
 			}
-			
-			DEBUG(DB_RMNTH, printf("DEBUG: rm_nth_datablock: freeing a block\n"));
-			DEBUG(DB_RMNTH, printf("  j:              %d\n", j));
-			DEBUG(DB_RMNTH, printf("  next_addr:      %d\n", next_addr));
-			DEBUG(DB_RMNTH, printf("  next_index[j]:  %d\n", next_index[j]));
-			DEBUG(DB_RMNTH, printf("  block_addrs[j]: %d\n", block_addrs[j]));
-			
-			b[j].address[next_index[j]] = 0;
-			data_write(block_addrs[j], &b[j]);
 		}
 		
-		/* If all of b[j] is now 0s, we can delete it as well */
-		if (memcmp(&b[j], empty_block, BLOCK_SIZE) != 0){
-			return SUCCESS;
-		}
-		DEBUG(DB_RMNTH, printf("DEBUG: rm_nth_datablock: recursively freeing\n"));
-	}
-
-	/* Clear the pointer in inode, if needed */
-	if (*from_pointer != 0){
-		DEBUG(DB_RMNTH, printf("DEBUG: rm_nth_datablock: clearing inode\n"));
-		DEBUG(DB_RMNTH, printf("  *from_pointer:  %d\n", *from_pointer));
-
-		ret = data_free(*from_pointer);
+		ext.logical = n + *done;
+		ext.physical = first;
+		ext.length = got;
+		ret = extent_insert(inod, &ext);
 		if (ret != SUCCESS){
-			ERR(fprintf(stderr, "ERR: rm_nth_datablock: data_free failed\n"));
-			ERR(fprintf(stderr, "  *from_pointer: %d\n", *from_pointer));
-			ERR(fprintf(stderr, "  ret:           %d\n", ret));
+			data_free_run(first, got);
 			return ret;
 		}
 		
-		*from_pointer = 0;
+		*done += got;
 	}
-
+	
 	return SUCCESS;
- }
+}
 
-/* Returns the data block number associated with the nth block of a file
+/* Preallocates, punches out or zeroes the bytes of a file from offset to offset + len,
+ * depending on mode, as with fallocate(2)
  *
- * If create is true, get_nth_datablock will attempt to create the datablock, if
- * it doesn't exist. Doing this may update inod and data blocks in the filesystem.
- * If a data block is created, created will be set to TRUE, otherwise it is unchanged
+ * With mode 0 or FALLOC_FL_KEEP_SIZE, every hole in the range is given data blocks, as
+ * contiguous as free space allows. Nothing is written to them: they are marked
+ * unwritten, and read as 0s until written. The file grows to cover the range unless
+ * FALLOC_FL_KEEP_SIZE is given
  *
- * Note that n is zero-indexed. n = 0 will return the first block of the file
+ * FALLOC_FL_PUNCH_HOLE (which needs FALLOC_FL_KEEP_SIZE) frees the whole blocks in the
+ * range and writes 0s over the partial ones at either end. FALLOC_FL_ZERO_RANGE does
+ * the same, then preallocates the range again
  *
  * Returns:
  *   DISC_UNINITIALIZED - no disk
- *   BUF_NULL           - inode is null
- *   DATA_FULL          - if create is true and the block (or an intermediate block) cannot be created
- *   INVALID_BLOCK      - an invalid block number was found during the search
- *   INT                - upon success, returns number for data block
+ *   BAD_INODE          - inode supplied was bad
+ *   -EINVAL            - offset or len is out of range
+ *   -EOPNOTSUPP        - mode isn't supported
+ *   DATA_FULL          - ran out of data blocks, part of the range may be allocated,
+ *                        or a partial block at either end couldn't be zeroed
+ *   SUCCESS            - range was allocated, punched or zeroed
  */
-int get_nth_datablock(inode* inod, off_t n, int create, int* created){
-	if (inod == NULL){
-		ERR(fprintf(stderr, "ERR: get_nth_datablock: inode is null\n"));
-		ERR(fprintf(stderr, "  inod: %p\n", inod));
-		return BUF_NULL;
+int fallocate_i(int inum, int mode, off_t offset, off_t len){
+	if (offset < 0 || len <= 0 || offset > MAX_FILE_SIZE || len > MAX_FILE_SIZE - offset){
+		ERR(fprintf(stderr, "ERR: fallocate_i: range is invalid\n"));
+		ERR(fprintf(stderr, "  offset: %lld\n", (long long)offset));
+		ERR(fprintf(stderr, "  len:    %lld\n", (long long)len));
+		return -EINVAL;
+	}
+	if ((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) ||
+			((mode & FALLOC_FL_PUNCH_HOLE) && (!(mode & FALLOC_FL_KEEP_SIZE) || (mode & FALLOC_FL_ZERO_RANGE)))){
+		ERR(fprintf(stderr, "ERR: fallocate_i: mode not supported\n"));
+		ERR(fprintf(stderr, "  mode: %d\n", mode));
+		return -EOPNOTSUPP;
 	}
 	
-	int num_direct = NUM_DIRECT; //10
-	int single_indirect = num_direct + ADDRESSES_PER_BLOCK; //10 + 1024
-	int double_indirect = single_indirect + ADDRESSES_PER_BLOCK * ADDRESSES_PER_BLOCK; //10 + 1024 + 1048576
-	int triple_indirect = double_indirect + ADDRESSES_PER_BLOCK * ADDRESSES_PER_BLOCK * ADDRESSES_PER_BLOCK;
-	
-	address_block b;
-	int offset, next_addr, next_index, ret, new_block;
-	int* from_pointer;
-	
-	uint8_t empty_block[BLOCK_SIZE];
-	memset(empty_block, 0, BLOCK_SIZE);
-	
-	DEBUG(DB_GETNTH, printf("DEBUG: get_nth_datablock: about to begin\n"));
-	DEBUG(DB_GETNTH, printf("  n:                %d\n", n));
-	DEBUG(DB_GETNTH, printf("  num_direct:       %d\n", num_direct));
-	DEBUG(DB_GETNTH, printf("  single_indirect:  %d\n", single_indirect));
-	DEBUG(DB_GETNTH, printf("  double_indirect:  %d\n", double_indirect));
-	DEBUG(DB_GETNTH, printf("  triple_indirect:  %d\n", triple_indirect));
-	DEBUG(DB_GETNTH, printf("  inod:             %p\n", inod));
-	
-	/* Figure out what type of block our target is, update i and next_addr */
-	offset = n;
-	int i;
-	if (offset < num_direct){
-		i = -1;
-		next_addr = inod->direct_blocks[offset];
-		from_pointer = &inod->direct_blocks[offset];
-	}
-	else if (offset < single_indirect){
-		offset -= num_direct;
-		i = 0;
-		next_addr = inod->indirect;
-		from_pointer = &inod->indirect;
-	}
-	else if (offset < double_indirect){
-		offset -= single_indirect;
-		i = 1;
-		next_addr = inod->double_indirect;
-		from_pointer = &inod->double_indirect;
-	}
-	else if (offset < triple_indirect){
-		offset -= double_indirect;
-		i = 2;
-		next_addr = inod->triple_indirect;
-		from_pointer = &inod->triple_indirect;
+	int ret = oft_flush_buffer(inum);
+	if (ret != SUCCESS){
+		return ret;
 	}
-	else{
+	
+	inode my_inode;
+	ret = inode_read(inum, &my_inode);
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: fallocate_i: inode_read failed\n"));
+		ERR(fprintf(stderr, "  inum: %d\n", inum));
+		return ret;
+	}
+	
+	/* Only files in data blocks can have blocks preallocated or punched */
+	if (my_inode.flags & INODE_INLINE){
+		ret = inline_to_blocks(inum, &my_inode);
+		if (ret != SUCCESS){
+			return ret;
+		}
+	}
+	
+	/* Dirty pages in the range would otherwise be mapped on top of what we do here */
+	ret = delalloc_flush(inum);
+	if (ret != SUCCESS){
+		return ret;
+	}
+	
+	off_t end = offset + len;
+	off_t first_whole = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	off_t end_whole = end / BLOCK_SIZE;
+	off_t zero_end;
+	ssize_t written;
+	uint8_t zero_block[BLOCK_SIZE];
+	memset(zero_block, 0, BLOCK_SIZE);
+	
+	if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)){
+		/* Partial blocks at the ends get 0s written over them, but only inside the file */
+		zero_end = MIN(MIN(first_whole * BLOCK_SIZE, end), my_inode.size);
+		if (offset < zero_end){
+			written = write_i(inum, zero_block, offset, zero_end - offset);
+			if (written < 0){
+				ERR(fprintf(stderr, "ERR: fallocate_i: couldn't zero the first block\n"));
+				ERR(fprintf(stderr, "  inum: %d\n", inum));
+				ERR(fprintf(stderr, "  ret:  %zd\n", written));
+				return written;
+			}
+		}
+		if (end_whole >= first_whole && end_whole * BLOCK_SIZE < MIN(end, my_inode.size)){
+			written = write_i(inum, zero_block, end_whole * BLOCK_SIZE, MIN(end, my_inode.size) - end_whole * BLOCK_SIZE);
+			if (written < 0){
+				ERR(fprintf(stderr, "ERR: fallocate_i: couldn't zero the last block\n"));
+				ERR(fprintf(stderr, "  inum: %d\n", inum));
+				ERR(fprintf(stderr, "  ret:  %zd\n", written));
+				return written;
+			}
+		}
+		
+		ret = inode_read(inum, &my_inode);
+		if (ret != SUCCESS){
+			ERR(fprintf(stderr, "ERR: fallocate_i: inode_read failed\n"));
+			ERR(fprintf(stderr, "  inum: %d\n", inum));
+			return ret;
+		}
+		
+		/* Whole blocks are dropped from the extent tree a range at a time */
+		if (end_whole > first_whole){
+			ret = extent_remove(&my_inode, first_whole, end_whole - first_whole, TRUE);
+			if (ret != SUCCESS){
+				ERR(fprintf(stderr, "ERR: fallocate_i: extent_remove failed\n"));
+				ERR(fprintf(stderr, "  inum: %d\n", inum));
+				ERR(fprintf(stderr, "  ret:  %d\n", ret));
+				inode_write(inum, &my_inode);
+				return ret;
+			}
+		}
+	}
+	
+	/* Fill the holes in the range with unwritten extents */
+	uint32_t n, last, physical, run, hole;
+	int first, count;
+	extent ext;
+	
+	n = offset / BLOCK_SIZE;
+	last = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	while (!(mode & FALLOC_FL_PUNCH_HOLE) && n < last){
+		ret = extent_lookup(&my_inode, n, &physical, &run, NULL);
+		if (ret != SUCCESS){
+			inode_write(inum, &my_inode);
+			return ret;
+		}
+		
+		hole = MIN(run, last - n);
+		if (physical != INVALID_DATA){
+			n += hole;
+			continue;
+		}
+		
+		while (hole > 0){
+			ret = data_allocate_run(hole, extent_goal(&my_inode, n), &first, &count);
+			if (ret != SUCCESS){
+				ERR(fprintf(stderr, "ERR: fallocate_i: filesystem full\n"));
+				ERR(fprintf(stderr, "  n: %u\n", n));
+				inode_write(inum, &my_inode);
+				return ret;
+			}
+			
+			ext.logical = n;
+			ext.physical = first;
+			ext.length = count | EXTENT_UNWRITTEN;
+			ret = extent_insert(&my_inode, &ext);
+			if (ret != SUCCESS){
+				ERR(fprintf(stderr, "ERR: fallocate_i: extent_insert failed\n"));
+				ERR(fprintf(stderr, "  n:   %u\n", n));
+				ERR(fprintf(stderr, "  ret: %d\n", ret));
+				while (count > 0){
+					data_free(first + --count);
+				}
+				inode_write(inum, &my_inode);
+				return ret;
+			}
+			
+			DEBUG(DB_FALLOCATE, printf("DEBUG: fallocate_i: preallocated a run\n"));
+			DEBUG(DB_FALLOCATE, printf("  n:     %u\n", n));
+			DEBUG(DB_FALLOCATE, printf("  first: %d\n", first));
+			DEBUG(DB_FALLOCATE, printf("  count: %d\n", count));
+			
+			n += count;
+			hole -= count;
+		}
+	}
+	
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > my_inode.size){
+		my_inode.size = end;
+	}
+	
+	return inode_write(inum, &my_inode);
+}
+
+/* Makes the count blocks of dst from block dst_n share the data blocks of the count
+ * blocks of src from block src_n, rather than copying them. Whatever dst had there
+ * before is dropped. Holes and preallocated blocks in src come out as holes in dst.
+ * Both files are marked as having shared blocks, so that write_i copies a block
+ * before writing it. Sizes are left alone
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - no disk
+ *   BAD_INODE          - src or dst is bad
+ *   -EINVAL            - the ranges are in the same file and overlap
+ *   TOO_MANY_REFS      - a block is already shared as many times as it can be
+ *   DATA_FULL          - no room for a node of dst's extent tree, part of the range
+ *                        may be shared
+ *   SUCCESS            - the blocks are shared
+ */
+int reflink_range(int src, uint32_t src_n, int dst, uint32_t dst_n, uint32_t count){
+	if (src == dst && src_n < dst_n + count && dst_n < src_n + count){
+		ERR(fprintf(stderr, "ERR: reflink_range: ranges overlap\n"));
+		ERR(fprintf(stderr, "  src_n: %u\n", src_n));
+		ERR(fprintf(stderr, "  dst_n: %u\n", dst_n));
+		ERR(fprintf(stderr, "  count: %u\n", count));
+		return -EINVAL;
+	}
+	
+	int ret;
+	if ((ret = oft_flush_buffer(src)) != SUCCESS || (ret = oft_flush_buffer(dst)) != SUCCESS){
+		return ret;
+	}
+	if (delalloc_count(src) > 0 && (ret = delalloc_flush(src)) != SUCCESS){
+		return ret;
+	}
+	if (delalloc_count(dst) > 0 && (ret = delalloc_flush(dst)) != SUCCESS){
+		return ret;
+	}
+	
+	/* Within one file, both sides work on the same copy of the inode */
+	inode dst_inode, src_buf;
+	inode* src_inode = (src == dst) ? &dst_inode : &src_buf;
+	ret = inode_read(dst, &dst_inode);
+	if (ret == SUCCESS && src != dst){
+		ret = inode_read(src, &src_buf);
+	}
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: reflink_range: inode_read failed\n"));
+		ERR(fprintf(stderr, "  src: %d\n", src));
+		ERR(fprintf(stderr, "  dst: %d\n", dst));
+		return ret;
+	}
+	if ((src_inode->flags & INODE_INLINE) || (dst_inode.flags & INODE_INLINE)){
+		return BAD_INODE;
+	}
+	
+	journal_begin();
+	
+	ret = extent_remove(&dst_inode, dst_n, count, TRUE);
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: reflink_range: extent_remove failed\n"));
+		ERR(fprintf(stderr, "  dst: %d\n", dst));
+		ERR(fprintf(stderr, "  ret: %d\n", ret));
+		inode_write(dst, &dst_inode);
+		journal_end();
+		return ret;
+	}
+	
+	uint64_t n = src_n;
+	uint64_t end = (uint64_t)src_n + count;
+	uint32_t physical, run;
+	int unwritten;
+	extent ext;
+	while (n < end){
+		ret = extent_lookup(src_inode, n, &physical, &run, &unwritten);
+		if (ret != SUCCESS){
+			break;
+		}
+		run = MIN(MAX(run, 1), end - n);
+		
+		if (physical != INVALID_DATA && !unwritten){
+			ret = data_share_run(physical, run);
+			if (ret != SUCCESS){
+				break;
+			}
+			
+			ext.logical = dst_n + (n - src_n);
+			ext.physical = physical;
+			ext.length = run;
+			ret = extent_insert(&dst_inode, &ext);
+			if (ret != SUCCESS){
+				data_free_run(physical, run);
+				break;
+			}
+		}
+		
+		n += run;
+	}
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: reflink_range: couldn't share a run\n"));
+		ERR(fprintf(stderr, "  src: %d\n", src));
+		ERR(fprintf(stderr, "  n:   %llu\n", (unsigned long long)n));
+		ERR(fprintf(stderr, "  ret: %d\n", ret));
+	}
+	
+	dst_inode.flags |= INODE_SHARED;
+	if (src != dst){
+		src_inode->flags |= INODE_SHARED;
+		inode_write(src, src_inode);
+	}
+	inode_write(dst, &dst_inode);
+	journal_end();
+	
+	return ret;
+}
+
+/* Gives block n of the file inod, held in data block block_addr, a data block of its
+ * own if block_addr is shared with another file. The contents are copied over if copy
+ * is set, otherwise the caller is about to write the whole block. block_addr is set to
+ * the block to write to. Only inod in memory is updated
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - no disk
+ *   INVALID_BLOCK      - block_addr isn't a valid data block
+ *   DATA_FULL          - no room for the copy, or for a node of the extent tree
+ *   SUCCESS            - block_addr belongs to inod alone
+ */
+int reflink_unshare(inode* inod, uint32_t n, int* block_addr, int copy){
+	int refs;
+	int ret = data_refcount(*block_addr, &refs);
+	if (ret != SUCCESS || refs == 0){
+		return ret;
+	}
+	
+	int first, count;
+	ret = data_allocate_run(1, extent_goal(inod, n), &first, &count);
+	if (ret != SUCCESS){
+		return ret;
+	}
+	
+	if (copy){
+		uint8_t block_buf[BLOCK_SIZE];
+		ret = data_read(*block_addr, &block_buf);
+		if (ret == SUCCESS){
+			ret = file_data_write(inod, first, &block_buf);
+		}
+		if (ret != SUCCESS){
+			data_free(first);
+			return ret;
+		}
+	}
+	
+	/* The old block goes back in if the new one can't, so the file never loses it */
+	extent ext;
+	ext.logical = n;
+	ext.physical = first;
+	ext.length = 1;
+	ret = extent_remove(inod, n, 1, FALSE);
+	if (ret == SUCCESS){
+		ret = extent_insert(inod, &ext);
+		if (ret != SUCCESS){
+			ext.physical = *block_addr;
+			extent_insert(inod, &ext);
+		}
+	}
+	if (ret != SUCCESS){
+		data_free(first);
+		return ret;
+	}
+	
+	DEBUG(DB_WRITEI, printf("DEBUG: reflink_unshare: block %u moved off a shared block\n", n));
+	DEBUG(DB_WRITEI, printf("  from: %d\n", *block_addr));
+	DEBUG(DB_WRITEI, printf("  to:   %d\n", first));
+	
+	data_free(*block_addr);
+	*block_addr = first;
+	return SUCCESS;
+}
+
+/* Makes dst a copy of src that shares all of its data blocks, as with the FICLONE
+ * ioctl. Copying is O(metadata): only the block maps change, unless src's blocks are
+ * already shared as many times as they can be and have to be copied. Whatever dst held
+ * before is dropped
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - no disk
+ *   BAD_INODE          - src or dst is bad
+ *   -EINVAL            - src and dst are the same, or aren't both regular files
+ *   DATA_FULL          - ran out of data blocks
+ *   SUCCESS            - dst is a clone of src
+ */
+int clone_i(int src, int dst){
+	inode src_inode, dst_inode;
+	int ret = inode_read(src, &src_inode);
+	if (ret == SUCCESS){
+		ret = inode_read(dst, &dst_inode);
+	}
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: clone_i: inode_read failed\n"));
+		ERR(fprintf(stderr, "  src: %d\n", src));
+		ERR(fprintf(stderr, "  dst: %d\n", dst));
+		return ret;
+	}
+	if (src == dst || !S_ISREG(src_inode.mode) || !S_ISREG(dst_inode.mode)){
+		return -EINVAL;
+	}
+	
+	ret = truncate(dst, 0);
+	if (ret != SUCCESS){
+		return ret;
+	}
+	
+	/* A short copy stopped on an error, which the next call runs into straight away */
+	off_t done = 0;
+	ssize_t copied;
+	while (done < src_inode.size){
+		copied = copy_range_i(src, done, dst, done, src_inode.size - done);
+		if (copied < 0){
+			return copied;
+		}
+		if (copied == 0){
+			break;
+		}
+		done += copied;
+	}
+	
+	return SUCCESS;
+}
+
+/* Copies size bytes at offset src_off of src to offset dst_off of dst, as with
+ * copy_file_range(2). When both offsets are the same distance into a block, the whole
+ * blocks in the range are shared with reflink_range, and only the partial blocks at
+ * either end are read and written. Otherwise everything is read and written, as are
+ * the whole blocks if some of them are already shared as many times as they can be
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - no disk
+ *   BAD_INODE          - src or dst is bad
+ *   -EINVAL            - the ranges are in the same file and overlap, or src and dst
+ *                        aren't both regular files
+ *   FILE_TOO_BIG       - the copy would go past MAX_FILE_SIZE, or an offset is negative
+ *   DATA_FULL          - ran out of data blocks before anything was copied
+ *   INT                - upon success, the number of bytes copied, which is short if
+ *                        src ends first
+ */
+ssize_t copy_range_i(int src, off_t src_off, int dst, off_t dst_off, size_t size){
+	if (src_off < 0 || dst_off < 0 || size > MAX_FILE_SIZE || dst_off > MAX_FILE_SIZE - (off_t)size){
+		ERR(fprintf(stderr, "ERR: copy_range_i: range is out of bounds\n"));
+		ERR(fprintf(stderr, "  src_off: %lld\n", (long long)src_off));
+		ERR(fprintf(stderr, "  dst_off: %lld\n", (long long)dst_off));
+		ERR(fprintf(stderr, "  size:    %llu\n", (unsigned long long)size));
+		return FILE_TOO_BIG;
+	}
+	if (src == dst && src_off < dst_off + (off_t)size && dst_off < src_off + (off_t)size){
+		return -EINVAL;
+	}
+	
+	inode src_inode, dst_inode;
+	int ret = inode_read(src, &src_inode);
+	if (ret == SUCCESS){
+		ret = inode_read(dst, &dst_inode);
+	}
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: copy_range_i: inode_read failed\n"));
+		ERR(fprintf(stderr, "  src: %d\n", src));
+		ERR(fprintf(stderr, "  dst: %d\n", dst));
+		return ret;
+	}
+	if (!S_ISREG(src_inode.mode) || !S_ISREG(dst_inode.mode)){
+		return -EINVAL;
+	}
+	
+	/* Nothing to copy past the end of src */
+	if (src_off >= src_inode.size){
+		return 0;
+	}
+	size = MIN(size, src_inode.size - src_off);
+	
+	/* The whole blocks in the middle can be shared if they line up */
+	off_t share_start = src_off;
+	off_t share_end = src_off;
+	if (src_off % BLOCK_SIZE == dst_off % BLOCK_SIZE && !(src_inode.flags & INODE_INLINE)){
+		share_start = (src_off + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+		share_end = MAX(share_start, (src_off + (off_t)size) / BLOCK_SIZE * BLOCK_SIZE);
+	}
+	
+	uint8_t copy_buf[COPY_CHUNK_BLOCKS * BLOCK_SIZE];
+	off_t done = 0;
+	ssize_t chunk;
+	while (done < (off_t)size){
+		if (src_off + done == share_start && share_end > share_start){
+			ret = inode_read(dst, &dst_inode);
+			if (ret == SUCCESS && (dst_inode.flags & INODE_INLINE)){
+				ret = inline_to_blocks(dst, &dst_inode);
+			}
+			if (ret == SUCCESS){
+				ret = reflink_range(src, share_start / BLOCK_SIZE, dst, (dst_off + done) / BLOCK_SIZE, (share_end - share_start) / BLOCK_SIZE);
+			}
+			if (ret == TOO_MANY_REFS){
+				share_end = share_start;
+				ret = SUCCESS;
+				continue;
+			}
+			if (ret != SUCCESS){
+				break;
+			}
+			done += share_end - share_start;
+			
+			inode_read(dst, &dst_inode);
+			dst_inode.size = MAX(dst_inode.size, dst_off + done);
+			dst_inode.mode &= (0xffff ^ (S_ISUID | S_ISGID));
+			inode_write(dst, &dst_inode);
+			continue;
+		}
+		
+		/* Read and write up to the shared part, or the end */
+		chunk = MIN((off_t)sizeof(copy_buf), (off_t)size - done);
+		if (src_off + done < share_start && share_end > share_start){
+			chunk = MIN(chunk, share_start - (src_off + done));
+		}
+		chunk = read_i(src, copy_buf, src_off + done, chunk);
+		if (chunk <= 0){
+			ret = chunk;
+			break;
+		}
+		chunk = write_i(dst, copy_buf, dst_off + done, chunk);
+		if (chunk <= 0){
+			ret = chunk;
+			break;
+		}
+		done += chunk;
+	}
+	
+	if (done == 0 && ret != SUCCESS){
+		return ret;
+	}
+	return done;
+}
+
+/* Moves the contents of an inline file out of the inode and into data blocks,
+ * so it can grow past INLINE_DATA_SIZE. inod is updated to the new version of the inode
+ *
+ * Returns (normally only SUCCESS or DATA_FULL):
+ *   DISC_UNINITIALIZED - no disk
+ *   BUF_NULL           - inod is null
+ *   DATA_FULL          - no room for the file's first block, the file is left inline
+ *   SUCCESS            - file is now stored in data blocks
+ */
+int inline_to_blocks(int inum, inode* inod){
+	if (inod == NULL){
+		ERR(fprintf(stderr, "ERR: inline_to_blocks: inod is null\n"));
+		ERR(fprintf(stderr, "  inod: %p\n", inod));
+		return BUF_NULL;
+	}
+	
+	uint8_t contents[INLINE_DATA_SIZE];
+	int size = inod->size;
+	memcpy(contents, inod->inline_data, INLINE_DATA_SIZE);
+	
+	/* Clear the inline area so it can be used for block pointers */
+	inode original = *inod;
+	inod->flags &= ~INODE_INLINE;
+	memset(inod->inline_data, 0, INLINE_DATA_SIZE);
+	int ret = inode_write(inum, inod);
+	if (ret != SUCCESS){
+		return ret;
+	}
+	
+	if (size > 0){
+		ret = write_i(inum, contents, 0, size);
+		if (ret != size){
+			ERR(fprintf(stderr, "ERR: inline_to_blocks: write_i failed\n"));
+			ERR(fprintf(stderr, "  inum: %d\n", inum));
+			ERR(fprintf(stderr, "  ret:  %d\n", ret));
+			
+			/* Give back whatever blocks were allocated and go back to being inline */
+			truncate(inum, 0);
+			inode_write(inum, &original);
+			*inod = original;
+			return ret < 0 ? ret : DATA_FULL;
+		}
+	}
+	
+	return inode_read(inum, inod);
+}
+
+/* Writes buf to data block block_addr of the file inod. Directory blocks are
+ * metadata and go through the journal, but the contents of regular files are
+ * written in place, so they are on disk before the transaction mapping them commits
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - no disk
+ *   INVALID_BLOCK      - block_addr isn't a valid data block
+ *   SUCCESS            - block was written
+ */
+int file_data_write(inode* inod, int block_addr, void* buf){
+	if (S_ISREG(inod->mode)){
+		return data_write_direct(block_addr, buf);
+	}
+	
+	return data_write(block_addr, buf);
+}
+
+/* Frees the blocks associated with the nth block of a file. Does not return
+ * an error if the block is already deleted
+ *
+ * This operation is equivilant (from a file contents perspective) of writing all
+ * 0s to a block, except that it doesn't take up room on disk
+ *
+ * Note that n is zero-indexed. n = 0 will return the first block of the file
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - no disk
+ *   BUF_NULL           - inode is null
+ *   INVALID_BLOCK      - an invalid block number was found during the search
+ *   DATA_FULL          - the block was in the middle of an extent, and there was no room to split it
+ *   SUCCESS            - nth block of file is no longer allocated
+ */
+int rm_nth_datablock(inode* inod, off_t n){
+	if (inod == NULL){
+		ERR(fprintf(stderr, "ERR: rm_nth_datablock: inode is null\n"));
+		ERR(fprintf(stderr, "  inod: %p\n", inod));
+		return BUF_NULL;
+	}
+	
+	/* Inline files don't have any data blocks */
+	if (inod->flags & INODE_INLINE){
+		return SUCCESS;
+	}
+	
+	if (n < 0 || n >= EXTENT_END){
+		ERR(fprintf(stderr, "ERR: rm_nth_datablock: block num was too big\n"));
+		ERR(fprintf(stderr, "  n: %lld\n", (long long)n));
+		return INVALID_BLOCK;
+	}
+	
+	DEBUG(DB_RMNTH, printf("DEBUG: rm_nth_datablock: about to begin\n"));
+	DEBUG(DB_RMNTH, printf("  n:     %lld\n", (long long)n));
+	DEBUG(DB_RMNTH, printf("  depth: %d\n", inod->ext_header.depth));
+	
+	return extent_remove(inod, n, 1, TRUE);
+}
+
+/* Returns the data block number associated with the nth block of a file
+ *
+ * If create is true, get_nth_datablock will attempt to create the datablock, if
+ * it doesn't exist. Doing this may update inod and data blocks in the filesystem.
+ * If a data block is created, created will be set to TRUE, otherwise it is unchanged.
+ * New blocks are filled with 0s, unless create is CREATE_UNZEROED, in which case
+ * the caller must write all of the block itself
+ *
+ * Note that n is zero-indexed. n = 0 will return the first block of the file
+ *
+ * Returns:
+ *   DISC_UNINITIALIZED - no disk
+ *   BUF_NULL           - inode is null
+ *   DATA_FULL          - if create is true and the block (or a node of the extent tree) cannot be created
+ *   INVALID_BLOCK      - an invalid block number was found during the search
+ *   INT                - upon success, returns number for data block
+ */
+int get_nth_datablock(inode* inod, off_t n, int create, int* created){
+	if (inod == NULL){
+		ERR(fprintf(stderr, "ERR: get_nth_datablock: inode is null\n"));
+		ERR(fprintf(stderr, "  inod: %p\n", inod));
+		return BUF_NULL;
+	}
+	
+	/* The extent tree of inline files holds file contents, not addresses */
+	if (inod->flags & INODE_INLINE){
+		ERR(fprintf(stderr, "ERR: get_nth_datablock: inode is inline\n"));
+		return INVALID_BLOCK;
+	}
+	
+	if (n < 0 || n >= EXTENT_END){
 		ERR(fprintf(stderr, "ERR: get_nth_datablock: block num was too big\n"));
-		ERR(fprintf(stderr, "  triple_indirect: %d\n", triple_indirect));
-		ERR(fprintf(stderr, "  n:               %d\n", n));
+		ERR(fprintf(stderr, "  n: %lld\n", (long long)n));
 		return INVALID_BLOCK;
 	}
 	
-	DEBUG(DB_GETNTH, printf("  next_addr:        %d\n", next_addr));
-
-	/* Special case when creating a first-layer block, since we have to update the inode */
-	if (next_addr == 0 && create){
-		/* Create a new block of all zeros */
-		ret = data_allocate(&empty_block, &new_block);
+	uint32_t physical, run;
+	int ret, new_block, count;
+	extent ext;
+	
+	uint8_t empty_block[BLOCK_SIZE];
+	
+	DEBUG(DB_GETNTH, printf("DEBUG: get_nth_datablock: about to begin\n"));
+	DEBUG(DB_GETNTH, printf("  n:     %lld\n", (long long)n));
+	DEBUG(DB_GETNTH, printf("  depth: %d\n", inod->ext_header.depth));
+	DEBUG(DB_GETNTH, printf("  inod:  %p\n", inod));
+	
+	ret = extent_lookup(inod, n, &physical, &run, NULL);
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: get_nth_datablock: extent_lookup failed\n"));
+		ERR(fprintf(stderr, "  n:   %lld\n", (long long)n));
+		ERR(fprintf(stderr, "  ret: %d\n", ret));
+		return ret;
+	}
+	
+	if (physical != INVALID_DATA || !create){
+		return physical;
+	}
+
+	/* Create a new block of all zeros, or leave it as it is if it's about to be overwritten */
+	if (create == CREATE_UNZEROED){
+		ret = data_allocate_run(1, extent_goal(inod, n), &new_block, &count);
+	}
+	else{
+		memset(empty_block, 0, BLOCK_SIZE);
+		ret = data_allocate_near(&empty_block, extent_goal(inod, n), &new_block);
+	}
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: get_nth_datablock: filesystem full\n"));
+		ERR(fprintf(stderr, "  ret: %d\n", ret));
+		return ret;
+	}
+	
+	ext.logical = n;
+	ext.physical = new_block;
+	ext.length = 1;
+	ret = extent_insert(inod, &ext);
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: get_nth_datablock: extent_insert failed\n"));
+		ERR(fprintf(stderr, "  ret: %d\n", ret));
+		data_free(new_block);
+		return ret;
+	}
+
+	DEBUG(DB_GETNTH, printf("  DEBUG: get_nth_datablock: created a new block\n"));
+	DEBUG(DB_GETNTH, printf("    new_block: %d\n", new_block));
+	
+	/* Do not update the inode itself, that's the caller's job */
+	*created = TRUE;
+	return new_block;
+}
+
+/* Finds where the nth block of a file is stored. If the block is mapped, physical is
+ * set to its data block and run to the number of blocks from n to the end of its extent.
+ * Otherwise physical is set to INVALID_DATA and run to the length of the hole from n
+ * to the next mapped block (EXTENT_END - n if nothing is mapped past n)
+ *
+ * If unwritten isn't null, it is set to TRUE when the block was preallocated and has
+ * never been written, meaning it reads as 0s whatever the data block holds
+ *
+ * Returns:
+ *   BUF_NULL      - inod, physical or run is null
+ *   INVALID_BLOCK - the extent tree is malformed
+ *   SUCCESS
+ */
+int extent_lookup(inode* inod, uint32_t n, uint32_t* physical, uint32_t* run, int* unwritten){
+	if (inod == NULL || physical == NULL || run == NULL){
+		ERR(fprintf(stderr, "ERR: extent_lookup: buffer is null\n"));
+		ERR(fprintf(stderr, "  inod:     %p\n", inod));
+		ERR(fprintf(stderr, "  physical: %p\n", physical));
+		ERR(fprintf(stderr, "  run:      %p\n", run));
+		return BUF_NULL;
+	}
+	
+	extent_path path;
+	extent_header* header;
+	extent* extents;
+	int ret, i;
+	
+	ret = extent_find_path(inod, n, &path);
+	if (ret != SUCCESS){
+		return ret;
+	}
+	header = (path.depth == 0) ? &inod->ext_header : &path.nodes[path.depth].header;
+	extents = (path.depth == 0) ? inod->extents : path.nodes[path.depth].extents;
+	
+	i = extent_search(extents, header->entries, n);
+	if (i >= 0 && n - extents[i].logical < EXTENT_LENGTH(extents[i])){
+		*physical = extents[i].physical + (n - extents[i].logical);
+		*run = EXTENT_LENGTH(extents[i]) - (n - extents[i].logical);
+		if (unwritten != NULL){
+			*unwritten = (EXTENT_IS_UNWRITTEN(extents[i]) != 0);
+		}
+	}
+	else{
+		*physical = INVALID_DATA;
+		*run = ((i + 1 < header->entries) ? extents[i + 1].logical : path.upper) - n;
+		if (unwritten != NULL){
+			*unwritten = FALSE;
+		}
+	}
+	
+	return SUCCESS;
+}
+
+/* Looks up the nth block of a file like extent_lookup, but through cursor. While n is
+ * inside the extent or hole the cursor last saw, and no block map has changed since,
+ * the answer comes straight from the cursor without going down the tree. Otherwise
+ * the tree is searched and the cursor moves to what was found
+ *
+ * Returns:
+ *   the return value of extent_lookup
+ */
+int extent_cursor_lookup(extent_cursor* cursor, inode* inod, uint32_t n, uint32_t* physical, uint32_t* run, int* unwritten){
+	if (cursor->count > 0 && cursor->generation == extent_generation && n >= cursor->start && n - cursor->start < cursor->count){
+		*physical = (cursor->physical == INVALID_DATA) ? INVALID_DATA : cursor->physical + (n - cursor->start);
+		*run = cursor->count - (n - cursor->start);
+		if (unwritten != NULL){
+			*unwritten = cursor->unwritten;
+		}
+		return SUCCESS;
+	}
+	
+	int is_unwritten;
+	int ret = extent_lookup(inod, n, physical, run, &is_unwritten);
+	if (ret != SUCCESS){
+		cursor->count = 0;
+		return ret;
+	}
+	
+	cursor->generation = extent_generation;
+	cursor->start = n;
+	cursor->count = *run;
+	cursor->physical = *physical;
+	cursor->unwritten = is_unwritten;
+	if (unwritten != NULL){
+		*unwritten = is_unwritten;
+	}
+	
+	return SUCCESS;
+}
+
+
+/* Picks the data block to allocate file block n near: right after file block n - 1
+ * when that is mapped, so that files written in order stay contiguous, and otherwise
+ * the start of the inode's group
+ *
+ * Returns the goal block
+ */
+int extent_goal(inode* inod, uint32_t n){
+	uint32_t physical, run;
+	if (n > 0 && extent_lookup(inod, n - 1, &physical, &run, NULL) == SUCCESS && physical != INVALID_DATA){
+		return physical + 1;
+	}
+	
+	return group_first_block(inod->group);
+}
+
+/* Maps the file blocks described by ext, none of which may already be mapped. The new
+ * extent is merged into a neighbour when they are contiguous on disk, otherwise full
+ * nodes of the tree are split on the way down to make room for it. Only inod in memory
+ * is updated, the caller is responsible for writing it back
+ *
+ * Returns:
+ *   BUF_NULL      - inod or ext is null
+ *   INVALID_BLOCK - the extent tree is malformed
+ *   DATA_FULL     - the tree needed a new node, and there are no free blocks
+ *   SUCCESS
+ */
+int extent_insert(inode* inod, extent* ext){
+	if (inod == NULL || ext == NULL){
+		ERR(fprintf(stderr, "ERR: extent_insert: buffer is null\n"));
+		ERR(fprintf(stderr, "  inod: %p\n", inod));
+		ERR(fprintf(stderr, "  ext:  %p\n", ext));
+		return BUF_NULL;
+	}
+	if (EXTENT_LENGTH(*ext) == 0){
+		return SUCCESS;
+	}
+	extent_generation++;
+	
+	extent_path path;
+	extent_header* header;
+	extent* extents;
+	extent_index* index;
+	int ret, i, level, entries;
+	
+	ret = extent_find_path(inod, ext->logical, &path);
+	if (ret != SUCCESS){
+		return ret;
+	}
+	
+	/* Each index entry holds the lowest block mapped under it. Blocks before the first
+	 * entry of a node are sent to its first child, so that entry may need to come down */
+	for (level = 0; level < path.depth; level++){
+		index = (level == 0) ? inod->ext_index : path.nodes[level].index;
+		if (index[path.pos[level]].logical > ext->logical){
+			index[path.pos[level]].logical = ext->logical;
+			if (level > 0){
+				ret = data_write(path.blocks[level], &path.nodes[level]);
+				if (ret != SUCCESS){
+					ERR(fprintf(stderr, "ERR: extent_insert: data_write failed\n"));
+					ERR(fprintf(stderr, "  block: %d\n", path.blocks[level]));
+					ERR(fprintf(stderr, "  ret:   %d\n", ret));
+					return ret;
+				}
+			}
+		}
+	}
+	
+	header = (path.depth == 0) ? &inod->ext_header : &path.nodes[path.depth].header;
+	extents = (path.depth == 0) ? inod->extents : path.nodes[path.depth].extents;
+	i = extent_search(extents, header->entries, ext->logical);
+	
+	/* Blocks contiguous with an existing extent just make it longer */
+	if (i >= 0 && extent_contiguous(&extents[i], ext)){
+		extents[i].length += EXTENT_LENGTH(*ext);
+		
+		/* The new blocks may have closed the gap to the next extent */
+		if (i + 1 < header->entries && extent_contiguous(&extents[i], &extents[i + 1])){
+			extents[i].length += EXTENT_LENGTH(extents[i + 1]);
+			memmove(&extents[i + 1], &extents[i + 2], (header->entries - i - 2) * sizeof(extent));
+			header->entries--;
+		}
+		
+		return (path.depth == 0) ? SUCCESS : data_write(path.blocks[path.depth], &path.nodes[path.depth]);
+	}
+	if (i + 1 < header->entries && extent_contiguous(ext, &extents[i + 1])){
+		extents[i + 1].logical = ext->logical;
+		extents[i + 1].physical = ext->physical;
+		extents[i + 1].length += EXTENT_LENGTH(*ext);
+		
+		return (path.depth == 0) ? SUCCESS : data_write(path.blocks[path.depth], &path.nodes[path.depth]);
+	}
+	
+	/* Needs a new entry. Make sure the root has room, then split any full node
+	 * on the way down so that each parent can take the index of a new sibling */
+	if (inod->ext_header.entries >= ((inod->ext_header.depth == 0) ? INODE_EXTENTS : INODE_EXTENT_INDEXES)){
+		ret = extent_grow(inod);
 		if (ret != SUCCESS){
-			ERR(fprintf(stderr, "ERR: get_nth_datablock: filesystem full\n"));
-			ERR(fprintf(stderr, "  ret: %d\n", ret));
 			return ret;
 		}
-
-		DEBUG(DB_GETNTH, printf("  DEBUG: get_nth_datablock: created a new block\n"));
-		DEBUG(DB_GETNTH, printf("    new_block: %d\n", new_block));
+	}
+	
+	path.depth = inod->ext_header.depth;
+	for (level = 0; level < path.depth; level++){
+		index = (level == 0) ? inod->ext_index : path.nodes[level].index;
+		entries = (level == 0) ? inod->ext_header.entries : path.nodes[level].header.entries;
 		
-		/* Update values to point to new block */
-		*from_pointer = new_block;
-		next_addr = new_block;
+		path.pos[level] = MAX(extent_index_search(index, entries, ext->logical), 0);
+		path.blocks[level + 1] = index[path.pos[level]].child;
+		ret = data_read(path.blocks[level + 1], &path.nodes[level + 1]);
+		if (ret != SUCCESS){
+			ERR(fprintf(stderr, "ERR: extent_insert: data_read failed\n"));
+			ERR(fprintf(stderr, "  block: %d\n", path.blocks[level + 1]));
+			ERR(fprintf(stderr, "  ret:   %d\n", ret));
+			return ret;
+		}
 		
-		/* Do not update the inode itself, that's the caller's job */
-		*created = TRUE;
+		entries = path.nodes[level + 1].header.entries;
+		if (entries >= ((level + 1 == path.depth) ? BLOCK_EXTENTS : BLOCK_EXTENT_INDEXES)){
+			ret = extent_split(inod, &path, level + 1, ext->logical);
+			if (ret != SUCCESS){
+				return ret;
+			}
+		}
+	}
+	
+	header = (path.depth == 0) ? &inod->ext_header : &path.nodes[path.depth].header;
+	extents = (path.depth == 0) ? inod->extents : path.nodes[path.depth].extents;
+	i = extent_search(extents, header->entries, ext->logical) + 1;
+	
+	memmove(&extents[i + 1], &extents[i], (header->entries - i) * sizeof(extent));
+	extents[i] = *ext;
+	header->entries++;
+	
+	DEBUG(DB_EXTENT, printf("DEBUG: extent_insert: added an extent\n"));
+	DEBUG(DB_EXTENT, printf("  logical:  %u\n", ext->logical));
+	DEBUG(DB_EXTENT, printf("  physical: %u\n", ext->physical));
+	DEBUG(DB_EXTENT, printf("  length:   %u\n", EXTENT_LENGTH(*ext)));
+	DEBUG(DB_EXTENT, printf("  unwritten: %d\n", EXTENT_IS_UNWRITTEN(*ext) != 0));
+	DEBUG(DB_EXTENT, printf("  depth:    %d\n", path.depth));
+	
+	return (path.depth == 0) ? SUCCESS : data_write(path.blocks[path.depth], &path.nodes[path.depth]);
+}
+
+/* Unmaps count file blocks starting from the nth, and if free_blocks is set, frees the
+ * data blocks behind them. Blocks in the range that aren't mapped are skipped. Tree nodes
+ * that end up empty are freed. Only inod in memory is updated, the caller is responsible
+ * for writing it back
+ *
+ * Returns:
+ *   BUF_NULL      - inod is null
+ *   INVALID_BLOCK - the extent tree is malformed
+ *   DATA_FULL     - an extent had to be split in two, and the tree had no room for the second half
+ *   SUCCESS
+ */
+int extent_remove(inode* inod, uint32_t n, uint32_t count, int free_blocks){
+	if (inod == NULL){
+		ERR(fprintf(stderr, "ERR: extent_remove: inode is null\n"));
+		ERR(fprintf(stderr, "  inod: %p\n", inod));
+		return BUF_NULL;
 	}
+	extent_generation++;
+	
+	extent_path path;
+	extent_header* header;
+	extent* extents;
+	extent tail;
+	uint64_t end, start, stop, extent_end;
+	uint32_t first;
+	int ret, i;
 	
-	/* Continue down indirect blocks */
-	for (; i >= 0; i--){
-		if (next_addr == 0 && !create) return 0;
-		ret = data_read(next_addr, &b);
+	end = MIN((uint64_t)n + count, EXTENT_END);
+	while (n < end){
+		ret = extent_find_path(inod, n, &path);
 		if (ret != SUCCESS){
-			ERR(fprintf(stderr, "ERR: get_nth_datablock: data_read failed\n"));
-			ERR(fprintf(stderr, "  next_addr:            %d\n", next_addr));
-			ERR(fprintf(stderr, "  ret:                  %d\n", ret));
 			return ret;
 		}
+		header = (path.depth == 0) ? &inod->ext_header : &path.nodes[path.depth].header;
+		extents = (path.depth == 0) ? inod->extents : path.nodes[path.depth].extents;
 		
-		next_index = offset / intPow(ADDRESSES_PER_BLOCK, i);
-		offset = offset % intPow(ADDRESSES_PER_BLOCK, i);
+		/* Find the first extent ending past n */
+		i = extent_search(extents, header->entries, n);
+		if (i < 0 || n - extents[i].logical >= EXTENT_LENGTH(extents[i])){
+			i++;
+		}
+		if (i >= header->entries){
+			/* Nothing more in this leaf, but the next one may overlap the range */
+			if (path.upper >= end){
+				break;
+			}
+			n = path.upper;
+			continue;
+		}
+		if (extents[i].logical >= end){
+			break;
+		}
 		
-		DEBUG(DB_GETNTH, printf("DEBUG: get_nth_datablock: doing an iteration\n"));
-		DEBUG(DB_GETNTH, printf("  i:          %d\n", i));
-		DEBUG(DB_GETNTH, printf("  next_index: %d\n", next_index));
-		DEBUG(DB_GETNTH, printf("  offset:     %d\n", offset));
+		extent_end = (uint64_t)extents[i].logical + EXTENT_LENGTH(extents[i]);
+		start = MAX(n, extents[i].logical);
+		stop = MIN(end, extent_end);
 		
-		/* If the next block needs to be created */
-		if (b.address[next_index] == 0 && create){
-			/* Create a new block of all zeros */
-			ret = data_allocate(&empty_block, &new_block);
+		/* Punching out the middle of an extent leaves a second piece after the hole,
+		 * which gets its own entry before anything is freed */
+		if (start > extents[i].logical && stop < extent_end){
+			tail.logical = stop;
+			tail.physical = extents[i].physical + (stop - extents[i].logical);
+			tail.length = (extent_end - stop) | EXTENT_IS_UNWRITTEN(extents[i]);
+			ret = extent_insert(inod, &tail);
 			if (ret != SUCCESS){
-				ERR(fprintf(stderr, "ERR: get_nth_datablock: filesystem full\n"));
-				ERR(fprintf(stderr, "  ret: %d\n", ret));
+				ERR(fprintf(stderr, "ERR: extent_remove: couldn't split the extent\n"));
+				ERR(fprintf(stderr, "  start: %llu\n", (unsigned long long)start));
+				ERR(fprintf(stderr, "  stop:  %llu\n", (unsigned long long)stop));
+				ERR(fprintf(stderr, "  ret:   %d\n", ret));
+				return ret;
+			}
+			
+			/* The insert may have rearranged the tree */
+			ret = extent_find_path(inod, start, &path);
+			if (ret != SUCCESS){
+				return ret;
+			}
+			header = (path.depth == 0) ? &inod->ext_header : &path.nodes[path.depth].header;
+			extents = (path.depth == 0) ? inod->extents : path.nodes[path.depth].extents;
+			i = extent_search(extents, header->entries, start);
+			extent_end = stop;
+		}
+		
+		first = extents[i].physical + (start - extents[i].logical);
+		if (start == extents[i].logical && stop == extent_end){
+			memmove(&extents[i], &extents[i + 1], (header->entries - i - 1) * sizeof(extent));
+			header->entries--;
+		}
+		else if (start == extents[i].logical){
+			extents[i].logical += stop - start;
+			extents[i].physical += stop - start;
+			extents[i].length -= stop - start; /* Leaves the unwritten bit alone */
+		}
+		else{
+			extents[i].length = (start - extents[i].logical) | EXTENT_IS_UNWRITTEN(extents[i]);
+		}
+		
+		if (path.depth > 0){
+			ret = data_write(path.blocks[path.depth], &path.nodes[path.depth]);
+			if (ret != SUCCESS){
+				ERR(fprintf(stderr, "ERR: extent_remove: data_write failed\n"));
+				ERR(fprintf(stderr, "  block: %d\n", path.blocks[path.depth]));
+				ERR(fprintf(stderr, "  ret:   %d\n", ret));
+				return ret;
+			}
+			if (header->entries == 0){
+				ret = extent_prune(inod, &path);
+				if (ret != SUCCESS){
+					return ret;
+				}
+			}
+		}
+		
+		DEBUG(DB_EXTENT, printf("DEBUG: extent_remove: unmapped blocks\n"));
+		DEBUG(DB_EXTENT, printf("  start: %llu\n", (unsigned long long)start));
+		DEBUG(DB_EXTENT, printf("  stop:  %llu\n", (unsigned long long)stop));
+		DEBUG(DB_EXTENT, printf("  first: %u\n", first));
+		
+		if (free_blocks){
+			ret = data_free_run(first, stop - start);
+			if (ret != SUCCESS){
+				ERR(fprintf(stderr, "ERR: extent_remove: data_free_run failed\n"));
+				ERR(fprintf(stderr, "  first: %u\n", first));
+				ERR(fprintf(stderr, "  count: %llu\n", (unsigned long long)(stop - start)));
+				ERR(fprintf(stderr, "  ret:   %d\n", ret));
 				return ret;
 			}
+		}
+		
+		n = stop;
+	}
+	
+	return SUCCESS;
+}
+
+/* Unmaps every block of a file from the nth onwards and frees the data blocks behind
+ * them, in a single walk down the right edge of the extent tree. Subtrees lying wholly
+ * past n are freed without any of their nodes being written back, each extent's blocks
+ * are freed as one run, and only the nodes on the path to n are written back.
+ * Only inod in memory is updated, the caller is responsible for writing it back
+ *
+ * Returns:
+ *   BUF_NULL      - inod is null
+ *   INVALID_BLOCK - the extent tree is malformed
+ *   SUCCESS
+ */
+int extent_truncate(inode* inod, uint32_t n){
+	if (inod == NULL){
+		ERR(fprintf(stderr, "ERR: extent_truncate: inode is null\n"));
+		ERR(fprintf(stderr, "  inod: %p\n", inod));
+		return BUF_NULL;
+	}
+	extent_generation++;
+	
+	int ret = extent_truncate_node(&inod->ext_header, inod->extents, n);
+	
+	/* Nothing left in the tree, so the root goes back to holding extents */
+	if (inod->ext_header.entries == 0){
+		inod->ext_header.depth = 0;
+	}
+	
+	return ret;
+}
 
-			DEBUG(DB_GETNTH, printf("  DEBUG: get_nth_datablock: created a new block\n"));
-			DEBUG(DB_GETNTH, printf("    new_block: %d\n", new_block));
+/* Does the work of extent_truncate for one node of the tree, given its header and
+ * entries, recursing into the children that hold blocks past n. Children left empty
+ * are freed and dropped from the node. The caller writes the node itself back
+ *
+ * Returns:
+ *   INVALID_BLOCK - the extent tree is malformed
+ *   SUCCESS
+ */
+int extent_truncate_node(extent_header* header, void* entries, uint32_t n){
+	extent* extents = (extent*)entries;
+	extent_index* index = (extent_index*)entries;
+	extent_block node;
+	uint32_t length;
+	int ret, child;
+	
+	if (header->depth > EXTENT_MAX_DEPTH){
+		ERR(fprintf(stderr, "ERR: extent_truncate_node: tree too deep\n"));
+		ERR(fprintf(stderr, "  depth: %d\n", header->depth));
+		return INVALID_BLOCK;
+	}
+	
+	/* A leaf: drop the extents from n on, and cut short the one n falls in */
+	if (header->depth == 0){
+		while (header->entries > 0){
+			extent* ext = &extents[header->entries - 1];
+			length = EXTENT_LENGTH(*ext);
+			if ((uint64_t)ext->logical + length <= n){
+				break;
+			}
 			
-			/* Update b and write it back */
-			b.address[next_index] = new_block;
-			ret = data_write(next_addr, &b);
+			if (ext->logical >= n){
+				ret = data_free_run(ext->physical, length);
+				header->entries--;
+			}
+			else{
+				ret = data_free_run(ext->physical + (n - ext->logical), length - (n - ext->logical));
+				ext->length = (n - ext->logical) | EXTENT_IS_UNWRITTEN(*ext);
+			}
 			if (ret != SUCCESS){
-				ERR(fprintf(stderr, "ERR: get_nth_datablock: tried to write an invalid block\n"));
-				ERR(fprintf(stderr, "  next_addr: %d\n", next_addr));
-				ERR(fprintf(stderr, "  ret:       %d\n", ret));
+				ERR(fprintf(stderr, "ERR: extent_truncate_node: data_free_run failed\n"));
+				ERR(fprintf(stderr, "  physical: %u\n", ext->physical));
+				ERR(fprintf(stderr, "  ret:      %d\n", ret));
 				return ret;
 			}
-			*created = TRUE;
+		}
+		return SUCCESS;
+	}
+	
+	/* An index: go through the children from the last, freeing the ones left empty,
+	 * until reaching one that still holds blocks before n */
+	while (header->entries > 0){
+		child = index[header->entries - 1].child;
+		ret = data_read(child, &node);
+		if (ret != SUCCESS){
+			ERR(fprintf(stderr, "ERR: extent_truncate_node: data_read failed\n"));
+			ERR(fprintf(stderr, "  child: %d\n", child));
+			ERR(fprintf(stderr, "  ret:   %d\n", ret));
+			return ret;
+		}
+		extent_node_reads++;
+		
+		if (node.header.depth != header->depth - 1){
+			ERR(fprintf(stderr, "ERR: extent_truncate_node: child at the wrong depth\n"));
+			ERR(fprintf(stderr, "  child: %d\n", child));
+			ERR(fprintf(stderr, "  depth: %d\n", node.header.depth));
+			return INVALID_BLOCK;
+		}
+		
+		ret = extent_truncate_node(&node.header, node.extents, n);
+		if (ret != SUCCESS){
+			return ret;
 		}
 		
-		next_addr = b.address[next_index];
+		/* Part of the child is before n, so it stays and this is the last node to change */
+		if (node.header.entries > 0){
+			return data_write(child, &node);
+		}
 		
-		DEBUG(DB_GETNTH, printf("  next_addr:  %d\n", next_addr));
+		ret = data_free(child);
+		if (ret != SUCCESS){
+			ERR(fprintf(stderr, "ERR: extent_truncate_node: data_free failed\n"));
+			ERR(fprintf(stderr, "  child: %d\n", child));
+			ERR(fprintf(stderr, "  ret:   %d\n", ret));
+			return ret;
+		}
+		header->entries--;
 	}
 	
-	return next_addr;
- }
- 
-/* Simple helper function to calculate pow for positive ints */
-int intPow(int x, int y){
-	int sum = 1;
-	int i;
-	for (i = 0; i < y; i++){
-		sum *= x;
+	return SUCCESS;
+}
+
+/* Turns the nth block of a file from unwritten back into an ordinary block, once real
+ * data has been written to it. Only inod in memory is updated
+ *
+ * Returns:
+ *   BUF_NULL      - inod is null
+ *   INVALID_BLOCK - the extent tree is malformed
+ *   DATA_FULL     - the unwritten extent had to be split, and the tree had no room
+ *   SUCCESS       - the block is written (or wasn't unwritten to begin with)
+ */
+int extent_mark_written(inode* inod, uint32_t n){
+	uint32_t physical, run;
+	int unwritten, ret;
+	extent ext;
+	
+	ret = extent_lookup(inod, n, &physical, &run, &unwritten);
+	if (ret != SUCCESS || !unwritten){
+		return ret;
+	}
+	
+	/* Take the block out of its extent without freeing it, then put it back written */
+	ret = extent_remove(inod, n, 1, FALSE);
+	if (ret != SUCCESS){
+		return ret;
+	}
+	
+	ext.logical = n;
+	ext.physical = physical;
+	ext.length = 1;
+	ret = extent_insert(inod, &ext);
+	if (ret != SUCCESS){
+		/* Put it back the way it was rather than leak the block */
+		ext.length |= EXTENT_UNWRITTEN;
+		extent_insert(inod, &ext);
+	}
+	
+	return ret;
+}
+
+/* Checks whether extent b carries on exactly where extent a ends, both in the file
+ * and on disk, so that the two could be one extent
+ *
+ * Returns:
+ *   TRUE  - a and b can be merged
+ *   FALSE - they can't, or the result would be too long
+ */
+int extent_contiguous(extent* a, extent* b){
+	return a->logical + EXTENT_LENGTH(*a) == b->logical &&
+		a->physical + EXTENT_LENGTH(*a) == b->physical &&
+		EXTENT_IS_UNWRITTEN(*a) == EXTENT_IS_UNWRITTEN(*b) &&
+		(uint64_t)EXTENT_LENGTH(*a) + EXTENT_LENGTH(*b) <= EXTENT_MAX_LENGTH;
+}
+
+/* Walks the extent tree of inod from the root to the leaf that covers the nth block
+ * of the file, reading each node on the way into path
+ *
+ * Returns:
+ *   BUF_NULL      - inod or path is null
+ *   INVALID_BLOCK - the extent tree is malformed
+ *   SUCCESS
+ */
+int extent_find_path(inode* inod, uint32_t n, extent_path* path){
+	if (inod == NULL || path == NULL){
+		ERR(fprintf(stderr, "ERR: extent_find_path: buffer is null\n"));
+		ERR(fprintf(stderr, "  inod: %p\n", inod));
+		ERR(fprintf(stderr, "  path: %p\n", path));
+		return BUF_NULL;
+	}
+	
+	extent_index* index;
+	int level, entries, ret;
+	
+	path->depth = inod->ext_header.depth;
+	path->blocks[0] = INVALID_DATA;
+	path->upper = EXTENT_END;
+	if (path->depth > EXTENT_MAX_DEPTH){
+		ERR(fprintf(stderr, "ERR: extent_find_path: tree is too deep\n"));
+		ERR(fprintf(stderr, "  depth: %d\n", path->depth));
+		return INVALID_BLOCK;
+	}
+	
+	for (level = 0; level < path->depth; level++){
+		index = (level == 0) ? inod->ext_index : path->nodes[level].index;
+		entries = (level == 0) ? inod->ext_header.entries : path->nodes[level].header.entries;
+		if (entries == 0){
+			ERR(fprintf(stderr, "ERR: extent_find_path: empty index node\n"));
+			ERR(fprintf(stderr, "  level: %d\n", level));
+			return INVALID_BLOCK;
+		}
+		
+		/* Blocks before the first index entry belong to the first child */
+		path->pos[level] = MAX(extent_index_search(index, entries, n), 0);
+		if (path->pos[level] + 1 < entries){
+			path->upper = index[path->pos[level] + 1].logical;
+		}
+		
+		path->blocks[level + 1] = index[path->pos[level]].child;
+		extent_node_reads++;
+		ret = data_read(path->blocks[level + 1], &path->nodes[level + 1]);
+		if (ret != SUCCESS){
+			ERR(fprintf(stderr, "ERR: extent_find_path: data_read failed\n"));
+			ERR(fprintf(stderr, "  block: %d\n", path->blocks[level + 1]));
+			ERR(fprintf(stderr, "  ret:   %d\n", ret));
+			return ret;
+		}
+	}
+	
+	return SUCCESS;
+}
+
+/* Binary search for the last of the sorted extents starting at or before block n
+ *
+ * Returns:
+ *   -1  - every extent starts after n
+ *   INT - index of the extent
+ */
+int extent_search(extent* extents, int entries, uint32_t n){
+	int low = 0;
+	int high = entries - 1;
+	int found = -1;
+	int mid;
+	
+	while (low <= high){
+		mid = low + (high - low) / 2;
+		if (extents[mid].logical <= n){
+			found = mid;
+			low = mid + 1;
+		}
+		else{
+			high = mid - 1;
+		}
+	}
+	
+	return found;
+}
+
+/* Binary search for the last of the sorted index entries starting at or before block n
+ *
+ * Returns:
+ *   -1  - every entry starts after n
+ *   INT - index of the entry
+ */
+int extent_index_search(extent_index* index, int entries, uint32_t n){
+	int low = 0;
+	int high = entries - 1;
+	int found = -1;
+	int mid;
+	
+	while (low <= high){
+		mid = low + (high - low) / 2;
+		if (index[mid].logical <= n){
+			found = mid;
+			low = mid + 1;
+		}
+		else{
+			high = mid - 1;
+		}
+	}
+	
+	return found;
+}
+
+/* Splits the full tree node at the given level of path in half, moving the upper
+ * half into a new block and adding it to the parent, which must have room. Afterwards
+ * path follows whichever half covers block n
+ *
+ * Returns:
+ *   BUF_NULL      - inod or path is null
+ *   INVALID_BLOCK - level isn't a block in path
+ *   DATA_FULL     - there are no free blocks for the new node
+ *   SUCCESS
+ */
+int extent_split(inode* inod, extent_path* path, int level, uint32_t n){
+	if (inod == NULL || path == NULL){
+		ERR(fprintf(stderr, "ERR: extent_split: buffer is null\n"));
+		ERR(fprintf(stderr, "  inod: %p\n", inod));
+		ERR(fprintf(stderr, "  path: %p\n", path));
+		return BUF_NULL;
+	}
+	if (level < 1 || level > path->depth){
+		ERR(fprintf(stderr, "ERR: extent_split: level out of range\n"));
+		ERR(fprintf(stderr, "  level: %d\n", level));
+		ERR(fprintf(stderr, "  depth: %d\n", path->depth));
+		return INVALID_BLOCK;
+	}
+	
+	extent_block* node = &path->nodes[level];
+	extent_block sibling;
+	extent_header* parent_header;
+	extent_index* parent_index;
+	uint32_t key;
+	int half, moved, pos, new_block, ret;
+	
+	half = node->header.entries / 2;
+	moved = node->header.entries - half;
+	
+	memset(&sibling, 0, sizeof(extent_block));
+	sibling.header.depth = node->header.depth;
+	sibling.header.entries = moved;
+	if (node->header.depth == 0){
+		memcpy(sibling.extents, &node->extents[half], moved * sizeof(extent));
+		memset(&node->extents[half], 0, moved * sizeof(extent));
+		key = sibling.extents[0].logical;
+	}
+	else{
+		memcpy(sibling.index, &node->index[half], moved * sizeof(extent_index));
+		memset(&node->index[half], 0, moved * sizeof(extent_index));
+		key = sibling.index[0].logical;
 	}
+	node->header.entries = half;
+	
+	ret = data_allocate_near(&sibling, group_first_block(inod->group), &new_block);
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: extent_split: filesystem full\n"));
+		ERR(fprintf(stderr, "  ret: %d\n", ret));
+		return ret;
+	}
+	ret = data_write(path->blocks[level], node);
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: extent_split: data_write failed\n"));
+		ERR(fprintf(stderr, "  block: %d\n", path->blocks[level]));
+		ERR(fprintf(stderr, "  ret:   %d\n", ret));
+		return ret;
+	}
+	
+	/* Add the new node to the parent, just after the old one */
+	parent_header = (level == 1) ? &inod->ext_header : &path->nodes[level - 1].header;
+	parent_index = (level == 1) ? inod->ext_index : path->nodes[level - 1].index;
+	pos = path->pos[level - 1] + 1;
+	
+	memmove(&parent_index[pos + 1], &parent_index[pos], (parent_header->entries - pos) * sizeof(extent_index));
+	parent_index[pos].logical = key;
+	parent_index[pos].child = new_block;
+	parent_header->entries++;
+	if (level > 1){
+		ret = data_write(path->blocks[level - 1], &path->nodes[level - 1]);
+		if (ret != SUCCESS){
+			ERR(fprintf(stderr, "ERR: extent_split: data_write failed\n"));
+			ERR(fprintf(stderr, "  block: %d\n", path->blocks[level - 1]));
+			ERR(fprintf(stderr, "  ret:   %d\n", ret));
+			return ret;
+		}
+	}
+	
+	DEBUG(DB_EXTENT, printf("DEBUG: extent_split: split a node\n"));
+	DEBUG(DB_EXTENT, printf("  level:     %d\n", level));
+	DEBUG(DB_EXTENT, printf("  key:       %u\n", key));
+	DEBUG(DB_EXTENT, printf("  new_block: %d\n", new_block));
+	
+	if (n >= key){
+		path->pos[level - 1] = pos;
+		path->blocks[level] = new_block;
+		memcpy(node, &sibling, sizeof(extent_block));
+	}
+	
+	return SUCCESS;
+}
+
+/* Moves the contents of the (full) root of the extent tree into a new block, and
+ * makes the root a single index entry pointing at it. Only inod in memory is updated
+ *
+ * Returns:
+ *   BUF_NULL  - inod is null
+ *   DATA_FULL - there are no free blocks, or the tree is as deep as it can go
+ *   SUCCESS
+ */
+int extent_grow(inode* inod){
+	if (inod == NULL){
+		ERR(fprintf(stderr, "ERR: extent_grow: inode is null\n"));
+		ERR(fprintf(stderr, "  inod: %p\n", inod));
+		return BUF_NULL;
+	}
+	if (inod->ext_header.depth >= EXTENT_MAX_DEPTH){
+		ERR(fprintf(stderr, "ERR: extent_grow: tree is too deep\n"));
+		ERR(fprintf(stderr, "  depth: %d\n", inod->ext_header.depth));
+		return DATA_FULL;
+	}
+	
+	extent_block child;
+	int new_block, ret;
+	
+	memset(&child, 0, sizeof(extent_block));
+	child.header = inod->ext_header;
+	memcpy(child.extents, inod->extents, INLINE_DATA_SIZE - sizeof(extent_header));
+	
+	ret = data_allocate_near(&child, group_first_block(inod->group), &new_block);
+	if (ret != SUCCESS){
+		ERR(fprintf(stderr, "ERR: extent_grow: filesystem full\n"));
+		ERR(fprintf(stderr, "  ret: %d\n", ret));
+		return ret;
+	}
+	
+	memset(inod->extents, 0, INLINE_DATA_SIZE - sizeof(extent_header));
+	inod->ext_header.depth++;
+	inod->ext_header.entries = 1;
+	inod->ext_index[0].logical = (child.header.depth == 0) ? child.extents[0].logical : child.index[0].logical;
+	inod->ext_index[0].child = new_block;
+	
+	DEBUG(DB_EXTENT, printf("DEBUG: extent_grow: tree grew a level\n"));
+	DEBUG(DB_EXTENT, printf("  depth:     %d\n", inod->ext_header.depth));
+	DEBUG(DB_EXTENT, printf("  new_block: %d\n", new_block));
+	
+	return SUCCESS;
+}
 
-	return sum;
-}
\ No newline at end of file
+/* Frees the empty leaf at the bottom of path, along with any index nodes that are
+ * left empty by its removal. Only inod in memory is updated
+ *
+ * Returns:
+ *   BUF_NULL - inod or path is null
+ *   SUCCESS
+ */
+int extent_prune(inode* inod, extent_path* path){
+	if (inod == NULL || path == NULL){
+		ERR(fprintf(stderr, "ERR: extent_prune: buffer is null\n"));
+		ERR(fprintf(stderr, "  inod: %p\n", inod));
+		ERR(fprintf(stderr, "  path: %p\n", path));
+		return BUF_NULL;
+	}
+	
+	extent_header* header;
+	extent_index* index;
+	int level, pos, ret;
+	
+	for (level = path->depth; level > 0 && path->nodes[level].header.entries == 0; level--){
+		ret = data_free(path->blocks[level]);
+		if (ret != SUCCESS){
+			ERR(fprintf(stderr, "ERR: extent_prune: data_free failed\n"));
+			ERR(fprintf(stderr, "  block: %d\n", path->blocks[level]));
+			ERR(fprintf(stderr, "  ret:   %d\n", ret));
+			return ret;
+		}
+		
+		header = (level == 1) ? &inod->ext_header : &path->nodes[level - 1].header;
+		index = (level == 1) ? inod->ext_index : path->nodes[level - 1].index;
+		pos = path->pos[level - 1];
+		memmove(&index[pos], &index[pos + 1], (header->entries - pos - 1) * sizeof(extent_index));
+		header->entries--;
+		
+		if (level > 1){
+			ret = data_write(path->blocks[level - 1], &path->nodes[level - 1]);
+			if (ret != SUCCESS){
+				ERR(fprintf(stderr, "ERR: extent_prune: data_write failed\n"));
+				ERR(fprintf(stderr, "  block: %d\n", path->blocks[level - 1]));
+				ERR(fprintf(stderr, "  ret:   %d\n", ret));
+				return ret;
+			}
+		}
+	}
+	
+	/* Nothing left in the tree, so the root goes back to holding extents */
+	if (inod->ext_header.entries == 0){
+		inod->ext_header.depth = 0;
+	}
+	
+	return SUCCESS;
+}
@@ -9,8 +9,46 @@
 #define DIRENTS_PER_BLOCK (BLOCK_SIZE / sizeof(dir_ent))
 #define DIRENTS_REMAINDER (BLOCK_SIZE % sizeof(dir_ent))
 
-#define ADDRESSES_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
-#define ADDRESSES_REMAINDER (BLOCK_SIZE % sizeof(uint32_t))
+/* fallocate modes, in case the C library doesn't provide them */
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE 0x02
+#endif
+#ifndef FALLOC_FL_ZERO_RANGE
+#define FALLOC_FL_ZERO_RANGE 0x10
+#endif
+
+/* Flags of a file_extent returned by fiemap_i, with the values FIEMAP uses */
+#ifndef FIEMAP_EXTENT_LAST
+#define FIEMAP_EXTENT_LAST 0x00000001
+#endif
+#ifndef FIEMAP_EXTENT_UNWRITTEN
+#define FIEMAP_EXTENT_UNWRITTEN 0x00000800
+#endif
+
+/* lseek whences for finding data and holes, likewise */
+#ifndef SEEK_DATA
+#define SEEK_DATA 3
+#endif
+#ifndef SEEK_HOLE
+#define SEEK_HOLE 4
+#endif
+
+/* Dimensions of an extent tree node stored in a data block */
+#define BLOCK_EXTENTS ((BLOCK_SIZE - sizeof(extent_header)) / sizeof(extent))
+#define BLOCK_EXTENT_INDEXES ((BLOCK_SIZE - sizeof(extent_header)) / sizeof(extent_index))
+#define EXTENT_REMAINDER ((BLOCK_SIZE - sizeof(extent_header)) % sizeof(extent))
+
+/* Levels of index the extent tree may grow to, far more than a 32 bit file needs */
+#define EXTENT_MAX_DEPTH 4
+
+/* One past the last file block an extent can map */
+#define EXTENT_END UINT32_MAX
+
+/* Largest a file can be, with every block its extent tree can map */
+#define MAX_FILE_SIZE ((off_t)EXTENT_END * BLOCK_SIZE)
 
 /* Structures that compose the open file table, used for open, close, unlink behavior
  *
@@ -18,10 +56,37 @@
  * 1. for each open inode, has number of references, pending deletion flag
  * 2. for each fd, has a inode and the type that it was opened with (O_APPND, O_WRONLY, etc)
  */
+/* A block map cursor remembers the last extent (or hole) looked up in a file, so that
+ * walking the file in order only goes down the extent tree once per extent rather than
+ * once per block. Every change to any block map bumps extent_generation, which makes
+ * every cursor stale
+ */
+typedef struct extent_cursor {
+	uint32_t generation; // extent_generation when the cursor was filled in
+	uint32_t start; // First file block of the extent or hole
+	uint32_t count; // Blocks in the extent or hole from start, 0 if the cursor is empty
+	uint32_t physical; // Data block start is in, INVALID_DATA for a hole
+	int unwritten;
+} extent_cursor;
+
+/* Write combining. Small writes that carry on from the last one to an open file are
+ * gathered in the file's OFT entry, up to the end of the block they're in, and handed
+ * to write_i together. The buffer is written out when it reaches the end of its block,
+ * when a write doesn't carry on from it, and before anything else looks at or changes
+ * the file, so no one ever sees the file without it
+ */
+typedef struct write_buffer {
+	uint8_t* data; // BLOCK_SIZE bytes, allocated the first time a write is buffered
+	off_t offset; // Where in the file data[0] goes
+	int size; // Bytes buffered, 0 if the buffer is empty
+} write_buffer;
+
 typedef struct oft_inode {
 	int inum; // The inum associated with this entry
 	int ref; // How many files currently have this inum open
 	int pending_deletion; // Will this file be deleted after the last reference is closed?
+	extent_cursor cursor; // Where the last read or write of this inode was in its block map
+	write_buffer wbuf; // Small writes not yet given to write_i
 } oft_inode;
 
 typedef struct oft_fd {
@@ -30,17 +95,96 @@ typedef struct oft_fd {
 	int flags; // The flags associated with this fd
 } oft_fd;
 
+/* Delayed allocation. While delalloc_enabled is set, writes to regular files that
+ * land in holes are kept in memory as dirty pages rather than being given a data
+ * block straight away. The blocks are allocated when the file is flushed, all at
+ * once and in file order, so that they come out contiguous
+ */
+#define DELALLOC_MAX_PAGES 256 // Dirty pages a file may have before it is flushed on its own
+
+typedef struct dirty_page {
+	uint32_t n; // The block of the file this page holds
+	uint8_t data[BLOCK_SIZE];
+} dirty_page;
+
+typedef struct dirty_inode {
+	int inum; // The inum these pages belong to
+	int num_pages;
+	int capacity; // Pages there's room for, grown by doubling so big writes don't copy them over and over
+	dirty_page* pages; // Sorted by n
+} dirty_inode;
+
+/* Value of get_nth_datablock's create for a block the caller is going to write every
+ * byte of, so a new one isn't filled with 0s first */
+#define CREATE_UNZEROED 2
+
+/* A run of a file's blocks that is contiguous on disk, as reported by fiemap_i */
+typedef struct file_extent {
+	uint32_t logical; // First file block
+	uint32_t physical; // Data block holding it
+	uint32_t length; // In blocks
+	uint32_t flags; // FIEMAP_EXTENT_*
+} file_extent;
+
+/* Blocks copy_range_i reads and writes at a time, where they can't be shared */
+#define COPY_CHUNK_BLOCKS 16
+
+/* Sparse policies, for when write_i frees blocks of 0s rather than writing them */
+#define SPARSE_DEFAULT -1 // Follow sparse_policy (only for sparse_set_policy)
+#define SPARSE_ALWAYS 0 // Any block that ends up all 0s, even after a partial write
+#define SPARSE_ALIGNED 1 // Only whole blocks written as 0s, so partial writes skip the check
+#define SPARSE_NEVER 2 // Never: 0s are written like any other data, with no check at all
+
+/* Asynchronous deletion. While orphan_async is set, deleting a file only puts its
+ * inode on the orphan list in the superblock. The reaper thread frees the blocks
+ * later, a bounded batch per transaction, so deleting a large file doesn't hold up
+ * the unlink or one giant transaction
+ */
+#define ORPHAN_BATCH_BLOCKS 256 // Blocks freed per transaction
+
 extern oft_inode* oft_inodes;
 extern int oft_inodes_size;
 extern oft_fd* oft_fds;
 extern int oft_fds_size;
 
-/* Addresses mapped onto a block */
-typedef struct __attribute__((__packed__)) address_block {
-	uint32_t address[ADDRESSES_PER_BLOCK];
+extern int delalloc_enabled;
+extern dirty_inode* dirty_inodes;
+extern int dirty_inodes_size;
+
+extern pthread_mutex_t fs_lock;
+
+extern int orphan_async;
+extern pthread_mutex_t orphan_lock;
+extern pthread_cond_t orphan_wake;
+extern pthread_t orphan_reaper_thread;
+extern int orphan_reaper_running;
+extern int orphan_blocks_reclaimed;
 
-	uint8_t padding[ADDRESSES_REMAINDER];
-} address_block;
+extern int sparse_policy;
+
+extern uint32_t extent_generation;
+extern int extent_node_reads;
+
+/* Extent tree node mapped onto a block */
+typedef struct __attribute__((__packed__)) extent_block {
+	extent_header header;
+	union {
+		extent extents[BLOCK_EXTENTS];
+		extent_index index[BLOCK_EXTENT_INDEXES];
+	};
+
+	uint8_t padding[EXTENT_REMAINDER];
+} extent_block;
+
+/* Route from the root of an extent tree down to a leaf. Level 0 is the root in
+ * the inode, level depth is the leaf. Only levels 1 and up have blocks */
+typedef struct extent_path {
+	int depth;
+	int blocks[EXTENT_MAX_DEPTH + 1]; // Data block holding each level
+	int pos[EXTENT_MAX_DEPTH + 1]; // Index entry followed out of each level
+	uint32_t upper; // First file block past the range covered by the leaf
+	extent_block nodes[EXTENT_MAX_DEPTH + 1];
+} extent_path;
 
 /* Directories mapped onto a block */
 typedef struct __attribute__((__packed__)) dir_ent {
@@ -58,6 +202,20 @@ int oft_add(int inode, int flags);
 int oft_remove(int fd);
 int oft_attempt_delete(int inode);
 int oft_lookup(int fd, int* inode, int* flags);
+void oft_get_cursor(int inum, extent_cursor* cursor);
+void oft_put_cursor(int inum, extent_cursor* cursor);
+ssize_t oft_write(int inum, void* buf, off_t offset, size_t size);
+int oft_flush_buffer(int inum);
+off_t oft_buffered_end(int inum);
+
+int delalloc_find(int inum);
+int delalloc_page(int inum, uint32_t n, int create, uint8_t** data);
+int delalloc_remove_page(int inum, uint32_t n);
+void delalloc_drop(int inum);
+void delalloc_truncate(int inum, off_t size);
+int delalloc_count(int inum);
+int delalloc_flush(int inum);
+int delalloc_flush_all();
 
 int mkdir_fs(const char *pathname, mode_t mode, int uid, int gid);
 int mknod_fs(const char *pathname, mode_t mode, int uid, int gid);
@@ -74,13 +232,49 @@ int search_by_inum(int inum, int search_num, int* index);
 int read_dir_whole(int inum, dir_ent* buf);
 int read_dir_page(int inum, dirblock* d, int page, int* entries, int* last);
 int truncate(int inum, off_t offset);
+int truncate_tail(inode* inod, int block_addr, int tail);
 int del(int inum);
 
-int read_i(int inum, void* buf, off_t offset, size_t size);
-int write_i(int inum, void* buf, off_t offset, size_t size);
+int orphan_add(int inum);
+int orphan_reap_locked();
+int orphan_recover();
+int orphan_reaper_start();
+void orphan_reaper_stop();
+void* orphan_reaper_main(void* arg);
+
+ssize_t read_i(int inum, void* buf, off_t offset, size_t size);
+ssize_t write_i(int inum, void* buf, off_t offset, size_t size);
+int write_run(inode* inod, uint32_t n, uint32_t count, void* buf, uint32_t* done);
+int seek_i(int inum, off_t offset, int whence, off_t* result);
+int fiemap_i(int inum, uint32_t start, file_extent* extents, int max, int* found);
+int is_zero(const void* buf, size_t size);
+int sparse_policy_of(inode* inod);
+int sparse_set_policy(int inum, int policy);
+int fallocate_i(int inum, int mode, off_t offset, off_t len);
+int reflink_range(int src, uint32_t src_n, int dst, uint32_t dst_n, uint32_t count);
+int reflink_unshare(inode* inod, uint32_t n, int* block_addr, int copy);
+int clone_i(int src, int dst);
+ssize_t copy_range_i(int src, off_t src_off, int dst, off_t dst_off, size_t size);
 
+int inline_to_blocks(int inum, inode* inod);
+int file_data_write(inode* inod, int block_addr, void* buf);
 int get_nth_datablock(inode* inod, off_t n, int create, int* created);
 int rm_nth_datablock(inode* inod, off_t n);
-int intPow(int x, int y);
+
+int extent_lookup(inode* inod, uint32_t n, uint32_t* physical, uint32_t* run, int* unwritten);
+int extent_cursor_lookup(extent_cursor* cursor, inode* inod, uint32_t n, uint32_t* physical, uint32_t* run, int* unwritten);
+int extent_goal(inode* inod, uint32_t n);
+int extent_insert(inode* inod, extent* ext);
+int extent_remove(inode* inod, uint32_t n, uint32_t count, int free_blocks);
+int extent_truncate(inode* inod, uint32_t n);
+int extent_truncate_node(extent_header* header, void* entries, uint32_t n);
+int extent_mark_written(inode* inod, uint32_t n);
+int extent_contiguous(extent* a, extent* b);
+int extent_find_path(inode* inod, uint32_t n, extent_path* path);
+int extent_search(extent* extents, int entries, uint32_t n);
+int extent_index_search(extent_index* index, int entries, uint32_t n);
+int extent_split(inode* inod, extent_path* path, int level, uint32_t n);
+int extent_grow(inode* inod);
+int extent_prune(inode* inod, extent_path* path);
 
 #endif
\ No newline at end of file
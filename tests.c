@@ -2,8 +2,11 @@
 #include "layer0.h"
 #include "layer1.h"
 #include "layer2.h"
+#include "fsck.h"
+#include "frag.h"
 #include <limits.h>
 #include <time.h>
+#include <sys/mman.h>
 
 #define TEST_FAILED 0
 #define TEST_PASSED 1
@@ -20,10 +23,36 @@ int write_read_file_offset();
 int write_read_file_offset_2();
 int overwrite_with_zeros();
 int write_on_small_fs_1();
+int inode_chunks_released();
+int inline_small_file();
+int extent_punch_middle();
+int delalloc_contiguous();
+int fallocate_prealloc_punch();
+int block_groups_locality();
+int journal_group_commit();
+int log_structured_cleaner();
+int snapshot_copy_on_write();
+int fsck_parallel();
+int mkfs_parallel_identical();
+int orphan_background_reclaim();
+int discard_freed_blocks();
+int extent_cursor_sequential();
+int write_inode_updates();
+int sparse_zero_policy();
+int direct_partial_writes();
+int truncate_frees_subtrees();
+int seek_data_hole();
+int fiemap_fragmentation();
+int large_file_offsets();
+int defrag_file_contiguous();
+int reflink_clone_cow();
+int big_write_runs();
+int write_combining();
+int journal_free_reuse();
 void print_inode(inode* inode);
 
 int main(int argc, const char **argv){
-	int (*tests[])() = {mkfs_size, lots_inodes, lots_inodes_free_some, free_nonexistent_inode, get_nth_1, get_nth_2, write_read_file, write_read_file_offset, write_read_file_offset_2, overwrite_with_zeros, write_on_small_fs_1};
+	int (*tests[])() = {mkfs_size, lots_inodes, lots_inodes_free_some, free_nonexistent_inode, get_nth_1, get_nth_2, write_read_file, write_read_file_offset, write_read_file_offset_2, overwrite_with_zeros, write_on_small_fs_1, inode_chunks_released, inline_small_file, extent_punch_middle, delalloc_contiguous, fallocate_prealloc_punch, block_groups_locality, journal_group_commit, log_structured_cleaner, snapshot_copy_on_write, fsck_parallel, mkfs_parallel_identical, orphan_background_reclaim, discard_freed_blocks, extent_cursor_sequential, write_inode_updates, sparse_zero_policy, direct_partial_writes, truncate_frees_subtrees, seek_data_hole, fiemap_fragmentation, large_file_offsets, defrag_file_contiguous, reflink_clone_cow, big_write_runs, write_combining, journal_free_reuse};
 	int max_test = sizeof(tests) / sizeof(tests[0]);
 	int num_tests = MAX(max_test, argc - 1);
 	srand(time(NULL));
@@ -141,17 +170,20 @@ void print_inode(inode* inode){
 	printf("inode->links:          %d\n", inode->links);
 	printf("inode->uid:            %d\n", inode->uid);
 	printf("inode->gid:            %d\n", inode->gid);
-	printf("inode->size:           %d\n", inode->size);
+	printf("inode->size:           %llu\n", (unsigned long long)inode->size);
 	printf("inode->access_time:    %d\n", inode->access_time);
 	printf("inode->mod_time:       %d\n", inode->mod_time);
-	printf("inode->direct_blocks:  %d",   inode->direct_blocks[0]);
+	printf("inode->flags:          %d\n", inode->flags);
+	printf("inode->ext_header:     %d entries, depth %d\n", inode->ext_header.entries, inode->ext_header.depth);
 	int i;
-	for (i = 1; i < NUM_DIRECT; i++){
-		printf(", %d", inode->direct_blocks[i]);
+	for (i = 0; i < inode->ext_header.entries; i++){
+		if (inode->ext_header.depth == 0){
+			printf("  extent: %u -> %u, %u blocks\n", inode->extents[i].logical, inode->extents[i].physical, inode->extents[i].length);
+		}
+		else{
+			printf("  index:  %u -> block %u\n", inode->ext_index[i].logical, inode->ext_index[i].child);
+		}
 	}
-	printf(": \n");
-	printf("inode->indirect:        %d\n", inode->indirect);
-	printf("inode->double_indirect: %d\n", inode->double_indirect);
 }
 
  /********************************************************************************************************************/
@@ -234,11 +266,14 @@ int mkfs_size(){
  *   - Confirm that the lowest available inode is allocated first & same inode isn't allocated multiple times if not freed
  *   - Confirm that inodes cannot be created once FS is full
  *   - Confirm that we can fit the expected number of inodes in the FS
+ *   - Confirm that inode chunks are allocated from the data region as needed
  * METHODOLOGY:
  *   - Create inodes until the filesystem runs out of space for them
  * EXPECTED RESULTS:
  *   - inode creation works and returns SUCCESS, until the FS runs out of room and they begin returning ILIST_FULL
- *   - exactly sb.num_inodes - 1 inodes should be created, since the root takes up a spot
+ *   - every free data block becomes a chunk, so exactly free_blocks * INODES_PER_BLOCK inodes should be
+ *     created, plus the rest of the root's chunk
+ *   - no data blocks are left free afterwards
  */
 int lots_inodes(){
 	printf("%30s", "MK_INODES_UNTIL_FAILURE");
@@ -250,7 +285,9 @@ int lots_inodes(){
 	superblock sb;
 	read_superblock(&sb);
 	
-	int expected_inodes = sb.num_inodes - 1;
+	int free_blocks;
+	data_count_free(&free_blocks);
+	int expected_inodes = free_blocks * INODES_PER_BLOCK + INODES_PER_BLOCK - 1;
 
 	int testing = 1, number = 0, previous_number = 0, result = 0, inodes_created = 0;
 	inode dummy_inode;
@@ -279,8 +316,9 @@ int lots_inodes(){
 		previous_number = number;
 	}
 	
+	data_count_free(&free_blocks);
 	free(disk);
-	if (inodes_created != expected_inodes){
+	if (inodes_created != expected_inodes || free_blocks != 0){
 		//printf("%d != %d\n", inodes_created, expected_inodes);
 		return TEST_FAILED;
 	}
@@ -299,9 +337,9 @@ int lots_inodes(){
  * 	 - Frees inodes starting from index 2, after the root inode
  * EXPECTED RESULTS:
  *   - inode creation works and returns SUCCESS, until the FS runs out of room and they begin returning ILIST_FULL
- *   - exactly sb.num_inodes - 1 inodes should be created at this point
+ *   - exactly free_blocks * INODES_PER_BLOCK + INODES_PER_BLOCK - 1 inodes should be created at this point
  * 	 - an arbitrary number of inodes are then freed, if result is SUCCESS, the number of inodes created is decremented
- *	 - exactly sb.num_inodes - 1 - (NUM_FREED) should exist
+ *	 - exactly that many - (NUM_FREED) should exist
  */
 int lots_inodes_free_some() {
 	printf("%30s", "MK_INODES_AND_FREE_SOME");
@@ -314,7 +352,9 @@ int lots_inodes_free_some() {
 	superblock sb;
 	read_superblock(&sb);
 	
-	int expected_inodes = sb.num_inodes - 1 - NUM_FREED;
+	int free_blocks;
+	data_count_free(&free_blocks);
+	int expected_inodes = free_blocks * INODES_PER_BLOCK + INODES_PER_BLOCK - 1 - NUM_FREED;
 
 	int testing = 1, number = 0, previous_number = 0, result = 0, inodes_created = 0;
 	inode dummy_inode;
@@ -381,7 +421,9 @@ int lots_inodes_free_all() {
 	superblock sb;
 	read_superblock(&sb);
 	
-	int expected_inodes = sb.num_inodes - 1;
+	int free_blocks;
+	data_count_free(&free_blocks);
+	int expected_inodes = free_blocks * INODES_PER_BLOCK + INODES_PER_BLOCK - 1;
 
 	int testing = 1, number = 0, previous_number = 0, result = 0, inodes_created = 0;
 	inode dummy_inode;
@@ -489,18 +531,19 @@ int free_nonexistent_inode() {
 
 /*
  * PURPOSE:
- *   - Confirm that get_nth_datablock works as intended for reading and writing for direct and single indirect blocks
+ *   - Confirm that get_nth_datablock works as intended for reading and writing sequential blocks
  * METHODOLOGY:
  *   - Call get_nth on a datablock with create true, then call it with create false
  * EXPECTED RESULTS:
  *   - First call to get_nth creates the data block with created set
  *   - Second call returns the same data block with created not set
+ *   - Sequentially allocated blocks merge into few enough extents to fit in the inode
  */
 int get_nth_1(){
 	printf("%30s", "MK_READ_DATA_BLOCKS_1");
 	fflush(stdout);
 	
-	int test_blocks = (NUM_DIRECT + ADDRESSES_PER_BLOCK) * 5;
+	int test_blocks = 5000;
 	int fs_blocks = test_blocks * 2;
 
 	int number, expected, actual, created;
@@ -525,17 +568,25 @@ int get_nth_1(){
 		}
 	}
 	
+	if (dummy_inode.ext_header.depth != 0){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
 	free(disk);
 	return TEST_PASSED;
 }
 
 /* PURPOSE:
- *   - Confirm that get_nth_datablock works as intended for reading and writing for random blocks (mostly triple indirect)
+ *   - Confirm that get_nth_datablock works as intended for reading and writing for random blocks
+ *   - Confirm that the extent tree grows past the inode and shrinks back when emptied
  * METHODOLOGY:
  *   - Call get_nth on a datablock with create true, then call it with create false
+ *   - Remove every block with rm_nth_datablock
  * EXPECTED RESULTS:
  *   - First call to get_nth creates the data block
  *   - Second call returns the same data block with created not set
+ *   - After removing every block, the tree is back in the inode and all its blocks are free
  */
 int get_nth_2(){
 	printf("%30s", "MK_READ_DATA_BLOCKS_2");
@@ -549,12 +600,13 @@ int get_nth_2(){
 	int ns[test_blocks];
 	int addrs[test_blocks];
 
-	int number, created;
+	int number, created, free_before, free_after;
 	mkfs(fs_blocks, 0, 0);
 
 	inode dummy_inode;
 	memset(&dummy_inode, 0, sizeof(inode));
 	inode_create(&dummy_inode, &number);
+	data_count_free(&free_before);
 	
 	/* Call it many times with random values */
 	int i;
@@ -576,7 +628,16 @@ int get_nth_2(){
 		}
 	}
 	
-	if (created != FALSE){
+	if (created != FALSE || dummy_inode.ext_header.depth == 0){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	for (i = 0; i < test_blocks; i++){
+		rm_nth_datablock(&dummy_inode, ns[i]);
+	}
+	data_count_free(&free_after);
+	if (dummy_inode.ext_header.depth != 0 || dummy_inode.ext_header.entries != 0 || free_after != free_before){
 		free(disk);
 		return TEST_FAILED;
 	}
@@ -756,21 +817,7 @@ int overwrite_with_zeros(){
 		}
 	
 		inode_read(number, &dummy_inode);
-		for (i = 0; i < NUM_DIRECT; i++){
-			if (dummy_inode.direct_blocks[i] != 0){
-				return TEST_FAILED;
-			}
-		}
-	
-		if (dummy_inode.indirect != 0){
-			free(disk);
-			return TEST_FAILED;
-		}
-		if (dummy_inode.double_indirect != 0){
-			free(disk);
-			return TEST_FAILED;
-		}
-		if (dummy_inode.triple_indirect != 0){
+		if (dummy_inode.ext_header.entries != 0 || dummy_inode.ext_header.depth != 0){
 			free(disk);
 			return TEST_FAILED;
 		}
@@ -782,9 +829,9 @@ int overwrite_with_zeros(){
 
 /* PURPOSE:
  *   - Confirm that writing 0s to a file fully deletes it and makes room available for other filesystem
- *   - Confirm that two adjacent double indirect blocks will share their chain
+ *   - Confirm that no extent tree blocks are left behind once a file's blocks are deleted
  * METHODOLOGY:
- *   - Write 2 blocks in a double indirect zone, delete them, re-write two blocks nearby
+ *   - Write 2 blocks far into a file, delete them, re-write two blocks nearby
  * EXPECTED RESULTS:
  *   - FS data block usage will never exceed 4 blocks at any one time
  */
@@ -806,12 +853,12 @@ int write_on_small_fs_1(){
 	uint8_t zero_buf[size];
 	memset(zero_buf, 0, size);
 
-	ret = write_i(number, data_buf, BLOCK_SIZE * (ADDRESSES_PER_BLOCK + NUM_DIRECT + 4), BLOCK_SIZE * 2);
+	ret = write_i(number, data_buf, BLOCK_SIZE * 1038, BLOCK_SIZE * 2);
 	
-	ret = write_i(number, zero_buf, BLOCK_SIZE * (ADDRESSES_PER_BLOCK + NUM_DIRECT + 4), BLOCK_SIZE * 2);
+	ret = write_i(number, zero_buf, BLOCK_SIZE * 1038, BLOCK_SIZE * 2);
 	//ret = truncate(number, 0);
 	
-	ret = write_i(number, data_buf, BLOCK_SIZE * (ADDRESSES_PER_BLOCK + NUM_DIRECT + 8), BLOCK_SIZE * 2);
+	ret = write_i(number, data_buf, BLOCK_SIZE * 1042, BLOCK_SIZE * 2);
 	
 	free(disk);
 	if (ret == BLOCK_SIZE * 2){
@@ -819,4 +866,2038 @@ int write_on_small_fs_1(){
 	}
 	
 	return TEST_FAILED;
-}
\ No newline at end of file
+}
+
+/* PURPOSE:
+ *   - Confirm that inode chunks are taken from the data region and given back once empty
+ * METHODOLOGY:
+ *   - Create a few chunks worth of inodes, then free all of them
+ * EXPECTED RESULTS:
+ *   - Free data blocks drop by one per new chunk, and return to the original count after freeing
+ */
+int inode_chunks_released(){
+	printf("%30s", "INODE_CHUNKS_RELEASED");
+	fflush(stdout);
+	
+	mkfs(400, 0, 0);
+	
+	int NUM_CHUNKS = 3;
+	int free_before, free_during, free_after;
+	data_count_free(&free_before);
+	
+	inode dummy_inode;
+	memset(&dummy_inode, 0, sizeof(inode));
+	
+	/* The root's chunk has INODES_PER_BLOCK - 1 spots left, fill it and NUM_CHUNKS more */
+	int i, number;
+	int to_create = INODES_PER_BLOCK - 1 + NUM_CHUNKS * INODES_PER_BLOCK;
+	for (i = 0; i < to_create; i++){
+		if (inode_create(&dummy_inode, &number) != SUCCESS){
+			free(disk);
+			return TEST_FAILED;
+		}
+	}
+	data_count_free(&free_during);
+	
+	for (i = 0; i < to_create; i++){
+		inode_free(i + 2);
+	}
+	data_count_free(&free_after);
+	
+	free(disk);
+	if (free_during != free_before - NUM_CHUNKS || free_after != free_before){
+		return TEST_FAILED;
+	}
+	
+	return TEST_PASSED;
+}
+
+/* PURPOSE:
+ *   - Confirm that small files are stored inside their inode and don't use data blocks
+ *   - Confirm that a file is moved to data blocks once it outgrows the inode
+ * METHODOLOGY:
+ *   - Create a file, write less than INLINE_DATA_SIZE to it, then append past that limit
+ * EXPECTED RESULTS:
+ *   - No data blocks are used while the file is small, and the file is inline
+ *   - After the append, the file is no longer inline and all of its contents can be read back
+ */
+int inline_small_file(){
+	printf("%30s", "INLINE_SMALL_FILE");
+	fflush(stdout);
+	
+	mkfs(400, 0, 0);
+	
+	int size = BLOCK_SIZE + 100;
+	uint8_t expected_result[size];
+	uint8_t actual_result[size];
+	
+	int i;
+	for (i = 0; i < size; i++){
+		expected_result[i] = rand() % 256;
+	}
+	
+	int free_before, free_after, parent, number, index;
+	mknod_fs("/small", S_IRWXU, 0, 0);
+	namei("/small", 0, 0, &parent, &number, &index);
+	
+	data_count_free(&free_before);
+	write_i(number, expected_result, 0, 100);
+	data_count_free(&free_after);
+	
+	inode my_inode;
+	inode_read(number, &my_inode);
+	if (free_before != free_after || !(my_inode.flags & INODE_INLINE) || my_inode.size != 100){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	read_i(number, actual_result, 0, 100);
+	if (memcmp(expected_result, actual_result, 100) != 0){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	/* Grow past the inode */
+	write_i(number, &expected_result[100], 100, size - 100);
+	inode_read(number, &my_inode);
+	if (my_inode.flags & INODE_INLINE){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	read_i(number, actual_result, 0, size);
+	if (memcmp(expected_result, actual_result, size) != 0){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	free(disk);
+	return TEST_PASSED;
+}
+
+/* PURPOSE:
+ *   - Confirm that removing a block from the middle of an extent splits it in two
+ * METHODOLOGY:
+ *   - Create a run of sequential blocks, then remove one from the middle
+ * EXPECTED RESULTS:
+ *   - The run is a single extent, which becomes two after the removal
+ *   - Every other block keeps its data block, and the removed one is free again
+ */
+int extent_punch_middle(){
+	printf("%30s", "EXTENT_PUNCH_MIDDLE");
+	fflush(stdout);
+	
+	mkfs(400, 0, 0);
+	
+	int NUM_BLOCKS = 10;
+	int HOLE = 5;
+	int addrs[NUM_BLOCKS];
+	int number, created, free_before, free_after;
+	
+	inode dummy_inode;
+	memset(&dummy_inode, 0, sizeof(inode));
+	inode_create(&dummy_inode, &number);
+	
+	int i;
+	for (i = 0; i < NUM_BLOCKS; i++){
+		addrs[i] = get_nth_datablock(&dummy_inode, i, TRUE, &created);
+	}
+	if (dummy_inode.ext_header.entries != 1 || dummy_inode.extents[0].length != NUM_BLOCKS){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	data_count_free(&free_before);
+	rm_nth_datablock(&dummy_inode, HOLE);
+	data_count_free(&free_after);
+	if (dummy_inode.ext_header.entries != 2 || free_after != free_before + 1){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	for (i = 0; i < NUM_BLOCKS; i++){
+		if (get_nth_datablock(&dummy_inode, i, FALSE, NULL) != ((i == HOLE) ? INVALID_DATA : addrs[i])){
+			free(disk);
+			return TEST_FAILED;
+		}
+	}
+	
+	free(disk);
+	return TEST_PASSED;
+}
+
+/* PURPOSE:
+ *   - Confirm that delayed allocation keeps interleaved writers from fragmenting each other
+ *   - Confirm that a file truncated before it is flushed never takes any data blocks
+ * METHODOLOGY:
+ *   - With delalloc on, alternate writing a block to each of two files, then flush them
+ *   - Write to a third file, then truncate it to 0 before flushing
+ * EXPECTED RESULTS:
+ *   - No data blocks are used until the flush, but the contents can still be read back
+ *   - After the flush, each file is a single extent
+ *   - The truncated file leaves nothing behind
+ */
+int delalloc_contiguous(){
+	printf("%30s", "DELALLOC_CONTIGUOUS");
+	fflush(stdout);
+	
+	mkfs(400, 0, 0);
+	delalloc_enabled = TRUE;
+	
+	int NUM_BLOCKS = 8;
+	int size = NUM_BLOCKS * BLOCK_SIZE;
+	uint8_t expected_a[size];
+	uint8_t expected_b[size];
+	uint8_t actual_result[size];
+	
+	int i;
+	for (i = 0; i < size; i++){
+		expected_a[i] = rand() % 255 + 1;
+		expected_b[i] = rand() % 255 + 1;
+	}
+	
+	int free_before, free_during, free_after, parent, index, a, b, c;
+	mknod_fs("/a", S_IRWXU, 0, 0);
+	mknod_fs("/b", S_IRWXU, 0, 0);
+	mknod_fs("/c", S_IRWXU, 0, 0);
+	namei("/a", 0, 0, &parent, &a, &index);
+	namei("/b", 0, 0, &parent, &b, &index);
+	namei("/c", 0, 0, &parent, &c, &index);
+	data_count_free(&free_before);
+	
+	for (i = 0; i < NUM_BLOCKS; i++){
+		write_i(a, &expected_a[i * BLOCK_SIZE], i * BLOCK_SIZE, BLOCK_SIZE);
+		write_i(b, &expected_b[i * BLOCK_SIZE], i * BLOCK_SIZE, BLOCK_SIZE);
+	}
+	write_i(c, expected_a, 0, size);
+	truncate(c, 0);
+	
+	data_count_free(&free_during);
+	read_i(a, actual_result, 0, size);
+	if (free_during != free_before || delalloc_count(c) != 0 || memcmp(expected_a, actual_result, size) != 0){
+		delalloc_enabled = FALSE;
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	delalloc_flush_all();
+	data_count_free(&free_after);
+	
+	inode inode_a, inode_b;
+	inode_read(a, &inode_a);
+	inode_read(b, &inode_b);
+	delalloc_enabled = FALSE;
+	if (free_after != free_before - 2 * NUM_BLOCKS || inode_a.ext_header.entries != 1 || inode_b.ext_header.entries != 1){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	read_i(b, actual_result, 0, size);
+	if (memcmp(expected_b, actual_result, size) != 0){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	free(disk);
+	return TEST_PASSED;
+}
+
+/* PURPOSE:
+ *   - Confirm that fallocate preallocates a contiguous range that reads as 0s
+ *   - Confirm that writes into preallocated blocks land in place, and that punching frees blocks
+ * METHODOLOGY:
+ *   - Preallocate a range, read it, write into the middle of it, then punch a hole over the write
+ *   - Ask for a range past the largest file, then punch part of a hole with the disk full
+ * EXPECTED RESULTS:
+ *   - Preallocation takes one extent's worth of blocks and grows the file
+ *   - Unwritten blocks read as 0s, written blocks read back and keep their data block
+ *   - Punching frees the whole blocks in the hole, and the hole reads as 0s
+ *   - The range past the largest file gets -EINVAL, and the punch that can't zero its
+ *     partial block gets DATA_FULL
+ */
+int fallocate_prealloc_punch(){
+	printf("%30s", "FALLOCATE_PREALLOC_PUNCH");
+	fflush(stdout);
+	
+	mkfs(400, 0, 0);
+	
+	int NUM_BLOCKS = 16;
+	int size = NUM_BLOCKS * BLOCK_SIZE;
+	uint8_t zero_buf[size];
+	uint8_t data_buf[BLOCK_SIZE * 2];
+	uint8_t actual_result[size];
+	memset(zero_buf, 0, size);
+	memset(data_buf, 7, BLOCK_SIZE * 2);
+	
+	int free_before, free_after, parent, index, number;
+	mknod_fs("/prealloc", S_IRWXU, 0, 0);
+	namei("/prealloc", 0, 0, &parent, &number, &index);
+	data_count_free(&free_before);
+	
+	inode my_inode;
+	fallocate_i(number, 0, 0, size);
+	inode_read(number, &my_inode);
+	data_count_free(&free_after);
+	if (my_inode.size != size || my_inode.ext_header.entries != 1 || !EXTENT_IS_UNWRITTEN(my_inode.extents[0]) ||
+			free_after != free_before - NUM_BLOCKS){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	read_i(number, actual_result, 0, size);
+	if (memcmp(zero_buf, actual_result, size) != 0){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	/* Write two blocks, starting halfway through block 4 */
+	int offset = 4 * BLOCK_SIZE + BLOCK_SIZE / 2;
+	int preallocated = get_nth_datablock(&my_inode, 5, FALSE, NULL);
+	write_i(number, data_buf, offset, BLOCK_SIZE * 2);
+	inode_read(number, &my_inode);
+	read_i(number, actual_result, 0, size);
+	if (get_nth_datablock(&my_inode, 5, FALSE, NULL) != preallocated ||
+			memcmp(zero_buf, actual_result, offset) != 0 ||
+			memcmp(data_buf, &actual_result[offset], BLOCK_SIZE * 2) != 0 ||
+			memcmp(zero_buf, &actual_result[offset + BLOCK_SIZE * 2], size - offset - BLOCK_SIZE * 2) != 0){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	/* Punch out blocks 4 through 7, which covers the write */
+	fallocate_i(number, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 4 * BLOCK_SIZE, 4 * BLOCK_SIZE);
+	data_count_free(&free_after);
+	inode_read(number, &my_inode);
+	read_i(number, actual_result, 0, size);
+	if (free_after != free_before - NUM_BLOCKS + 4 || my_inode.size != size || memcmp(zero_buf, actual_result, size) != 0){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	/* A range running past the largest file is refused rather than overflowing */
+	if (fallocate_i(number, 0, MAX_FILE_SIZE - BLOCK_SIZE, LLONG_MAX) != -EINVAL){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	/* Fill the disk, then punch from halfway through block 4: the 0s written over its
+	 * first half need a block, since SPARSE_NEVER doesn't leave the hole alone */
+	int filler;
+	off_t fill = 0;
+	mknod_fs("/filler", S_IRWXU, 0, 0);
+	namei("/filler", 0, 0, &parent, &filler, &index);
+	while (write_i(filler, data_buf, fill, BLOCK_SIZE) == BLOCK_SIZE){
+		fill += BLOCK_SIZE;
+	}
+	sparse_set_policy(number, SPARSE_NEVER);
+	if (fallocate_i(number, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 4 * BLOCK_SIZE + BLOCK_SIZE / 2, BLOCK_SIZE) != DATA_FULL){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	free(disk);
+	return TEST_PASSED;
+}
+
+/* PURPOSE:
+ *   - Confirm that a big enough filesystem is split into several block groups
+ *   - Confirm that files are placed in their directory's group, along with their data
+ *   - Confirm that the group free counts add up as blocks are taken and given back
+ * METHODOLOGY:
+ *   - Make a directory, a file inside it and a file in the root, and write a few blocks to each
+ *   - Compare the groups of the inodes and of their data blocks, then delete the files
+ * EXPECTED RESULTS:
+ *   - The new directory goes in a different group than the root, which has less room left
+ *   - Each file's inode and data blocks are in its directory's group
+ *   - The free count goes back to where it started once the files are deleted
+ */
+int block_groups_locality(){
+	printf("%30s", "BLOCK_GROUPS_LOCALITY");
+	fflush(stdout);
+	
+	mkfs(BLOCKS_PER_GROUP * 2 + 4000, 0, 0);
+	superblock sb;
+	read_superblock(&sb);
+	
+	int NUM_BLOCKS = 3;
+	int size = NUM_BLOCKS * BLOCK_SIZE;
+	uint8_t data_buf[size];
+	memset(data_buf, 1, size);
+	
+	int free_before, free_after, parent, index, dir, in_dir, in_root;
+	mkdir_fs("/dir", S_IRWXU, 0, 0);
+	data_count_free(&free_before);
+	mknod_fs("/dir/file", S_IRWXU, 0, 0);
+	mknod_fs("/file", S_IRWXU, 0, 0);
+	namei("/dir", 0, 0, &parent, &dir, &index);
+	namei("/dir/file", 0, 0, &parent, &in_dir, &index);
+	namei("/file", 0, 0, &parent, &in_root, &index);
+	
+	write_i(in_dir, data_buf, 0, size);
+	write_i(in_root, data_buf, 0, size);
+	
+	inode inode_dir, inode_root;
+	inode_read(in_dir, &inode_dir);
+	inode_read(in_root, &inode_root);
+	int block_dir = get_nth_datablock(&inode_dir, NUM_BLOCKS - 1, FALSE, NULL);
+	int block_root = get_nth_datablock(&inode_root, NUM_BLOCKS - 1, FALSE, NULL);
+	
+	if (sb.num_groups != 3 || inode_group(dir) == ROOT_GROUP || inode_group(in_dir) != inode_group(dir) ||
+	    inode_group(in_root) != ROOT_GROUP || inode_dir.group != inode_group(dir) ||
+	    data_group(block_dir) != inode_group(dir) || data_group(block_root) != ROOT_GROUP ||
+	    inode_dir.ext_header.entries != 1 || inode_root.ext_header.entries != 1){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	del(in_dir);
+	del(in_root);
+	data_count_free(&free_after);
+	
+	free(disk);
+	if (free_after != free_before){
+		return TEST_FAILED;
+	}
+	
+	return TEST_PASSED;
+}
+
+/* PURPOSE:
+ *   - Confirm that operations finished before a sync are committed together in one flush
+ *   - Confirm that a crash keeps committed operations and loses uncommitted ones
+ * METHODOLOGY:
+ *   - Make several files, each as its own transaction, then sync the journal once
+ *   - Make one more file without syncing, throw away everything in memory and remount
+ * EXPECTED RESULTS:
+ *   - The sync writes a single commit with a single flush of the disk
+ *   - The synced files are all there after the remount, and the unsynced one is not
+ */
+int journal_group_commit(){
+	printf("%30s", "JOURNAL_GROUP_COMMIT");
+	fflush(stdout);
+	
+	mkfs(4000, 0, 0);
+	superblock sb;
+	read_superblock(&sb);
+	if (sb.journal_size == 0){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	int NUM_FILES = 5;
+	char path[32];
+	int i, parent, target, index;
+	int commits_before = journal_commits;
+	int syncs_before = disk_syncs;
+	for (i = 0; i < NUM_FILES; i++){
+		sprintf(path, "/file%d", i);
+		journal_begin();
+		mknod_fs(path, S_IRWXU, 0, 0);
+		journal_end();
+	}
+	journal_sync();
+	
+	if (journal_commits - commits_before != 1 || disk_syncs - syncs_before != 1){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	journal_begin();
+	mknod_fs("/lost", S_IRWXU, 0, 0);
+	journal_end();
+	
+	/* Crash: whatever was still only in memory is gone */
+	journal_discard();
+	mount_fs();
+	
+	for (i = 0; i < NUM_FILES; i++){
+		sprintf(path, "/file%d", i);
+		if (namei(path, 0, 0, &parent, &target, &index) != SUCCESS || target == INVALID_INODE){
+			free(disk);
+			return TEST_FAILED;
+		}
+	}
+	if (namei("/lost", 0, 0, &parent, &target, &index) != SUCCESS || target != INVALID_INODE){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	free(disk);
+	return TEST_PASSED;
+}
+
+/* PURPOSE:
+ *   - Confirm that random overwrites in log-structured mode read back correctly
+ *   - Confirm that the cleaner gets dead space back once the log wraps around
+ * METHODOLOGY:
+ *   - Write a file taking up about half the disk, then overwrite random blocks of it
+ *     until several times the disk's size has been written
+ *   - Read the whole file back and compare, and look at the cleaner's counters
+ * EXPECTED RESULTS:
+ *   - The file reads back as last written
+ *   - Segments were cleaned, copying fewer blocks than were written
+ */
+int log_structured_cleaner(){
+	printf("%30s", "LOG_STRUCTURED_CLEANER");
+	fflush(stdout);
+	
+	int DISK_BLOCKS = 2048;
+	lfs_enabled = TRUE;
+	mkfs(DISK_BLOCKS, 0, 0);
+	lfs_enabled = FALSE;
+	if (lfs_segments == 0 || total_blocks >= DISK_BLOCKS){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	int NUM_BLOCKS = 800;
+	int OVERWRITES = DISK_BLOCKS * 3;
+	int size = NUM_BLOCKS * BLOCK_SIZE;
+	uint8_t* expected = malloc(size);
+	uint8_t* actual = malloc(size);
+	int i;
+	for (i = 0; i < size; i++){
+		expected[i] = rand() % 256;
+	}
+	
+	int parent, inum, index;
+	mknod_fs("/file", S_IRWXU, 0, 0);
+	namei("/file", 0, 0, &parent, &inum, &index);
+	write_i(inum, expected, 0, size);
+	
+	int written_before = lfs_blocks_written;
+	int moved_before = lfs_blocks_moved;
+	int cleaned_before = lfs_segments_cleaned;
+	int n;
+	for (i = 0; i < OVERWRITES; i++){
+		n = rand() % NUM_BLOCKS;
+		memset(expected + n * BLOCK_SIZE, i % 256, BLOCK_SIZE);
+		write_i(inum, expected + n * BLOCK_SIZE, n * BLOCK_SIZE, BLOCK_SIZE);
+	}
+	
+	read_i(inum, actual, 0, size);
+	int written = lfs_blocks_written - written_before;
+	int moved = lfs_blocks_moved - moved_before;
+	int cleaned = lfs_segments_cleaned - cleaned_before;
+	int same = memcmp(expected, actual, size) == 0;
+	
+	free(expected);
+	free(actual);
+	free(disk);
+	if (!same || written < OVERWRITES || cleaned == 0 || moved >= written){
+		return TEST_FAILED;
+	}
+	
+	return TEST_PASSED;
+}
+
+/* PURPOSE:
+ *   - Confirm that taking a snapshot copies nothing, and later writes copy only what they change
+ *   - Confirm that a mounted snapshot shows the filesystem as it was, and can't be written to
+ * METHODOLOGY:
+ *   - Write a file, take a snapshot, then overwrite the file and make another one
+ *   - Mount the snapshot and look at both files, then go back to the live filesystem
+ * EXPECTED RESULTS:
+ *   - No blocks are saved when the snapshot is taken, and fewer than the disk's worth after
+ *   - The snapshot has the old contents of the file and not the new file, and refuses writes
+ *   - The live filesystem has the new contents and both files
+ */
+int snapshot_copy_on_write(){
+	printf("%30s", "SNAPSHOT_COPY_ON_WRITE");
+	fflush(stdout);
+	
+	mkfs(4000, 0, 0);
+	
+	int NUM_BLOCKS = 10;
+	int size = NUM_BLOCKS * BLOCK_SIZE;
+	uint8_t old_buf[size];
+	uint8_t new_buf[size];
+	uint8_t read_buf[size];
+	memset(old_buf, 1, size);
+	memset(new_buf, 2, size);
+	
+	int parent, inum, index, id, target;
+	mknod_fs("/file", S_IRWXU, 0, 0);
+	namei("/file", 0, 0, &parent, &inum, &index);
+	write_i(inum, old_buf, 0, size);
+	
+	int saved_before = snapshot_blocks_saved;
+	if (snapshot_create("backup", &id) != SUCCESS || snapshot_blocks_saved != saved_before){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	write_i(inum, new_buf, 0, size);
+	mknod_fs("/new", S_IRWXU, 0, 0);
+	int saved = snapshot_blocks_saved - saved_before;
+	
+	/* Look at the snapshot */
+	int found, failed = FALSE;
+	snapshot_find("backup", &found);
+	snapshot_mount(found);
+	namei("/file", 0, 0, &parent, &target, &index);
+	read_i(target, read_buf, 0, size);
+	failed |= memcmp(read_buf, old_buf, size) != 0;
+	namei("/new", 0, 0, &parent, &target, &index);
+	failed |= target != INVALID_INODE;
+	failed |= write_block(0, read_buf) != READ_ONLY;
+	snapshot_unmount();
+	
+	/* Then at the live filesystem */
+	read_i(inum, read_buf, 0, size);
+	failed |= memcmp(read_buf, new_buf, size) != 0;
+	namei("/new", 0, 0, &parent, &target, &index);
+	failed |= target == INVALID_INODE;
+	failed |= snapshot_delete(id) != SUCCESS || snapshots_live != 0;
+	
+	free(disk);
+	if (failed || saved < NUM_BLOCKS || saved >= total_blocks / 10){
+		return TEST_FAILED;
+	}
+	
+	return TEST_PASSED;
+}
+
+/* PURPOSE:
+ *   - Confirm that fsck finds nothing wrong with a healthy filesystem, offline or online
+ *   - Confirm that it finds leaked blocks, blocks used twice and bad directory entries
+ *   - Confirm that the result doesn't depend on the number of threads
+ * METHODOLOGY:
+ *   - Make directories and files over several groups, one of them sparse enough to need
+ *     an extent tree below the inode, and check the filesystem
+ *   - Leak a block, point one file's extent at another file's blocks, and add an entry
+ *     for a free inode, then check again with one thread and with several
+ * EXPECTED RESULTS:
+ *   - The healthy filesystem has no problems, and every inode is checked
+ *   - The broken one has at least the leaked and doubly used blocks and the one bad entry
+ *   - Both checks of the broken filesystem find the same number of problems
+ */
+int fsck_parallel(){
+	printf("%30s", "FSCK_PARALLEL");
+	fflush(stdout);
+	
+	mkfs(BLOCKS_PER_GROUP * 3, 0, 0);
+	
+	int size = 4 * BLOCK_SIZE;
+	uint8_t data_buf[size];
+	memset(data_buf, 1, size);
+	
+	int parent, index, f1, f2, sparse, i;
+	mkdir_fs("/a", S_IRWXU, 0, 0);
+	mkdir_fs("/a/b", S_IRWXU, 0, 0);
+	mknod_fs("/f1", S_IRWXU, 0, 0);
+	mknod_fs("/a/f2", S_IRWXU, 0, 0);
+	mknod_fs("/a/b/sparse", S_IRWXU, 0, 0);
+	namei("/f1", 0, 0, &parent, &f1, &index);
+	namei("/a/f2", 0, 0, &parent, &f2, &index);
+	namei("/a/b/sparse", 0, 0, &parent, &sparse, &index);
+	write_i(f1, data_buf, 0, size);
+	write_i(f2, data_buf, 0, size);
+	for (i = 0; i < INODE_EXTENTS * 2; i++){
+		write_i(sparse, data_buf, 2 * i * BLOCK_SIZE, BLOCK_SIZE);
+	}
+	
+	fsck_report report, report_online;
+	int ret = fsck(NO_SNAPSHOT, 4, &report);
+	int ret_online = fsck_online(4, &report_online);
+	if (ret != SUCCESS || ret_online != SUCCESS || report.inodes_checked != 6 || report_online.inodes_checked != 6){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	/* Break it */
+	int leaked;
+	data_allocate(data_buf, &leaked);
+	
+	inode inode_f1, inode_f2;
+	inode_read(f1, &inode_f1);
+	inode_read(f2, &inode_f2);
+	inode_f1.extents[0].physical = inode_f2.extents[0].physical;
+	inode_write(f1, &inode_f1);
+	
+	superblock sb;
+	read_superblock(&sb);
+	dir_ent d;
+	strcpy(d.name, "dangling");
+	d.inode_num = sb.num_inodes;
+	namei("/a", 0, 0, &parent, &index, &i);
+	add_dirent(index, &d);
+	
+	fsck_report report_one, report_many;
+	int ret_one = fsck(NO_SNAPSHOT, 1, &report_one);
+	int ret_many = fsck(NO_SNAPSHOT, 8, &report_many);
+	
+	free(disk);
+	if (ret_one != FSCK_PROBLEMS || ret_many != FSCK_PROBLEMS || report_many.leaked_blocks < 2 ||
+	    report_many.double_blocks < 1 || report_many.bad_dirents != 1 ||
+	    fsck_problems(&report_one) != fsck_problems(&report_many)){
+		return TEST_FAILED;
+	}
+	
+	return TEST_PASSED;
+}
+
+/* PURPOSE:
+ *   - Confirm that laying out the groups with several threads gives the same disk as one thread
+ * METHODOLOGY:
+ *   - Make a filesystem with several groups using one thread, and keep its disk
+ *   - Make the same filesystem again using several threads, and compare the two disks
+ *   - Do both again in log-structured mode
+ * EXPECTED RESULTS:
+ *   - The disks are byte for byte the same each time, and the filesystem passes fsck
+ */
+int mkfs_parallel_identical(){
+	printf("%30s", "MKFS_PARALLEL_IDENTICAL");
+	fflush(stdout);
+	
+	int blocks = BLOCKS_PER_GROUP * 4;
+	int saved_threads = mkfs_threads;
+	uint8_t* serial_disk;
+	int serial_blocks, same, ret, lfs;
+	fsck_report report;
+	
+	for (lfs = FALSE; lfs <= TRUE; lfs++){
+		lfs_enabled = lfs;
+		mkfs_threads = 1;
+		mkfs(blocks, 0, 0);
+		serial_disk = disk;
+		serial_blocks = total_blocks;
+		
+		mkfs_threads = 4;
+		mkfs(blocks, 0, 0);
+		mkfs_threads = saved_threads;
+		lfs_enabled = FALSE;
+		
+		same = serial_blocks == total_blocks && memcmp(serial_disk, disk, (size_t)total_blocks * BLOCK_SIZE) == 0;
+		free(serial_disk);
+		
+		ret = fsck(NO_SNAPSHOT, 4, &report);
+		
+		free(disk);
+		if (!same || ret != SUCCESS){
+			return TEST_FAILED;
+		}
+	}
+	
+	return TEST_PASSED;
+}
+
+/* PURPOSE:
+ *   - Confirm that deleting a file with orphan_async set frees nothing right away
+ *   - Confirm that the reaper frees a big file a bounded batch at a time
+ *   - Confirm that orphans left over from a crash are reclaimed at mount
+ * METHODOLOGY:
+ *   - Write a small file and one of a bit more than two batches, delete both, and
+ *     check the free block count and the orphan list
+ *   - Reap twice, which should take care of the small file and one batch of the big one
+ *   - Make that durable, crash, mount and recover, then check everything came back
+ * EXPECTED RESULTS:
+ *   - Deleting leaves both files on the orphan list, and fsck counts them as orphans
+ *   - After two reaps the big file is at the head, one batch shorter
+ *   - After recovery the list is empty, every block is free again and fsck is happy
+ */
+int orphan_background_reclaim(){
+	printf("%30s", "ORPHAN_BACKGROUND_RECLAIM");
+	fflush(stdout);
+	
+	mkfs(BLOCKS_PER_GROUP * 2, 0, 0);
+	int free_start, free_written, free_now;
+	data_count_free(&free_start);
+	
+	int big_blocks = ORPHAN_BATCH_BLOCKS * 2 + 10;
+	uint8_t* data_buf = malloc(big_blocks * BLOCK_SIZE);
+	memset(data_buf, 1, big_blocks * BLOCK_SIZE);
+	
+	int parent, index, big, small;
+	mknod_fs("/big", S_IRWXU, 0, 0);
+	mknod_fs("/small", S_IRWXU, 0, 0);
+	namei("/big", 0, 0, &parent, &big, &index);
+	namei("/small", 0, 0, &parent, &small, &index);
+	write_i(big, data_buf, 0, big_blocks * BLOCK_SIZE);
+	write_i(small, data_buf, 0, 2 * BLOCK_SIZE);
+	free(data_buf);
+	data_count_free(&free_written);
+	
+	orphan_async = TRUE;
+	journal_begin();
+	namei("/big", 0, 0, &parent, &big, &index);
+	remove_dirent(parent, index);
+	del(big);
+	namei("/small", 0, 0, &parent, &small, &index);
+	remove_dirent(parent, index);
+	del(small);
+	journal_end();
+	orphan_async = FALSE;
+	
+	superblock sb;
+	read_superblock(&sb);
+	data_count_free(&free_now);
+	fsck_report report;
+	int ret = fsck(NO_SNAPSHOT, 2, &report);
+	if (sb.orphan_head != small || free_now != free_written || ret != SUCCESS || report.orphans != 2){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	pthread_mutex_lock(&fs_lock);
+	pthread_mutex_lock(&orphan_lock);
+	orphan_reap_locked();
+	orphan_reap_locked();
+	pthread_mutex_unlock(&orphan_lock);
+	pthread_mutex_unlock(&fs_lock);
+	
+	inode inode_big;
+	inode_read(big, &inode_big);
+	read_superblock(&sb);
+	if (sb.orphan_head != big || inode_big.size != (big_blocks - ORPHAN_BATCH_BLOCKS) * BLOCK_SIZE){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	/* Crash with the big file only partly reclaimed */
+	journal_sync();
+	journal_discard();
+	mount_fs();
+	orphan_recover();
+	
+	read_superblock(&sb);
+	data_count_free(&free_now);
+	ret = fsck(NO_SNAPSHOT, 2, &report);
+	
+	free(disk);
+	if (sb.orphan_head != INVALID_INODE || free_now != free_start || ret != SUCCESS || report.orphans != 0){
+		return TEST_FAILED;
+	}
+	
+	return TEST_PASSED;
+}
+
+/* PURPOSE:
+ *   - Confirm that freed data blocks are only discarded once their free has committed
+ *   - Confirm that discarding gives the memory back to the host and the blocks read as 0s
+ *   - Confirm that data_trim discards every free block
+ * METHODOLOGY:
+ *   - Write a file, delete it, and try to discard before and after committing
+ *   - Check the file's old blocks on the disk, and whether their pages are still resident
+ *   - Trim the whole filesystem, then check it and write a new file
+ * EXPECTED RESULTS:
+ *   - Nothing is discarded before the commit, and exactly the file's blocks after it
+ *   - The old blocks are 0s and at least one of their pages is no longer resident
+ *   - The trim covers every free block, and the filesystem is still fine afterwards
+ */
+int discard_freed_blocks(){
+	printf("%30s", "DISCARD_FREED_BLOCKS");
+	fflush(stdout);
+	
+	mkfs(BLOCKS_PER_GROUP * 2, 0, 0);
+	discard_enabled = TRUE;
+	
+	int NUM_BLOCKS = 64;
+	int size = NUM_BLOCKS * BLOCK_SIZE;
+	uint8_t* data_buf = malloc(size);
+	memset(data_buf, 1, size);
+	
+	int parent, index, target;
+	mknod_fs("/file", S_IRWXU, 0, 0);
+	namei("/file", 0, 0, &parent, &target, &index);
+	write_i(target, data_buf, 0, size);
+	
+	inode my_inode;
+	inode_read(target, &my_inode);
+	superblock sb;
+	read_superblock(&sb);
+	uint8_t* old_data = disk + (uintptr_t)(sb.data_block_offset + my_inode.extents[0].physical - 1) * BLOCK_SIZE;
+	int old_blocks = EXTENT_LENGTH(my_inode.extents[0]);
+	
+	journal_sync();
+	journal_begin();
+	remove_dirent(parent, index);
+	del(target);
+	journal_end();
+	
+	int early = 0, discarded = 0;
+	data_discard_flush(&early);
+	journal_sync();
+	data_discard_flush(&discarded);
+	
+	/* Look for a page of the old blocks that isn't resident anymore. Pages are block sized here */
+	uintptr_t page = BLOCK_SIZE;
+	uintptr_t first_page = ((uintptr_t)old_data + page - 1) & ~(page - 1);
+	unsigned char resident = 1;
+	if (first_page + page <= (uintptr_t)old_data + (uintptr_t)old_blocks * BLOCK_SIZE){
+		mincore((void*)first_page, page, &resident);
+	}
+	
+	int i, zeros = TRUE;
+	for (i = 0; i < old_blocks * BLOCK_SIZE; i++){
+		if (old_data[i] != 0){
+			zeros = FALSE;
+			break;
+		}
+	}
+	
+	if (early != 0 || discarded != NUM_BLOCKS || !zeros || (resident & 1)){
+		discard_enabled = FALSE;
+		free(data_buf);
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	int trimmed, free_blocks;
+	data_trim(1, &trimmed);
+	data_count_free(&free_blocks);
+	discard_enabled = FALSE;
+	
+	fsck_report report;
+	int ret = fsck(NO_SNAPSHOT, 2, &report);
+	
+	uint8_t* read_buf = malloc(size);
+	mknod_fs("/again", S_IRWXU, 0, 0);
+	namei("/again", 0, 0, &parent, &target, &index);
+	write_i(target, data_buf, 0, size);
+	read_i(target, read_buf, 0, size);
+	int same = memcmp(data_buf, read_buf, size) == 0;
+	
+	free(read_buf);
+	free(data_buf);
+	free(disk);
+	if (trimmed != free_blocks || ret != SUCCESS || !same){
+		return TEST_FAILED;
+	}
+	
+	return TEST_PASSED;
+}
+
+/* PURPOSE:
+ *   - Confirm that reading a file in order only goes down its extent tree once per
+ *     extent or hole, not once per block
+ *   - Confirm that an open file keeps its place between calls
+ * METHODOLOGY:
+ *   - Write runs of blocks with holes between them, enough runs to push the extents
+ *     out of the inode and into a tree node
+ *   - Read the whole file in one call, then again a block per call while it's open,
+ *     counting the tree nodes read each time
+ *   - Write to the open file in between, which has to make its cursor stale
+ * EXPECTED RESULTS:
+ *   - Both reads see the right data
+ *   - Neither reads more nodes than there are extents and holes, give or take a hole
+ *     split between leaves and the lookups after the write
+ */
+int extent_cursor_sequential(){
+	printf("%30s", "EXTENT_CURSOR_SEQUENTIAL");
+	fflush(stdout);
+	
+	mkfs(BLOCKS_PER_GROUP * 2, 0, 0);
+	
+	int RUNS = INODE_EXTENTS * 2;
+	int RUN_BLOCKS = 8;
+	int STRIDE = 16;
+	int blocks = RUNS * STRIDE;
+	uint8_t* expected = calloc(blocks, BLOCK_SIZE);
+	uint8_t* read_buf = malloc(blocks * BLOCK_SIZE);
+	
+	int parent, index, target, i;
+	mknod_fs("/file", S_IRWXU, 0, 0);
+	namei("/file", 0, 0, &parent, &target, &index);
+	for (i = 0; i < RUNS; i++){
+		memset(&expected[i * STRIDE * BLOCK_SIZE], i + 1, RUN_BLOCKS * BLOCK_SIZE);
+		write_i(target, &expected[i * STRIDE * BLOCK_SIZE], i * STRIDE * BLOCK_SIZE, RUN_BLOCKS * BLOCK_SIZE);
+	}
+	truncate(target, blocks * BLOCK_SIZE);
+	
+	inode my_inode;
+	inode_read(target, &my_inode);
+	
+	int reads_before = extent_node_reads;
+	read_i(target, read_buf, 0, blocks * BLOCK_SIZE);
+	int whole_reads = extent_node_reads - reads_before;
+	int whole_same = memcmp(expected, read_buf, blocks * BLOCK_SIZE) == 0;
+	
+	int fd = oft_add(target, O_RDWR);
+	reads_before = extent_node_reads;
+	for (i = 0; i < blocks; i++){
+		if (i == blocks / 2){
+			write_i(target, &expected[i * BLOCK_SIZE], i * BLOCK_SIZE, BLOCK_SIZE);
+		}
+		read_i(target, &read_buf[i * BLOCK_SIZE], i * BLOCK_SIZE, BLOCK_SIZE);
+	}
+	int open_reads = extent_node_reads - reads_before;
+	int open_same = memcmp(expected, read_buf, blocks * BLOCK_SIZE) == 0;
+	oft_remove(fd);
+	
+	free(expected);
+	free(read_buf);
+	free(disk);
+	if (my_inode.ext_header.depth == 0 || !whole_same || !open_same ||
+	    whole_reads > RUNS * 2 + 2 || open_reads > RUNS * 2 + 4){
+		return TEST_FAILED;
+	}
+	
+	return TEST_PASSED;
+}
+
+/* PURPOSE:
+ *   - Measure how many times write_i and truncate write the inode back, which each
+ *     rewrite the inode's whole chunk
+ * METHODOLOGY:
+ *   - Write files of 1, 16 and 256 blocks over a file that already has blocks, and
+ *     count inode writes for the write and for truncating the file back to nothing
+ *   - Read the data back
+ * EXPECTED RESULTS:
+ *   - One inode write per write_i, however many blocks it covers (it used to be one
+ *     per block), and at most two per truncate
+ *   - The data reads back correctly
+ */
+int write_inode_updates(){
+	printf("%30s", "WRITE_INODE_UPDATES");
+	fflush(stdout);
+	
+	mkfs(BLOCKS_PER_GROUP * 2, 0, 0);
+	
+	int parent, index, target;
+	mknod_fs("/file", S_IRWXU, 0, 0);
+	namei("/file", 0, 0, &parent, &target, &index);
+	
+	/* Get the file out of its inode first */
+	uint8_t small[BLOCK_SIZE];
+	memset(small, 1, BLOCK_SIZE);
+	write_i(target, small, 0, BLOCK_SIZE);
+	
+	int sizes[] = {1, 16, 256};
+	int i, before, write_updates, truncate_updates, same;
+	for (i = 0; i < 3; i++){
+		int size = sizes[i] * BLOCK_SIZE;
+		uint8_t* data_buf = malloc(size);
+		uint8_t* read_buf = malloc(size);
+		memset(data_buf, i + 2, size);
+		
+		before = inode_writes;
+		write_i(target, data_buf, 0, size);
+		write_updates = inode_writes - before;
+		
+		read_i(target, read_buf, 0, size);
+		same = memcmp(data_buf, read_buf, size) == 0;
+		
+		before = inode_writes;
+		truncate(target, 0);
+		truncate_updates = inode_writes - before;
+		
+		free(data_buf);
+		free(read_buf);
+		if (write_updates != 1 || truncate_updates > 2 || !same){
+			free(disk);
+			return TEST_FAILED;
+		}
+	}
+	
+	free(disk);
+	return TEST_PASSED;
+}
+
+/* PURPOSE:
+ *   - Confirm that is_zero finds a single non-zero byte anywhere in a buffer
+ *   - Confirm that each block of a write is checked for 0s, not just the first
+ *   - Confirm that the sparse policies free blocks of 0s when they should, and only then
+ * METHODOLOGY:
+ *   - Set one byte at a time in a zeroed buffer, starting at an odd address
+ *   - Write a block of 0s followed by a block of data, and read it back
+ *   - Under each policy, write a whole block of 0s and zero out a block with a partial
+ *     write, and see which blocks are left mapped. Also give one file its own policy
+ * EXPECTED RESULTS:
+ *   - is_zero is only true for the untouched buffer
+ *   - The data reads back, and the block of 0s is a hole
+ *   - SPARSE_ALWAYS frees both blocks, SPARSE_ALIGNED only the whole one, SPARSE_NEVER
+ *     neither, and a file's own policy wins over the mount's
+ */
+int sparse_zero_policy(){
+	printf("%30s", "SPARSE_ZERO_POLICY");
+	fflush(stdout);
+	
+	uint8_t zeros[BLOCK_SIZE + 1];
+	memset(zeros, 0, sizeof(zeros));
+	int i;
+	if (!is_zero(&zeros[1], BLOCK_SIZE)){
+		return TEST_FAILED;
+	}
+	for (i = 1; i <= BLOCK_SIZE; i++){
+		zeros[i] = 1;
+		if (is_zero(&zeros[1], BLOCK_SIZE)){
+			return TEST_FAILED;
+		}
+		zeros[i] = 0;
+	}
+	
+	mkfs(4000, 0, 0);
+	
+	uint8_t data_buf[2 * BLOCK_SIZE];
+	uint8_t read_buf[2 * BLOCK_SIZE];
+	memset(data_buf, 0, BLOCK_SIZE);
+	memset(&data_buf[BLOCK_SIZE], 7, BLOCK_SIZE);
+	
+	int parent, index, target, unwritten;
+	uint32_t physical, run;
+	inode my_inode;
+	mknod_fs("/mixed", S_IRWXU, 0, 0);
+	namei("/mixed", 0, 0, &parent, &target, &index);
+	write_i(target, data_buf, 0, 2 * BLOCK_SIZE);
+	read_i(target, read_buf, 0, 2 * BLOCK_SIZE);
+	inode_read(target, &my_inode);
+	extent_lookup(&my_inode, 0, &physical, &run, &unwritten);
+	if (memcmp(data_buf, read_buf, 2 * BLOCK_SIZE) != 0 || physical != INVALID_DATA){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	/* Blocks 0 and 1 start out as data. Block 0 is overwritten with a whole block of 0s,
+	 * and block 1 is zeroed out half at a time */
+	int policies[] = {SPARSE_ALWAYS, SPARSE_ALIGNED, SPARSE_NEVER, SPARSE_ALWAYS};
+	int file_policies[] = {SPARSE_DEFAULT, SPARSE_DEFAULT, SPARSE_DEFAULT, SPARSE_NEVER};
+	int whole_freed[] = {TRUE, TRUE, FALSE, FALSE};
+	int partial_freed[] = {TRUE, FALSE, FALSE, FALSE};
+	char path[32];
+	uint32_t physical_partial;
+	for (i = 0; i < 4; i++){
+		sparse_policy = policies[i];
+		sprintf(path, "/policy%d", i);
+		mknod_fs(path, S_IRWXU, 0, 0);
+		namei(path, 0, 0, &parent, &target, &index);
+		sparse_set_policy(target, file_policies[i]);
+		
+		memset(data_buf, 7, 2 * BLOCK_SIZE);
+		write_i(target, data_buf, 0, 2 * BLOCK_SIZE);
+		memset(data_buf, 0, 2 * BLOCK_SIZE);
+		write_i(target, data_buf, 0, BLOCK_SIZE);
+		write_i(target, data_buf, BLOCK_SIZE, BLOCK_SIZE / 2);
+		write_i(target, data_buf, BLOCK_SIZE + BLOCK_SIZE / 2, BLOCK_SIZE / 2);
+		
+		read_i(target, read_buf, 0, 2 * BLOCK_SIZE);
+		inode_read(target, &my_inode);
+		extent_lookup(&my_inode, 0, &physical, &run, &unwritten);
+		extent_lookup(&my_inode, 1, &physical_partial, &run, &unwritten);
+		if ((physical == INVALID_DATA) != whole_freed[i] || (physical_partial == INVALID_DATA) != partial_freed[i] ||
+		    !is_zero(read_buf, 2 * BLOCK_SIZE)){
+			sparse_policy = SPARSE_ALWAYS;
+			free(disk);
+			return TEST_FAILED;
+		}
+	}
+	sparse_policy = SPARSE_ALWAYS;
+	
+	free(disk);
+	return TEST_PASSED;
+}
+
+/* PURPOSE: Make sure partial writes to regular files copy only the bytes being written,
+ *   and that blocks about to be overwritten aren't filled with 0s when they're allocated
+ * METHODOLOGY: On a filesystem small enough to have no journal, so every write goes
+ *   straight to the disk, count the bytes written to the disk by allocations with and
+ *   without zeroing, and by a small write into the middle of an existing block. Then
+ *   write part of a block that used to belong to a deleted file
+ * EXPECTED RESULTS: Allocating without zeroing saves one block of writes. The small write
+ *   costs its own bytes plus the inode block. The reused block reads back as our data
+ *   with 0s around it, not the deleted file's contents
+ */
+int direct_partial_writes(){
+	printf("%30s", "DIRECT_PARTIAL_WRITES");
+	fflush(stdout);
+	
+	mkfs(400, 0, 0);
+	
+	int parent, index, target, old;
+	mknod_fs("/old", S_IRWXU, 0, 0);
+	namei("/old", 0, 0, &parent, &old, &index);
+	mknod_fs("/file", S_IRWXU, 0, 0);
+	namei("/file", 0, 0, &parent, &target, &index);
+	
+	uint8_t data_buf[BLOCK_SIZE * 4];
+	uint8_t read_buf[BLOCK_SIZE * 4];
+	memset(data_buf, 0xab, sizeof(data_buf));
+	write_i(old, data_buf, 0, sizeof(data_buf));
+	write_i(target, data_buf, 0, BLOCK_SIZE);
+	
+	/* A block allocated for overwriting skips the write of 0s */
+	inode my_inode;
+	int created;
+	inode_read(target, &my_inode);
+	long long before = disk_bytes_written;
+	get_nth_datablock(&my_inode, 10, TRUE, &created);
+	long long zeroed = disk_bytes_written - before;
+	before = disk_bytes_written;
+	get_nth_datablock(&my_inode, 11, CREATE_UNZEROED, &created);
+	long long unzeroed = disk_bytes_written - before;
+	if (zeroed - unzeroed != BLOCK_SIZE){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	/* A small write into an existing block writes just those bytes, and the inode */
+	uint8_t small[100];
+	memset(small, 0x5c, sizeof(small));
+	before = disk_bytes_written;
+	write_i(target, small, 1000, sizeof(small));
+	if (disk_bytes_written - before != sizeof(small) + BLOCK_SIZE){
+		free(disk);
+		return TEST_FAILED;
+	}
+	read_i(target, read_buf, 0, BLOCK_SIZE);
+	memcpy(data_buf + 1000, small, sizeof(small));
+	if (memcmp(read_buf, data_buf, BLOCK_SIZE) != 0){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	/* A new block holding stale data still reads as 0s around what was written */
+	inode_read(old, &my_inode);
+	int stale = get_nth_datablock(&my_inode, 0, FALSE, NULL);
+	del(old);
+	write_i(target, small, BLOCK_SIZE * 2 + 2000, sizeof(small));
+	inode_read(target, &my_inode);
+	if (get_nth_datablock(&my_inode, 2, FALSE, NULL) != stale){
+		free(disk);
+		return TEST_FAILED;
+	}
+	data_read(stale, read_buf);
+	memset(data_buf, 0, BLOCK_SIZE);
+	memcpy(data_buf + 2000, small, sizeof(small));
+	if (memcmp(read_buf, data_buf, BLOCK_SIZE) != 0){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	free(disk);
+	return TEST_PASSED;
+}
+
+/* PURPOSE: Make sure truncate frees everything past the new end in one pass over a
+ *   deep extent tree, without going through write_i, and clears the rest of the last block
+ * METHODOLOGY: Write every other block of a file, so it has enough extents to need leaves
+ *   and an index, then cut it off part way through a block. Grow it back with truncate,
+ *   then cut it down to nothing
+ * EXPECTED RESULTS: The free block count goes back up by the blocks past the end, the
+ *   data before the cut is intact, the bytes after it read as 0s once the file grows,
+ *   and fsck finds nothing wrong. Emptying the file gives back every block it had
+ */
+int truncate_frees_subtrees(){
+	printf("%30s", "TRUNCATE_FREES_SUBTREES");
+	fflush(stdout);
+	
+	mkfs(BLOCKS_PER_GROUP * 4, 0, 0);
+	
+	int parent, index, target;
+	mknod_fs("/file", S_IRWXU, 0, 0);
+	namei("/file", 0, 0, &parent, &target, &index);
+	
+	int TRUNCATE_BLOCKS = 4000;
+	uint8_t data_buf[BLOCK_SIZE];
+	uint8_t read_buf[BLOCK_SIZE];
+	int free_start, free_full, free_cut, free_end;
+	data_count_free(&free_start);
+	
+	int i;
+	for (i = 0; i < TRUNCATE_BLOCKS; i += 2){
+		memset(data_buf, i % 251 + 1, BLOCK_SIZE);
+		write_i(target, data_buf, (off_t)i * BLOCK_SIZE, BLOCK_SIZE);
+	}
+	data_count_free(&free_full);
+	
+	inode my_inode;
+	inode_read(target, &my_inode);
+	if (my_inode.ext_header.depth == 0){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	/* Cut part way into block 1000, which holds data */
+	off_t cut = 1000 * BLOCK_SIZE + 123;
+	truncate(target, cut);
+	data_count_free(&free_cut);
+	if (free_cut - free_full < (TRUNCATE_BLOCKS - 1002) / 2){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	truncate(target, (off_t)1002 * BLOCK_SIZE);
+	read_i(target, read_buf, 1000 * BLOCK_SIZE, BLOCK_SIZE);
+	memset(data_buf, 1000 % 251 + 1, BLOCK_SIZE);
+	memset(data_buf + 123, 0, BLOCK_SIZE - 123);
+	if (memcmp(read_buf, data_buf, BLOCK_SIZE) != 0){
+		free(disk);
+		return TEST_FAILED;
+	}
+	read_i(target, read_buf, 998 * BLOCK_SIZE, BLOCK_SIZE);
+	memset(data_buf, 998 % 251 + 1, BLOCK_SIZE);
+	if (memcmp(read_buf, data_buf, BLOCK_SIZE) != 0){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	fsck_report report;
+	if (fsck(NO_SNAPSHOT, 4, &report) != SUCCESS){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	truncate(target, 0);
+	data_count_free(&free_end);
+	inode_read(target, &my_inode);
+	if (free_end != free_start || my_inode.ext_header.entries != 0 || my_inode.ext_header.depth != 0){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	free(disk);
+	return TEST_PASSED;
+}
+
+/* PURPOSE: Make sure reads of sparse files fill holes in directly, and that seek_i finds
+ *   data and holes by skipping over whole extents
+ * METHODOLOGY: Make a file of almost a million blocks with only three blocks of data (one of them
+ *   preallocated and never written), read all of it in big pieces, then look for data
+ *   and holes from different offsets
+ * EXPECTED RESULTS: The read gives the data blocks and 0s everywhere else, and each seek
+ *   lands on the start of the next data or hole, with the end of the file as a hole.
+ *   Scanning the file reads only a few extent tree nodes
+ */
+int seek_data_hole(){
+	printf("%30s", "SEEK_DATA_HOLE");
+	fflush(stdout);
+	
+	mkfs(BLOCKS_PER_GROUP * 2, 0, 0);
+	
+	int parent, index, target;
+	mknod_fs("/file", S_IRWXU, 0, 0);
+	namei("/file", 0, 0, &parent, &target, &index);
+	
+	off_t data_at[] = {0, 300000, 900000};
+	uint8_t data_buf[BLOCK_SIZE];
+	int i;
+	for (i = 0; i < 3; i++){
+		memset(data_buf, i + 1, BLOCK_SIZE);
+		write_i(target, data_buf, data_at[i] * BLOCK_SIZE, BLOCK_SIZE);
+	}
+	fallocate_i(target, FALLOC_FL_KEEP_SIZE, (off_t)500000 * BLOCK_SIZE, BLOCK_SIZE);
+	off_t size = (off_t)999936 * BLOCK_SIZE;
+	truncate(target, size);
+	
+	/* Read it all back a megabyte at a time */
+	int chunk = 256 * BLOCK_SIZE;
+	uint8_t* read_buf = malloc(chunk);
+	off_t pos, at;
+	int j, k;
+	for (pos = 0; pos < size; pos += chunk){
+		if (read_i(target, read_buf, pos, chunk) != chunk){
+			free(read_buf);
+			free(disk);
+			return TEST_FAILED;
+		}
+		for (j = 0; j < 256; j++){
+			at = pos / BLOCK_SIZE + j;
+			int expected = 0;
+			for (k = 0; k < 3; k++){
+				if (data_at[k] == at){
+					expected = k + 1;
+				}
+			}
+			if (read_buf[j * BLOCK_SIZE] != expected || read_buf[(j + 1) * BLOCK_SIZE - 1] != expected){
+				free(read_buf);
+				free(disk);
+				return TEST_FAILED;
+			}
+		}
+	}
+	free(read_buf);
+	
+	/* Each seek from a given offset, and where it should land */
+	struct { off_t from; int whence; int ret; off_t expected; } seeks[] = {
+		{0, SEEK_DATA, SUCCESS, 0},
+		{0, SEEK_HOLE, SUCCESS, BLOCK_SIZE},
+		{100, SEEK_HOLE, SUCCESS, BLOCK_SIZE},
+		{BLOCK_SIZE, SEEK_DATA, SUCCESS, (off_t)300000 * BLOCK_SIZE},
+		{(off_t)300000 * BLOCK_SIZE + 7, SEEK_DATA, SUCCESS, (off_t)300000 * BLOCK_SIZE + 7},
+		{(off_t)300000 * BLOCK_SIZE + 7, SEEK_HOLE, SUCCESS, (off_t)300001 * BLOCK_SIZE},
+		{(off_t)400000 * BLOCK_SIZE, SEEK_DATA, SUCCESS, (off_t)900000 * BLOCK_SIZE},
+		{(off_t)900001 * BLOCK_SIZE, SEEK_DATA, NO_DATA, 0},
+		{(off_t)900001 * BLOCK_SIZE, SEEK_HOLE, SUCCESS, (off_t)900001 * BLOCK_SIZE},
+		{size - 1, SEEK_HOLE, SUCCESS, size - 1},
+		{size, SEEK_HOLE, NO_DATA, 0},
+	};
+	int before = extent_node_reads;
+	off_t result;
+	for (i = 0; i < sizeof(seeks) / sizeof(seeks[0]); i++){
+		result = 0;
+		if (seek_i(target, seeks[i].from, seeks[i].whence, &result) != seeks[i].ret || result != seeks[i].expected){
+			free(disk);
+			return TEST_FAILED;
+		}
+	}
+	if (extent_node_reads - before > 64){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	free(disk);
+	return TEST_PASSED;
+}
+
+/* PURPOSE: Make sure fiemap_i reports the runs a file is stored in, and that the
+ *   fragmentation report adds up
+ * METHODOLOGY: Write one file in a single go, and two more a block at a time taking
+ *   turns, so that their blocks end up interleaved. Preallocate past the end of the
+ *   first. Ask for the runs of each, with and without room for all of them, then scan
+ * EXPECTED RESULTS: The first file is one written run and one unwritten run, the last
+ *   one marked as such. The interleaved files are in many runs that add up to their
+ *   blocks. The report finds the fragmented files, and its free space matches the
+ *   free block count, with the histogram adding up to the number of free runs
+ */
+int fiemap_fragmentation(){
+	printf("%30s", "FIEMAP_FRAGMENTATION");
+	fflush(stdout);
+	
+	mkfs(BLOCKS_PER_GROUP * 2, 0, 0);
+	
+	int parent, index, whole, left, right;
+	mknod_fs("/whole", S_IRWXU, 0, 0);
+	namei("/whole", 0, 0, &parent, &whole, &index);
+	mknod_fs("/left", S_IRWXU, 0, 0);
+	namei("/left", 0, 0, &parent, &left, &index);
+	mknod_fs("/right", S_IRWXU, 0, 0);
+	namei("/right", 0, 0, &parent, &right, &index);
+	
+	int BLOCKS = 16;
+	uint8_t data_buf[BLOCK_SIZE * 16];
+	memset(data_buf, 0x77, sizeof(data_buf));
+	write_i(whole, data_buf, 0, BLOCK_SIZE * BLOCKS);
+	fallocate_i(whole, FALLOC_FL_KEEP_SIZE, BLOCK_SIZE * BLOCKS, BLOCK_SIZE * 4);
+	
+	int i;
+	for (i = 0; i < BLOCKS; i++){
+		write_i(left, data_buf, i * BLOCK_SIZE, BLOCK_SIZE);
+		write_i(right, data_buf, i * BLOCK_SIZE, BLOCK_SIZE);
+	}
+	
+	file_extent runs[32];
+	int found;
+	if (fiemap_i(whole, 0, runs, 32, &found) != SUCCESS || found != 2 ||
+	    runs[0].logical != 0 || runs[0].length != BLOCKS || runs[0].flags != 0 ||
+	    runs[1].logical != BLOCKS || runs[1].length != 4 || runs[1].flags != (FIEMAP_EXTENT_UNWRITTEN | FIEMAP_EXTENT_LAST)){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	int all, blocks = 0;
+	fiemap_i(left, 0, NULL, 0, &all);
+	fiemap_i(left, 0, runs, 32, &found);
+	for (i = 0; i < found; i++){
+		blocks += runs[i].length;
+	}
+	if (all < 2 || found != all || blocks != BLOCKS || !(runs[found - 1].flags & FIEMAP_EXTENT_LAST)){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	/* Not enough room: the first runs, without the last one's flag */
+	fiemap_i(left, 0, runs, 1, &found);
+	if (found != 1 || (runs[0].flags & FIEMAP_EXTENT_LAST)){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	frag_report report;
+	int free_blocks, free_runs = 0;
+	frag_scan(&report);
+	data_count_free(&free_blocks);
+	for (i = 0; i < FRAG_BUCKETS; i++){
+		free_runs += report.free_histogram[i];
+	}
+	if (report.fragmented_files < 2 || report.files < 3 || report.score <= 0 || report.score > 100 ||
+	    (report.worst_inum != left && report.worst_inum != right) ||
+	    report.free_blocks != free_blocks || free_runs != report.free_extents || report.largest_free <= 0){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	free(disk);
+	return TEST_PASSED;
+}
+
+/* PURPOSE: Make sure files can grow past 4 GB, with offsets worked out in 64 bits
+ * METHODOLOGY: Write a block at 5 GB into an empty file, and a few bytes across the
+ *   4 GB mark, then read them back and grow and shrink the file around them. Try to
+ *   write and truncate past the largest file size
+ * EXPECTED RESULTS: The size goes past 4 GB and everything reads back where it was
+ *   written, with 0s in between. Shrinking frees the block at 5 GB. Going past
+ *   MAX_FILE_SIZE, or writing at a negative offset, fails with FILE_TOO_BIG
+ */
+int large_file_offsets(){
+	printf("%30s", "LARGE_FILE_OFFSETS");
+	fflush(stdout);
+	
+	mkfs(BLOCKS_PER_GROUP * 2, 0, 0);
+	
+	int parent, index, target;
+	mknod_fs("/file", S_IRWXU, 0, 0);
+	namei("/file", 0, 0, &parent, &target, &index);
+	
+	off_t four_gb = (off_t)4 << 30;
+	off_t five_gb = (off_t)5 << 30;
+	uint8_t data_buf[BLOCK_SIZE];
+	uint8_t read_buf[BLOCK_SIZE];
+	memset(data_buf, 0x42, BLOCK_SIZE);
+	
+	int free_before, free_after;
+	data_count_free(&free_before);
+	
+	if (write_i(target, data_buf, five_gb, BLOCK_SIZE) != BLOCK_SIZE ||
+	    write_i(target, data_buf, four_gb - 10, 20) != 20 ||
+	    get_stat(target).st_size != five_gb + BLOCK_SIZE){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	if (read_i(target, read_buf, five_gb, BLOCK_SIZE) != BLOCK_SIZE || memcmp(read_buf, data_buf, BLOCK_SIZE) != 0){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	/* 10 bytes of 0s, then the 20 written across 4 GB, then 0s again */
+	uint8_t expected[40];
+	memset(expected, 0, sizeof(expected));
+	memset(expected + 10, 0x42, 20);
+	if (read_i(target, read_buf, four_gb - 20, 40) != 40 || memcmp(read_buf, expected, 40) != 0){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	/* Grow it, then cut it back to just past 4 GB */
+	if (truncate(target, five_gb * 2) != SUCCESS || get_stat(target).st_size != five_gb * 2 ||
+	    truncate(target, four_gb + 5) != SUCCESS || get_stat(target).st_size != four_gb + 5){
+		free(disk);
+		return TEST_FAILED;
+	}
+	if (read_i(target, read_buf, four_gb - 20, 40) != 25 || memcmp(read_buf, expected, 25) != 0){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	truncate(target, 0);
+	data_count_free(&free_after);
+	if (free_after != free_before){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	if (write_i(target, data_buf, MAX_FILE_SIZE - 1, 2) != FILE_TOO_BIG ||
+	    write_i(target, data_buf, -1, 2) != FILE_TOO_BIG ||
+	    truncate(target, MAX_FILE_SIZE + 1) != FILE_TOO_BIG){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	fsck_report report;
+	if (fsck(NO_SNAPSHOT, 4, &report) != SUCCESS){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	free(disk);
+	return TEST_PASSED;
+}
+
+/* PURPOSE: Make sure the defragmenter moves a scattered file into one run without
+ *   changing what it holds
+ * METHODOLOGY: Write two files a block at a time taking turns, so that their blocks
+ *   are interleaved. Open one of them and defragment the filesystem, then close it and
+ *   defragment again. Read both back and check the block counts
+ * EXPECTED RESULTS: The open file is left alone by the first pass and the other is
+ *   put in a single run. After the second pass both are in one run each, with their
+ *   data unchanged. Moving frees as many blocks as it takes, and fsck finds nothing
+ */
+int defrag_file_contiguous(){
+	printf("%30s", "DEFRAG_FILE_CONTIGUOUS");
+	fflush(stdout);
+	
+	mkfs(BLOCKS_PER_GROUP * 2, 0, 0);
+	defrag_pause_ms = 0;
+	
+	int parent, index, left, right;
+	mknod_fs("/left", S_IRWXU, 0, 0);
+	namei("/left", 0, 0, &parent, &left, &index);
+	mknod_fs("/right", S_IRWXU, 0, 0);
+	namei("/right", 0, 0, &parent, &right, &index);
+	
+	int BLOCKS = 16;
+	uint8_t data_buf[BLOCK_SIZE];
+	int i;
+	for (i = 0; i < BLOCKS; i++){
+		memset(data_buf, 'a' + i, BLOCK_SIZE);
+		write_i(left, data_buf, i * BLOCK_SIZE, BLOCK_SIZE);
+		memset(data_buf, 'A' + i, BLOCK_SIZE);
+		write_i(right, data_buf, i * BLOCK_SIZE, BLOCK_SIZE);
+	}
+	
+	int free_before, free_after, blocks, extents, files, moved;
+	data_count_free(&free_before);
+	frag_file(left, &blocks, &extents);
+	if (extents < 2){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	/* The open file stays where it is */
+	int fd = oft_add(right, O_RDWR);
+	defrag_all(&files, &moved);
+	frag_file(left, &blocks, &extents);
+	if (files != 1 || moved != BLOCKS || blocks != BLOCKS || extents != 1){
+		free(disk);
+		return TEST_FAILED;
+	}
+	frag_file(right, &blocks, &extents);
+	if (extents < 2){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	oft_remove(fd);
+	defrag_all(&files, &moved);
+	frag_file(right, &blocks, &extents);
+	data_count_free(&free_after);
+	if (files != 1 || moved != BLOCKS || blocks != BLOCKS || extents != 1 || free_after != free_before){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	/* Nothing left to do */
+	defrag_all(&files, &moved);
+	if (files != 0 || moved != 0){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	uint8_t read_buf[BLOCK_SIZE];
+	for (i = 0; i < BLOCKS; i++){
+		memset(data_buf, 'a' + i, BLOCK_SIZE);
+		if (read_i(left, read_buf, i * BLOCK_SIZE, BLOCK_SIZE) != BLOCK_SIZE || memcmp(read_buf, data_buf, BLOCK_SIZE) != 0){
+			free(disk);
+			return TEST_FAILED;
+		}
+		memset(data_buf, 'A' + i, BLOCK_SIZE);
+		if (read_i(right, read_buf, i * BLOCK_SIZE, BLOCK_SIZE) != BLOCK_SIZE || memcmp(read_buf, data_buf, BLOCK_SIZE) != 0){
+			free(disk);
+			return TEST_FAILED;
+		}
+	}
+	
+	fsck_report report;
+	if (fsck(NO_SNAPSHOT, 2, &report) != SUCCESS){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	defrag_pause_ms = DEFRAG_PAUSE_MS;
+	free(disk);
+	return TEST_PASSED;
+}
+
+/* PURPOSE: Make sure clones share their data blocks, and that writing to either side
+ *   copies only the block written
+ * METHODOLOGY: Write a file of whole blocks plus a bit, clone it, then write part of a
+ *   block of the clone and try to defragment it. Copy ranges that do and don't line up
+ *   with the blocks, past the end, into a directory and of an impossible size. Copy
+ *   and clone the first block more times than it can be shared. Truncate the original
+ *   away and read the clone again
+ * EXPECTED RESULTS: The clone reads the same as the original but only costs the share
+ *   counts and its partial last block. The write costs one block and doesn't show up
+ *   in the original. Defragmenting moves none of the shared blocks. Misaligned copies
+ *   are read and written, copies past the end copy nothing, and the bad copies are
+ *   refused. Copies past the share limit are read and written and still succeed.
+ *   Once the original is gone the clone is intact and nothing is shared.
+ *   fsck finds nothing wrong at each step
+ */
+int reflink_clone_cow(){
+	printf("%30s", "REFLINK_CLONE_COW");
+	fflush(stdout);
+	
+	mkfs(BLOCKS_PER_GROUP * 2, 0, 0);
+	
+	int parent, index, src, dst, other;
+	mknod_fs("/src", S_IRWXU, 0, 0);
+	namei("/src", 0, 0, &parent, &src, &index);
+	mknod_fs("/dst", S_IRWXU, 0, 0);
+	namei("/dst", 0, 0, &parent, &dst, &index);
+	mknod_fs("/other", S_IRWXU, 0, 0);
+	namei("/other", 0, 0, &parent, &other, &index);
+	
+	int BLOCKS = 64;
+	int TAIL = 100;
+	int size = BLOCKS * BLOCK_SIZE + TAIL;
+	uint8_t* data_buf = malloc(size);
+	uint8_t* read_buf = malloc(size);
+	int i;
+	for (i = 0; i < size; i++){
+		data_buf[i] = rand() % 255 + 1;
+	}
+	write_i(src, data_buf, 0, size);
+	
+	int free_before, free_after;
+	data_count_free(&free_before);
+	fsck_report report;
+	if (clone_i(src, dst) != SUCCESS || read_i(dst, read_buf, 0, size) != size || memcmp(read_buf, data_buf, size) != 0){
+		free(data_buf);
+		free(read_buf);
+		free(disk);
+		return TEST_FAILED;
+	}
+	data_count_free(&free_after);
+	if (free_before - free_after != REFCOUNT_BLOCKS + 1 || fsck(NO_SNAPSHOT, 2, &report) != SUCCESS){
+		free(data_buf);
+		free(read_buf);
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	/* Copy on write: one new block for the clone, the original is untouched */
+	uint8_t changes[10];
+	memset(changes, 0, sizeof(changes));
+	write_i(dst, changes, 5 * BLOCK_SIZE + 20, sizeof(changes));
+	data_count_free(&free_before);
+	
+	inode src_inode;
+	uint32_t physical, run;
+	int refs_5, refs_6;
+	inode_read(src, &src_inode);
+	extent_lookup(&src_inode, 5, &physical, &run, NULL);
+	data_refcount(physical, &refs_5);
+	data_refcount(physical + 1, &refs_6);
+	if (free_after - free_before != 1 || refs_5 != 0 || refs_6 != 1 ||
+	    read_i(src, read_buf, 0, size) != size || memcmp(read_buf, data_buf, size) != 0){
+		free(data_buf);
+		free(read_buf);
+		free(disk);
+		return TEST_FAILED;
+	}
+	memcpy(&data_buf[5 * BLOCK_SIZE + 20], changes, sizeof(changes));
+	
+	/* The clone is now in three runs, but putting them together would unshare them */
+	int moved;
+	if (defrag_file(dst, &moved) != SUCCESS || moved != 0 || data_count_free(&free_after) != SUCCESS || free_after != free_before ||
+	    read_i(dst, read_buf, 0, size) != size || memcmp(read_buf, data_buf, size) != 0){
+		free(data_buf);
+		free(read_buf);
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	/* Misaligned ranges are copied, ranges past the end copy nothing */
+	if (copy_range_i(dst, 10, other, 0, 3 * BLOCK_SIZE) != 3 * BLOCK_SIZE || copy_range_i(dst, size, other, 0, 100) != 0 ||
+	    read_i(other, read_buf, 0, 3 * BLOCK_SIZE) != 3 * BLOCK_SIZE || memcmp(read_buf, &data_buf[10], 3 * BLOCK_SIZE) != 0 ||
+	    copy_range_i(dst, 0, dst, BLOCK_SIZE, 2 * BLOCK_SIZE) != -EINVAL || copy_range_i(dst, 0, ROOT_INODE, 0, BLOCK_SIZE) != -EINVAL ||
+	    copy_range_i(dst, 0, other, BLOCK_SIZE, SIZE_MAX) != FILE_TOO_BIG){
+		free(data_buf);
+		free(read_buf);
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	/* Aligned ranges share the whole blocks in them */
+	data_count_free(&free_before);
+	if (copy_range_i(src, 2 * BLOCK_SIZE + 7, other, 10 * BLOCK_SIZE + 7, 4 * BLOCK_SIZE) != 4 * BLOCK_SIZE){
+		free(data_buf);
+		free(read_buf);
+		free(disk);
+		return TEST_FAILED;
+	}
+	data_count_free(&free_after);
+	if (free_before - free_after != 2 || fsck(NO_SNAPSHOT, 2, &report) != SUCCESS){
+		free(data_buf);
+		free(read_buf);
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	/* A block shared as many times as it can be is copied instead, by both calls */
+	int many, again;
+	mknod_fs("/many", S_IRWXU, 0, 0);
+	namei("/many", 0, 0, &parent, &many, &index);
+	mknod_fs("/again", S_IRWXU, 0, 0);
+	namei("/again", 0, 0, &parent, &again, &index);
+	for (i = 0; i < REFCOUNT_MAX; i++){
+		if (copy_range_i(src, 0, many, (off_t)i * BLOCK_SIZE, BLOCK_SIZE) != BLOCK_SIZE){
+			break;
+		}
+	}
+	if (i != REFCOUNT_MAX || read_i(many, read_buf, (off_t)(REFCOUNT_MAX - 1) * BLOCK_SIZE, BLOCK_SIZE) != BLOCK_SIZE ||
+	    memcmp(read_buf, data_buf, BLOCK_SIZE) != 0 || clone_i(src, again) != SUCCESS ||
+	    read_i(again, read_buf, 0, BLOCK_SIZE) != BLOCK_SIZE || memcmp(read_buf, data_buf, BLOCK_SIZE) != 0){
+		free(data_buf);
+		free(read_buf);
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	/* The clone keeps every block once the original lets go */
+	truncate(src, 0);
+	if (read_i(dst, read_buf, 0, size) != size || memcmp(read_buf, data_buf, size) != 0 || fsck(NO_SNAPSHOT, 2, &report) != SUCCESS){
+		free(data_buf);
+		free(read_buf);
+		free(disk);
+		return TEST_FAILED;
+	}
+	inode dst_inode;
+	inode_read(dst, &dst_inode);
+	extent_lookup(&dst_inode, 6, &physical, &run, NULL);
+	data_refcount(physical, &refs_6);
+	
+	free(data_buf);
+	free(read_buf);
+	free(disk);
+	return (refs_6 == 0) ? TEST_PASSED : TEST_FAILED;
+}
+
+/* PURPOSE: Make sure big writes into holes are given their blocks a run at a time,
+ *   with the same results as writing them a block at a time
+ * METHODOLOGY: Write 4 MB in one call to an empty file, with one block of 0s in the
+ *   middle, then overwrite 1 MB past it starting part way through a block. Do the same
+ *   with delayed allocation, flushing afterwards
+ * EXPECTED RESULTS: Everything reads back as written. The block of 0s is a hole and
+ *   the rest of the file is in one run either side of it. The delayed file is in a
+ *   single run. fsck finds nothing wrong
+ */
+int big_write_runs(){
+	printf("%30s", "BIG_WRITE_RUNS");
+	fflush(stdout);
+	
+	mkfs(BLOCKS_PER_GROUP * 2, 0, 0);
+	
+	int parent, index, target, delayed;
+	mknod_fs("/file", S_IRWXU, 0, 0);
+	namei("/file", 0, 0, &parent, &target, &index);
+	mknod_fs("/delayed", S_IRWXU, 0, 0);
+	namei("/delayed", 0, 0, &parent, &delayed, &index);
+	
+	int BLOCKS = 1024;
+	int ZERO_BLOCK = 100;
+	int size = BLOCKS * BLOCK_SIZE;
+	uint8_t* data_buf = malloc(size);
+	uint8_t* read_buf = malloc(size);
+	int i;
+	for (i = 0; i < size; i++){
+		data_buf[i] = rand() % 255 + 1;
+	}
+	memset(&data_buf[ZERO_BLOCK * BLOCK_SIZE], 0, BLOCK_SIZE);
+	
+	file_extent runs[4];
+	int found;
+	fsck_report report;
+	if (write_i(target, data_buf, 0, size) != size || fiemap_i(target, 0, runs, 4, &found) != SUCCESS || found != 2 ||
+	    runs[0].logical != 0 || runs[0].length != ZERO_BLOCK ||
+	    runs[1].logical != ZERO_BLOCK + 1 || runs[1].length != BLOCKS - ZERO_BLOCK - 1){
+		free(data_buf);
+		free(read_buf);
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	/* Overwriting goes to the blocks already there */
+	int MB = 1024 * 1024;
+	for (i = 0; i < MB; i++){
+		data_buf[2 * ZERO_BLOCK * BLOCK_SIZE + 10 + i] = rand() % 255 + 1;
+	}
+	if (write_i(target, &data_buf[2 * ZERO_BLOCK * BLOCK_SIZE + 10], 2 * ZERO_BLOCK * BLOCK_SIZE + 10, MB) != MB ||
+	    read_i(target, read_buf, 0, size) != size || memcmp(read_buf, data_buf, size) != 0 ||
+	    fiemap_i(target, 0, NULL, 0, &found) != SUCCESS || found != 2){
+		free(data_buf);
+		free(read_buf);
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	delalloc_enabled = TRUE;
+	write_i(delayed, data_buf, 0, ZERO_BLOCK * BLOCK_SIZE);
+	delalloc_flush(delayed);
+	delalloc_enabled = FALSE;
+	if (fiemap_i(delayed, 0, runs, 4, &found) != SUCCESS || found != 1 || runs[0].length != ZERO_BLOCK ||
+	    read_i(delayed, read_buf, 0, ZERO_BLOCK * BLOCK_SIZE) != ZERO_BLOCK * BLOCK_SIZE ||
+	    memcmp(read_buf, data_buf, ZERO_BLOCK * BLOCK_SIZE) != 0){
+		free(data_buf);
+		free(read_buf);
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	free(data_buf);
+	free(read_buf);
+	int ret = fsck(NO_SNAPSHOT, 2, &report);
+	free(disk);
+	return (ret == SUCCESS) ? TEST_PASSED : TEST_FAILED;
+}
+
+/* PURPOSE: Make sure small sequential writes to an open file are gathered into whole
+ *   blocks, without anyone being able to tell they haven't been written yet
+ * METHODOLOGY: Open a file and append 1000 writes of 37 bytes with oft_write. Check
+ *   its size and contents before anything else happens, then write somewhere else in
+ *   the file, append some more and close it. Then fill the disk, append to another
+ *   file and write somewhere else in it, free some space and write there again
+ * EXPECTED RESULTS: The appends update the inode about once per block rather than
+ *   once per write. The size and contents are right while the last writes are still
+ *   buffered, the write elsewhere lands after them, and closing the file writes out
+ *   the rest. fsck finds nothing wrong. On the full disk the second write fails
+ *   without losing the append, which is written once there's room
+ */
+int write_combining(){
+	printf("%30s", "WRITE_COMBINING");
+	fflush(stdout);
+	
+	mkfs(BLOCKS_PER_GROUP * 2, 0, 0);
+	
+	int parent, index, target;
+	mknod_fs("/file", S_IRWXU, 0, 0);
+	namei("/file", 0, 0, &parent, &target, &index);
+	int fd = oft_add(target, O_RDWR);
+	
+	int WRITES = 1000;
+	int WRITE_SIZE = 37;
+	int size = WRITES * WRITE_SIZE;
+	uint8_t* data_buf = malloc(size + BLOCK_SIZE);
+	uint8_t* read_buf = malloc(size + BLOCK_SIZE);
+	int i;
+	for (i = 0; i < size + BLOCK_SIZE; i++){
+		data_buf[i] = rand() % 255 + 1;
+	}
+	
+	int failed = FALSE;
+	int before = inode_writes;
+	for (i = 0; i < WRITES; i++){
+		if (oft_write(target, &data_buf[i * WRITE_SIZE], i * WRITE_SIZE, WRITE_SIZE) != WRITE_SIZE){
+			failed = TRUE;
+		}
+	}
+	int updates = inode_writes - before;
+	
+	/* The last block's worth is still buffered */
+	if (failed || updates >= WRITES / 10 || oft_buffered_end(target) != size || get_stat(target).st_size != size ||
+	    read_i(target, read_buf, 0, size) != size || memcmp(read_buf, data_buf, size) != 0){
+		free(data_buf);
+		free(read_buf);
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	/* A write somewhere else comes after the buffered one it doesn't carry on from */
+	oft_write(target, &data_buf[size], size, 20);
+	for (i = 0; i < 30; i++){
+		data_buf[100 + i] = rand() % 255 + 1;
+	}
+	oft_write(target, &data_buf[100], 100, 30);
+	oft_write(target, &data_buf[130], 130, 30);
+	oft_write(target, &data_buf[size + 20], size + 20, 100);
+	if (read_i(target, read_buf, 0, size + 120) != size + 120 || memcmp(read_buf, data_buf, size + 120) != 0){
+		free(data_buf);
+		free(read_buf);
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	/* Closing writes out the rest */
+	oft_write(target, &data_buf[size + 120], size + 120, 50);
+	oft_remove(fd);
+	fsck_report report;
+	if (get_stat(target).st_size != size + 170 || read_i(target, read_buf, 0, size + 170) != size + 170 ||
+	    memcmp(read_buf, data_buf, size + 170) != 0 || fsck(NO_SNAPSHOT, 2, &report) != SUCCESS){
+		free(data_buf);
+		free(read_buf);
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	/* With the disk full, a buffered append that can't be written out stays buffered
+	 * until there's room for it */
+	int small, filler;
+	mknod_fs("/small", S_IRWXU, 0, 0);
+	namei("/small", 0, 0, &parent, &small, &index);
+	mknod_fs("/filler", S_IRWXU, 0, 0);
+	namei("/filler", 0, 0, &parent, &filler, &index);
+	write_i(small, data_buf, 0, BLOCK_SIZE);
+	fd = oft_add(small, O_RDWR);
+	off_t fill = 0;
+	while (write_i(filler, data_buf, fill, BLOCK_SIZE) == BLOCK_SIZE){
+		fill += BLOCK_SIZE;
+	}
+	if (oft_write(small, &data_buf[BLOCK_SIZE], BLOCK_SIZE, 40) != 40 || oft_write(small, &data_buf[10], 10, 1) != DATA_FULL){
+		free(data_buf);
+		free(read_buf);
+		free(disk);
+		return TEST_FAILED;
+	}
+	truncate(filler, 0);
+	if (oft_write(small, &data_buf[10], 10, 1) != 1 || oft_remove(fd) != TRUE || get_stat(small).st_size != BLOCK_SIZE + 40 ||
+	    read_i(small, read_buf, 0, BLOCK_SIZE + 40) != BLOCK_SIZE + 40 || memcmp(read_buf, data_buf, BLOCK_SIZE + 40) != 0){
+		free(data_buf);
+		free(read_buf);
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	free(data_buf);
+	free(read_buf);
+	free(disk);
+	return TEST_PASSED;
+}
+
+/* PURPOSE: Make sure blocks freed by a transaction aren't given to anyone else until
+ *   it has committed, since file data is written to them in place
+ * METHODOLOGY: Write a file and commit. In one transaction truncate it to nothing and
+ *   write a second file of the same size, then commit and write a third
+ * EXPECTED RESULTS: The second file's blocks are all new, so a crash before the commit
+ *   would leave the first file's blocks as they were. The third file reuses the first
+ *   file's old blocks. fsck finds nothing wrong
+ */
+int journal_free_reuse(){
+	printf("%30s", "JOURNAL_FREE_REUSE");
+	fflush(stdout);
+	
+	mkfs(BLOCKS_PER_GROUP * 2, 0, 0);
+	
+	int parent, index, first, second, third;
+	mknod_fs("/first", S_IRWXU, 0, 0);
+	namei("/first", 0, 0, &parent, &first, &index);
+	mknod_fs("/second", S_IRWXU, 0, 0);
+	namei("/second", 0, 0, &parent, &second, &index);
+	mknod_fs("/third", S_IRWXU, 0, 0);
+	namei("/third", 0, 0, &parent, &third, &index);
+	
+	int NUM_BLOCKS = 32;
+	int size = NUM_BLOCKS * BLOCK_SIZE;
+	uint8_t* data_buf = malloc(size);
+	memset(data_buf, 1, size);
+	
+	file_extent old_run, new_run;
+	int found;
+	write_i(first, data_buf, 0, size);
+	fiemap_i(first, 0, &old_run, 1, &found);
+	journal_sync();
+	
+	journal_begin();
+	truncate(first, 0);
+	write_i(second, data_buf, 0, size);
+	journal_end();
+	fiemap_i(second, 0, &new_run, 1, &found);
+	if (found != 1 || (new_run.physical < old_run.physical + old_run.length && old_run.physical < new_run.physical + new_run.length)){
+		free(data_buf);
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	journal_sync();
+	write_i(third, data_buf, 0, size);
+	fiemap_i(third, 0, &new_run, 1, &found);
+	free(data_buf);
+	
+	fsck_report report;
+	if (found != 1 || new_run.physical != old_run.physical || fsck(NO_SNAPSHOT, 2, &report) != SUCCESS){
+		free(disk);
+		return TEST_FAILED;
+	}
+	
+	free(disk);
+	return TEST_PASSED;
+}